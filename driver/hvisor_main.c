@@ -11,19 +11,25 @@
 #include <asm/cacheflush.h>
 #include <linux/clk.h>
 #include <linux/delay.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
 #include <linux/eventfd.h>
 #include <linux/gfp.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/kernel.h>
+#include <linux/limits.h>
+#include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/of_irq.h>
 #include <linux/of_reserved_mem.h>
 #include <linux/reset.h>
+#include <linux/scatterlist.h>
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/string.h>
@@ -185,6 +191,289 @@ out:
     return ret;
 }
 
+// RAM of the zones started through this driver, the memory that
+// HVISOR_EXPORT_DMABUF may export. A zone with live exports cannot be shut
+// down, as its memory could be handed to another zone while still shown.
+struct hvisor_zone_mem {
+    struct list_head list;
+    u32 zone_id;
+    u32 nr_regions;
+    u32 nr_exports; // dma-bufs not yet released
+    memory_region_t regions[CONFIG_MAX_MEMORY_REGIONS];
+};
+
+static LIST_HEAD(hvisor_zone_mems);
+static DEFINE_MUTEX(hvisor_zone_mems_lock);
+
+static struct hvisor_zone_mem *hvisor_zone_mem_find(u32 zone_id) {
+    struct hvisor_zone_mem *zm;
+
+    list_for_each_entry(zm, &hvisor_zone_mems, list)
+        if (zm->zone_id == zone_id)
+            return zm;
+    return NULL;
+}
+
+static void hvisor_zone_mem_add(const zone_config_t *config) {
+    struct hvisor_zone_mem *zm, *old;
+    u32 i, n = min_t(u32, config->num_memory_regions,
+                     CONFIG_MAX_MEMORY_REGIONS);
+
+    zm = kzalloc(sizeof(*zm), GFP_KERNEL);
+    if (!zm) {
+        pr_warn("hvisor.ko: zone %u memory cannot be exported\n",
+                config->zone_id);
+        return;
+    }
+    zm->zone_id = config->zone_id;
+    for (i = 0; i < n; i++)
+        if (config->memory_regions[i].type == MEM_TYPE_RAM)
+            zm->regions[zm->nr_regions++] = config->memory_regions[i];
+
+    mutex_lock(&hvisor_zone_mems_lock);
+    old = hvisor_zone_mem_find(zm->zone_id);
+    if (old) {
+        zm->nr_exports = old->nr_exports;
+        list_del(&old->list);
+        kfree(old);
+    }
+    list_add(&zm->list, &hvisor_zone_mems);
+    mutex_unlock(&hvisor_zone_mems_lock);
+}
+
+// Whether [paddr, paddr + size) is RAM of the zone. The range may span
+// adjacent regions. Called with hvisor_zone_mems_lock held.
+static bool hvisor_zone_mem_covers(const struct hvisor_zone_mem *zm, u64 paddr,
+                                   u64 size) {
+    u64 end = paddr + size;
+    bool found = true;
+    u32 i;
+
+    while (found && paddr < end) {
+        found = false;
+        for (i = 0; i < zm->nr_regions; i++) {
+            u64 start = zm->regions[i].physical_start;
+            u64 rend = start + zm->regions[i].size;
+
+            if (paddr >= start && paddr < rend) {
+                paddr = min(end, rend);
+                found = true;
+                break;
+            }
+        }
+    }
+    return paddr >= end;
+}
+
+// Count an export of the chunks if they all are RAM of zone zone_id.
+static int hvisor_zone_mem_get(u32 zone_id,
+                               const struct hvisor_dmabuf_chunk *chunks,
+                               u32 nr_chunks) {
+    struct hvisor_zone_mem *zm;
+    int err = 0;
+    u32 i;
+
+    mutex_lock(&hvisor_zone_mems_lock);
+    zm = hvisor_zone_mem_find(zone_id);
+    for (i = 0; zm && i < nr_chunks; i++)
+        if (!hvisor_zone_mem_covers(zm, chunks[i].paddr, chunks[i].size))
+            break;
+    if (zm && i == nr_chunks)
+        zm->nr_exports++;
+    else
+        err = -EINVAL;
+    mutex_unlock(&hvisor_zone_mems_lock);
+    return err;
+}
+
+static void hvisor_zone_mem_put(u32 zone_id) {
+    struct hvisor_zone_mem *zm;
+
+    mutex_lock(&hvisor_zone_mems_lock);
+    zm = hvisor_zone_mem_find(zone_id);
+    if (zm)
+        zm->nr_exports--;
+    mutex_unlock(&hvisor_zone_mems_lock);
+}
+
+// Refuse to shut down a zone whose memory is still exported. The lock is
+// held across the hypercall so that no export can slip in.
+static int hvisor_zone_shutdown(u64 zone_id) {
+    struct hvisor_zone_mem *zm;
+    int err;
+
+    mutex_lock(&hvisor_zone_mems_lock);
+    zm = hvisor_zone_mem_find(zone_id);
+    if (zm && zm->nr_exports) {
+        pr_err("hvisor.ko: zone %llu memory is still exported as %u "
+               "dma-bufs\n",
+               zone_id, zm->nr_exports);
+        err = -EBUSY;
+        goto out;
+    }
+    err = hvisor_call(HVISOR_HC_SHUTDOWN_ZONE, zone_id, 0);
+    if (!err && zm) {
+        list_del(&zm->list);
+        kfree(zm);
+    }
+out:
+    mutex_unlock(&hvisor_zone_mems_lock);
+    return err;
+}
+
+// Zone memory exported as a dma-buf. The memory is reserved for the zones and
+// has no struct page, so it is mapped for the importing device with
+// dma_map_resource() rather than through pages.
+struct hvisor_dmabuf {
+    u32 zone_id;
+    u32 nr_chunks;
+    struct hvisor_dmabuf_chunk chunks[];
+};
+
+static void hvisor_dmabuf_unmap_sg(struct device *dev, struct sg_table *sgt,
+                                   int nents, enum dma_data_direction dir) {
+    struct scatterlist *sg;
+    int i;
+
+    for_each_sg(sgt->sgl, sg, nents, i)
+        dma_unmap_resource(dev, sg_dma_address(sg), sg_dma_len(sg), dir,
+                           DMA_ATTR_SKIP_CPU_SYNC);
+}
+
+static struct sg_table *
+hvisor_dmabuf_map(struct dma_buf_attachment *attach,
+                  enum dma_data_direction dir) {
+    struct hvisor_dmabuf *hb = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    struct scatterlist *sg;
+    dma_addr_t addr;
+    int i, err;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+    err = sg_alloc_table(sgt, hb->nr_chunks, GFP_KERNEL);
+    if (err) {
+        kfree(sgt);
+        return ERR_PTR(err);
+    }
+
+    for_each_sg(sgt->sgl, sg, hb->nr_chunks, i) {
+        addr = dma_map_resource(attach->dev, hb->chunks[i].paddr,
+                                hb->chunks[i].size, dir,
+                                DMA_ATTR_SKIP_CPU_SYNC);
+        if (dma_mapping_error(attach->dev, addr)) {
+            hvisor_dmabuf_unmap_sg(attach->dev, sgt, i, dir);
+            sg_free_table(sgt);
+            kfree(sgt);
+            return ERR_PTR(-EIO);
+        }
+        sg->length = hb->chunks[i].size;
+        sg_dma_address(sg) = addr;
+        sg_dma_len(sg) = hb->chunks[i].size;
+    }
+    return sgt;
+}
+
+static void hvisor_dmabuf_unmap(struct dma_buf_attachment *attach,
+                                struct sg_table *sgt,
+                                enum dma_data_direction dir) {
+    hvisor_dmabuf_unmap_sg(attach->dev, sgt, sgt->nents, dir);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static int hvisor_dmabuf_mmap(struct dma_buf *dmabuf,
+                              struct vm_area_struct *vma) {
+    struct hvisor_dmabuf *hb = dmabuf->priv;
+    unsigned long addr = vma->vm_start;
+    unsigned long size;
+    int i, err;
+
+    if (vma->vm_pgoff)
+        return -EINVAL;
+    for (i = 0; i < hb->nr_chunks && addr < vma->vm_end; i++) {
+        size = min_t(unsigned long, hb->chunks[i].size, vma->vm_end - addr);
+        err = remap_pfn_range(vma, addr, hb->chunks[i].paddr >> PAGE_SHIFT,
+                              size, vma->vm_page_prot);
+        if (err)
+            return err;
+        addr += size;
+    }
+    return 0;
+}
+
+static void hvisor_dmabuf_release(struct dma_buf *dmabuf) {
+    struct hvisor_dmabuf *hb = dmabuf->priv;
+
+    hvisor_zone_mem_put(hb->zone_id);
+    kvfree(hb);
+}
+
+static const struct dma_buf_ops hvisor_dmabuf_ops = {
+    .map_dma_buf = hvisor_dmabuf_map,
+    .unmap_dma_buf = hvisor_dmabuf_unmap,
+    .mmap = hvisor_dmabuf_mmap,
+    .release = hvisor_dmabuf_release,
+};
+
+static int hvisor_export_dmabuf(struct hvisor_export_dmabuf_args __user *arg) {
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct hvisor_export_dmabuf_args kargs;
+    struct hvisor_dmabuf *hb;
+    struct dma_buf *dmabuf;
+    u64 size = 0;
+    int i, fd;
+
+    if (copy_from_user(&kargs, arg, sizeof(kargs)))
+        return -EFAULT;
+    if (!kargs.nr_chunks || kargs.nr_chunks > HVISOR_DMABUF_MAX_CHUNKS)
+        return -EINVAL;
+
+    hb = kvzalloc(struct_size(hb, chunks, kargs.nr_chunks), GFP_KERNEL);
+    if (!hb)
+        return -ENOMEM;
+    hb->zone_id = kargs.zone_id;
+    hb->nr_chunks = kargs.nr_chunks;
+    if (copy_from_user(hb->chunks, u64_to_user_ptr(kargs.chunks),
+                       kargs.nr_chunks * sizeof(hb->chunks[0]))) {
+        kvfree(hb);
+        return -EFAULT;
+    }
+    for (i = 0; i < hb->nr_chunks; i++) {
+        if (!hb->chunks[i].size || !PAGE_ALIGNED(hb->chunks[i].paddr) ||
+            !PAGE_ALIGNED(hb->chunks[i].size) ||
+            hb->chunks[i].paddr + hb->chunks[i].size < hb->chunks[i].paddr ||
+            // A scatterlist entry holds at most UINT_MAX bytes
+            hb->chunks[i].size > UINT_MAX) {
+            kvfree(hb);
+            return -EINVAL;
+        }
+        size += hb->chunks[i].size;
+    }
+    if (hvisor_zone_mem_get(hb->zone_id, hb->chunks, hb->nr_chunks)) {
+        kvfree(hb);
+        return -EINVAL;
+    }
+
+    exp_info.ops = &hvisor_dmabuf_ops;
+    exp_info.size = size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = hb;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        hvisor_zone_mem_put(hb->zone_id);
+        kvfree(hb);
+        return PTR_ERR(dmabuf);
+    }
+
+    // From here on hb is freed, and the export uncounted, with the dma-buf
+    fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+    if (fd < 0)
+        dma_buf_put(dmabuf);
+    return fd;
+}
+
 static int hvisor_zone_start(zone_config_t __user *arg) {
     int err = 0;
     zone_config_t *zone_config = kmalloc(sizeof(zone_config_t), GFP_KERNEL);
@@ -203,6 +492,8 @@ static int hvisor_zone_start(zone_config_t __user *arg) {
 
     err = hvisor_call(HVISOR_HC_START_ZONE, __pa(zone_config),
                       sizeof(zone_config_t));
+    if (!err)
+        hvisor_zone_mem_add(zone_config);
     kfree(zone_config);
     return err;
 }
@@ -343,7 +634,7 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
         err = hvisor_set_boot_mode((struct hv_zone_boot_mode __user *)arg);
         break;
     case HVISOR_ZONE_SHUTDOWN:
-        err = hvisor_call(HVISOR_HC_SHUTDOWN_ZONE, arg, 0);
+        err = hvisor_zone_shutdown(arg);
         break;
     case HVISOR_ZONE_LIST:
         err = hvisor_zone_list((zone_list_args_t __user *)arg);
@@ -371,6 +662,10 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
     case HVISOR_LOAD_IMAGE:
         err = hvisor_load_image((struct hvisor_load_image_args __user *)arg);
         break;
+    case HVISOR_EXPORT_DMABUF:
+        err = hvisor_export_dmabuf(
+            (struct hvisor_export_dmabuf_args __user *)arg);
+        break;
     case HVISOR_SCMI_CLOCK_IOCTL:
         err = hvisor_scmi_clock_ioctl(
             (struct hvisor_scmi_clock_args __user *)arg);
@@ -566,6 +861,8 @@ err_misc:
 ** Module Exit function
 */
 static void __exit hvisor_exit(void) {
+    struct hvisor_zone_mem *zm, *tmp;
+
     if (virtio_irq != -1)
         free_irq(virtio_irq, &hvisor_misc_dev);
     if (virtio_irq_ctx)
@@ -575,6 +872,8 @@ static void __exit hvisor_exit(void) {
         free_pages((unsigned long)virtio_bridge, 0);
     }
     misc_deregister(&hvisor_misc_dev);
+    list_for_each_entry_safe(zm, tmp, &hvisor_zone_mems, list)
+        kfree(zm);
 #ifndef X86_64
     hvisor_scmi_cleanup();
     hvisor_put_node();
@@ -589,3 +888,9 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("KouweiLee <15035660024@163.com>");
 MODULE_DESCRIPTION("The hvisor device driver");
 MODULE_VERSION("1:0.0");
+// dma_buf_export() and dma_buf_fd() are in the DMA_BUF namespace since 5.16
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
@@ -91,6 +91,26 @@ struct hvisor_load_image_args {
 };
 #define HVISOR_LOAD_IMAGE _IOW(1, 8, struct hvisor_load_image_args)
 
+/*
+ * Export physically contiguous pieces of zone memory, in order, as one
+ * dma-buf, e.g. so that the display of the root zone scans out a guest
+ * framebuffer. Addresses and sizes are page aligned, and each chunk holds at
+ * most 4 GiB - 1. The chunks must lie in RAM regions of zone zone_id, which
+ * must have been started through /dev/hvisor. Returns the fd. The zone
+ * cannot be shut down (EBUSY) until every such dma-buf is released.
+ */
+#define HVISOR_DMABUF_MAX_CHUNKS 4096
+struct hvisor_dmabuf_chunk {
+    __u64 paddr;
+    __u64 size;
+};
+struct hvisor_export_dmabuf_args {
+    __u64 chunks; /* User address of nr_chunks struct hvisor_dmabuf_chunk */
+    __u32 nr_chunks;
+    __u32 zone_id;
+};
+#define HVISOR_EXPORT_DMABUF _IOW(1, 12, struct hvisor_export_dmabuf_args)
+
 #define HVISOR_HC_INIT_VIRTIO 0
 #define HVISOR_HC_FINISH_REQ 1
 #define HVISOR_HC_START_ZONE 2
@@ -31,6 +31,8 @@
 #include "log.h"
 #include "safe_cjson.h"
 #include "virtio.h"
+#include "virtio_blk.h"
+#include "virtio_ctl.h"
 #include "zone_config.h"
 
 static void __attribute__((noreturn)) help(int exit_status) {
@@ -41,7 +43,9 @@ static void __attribute__((noreturn)) help(int exit_status) {
     printf("  zone start    <config.json>    Initialize an isolation zone\n");
     printf("  zone shutdown -id <zone_id>   Terminate a zone by ID\n");
     printf("  zone list                      List all active zones\n");
-    printf("  virtio start  <virtio.json>    Activate virtio devices\n\n");
+    printf("  virtio start  <virtio.json>    Activate virtio devices\n");
+    printf("  virtio ctl    <zone> <addr> <cmd>  Control a virtio device\n");
+    printf("  virtio replay <trace> <img>    Replay a virtio-blk trace\n\n");
     printf("Options:\n");
     printf("  --id <zone_id>    Specify zone ID for shutdown\n");
     printf("  --help            Show this help message\n\n");
@@ -49,6 +53,7 @@ static void __attribute__((noreturn)) help(int exit_status) {
     printf("  Start zone:    hvisor zone start /path/to/vm.json\n");
     printf("  Shutdown zone: hvisor zone shutdown -id 1\n");
     printf("  List zones:    hvisor zone list\n");
+    printf("  Device help:   hvisor virtio ctl 1 0xa003c00 help\n");
     exit(exit_status);
 }
 
@@ -1128,6 +1133,10 @@ int main(int argc, char *argv[]) {
 
         if (strcmp(argv[2], "start") == 0) {
             err = virtio_start(argc, argv);
+        } else if (strcmp(argv[2], "ctl") == 0) {
+            err = virtio_ctl(argc - 3, &argv[3]);
+        } else if (strcmp(argv[2], "replay") == 0) {
+            err = virtio_blk_replay(argc - 2, &argv[2]);
         } else {
             help(1);
         }
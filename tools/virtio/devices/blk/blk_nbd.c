@@ -0,0 +1,873 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "virtio_blk.h"
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * NBD client backend
+ * ------------------
+ * The disk is an export of a Network Block Device server, reached over TCP
+ * ("host:port") or a unix socket ("unix:/path"). Only the fixed newstyle
+ * handshake and simple replies are used: NBD_OPT_GO, falling back to
+ * NBD_OPT_EXPORT_NAME for older servers.
+ *
+ * The device worker uses the asynchronous interface: every request is sent
+ * at once with its slot index as cookie, and reap() matches the replies,
+ * which may arrive in any order. With several connections the requests are
+ * spread round-robin. A connection keeps at most NBD_QUEUE_DEPTH requests
+ * in flight. While a request is being sent the pending replies are read as
+ * well, so neither side can block on a full socket buffer.
+ *
+ * The blocking calls (preadv, ...) go through connections of their own, so
+ * other threads never touch the worker's connections. Each caller borrows
+ * an idle one from a pool, opened on first use, so concurrent callers (the
+ * jobs of "hvisor virtio replay") keep one request each in flight. Without
+ * NBD_FLAG_CAN_MULTI_CONN the pool is a single connection.
+ */
+
+// Handshake
+#define NBD_MAGIC 0x4e42444d41474943ULL      // "NBDMAGIC"
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL // "IHAVEOPT"
+#define NBD_REP_MAGIC 0x0003e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_GO 7
+#define NBD_REP_ACK 1
+#define NBD_REP_INFO 3
+#define NBD_REP_FLAG_ERROR (1U << 31)
+#define NBD_REP_ERR_UNSUP (NBD_REP_FLAG_ERROR | 1)
+#define NBD_INFO_EXPORT 0
+
+// Transmission flags
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_FUA (1 << 3)
+#define NBD_FLAG_SEND_TRIM (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+
+// Transmission
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC 0x67446698
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+#define NBD_CMD_WRITE_ZEROES 6
+#define NBD_CMD_FLAG_FUA (1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE (1 << 1)
+
+// Requests in flight on one connection.
+#define NBD_QUEUE_DEPTH 16
+
+// Connections for the blocking calls.
+#define NBD_MAX_SYNC_CONNS 64
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t cookie;
+    uint64_t offset;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t cookie;
+} __attribute__((packed));
+
+enum nbd_slot_state {
+    NBD_SLOT_FREE,
+    NBD_SLOT_BUSY,
+    // A write-through WRITE on a server without FUA: the write completed,
+    // a FLUSH must follow before the request completes.
+    NBD_SLOT_NEED_FLUSH,
+    NBD_SLOT_FLUSHING,
+};
+
+struct nbd_slot {
+    enum nbd_slot_state state;
+    struct blk_io *io;
+    uint32_t len;
+};
+
+struct nbd_conn {
+    int fd; // -1 when not connected
+    int queued;
+    int need_flush;
+    struct nbd_slot slots[NBD_QUEUE_DEPTH];
+    // Scratch iovec arrays for sending a request and reading a reply.
+    struct iovec *send_iov, *recv_iov;
+    int iov_cap;
+};
+
+struct blk_nbd {
+    BlkBackend be;
+    char *server;
+    char *export_name;
+    uint16_t tflags;
+    int num_conns;
+    int next_conn;
+    struct nbd_conn conns[BLK_NBD_MAX_CONNS];
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    int num_sync;  // Pool entries handed out at least once
+    int sync_idle; // Entries of sync_free
+    struct nbd_conn *sync_free[NBD_MAX_SYNC_CONNS];
+    struct nbd_conn sync_conns[NBD_MAX_SYNC_CONNS];
+};
+
+static int nbd_recv_reply(struct blk_nbd *nbd, struct nbd_conn *c);
+
+static void iov_advance(struct iovec **iov, int *cnt, size_t n) {
+    while (*cnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*cnt)--;
+    }
+    if (*cnt > 0) {
+        (*iov)->iov_base = (uint8_t *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/*
+ * Send or receive a whole iovec array, which is consumed. When sending on a
+ * connection with requests in flight (nbd != NULL), replies that arrive
+ * while the socket is full are read in between.
+ */
+static int nbd_xfer(struct blk_nbd *nbd, struct nbd_conn *c,
+                    struct iovec *iov, int cnt, bool send) {
+    iov_advance(&iov, &cnt, 0);
+    while (cnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = MIN(cnt, IOV_MAX)};
+        // MSG_NOSIGNAL: a closed connection must not raise SIGPIPE.
+        ssize_t n = send ? sendmsg(c->fd, &msg, MSG_NOSIGNAL)
+                         : readv(c->fd, iov, msg.msg_iovlen);
+        if (n > 0) {
+            iov_advance(&iov, &cnt, n);
+            continue;
+        }
+        if (n == 0)
+            return ECONNRESET;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            return errno;
+
+        struct pollfd pfd = {
+            .fd = c->fd,
+            .events = send ? POLLOUT | POLLIN : POLLIN,
+        };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return errno;
+        if (send && nbd && (pfd.revents & POLLIN) &&
+            !(pfd.revents & POLLOUT) && nbd_recv_reply(nbd, c) < 0)
+            return EIO;
+    }
+    return 0;
+}
+
+static int nbd_xfer_buf(struct nbd_conn *c, void *buf, size_t len,
+                        bool send) {
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    return nbd_xfer(NULL, c, &iov, 1, send);
+}
+
+static int nbd_connect_socket(const char *server) {
+    int fd;
+
+    if (strncmp(server, "unix:", 5) == 0) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(server + 5) >= sizeof(addr.sun_path)) {
+            log_error("nbd: socket path too long: %s", server + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, server + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            log_error("nbd: cannot connect to %s, errno=%d", server, errno);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // host:port, the host may be a bracketed IPv6 address.
+    char host[256];
+    const char *port = strrchr(server, ':');
+    const char *name = server;
+    size_t len = port ? (size_t)(port - server) : 0;
+    if (!port || len == 0 || len >= sizeof(host)) {
+        log_error("nbd: invalid server %s", server);
+        return -1;
+    }
+    if (name[0] == '[' && name[len - 1] == ']') {
+        name++;
+        len -= 2;
+    }
+    memcpy(host, name, len);
+    host[len] = '\0';
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *res, *ai;
+    int ret = getaddrinfo(host, port + 1, &hints, &res);
+    if (ret != 0) {
+        log_error("nbd: cannot resolve %s: %s", server, gai_strerror(ret));
+        return -1;
+    }
+    fd = -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        log_error("nbd: cannot connect to %s, errno=%d", server, errno);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    return fd;
+}
+
+static int nbd_send_option(struct nbd_conn *c, uint32_t opt, const void *data,
+                           uint32_t len) {
+    struct {
+        uint64_t magic;
+        uint32_t opt;
+        uint32_t len;
+    } __attribute__((packed)) hdr = {
+        .magic = htobe64(NBD_OPTS_MAGIC),
+        .opt = htobe32(opt),
+        .len = htobe32(len),
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+        {.iov_base = (void *)data, .iov_len = len},
+    };
+    return nbd_xfer(NULL, c, iov, 2, true);
+}
+
+/*
+ * NBD_OPT_GO: returns 0 with the export size and flags, EOPNOTSUPP if the
+ * server does not know the option, or another errno.
+ */
+static int nbd_opt_go(struct nbd_conn *c, const char *export_name,
+                      uint64_t *size, uint16_t *tflags) {
+    uint32_t name_len = strlen(export_name);
+    uint32_t len = 4 + name_len + 2;
+    uint8_t *data = calloc(1, len);
+    bool have_info = false;
+    int err;
+
+    if (!data)
+        return ENOMEM;
+    *(uint32_t *)data = htobe32(name_len);
+    memcpy(data + 4, export_name, name_len);
+    // No information requests: the server sends NBD_INFO_EXPORT anyway.
+    err = nbd_send_option(c, NBD_OPT_GO, data, len);
+    free(data);
+    if (err)
+        return err;
+
+    for (;;) {
+        struct {
+            uint64_t magic;
+            uint32_t opt;
+            uint32_t type;
+            uint32_t len;
+        } __attribute__((packed)) rep;
+        uint8_t buf[256], skip[256];
+
+        err = nbd_xfer_buf(c, &rep, sizeof(rep), false);
+        if (err)
+            return err;
+        if (be64toh(rep.magic) != NBD_REP_MAGIC) {
+            log_error("nbd: bad option reply magic");
+            return EPROTO;
+        }
+        uint32_t type = be32toh(rep.type);
+        uint32_t rlen = be32toh(rep.len);
+        // Keep the head of the payload, skip the rest.
+        uint32_t keep = MIN(rlen, sizeof(buf));
+        err = nbd_xfer_buf(c, buf, keep, false);
+        for (uint32_t left = rlen - keep; !err && left > 0;) {
+            uint32_t n = MIN(left, sizeof(skip));
+            err = nbd_xfer_buf(c, skip, n, false);
+            left -= n;
+        }
+        if (err)
+            return err;
+
+        if (type == NBD_REP_INFO && rlen >= 12 &&
+            be16toh(*(uint16_t *)buf) == NBD_INFO_EXPORT) {
+            memcpy(size, buf + 2, sizeof(*size));
+            *size = be64toh(*size);
+            memcpy(tflags, buf + 10, sizeof(*tflags));
+            *tflags = be16toh(*tflags);
+            have_info = true;
+        } else if (type == NBD_REP_ACK) {
+            if (!have_info) {
+                log_error("nbd: server sent no export information");
+                return EPROTO;
+            }
+            return 0;
+        } else if (type == NBD_REP_ERR_UNSUP) {
+            return EOPNOTSUPP;
+        } else if (type & NBD_REP_FLAG_ERROR) {
+            log_error("nbd: export \"%s\" refused, reply %#x", export_name,
+                      type);
+            return ENOENT;
+        }
+    }
+}
+
+static int nbd_opt_export_name(struct nbd_conn *c, const char *export_name,
+                               bool no_zeroes, uint64_t *size,
+                               uint16_t *tflags) {
+    struct {
+        uint64_t size;
+        uint16_t flags;
+        uint8_t zeroes[124];
+    } __attribute__((packed)) rep;
+    int err;
+
+    err = nbd_send_option(c, NBD_OPT_EXPORT_NAME, export_name,
+                          strlen(export_name));
+    if (!err)
+        err = nbd_xfer_buf(c, &rep,
+                           no_zeroes ? sizeof(rep) - sizeof(rep.zeroes)
+                                     : sizeof(rep),
+                           false);
+    if (err)
+        return err;
+    *size = be64toh(rep.size);
+    *tflags = be16toh(rep.flags);
+    return 0;
+}
+
+static int nbd_handshake(struct nbd_conn *c, const char *export_name,
+                         uint64_t *size, uint16_t *tflags) {
+    struct {
+        uint64_t magic;
+        uint64_t opts_magic;
+        uint16_t flags;
+    } __attribute__((packed)) greeting;
+    int err;
+
+    err = nbd_xfer_buf(c, &greeting, sizeof(greeting), false);
+    if (err)
+        return err;
+    if (be64toh(greeting.magic) != NBD_MAGIC ||
+        be64toh(greeting.opts_magic) != NBD_OPTS_MAGIC) {
+        log_error("nbd: server does not speak the newstyle protocol");
+        return EPROTO;
+    }
+
+    uint16_t hflags = be16toh(greeting.flags);
+    uint32_t cflags =
+        htobe32(hflags & (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES));
+    err = nbd_xfer_buf(c, &cflags, sizeof(cflags), true);
+    if (err)
+        return err;
+
+    // Servers without fixed newstyle may drop the connection on an
+    // unknown option, so only try NBD_OPT_GO with them.
+    if (hflags & NBD_FLAG_FIXED_NEWSTYLE) {
+        err = nbd_opt_go(c, export_name, size, tflags);
+        if (err != EOPNOTSUPP)
+            return err;
+    }
+    return nbd_opt_export_name(c, export_name, hflags & NBD_FLAG_NO_ZEROES,
+                               size, tflags);
+}
+
+static int nbd_conn_open(struct blk_nbd *nbd, struct nbd_conn *c) {
+    uint64_t size;
+    uint16_t tflags;
+
+    c->fd = nbd_connect_socket(nbd->server);
+    if (c->fd < 0)
+        return -1;
+    if (set_nonblocking(c->fd) < 0 ||
+        nbd_handshake(c, nbd->export_name, &size, &tflags) != 0) {
+        log_error("nbd: handshake with %s failed", nbd->server);
+        goto err;
+    }
+    // Every connection must see the same export.
+    if (nbd->be.size && (size != nbd->be.size || tflags != nbd->tflags)) {
+        log_error("nbd: export \"%s\" changed on %s", nbd->export_name,
+                  nbd->server);
+        goto err;
+    }
+    nbd->be.size = size;
+    nbd->tflags = tflags;
+    return 0;
+err:
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+}
+
+static int nbd_grow_iov(struct nbd_conn *c, int cnt) {
+    if (cnt <= c->iov_cap)
+        return 0;
+    struct iovec *send_iov = realloc(c->send_iov, sizeof(*send_iov) * cnt);
+    if (!send_iov)
+        return ENOMEM;
+    c->send_iov = send_iov;
+    struct iovec *recv_iov = realloc(c->recv_iov, sizeof(*recv_iov) * cnt);
+    if (!recv_iov)
+        return ENOMEM;
+    c->recv_iov = recv_iov;
+    c->iov_cap = cnt;
+    return 0;
+}
+
+// Complete every request on a broken connection and close it.
+static void nbd_conn_fail(struct nbd_conn *c) {
+    log_error("nbd: connection lost, failing %d requests", c->queued);
+    close(c->fd);
+    c->fd = -1;
+    for (int i = 0; i < NBD_QUEUE_DEPTH; i++) {
+        struct nbd_slot *slot = &c->slots[i];
+        if (slot->state == NBD_SLOT_FREE)
+            continue;
+        slot->state = NBD_SLOT_FREE;
+        slot->io->done(slot->io, EIO, 0);
+    }
+    c->queued = 0;
+    c->need_flush = 0;
+}
+
+static int nbd_send_request(struct blk_nbd *nbd, struct nbd_conn *c,
+                            uint16_t type, uint16_t flags, uint64_t cookie,
+                            uint64_t off, uint32_t len,
+                            const struct iovec *data, int cnt) {
+    struct nbd_request req = {
+        .magic = htobe32(NBD_REQUEST_MAGIC),
+        .flags = htobe16(flags),
+        .type = htobe16(type),
+        .cookie = cookie,
+        .offset = htobe64(off),
+        .length = htobe32(len),
+    };
+
+    c->send_iov[0].iov_base = &req;
+    c->send_iov[0].iov_len = sizeof(req);
+    if (cnt > 0)
+        memcpy(&c->send_iov[1], data, sizeof(*data) * cnt);
+    return nbd_xfer(nbd, c, c->send_iov, cnt + 1, true);
+}
+
+static int nbd_send_flush(struct blk_nbd *nbd, struct nbd_conn *c, int i) {
+    c->slots[i].state = NBD_SLOT_FLUSHING;
+    return nbd_send_request(nbd, c, NBD_CMD_FLUSH, 0, i, 0, 0, NULL, 0);
+}
+
+/*
+ * Read one reply and complete its request. Returns 1 if a request
+ * completed, 0 if it still waits for a FLUSH, -1 if the connection broke.
+ */
+static int nbd_recv_reply(struct blk_nbd *nbd, struct nbd_conn *c) {
+    struct nbd_reply rep;
+
+    if (nbd_xfer_buf(c, &rep, sizeof(rep), false) != 0)
+        return -1;
+    if (be32toh(rep.magic) != NBD_REPLY_MAGIC ||
+        rep.cookie >= NBD_QUEUE_DEPTH ||
+        c->slots[rep.cookie].state == NBD_SLOT_FREE ||
+        c->slots[rep.cookie].state == NBD_SLOT_NEED_FLUSH) {
+        log_error("nbd: unexpected reply from %s", nbd->server);
+        return -1;
+    }
+
+    struct nbd_slot *slot = &c->slots[rep.cookie];
+    struct blk_io *io = slot->io;
+    int err = be32toh(rep.error);
+    if (!err && io->op == BLK_IO_READ && slot->state == NBD_SLOT_BUSY) {
+        memcpy(c->recv_iov, io->iov, sizeof(*io->iov) * io->cnt);
+        if (nbd_xfer(NULL, c, c->recv_iov, io->cnt, false) != 0)
+            return -1;
+    }
+    if (!err && io->fua && slot->state == NBD_SLOT_BUSY &&
+        !(nbd->tflags & NBD_FLAG_SEND_FUA) &&
+        (nbd->tflags & NBD_FLAG_SEND_FLUSH)) {
+        // Sent by the caller of reap(), never from inside a send.
+        slot->state = NBD_SLOT_NEED_FLUSH;
+        c->need_flush++;
+        return 0;
+    }
+
+    slot->state = NBD_SLOT_FREE;
+    c->queued--;
+    io->done(io, err, err || io->op != BLK_IO_READ ? 0 : slot->len);
+    return 1;
+}
+
+static int nbd_send_pending_flushes(struct blk_nbd *nbd, struct nbd_conn *c) {
+    for (int i = 0; i < NBD_QUEUE_DEPTH && c->need_flush > 0; i++) {
+        if (c->slots[i].state != NBD_SLOT_NEED_FLUSH)
+            continue;
+        c->need_flush--;
+        if (nbd_send_flush(nbd, c, i) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int nbd_conn_submit(struct blk_nbd *nbd, struct nbd_conn *c,
+                           struct blk_io *io) {
+    uint16_t type, flags = 0;
+    uint64_t len = io->len;
+    int i, err;
+
+    switch (io->op) {
+    case BLK_IO_READ:
+    case BLK_IO_WRITE:
+        len = 0;
+        for (int j = 0; j < io->cnt; j++)
+            len += io->iov[j].iov_len;
+        type = io->op == BLK_IO_READ ? NBD_CMD_READ : NBD_CMD_WRITE;
+        if (io->fua && (nbd->tflags & NBD_FLAG_SEND_FUA))
+            flags |= NBD_CMD_FLAG_FUA;
+        break;
+    case BLK_IO_FLUSH:
+        type = NBD_CMD_FLUSH;
+        break;
+    case BLK_IO_DISCARD:
+        type = NBD_CMD_TRIM;
+        break;
+    case BLK_IO_WRITE_ZEROES:
+        type = NBD_CMD_WRITE_ZEROES;
+        if (!io->unmap)
+            flags |= NBD_CMD_FLAG_NO_HOLE;
+        break;
+    default:
+        return EINVAL;
+    }
+    if (len > UINT32_MAX)
+        return EINVAL;
+    // Without a server-side cache there is nothing to flush.
+    if (io->op == BLK_IO_FLUSH && !(nbd->tflags & NBD_FLAG_SEND_FLUSH)) {
+        io->done(io, 0, 0);
+        return 0;
+    }
+
+    for (i = 0; i < NBD_QUEUE_DEPTH; i++)
+        if (c->slots[i].state == NBD_SLOT_FREE)
+            break;
+    if (i == NBD_QUEUE_DEPTH)
+        return EAGAIN;
+    err = nbd_grow_iov(c, io->cnt + 1);
+    if (err)
+        return err;
+
+    c->slots[i] = (struct nbd_slot){
+        .state = NBD_SLOT_BUSY,
+        .io = io,
+        .len = len,
+    };
+    c->queued++;
+    if (nbd_send_request(nbd, c, type, flags, i, io->off, len,
+                         io->op == BLK_IO_WRITE ? io->iov : NULL,
+                         io->op == BLK_IO_WRITE ? io->cnt : 0) != 0)
+        nbd_conn_fail(c);
+    return 0;
+}
+
+static int blk_nbd_submit(BlkBackend *be, struct blk_io *io) {
+    struct blk_nbd *nbd = (struct blk_nbd *)be;
+    bool busy = false;
+
+    for (int n = 0; n < nbd->num_conns; n++) {
+        struct nbd_conn *c = &nbd->conns[nbd->next_conn];
+        nbd->next_conn = (nbd->next_conn + 1) % nbd->num_conns;
+
+        if (c->fd < 0 && nbd_conn_open(nbd, c) != 0)
+            continue;
+        int err = nbd_conn_submit(nbd, c, io);
+        if (err != EAGAIN)
+            return err;
+        busy = true;
+    }
+    return busy ? EAGAIN : EIO;
+}
+
+static int nbd_queued(struct blk_nbd *nbd) {
+    int queued = 0;
+    for (int i = 0; i < nbd->num_conns; i++)
+        queued += nbd->conns[i].queued;
+    return queued;
+}
+
+static void blk_nbd_reap(BlkBackend *be, bool all) {
+    struct blk_nbd *nbd = (struct blk_nbd *)be;
+    struct pollfd pfds[BLK_NBD_MAX_CONNS];
+    struct nbd_conn *conns[BLK_NBD_MAX_CONNS];
+    int completed = 0;
+
+    while (nbd_queued(nbd) > 0 && (all || completed == 0)) {
+        int n = 0;
+        for (int i = 0; i < nbd->num_conns; i++) {
+            if (nbd->conns[i].queued == 0)
+                continue;
+            conns[n] = &nbd->conns[i];
+            pfds[n].fd = nbd->conns[i].fd;
+            pfds[n].events = POLLIN;
+            n++;
+        }
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("nbd: poll failed, errno=%d", errno);
+            for (int i = 0; i < n; i++)
+                nbd_conn_fail(conns[i]);
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct nbd_conn *c = conns[i];
+            if (!pfds[i].revents)
+                continue;
+            int queued = c->queued;
+            int ret = nbd_recv_reply(nbd, c);
+            if (ret >= 0)
+                ret = nbd_send_pending_flushes(nbd, c);
+            if (ret < 0)
+                nbd_conn_fail(c);
+            completed += queued - c->queued;
+        }
+    }
+}
+
+struct nbd_sync_call {
+    struct blk_io io; // Must stay first, done() casts back
+    bool done;
+    int err;
+    ssize_t len;
+};
+
+static void nbd_sync_done(struct blk_io *io, int err, ssize_t len) {
+    struct nbd_sync_call *call = (struct nbd_sync_call *)io;
+    call->done = true;
+    call->err = err;
+    call->len = len;
+}
+
+// Take an idle connection for a blocking call, waiting while all are busy.
+static struct nbd_conn *nbd_sync_get(struct blk_nbd *nbd) {
+    int max = nbd->tflags & NBD_FLAG_CAN_MULTI_CONN ? NBD_MAX_SYNC_CONNS : 1;
+    struct nbd_conn *c;
+
+    pthread_mutex_lock(&nbd->sync_lock);
+    while (!nbd->sync_idle && nbd->num_sync == max)
+        pthread_cond_wait(&nbd->sync_cond, &nbd->sync_lock);
+    if (nbd->sync_idle)
+        c = nbd->sync_free[--nbd->sync_idle];
+    else
+        c = &nbd->sync_conns[nbd->num_sync++];
+    pthread_mutex_unlock(&nbd->sync_lock);
+    return c;
+}
+
+static void nbd_sync_put(struct blk_nbd *nbd, struct nbd_conn *c) {
+    pthread_mutex_lock(&nbd->sync_lock);
+    nbd->sync_free[nbd->sync_idle++] = c;
+    pthread_cond_signal(&nbd->sync_cond);
+    pthread_mutex_unlock(&nbd->sync_lock);
+}
+
+// Run io on a connection reserved for the blocking calls.
+static int nbd_sync_io(struct blk_nbd *nbd, struct nbd_sync_call *call) {
+    struct nbd_conn *c = nbd_sync_get(nbd);
+    int err = 0;
+
+    call->io.done = nbd_sync_done;
+    if (c->fd < 0 && nbd_conn_open(nbd, c) != 0)
+        err = EIO;
+    if (!err)
+        err = nbd_conn_submit(nbd, c, &call->io);
+    while (!err && !call->done) {
+        if (nbd_recv_reply(nbd, c) < 0 ||
+            nbd_send_pending_flushes(nbd, c) < 0)
+            nbd_conn_fail(c);
+    }
+    nbd_sync_put(nbd, c);
+    return err ? err : call->err;
+}
+
+static int blk_nbd_preadv(BlkBackend *be, const struct iovec *iov, int cnt,
+                          uint64_t off, ssize_t *len) {
+    struct nbd_sync_call call = {
+        .io = {.op = BLK_IO_READ,
+               .off = off,
+               .iov = (struct iovec *)iov,
+               .cnt = cnt},
+    };
+    int err = nbd_sync_io((struct blk_nbd *)be, &call);
+    *len = err ? -1 : call.len;
+    return err;
+}
+
+static int blk_nbd_pwritev(BlkBackend *be, const struct iovec *iov, int cnt,
+                           uint64_t off) {
+    struct nbd_sync_call call = {
+        .io = {.op = BLK_IO_WRITE,
+               .off = off,
+               .iov = (struct iovec *)iov,
+               .cnt = cnt},
+    };
+    return nbd_sync_io((struct blk_nbd *)be, &call);
+}
+
+static int blk_nbd_flush(BlkBackend *be) {
+    struct nbd_sync_call call = {.io = {.op = BLK_IO_FLUSH}};
+    return nbd_sync_io((struct blk_nbd *)be, &call);
+}
+
+static int blk_nbd_discard(BlkBackend *be, uint64_t off, uint64_t len) {
+    struct nbd_sync_call call = {
+        .io = {.op = BLK_IO_DISCARD, .off = off, .len = len},
+    };
+    return nbd_sync_io((struct blk_nbd *)be, &call);
+}
+
+static int blk_nbd_write_zeroes(BlkBackend *be, uint64_t off, uint64_t len,
+                                bool unmap) {
+    struct nbd_sync_call call = {
+        .io = {.op = BLK_IO_WRITE_ZEROES,
+               .off = off,
+               .len = len,
+               .unmap = unmap},
+    };
+    return nbd_sync_io((struct blk_nbd *)be, &call);
+}
+
+static void nbd_conn_close(struct nbd_conn *c) {
+    if (c->fd >= 0) {
+        // Best effort, the server drops the export either way.
+        if (nbd_grow_iov(c, 1) == 0)
+            nbd_send_request(NULL, c, NBD_CMD_DISC, 0, 0, 0, 0, NULL, 0);
+        close(c->fd);
+    }
+    free(c->send_iov);
+    free(c->recv_iov);
+}
+
+static void blk_nbd_close(BlkBackend *be) {
+    struct blk_nbd *nbd = (struct blk_nbd *)be;
+
+    for (int i = 0; i < nbd->num_conns; i++)
+        nbd_conn_close(&nbd->conns[i]);
+    for (int i = 0; i < nbd->num_sync; i++)
+        nbd_conn_close(&nbd->sync_conns[i]);
+    pthread_cond_destroy(&nbd->sync_cond);
+    pthread_mutex_destroy(&nbd->sync_lock);
+    free(nbd->server);
+    free(nbd->export_name);
+    free(nbd);
+}
+
+static const struct blk_backend_ops blk_nbd_ops = {
+    .name = "nbd",
+    .preadv = blk_nbd_preadv,
+    .pwritev = blk_nbd_pwritev,
+    .flush = blk_nbd_flush,
+    .discard = blk_nbd_discard,
+    .write_zeroes = blk_nbd_write_zeroes,
+    .submit = blk_nbd_submit,
+    .reap = blk_nbd_reap,
+    .close = blk_nbd_close,
+};
+
+BlkBackend *blk_nbd_open(const char *server, const char *export_name,
+                         int connections) {
+    struct blk_nbd *nbd = calloc(1, sizeof(*nbd));
+
+    if (!nbd) {
+        log_error("failed to allocate blk nbd backend");
+        return NULL;
+    }
+    nbd->be.ops = &blk_nbd_ops;
+    nbd->num_conns = 1;
+    for (int i = 0; i < BLK_NBD_MAX_CONNS; i++)
+        nbd->conns[i].fd = -1;
+    for (int i = 0; i < NBD_MAX_SYNC_CONNS; i++)
+        nbd->sync_conns[i].fd = -1;
+    pthread_mutex_init(&nbd->sync_lock, NULL);
+    pthread_cond_init(&nbd->sync_cond, NULL);
+    nbd->server = strdup(server);
+    nbd->export_name = strdup(export_name);
+    if (!nbd->server || !nbd->export_name)
+        goto err;
+
+    if (nbd_conn_open(nbd, &nbd->conns[0]) != 0)
+        goto err;
+    // Flushes on one connection only cover writes on the others if the
+    // server says so.
+    if (connections > 1 && !(nbd->tflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        log_warn("nbd: %s does not allow multiple connections, using one",
+                 server);
+        connections = 1;
+    }
+    for (int i = 1; i < connections; i++) {
+        if (nbd_conn_open(nbd, &nbd->conns[i]) != 0)
+            goto err;
+        nbd->num_conns++;
+    }
+
+    if (nbd->tflags & NBD_FLAG_SEND_TRIM)
+        nbd->be.flags |= BLK_BACKEND_DISCARD;
+    if (nbd->tflags & NBD_FLAG_SEND_WRITE_ZEROES)
+        nbd->be.flags |= BLK_BACKEND_WRITE_ZEROES;
+    if (nbd->tflags & NBD_FLAG_READ_ONLY)
+        nbd->be.flags |= BLK_BACKEND_READ_ONLY;
+
+    log_info("blk nbd: %s export \"%s\", %d connections, %" PRIu64
+             " bytes, flags %#x",
+             server, export_name, nbd->num_conns, nbd->be.size, nbd->tflags);
+    return &nbd->be;
+
+err:
+    blk_nbd_close(&nbd->be);
+    return NULL;
+}
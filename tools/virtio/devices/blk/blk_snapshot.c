@@ -0,0 +1,391 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "virtio_blk.h"
+
+/*
+ * Dirty block tracking and live snapshots
+ * =======================================
+ *
+ * With "dirty_bitmap" set, every virtio-blk device keeps one bit per
+ * dirty_block_size bytes of the disk. The worker sets the bits of a range
+ * before it issues a WRITE, DISCARD or WRITE_ZEROES to the backend. The
+ * bitmap starts all set since nothing has been copied yet.
+ *
+ * "hvisor virtio ctl <zone> <addr> snapshot <target>" quiesces the worker,
+ * so no request is half done, and forks the bitmap: the set bits move to
+ * the snapshot and the live bitmap starts over empty. The worker then runs
+ * again and a snapshot thread copies the forked blocks to the target in the
+ * background. The copy of the unchanged blocks is the state of the disk at
+ * the fork, so the target is crash consistent.
+ *
+ * To keep it that way, the worker copies a block that is still pending
+ * itself before it overwrites it (copy on write). snap->lock serializes the
+ * two copiers; a pending bit is only cleared under it, after the block has
+ * reached the target. Pending bits are never set after the fork, so a clear
+ * bit read without the lock is final.
+ *
+ * If the copy fails or is cancelled, the forked bits are merged back into
+ * the live bitmap, so the next snapshot copies those blocks again.
+ */
+
+struct blk_snapshot {
+    BlkDev *dev;
+    char *target;
+    int fd;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    uint64_t *fork;    // Blocks of this snapshot
+    uint64_t *pending; // Blocks not copied yet
+    uint8_t *buf;      // Copy thread buffer
+    uint8_t *cow_buf;  // Worker buffer
+    uint64_t total;
+    uint64_t copied; // Under lock
+    int err;         // Positive errno, under lock
+    bool stop;       // Cancel requested by blk_dirty_close()
+    bool done;       // Snapshot thread finished
+    struct timespec start;
+    double elapsed; // Seconds, set when done
+};
+
+#define BITS_PER_WORD 64
+
+static inline uint64_t bitmap_words(uint64_t bits) {
+    return (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
+
+static inline bool bitmap_test(const uint64_t *map, uint64_t bit) {
+    return __atomic_load_n(&map[bit / BITS_PER_WORD], __ATOMIC_ACQUIRE) &
+           (1ULL << (bit % BITS_PER_WORD));
+}
+
+static uint64_t bitmap_weight(const uint64_t *map, uint64_t bits) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < bitmap_words(bits); i++)
+        n += __builtin_popcountll(__atomic_load_n(&map[i], __ATOMIC_RELAXED));
+    return n;
+}
+
+static void bitmap_fill(uint64_t *map, uint64_t bits) {
+    memset(map, 0xff, bitmap_words(bits) * sizeof(*map));
+    if (bits % BITS_PER_WORD)
+        map[bits / BITS_PER_WORD] = (1ULL << (bits % BITS_PER_WORD)) - 1;
+}
+
+static inline bool snap_done(struct blk_snapshot *snap) {
+    return __atomic_load_n(&snap->done, __ATOMIC_ACQUIRE);
+}
+
+int blk_dirty_init(BlkDev *dev, uint64_t block_size) {
+    dev->dirty_block_size = block_size;
+    dev->dirty_blocks = (dev->backend->size + block_size - 1) / block_size;
+    dev->dirty = malloc(bitmap_words(dev->dirty_blocks) * sizeof(uint64_t));
+    if (!dev->dirty) {
+        log_error("virtio-blk: cannot allocate the dirty bitmap");
+        return -1;
+    }
+    bitmap_fill(dev->dirty, dev->dirty_blocks);
+    log_info("virtio-blk: tracking %" PRIu64 " dirty blocks of %" PRIu64
+             " bytes",
+             dev->dirty_blocks, block_size);
+    return 0;
+}
+
+// Copy one pending block to the target. Called with snap->lock held.
+static int snap_copy_block(struct blk_snapshot *snap, uint64_t block,
+                           uint8_t *buf) {
+    BlkDev *dev = snap->dev;
+    BlkBackend *be = dev->backend;
+    uint64_t off = block * dev->dirty_block_size;
+    struct iovec iov = {buf, MIN(dev->dirty_block_size, be->size - off)};
+    ssize_t len = 0;
+
+    int err = be->ops->preadv(be, &iov, 1, off, &len);
+    if (!err && len != (ssize_t)iov.iov_len)
+        err = EIO;
+    for (size_t done = 0; !err && done < iov.iov_len;) {
+        ssize_t n = pwrite(snap->fd, buf + done, iov.iov_len - done,
+                           off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            err = n < 0 ? errno : EIO;
+        else
+            done += n;
+    }
+    if (err) {
+        log_error("virtio-blk: snapshot of block %" PRIu64 " failed: %s",
+                  block, strerror(err));
+        return err;
+    }
+    __atomic_fetch_and(&snap->pending[block / BITS_PER_WORD],
+                       ~(1ULL << (block % BITS_PER_WORD)), __ATOMIC_RELEASE);
+    snap->copied++;
+    return 0;
+}
+
+void blk_dirty_write(BlkDev *dev, const struct blk_io *io) {
+    uint64_t len = io->len;
+    struct blk_snapshot *snap = dev->snap;
+
+    if (!dev->dirty)
+        return;
+    if (io->op == BLK_IO_WRITE) {
+        len = 0;
+        for (int i = 0; i < io->cnt; i++)
+            len += io->iov[i].iov_len;
+    }
+    if (len == 0 || io->off >= dev->backend->size)
+        return;
+
+    uint64_t first = io->off / dev->dirty_block_size;
+    uint64_t last = MIN((io->off + len - 1) / dev->dirty_block_size,
+                        dev->dirty_blocks - 1);
+    for (uint64_t b = first; b <= last; b++) {
+        if (snap && bitmap_test(snap->pending, b)) {
+            pthread_mutex_lock(&snap->lock);
+            // A failed copy stops the snapshot, don't try again.
+            if (!snap->err && bitmap_test(snap->pending, b))
+                snap->err = snap_copy_block(snap, b, snap->cow_buf);
+            pthread_mutex_unlock(&snap->lock);
+        }
+        __atomic_fetch_or(&dev->dirty[b / BITS_PER_WORD],
+                          1ULL << (b % BITS_PER_WORD), __ATOMIC_RELAXED);
+    }
+}
+
+static void *blk_snapshot_thread(void *arg) {
+    struct blk_snapshot *snap = arg;
+    BlkDev *dev = snap->dev;
+    int err = 0;
+
+    for (uint64_t b = 0; b < dev->dirty_blocks && !err; b++) {
+        if (__atomic_load_n(&snap->stop, __ATOMIC_RELAXED)) {
+            err = ECANCELED;
+            break;
+        }
+        // Skip clean words at once, most of the disk on a quiet guest.
+        if (b % BITS_PER_WORD == 0 &&
+            !__atomic_load_n(&snap->pending[b / BITS_PER_WORD],
+                             __ATOMIC_ACQUIRE)) {
+            b += BITS_PER_WORD - 1;
+            continue;
+        }
+        if (!bitmap_test(snap->pending, b))
+            continue;
+        pthread_mutex_lock(&snap->lock);
+        if (snap->err)
+            err = snap->err;
+        else if (bitmap_test(snap->pending, b))
+            err = snap->err = snap_copy_block(snap, b, snap->buf);
+        pthread_mutex_unlock(&snap->lock);
+    }
+    if (!err && fdatasync(snap->fd) < 0)
+        err = errno;
+
+    pthread_mutex_lock(&snap->lock);
+    if (err && !snap->err)
+        snap->err = err;
+    if (snap->err) {
+        // The target is incomplete: stop the worker from copying and let
+        // the next snapshot take these blocks again. The worker tests the
+        // pending bits without the lock, so they are cleared atomically.
+        for (uint64_t i = 0; i < bitmap_words(dev->dirty_blocks); i++) {
+            __atomic_store_n(&snap->pending[i], 0, __ATOMIC_RELEASE);
+            __atomic_fetch_or(&dev->dirty[i], snap->fork[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&snap->lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    snap->elapsed = (now.tv_sec - snap->start.tv_sec) +
+                    (now.tv_nsec - snap->start.tv_nsec) / 1e9;
+    if (snap->err)
+        log_error("virtio-blk: snapshot to %s failed: %s", snap->target,
+                  strerror(snap->err));
+    else
+        log_info("virtio-blk: snapshot to %s done, %" PRIu64
+                 " blocks in %.1fs",
+                 snap->target, snap->copied, snap->elapsed);
+    __atomic_store_n(&snap->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void blk_snapshot_free(struct blk_snapshot *snap) {
+    if (!snap)
+        return;
+    if (snap->fd >= 0)
+        close(snap->fd);
+    pthread_mutex_destroy(&snap->lock);
+    free(snap->fork);
+    free(snap->pending);
+    free(snap->buf);
+    free(snap->cow_buf);
+    free(snap->target);
+    free(snap);
+}
+
+static struct blk_snapshot *blk_snapshot_alloc(BlkDev *dev,
+                                               const char *target) {
+    size_t map_size = bitmap_words(dev->dirty_blocks) * sizeof(uint64_t);
+    struct blk_snapshot *snap = calloc(1, sizeof(*snap));
+
+    if (!snap)
+        return NULL;
+    snap->dev = dev;
+    snap->fd = -1;
+    pthread_mutex_init(&snap->lock, NULL);
+    snap->target = strdup(target);
+    snap->fork = calloc(1, map_size);
+    snap->pending = calloc(1, map_size);
+    snap->buf = malloc(dev->dirty_block_size);
+    snap->cow_buf = malloc(dev->dirty_block_size);
+    if (!snap->target || !snap->fork || !snap->pending || !snap->buf ||
+        !snap->cow_buf) {
+        blk_snapshot_free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+void blk_dirty_close(BlkDev *dev) {
+    struct blk_snapshot *snap = dev->snap;
+
+    if (snap) {
+        __atomic_store_n(&snap->stop, true, __ATOMIC_RELAXED);
+        pthread_join(snap->tid, NULL);
+        blk_snapshot_free(snap);
+        dev->snap = NULL;
+    }
+    free(dev->dirty);
+    dev->dirty = NULL;
+}
+
+int blk_ctl_snapshot(VirtIODevice *vdev, int argc, char *argv[], char *reply,
+                     size_t len) {
+    BlkDev *dev = vdev->dev;
+    struct blk_snapshot *snap;
+    bool full = argc == 3 && strcmp(argv[2], "full") == 0;
+    struct stat st;
+    int err;
+
+    if (!dev->dirty) {
+        snprintf(reply, len, "dirty_bitmap is not enabled\n");
+        return -EOPNOTSUPP;
+    }
+    if (argc < 2 || argc > 3 || (argc == 3 && !full)) {
+        snprintf(reply, len, "usage: snapshot <target> [full]\n");
+        return -EINVAL;
+    }
+    if (dev->snap && !snap_done(dev->snap)) {
+        snprintf(reply, len, "a snapshot to %s is in progress\n",
+                 dev->snap->target);
+        return -EBUSY;
+    }
+
+    snap = blk_snapshot_alloc(dev, argv[1]);
+    if (!snap)
+        return -ENOMEM;
+    snap->fd = open(argv[1], O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (snap->fd < 0 || fstat(snap->fd, &st) < 0 ||
+        (S_ISREG(st.st_mode) && (uint64_t)st.st_size != dev->backend->size &&
+         ftruncate(snap->fd, dev->backend->size) < 0)) {
+        err = errno;
+        snprintf(reply, len, "cannot open %s: %s\n", argv[1], strerror(err));
+        blk_snapshot_free(snap);
+        return -err;
+    }
+
+    // Fork the bitmap at a request boundary. Only this part stalls the
+    // guest; everything above is done while the worker runs.
+    blk_quiesce(dev);
+    for (uint64_t i = 0; i < bitmap_words(dev->dirty_blocks); i++)
+        snap->fork[i] = __atomic_exchange_n(&dev->dirty[i], 0,
+                                            __ATOMIC_RELAXED);
+    if (full)
+        bitmap_fill(snap->fork, dev->dirty_blocks);
+    memcpy(snap->pending, snap->fork,
+           bitmap_words(dev->dirty_blocks) * sizeof(uint64_t));
+    snap->total = bitmap_weight(snap->fork, dev->dirty_blocks);
+    clock_gettime(CLOCK_MONOTONIC, &snap->start);
+
+    struct blk_snapshot *old = dev->snap;
+    dev->snap = snap;
+    err = pthread_create(&snap->tid, NULL, blk_snapshot_thread, snap);
+    if (err) {
+        for (uint64_t i = 0; i < bitmap_words(dev->dirty_blocks); i++)
+            dev->dirty[i] |= snap->fork[i];
+        dev->snap = old;
+    }
+    blk_resume(dev);
+
+    if (err) {
+        snprintf(reply, len, "cannot start the snapshot thread: %s\n",
+                 strerror(err));
+        blk_snapshot_free(snap);
+        return -err;
+    }
+    if (old) {
+        pthread_join(old->tid, NULL);
+        blk_snapshot_free(old);
+    }
+    snprintf(reply, len,
+             "snapshot of %" PRIu64 " blocks (%" PRIu64 " bytes) to %s "
+             "started\n",
+             snap->total, snap->total * dev->dirty_block_size, snap->target);
+    return 0;
+}
+
+// Describe dirty tracking and the last snapshot for the status command.
+int blk_snapshot_status(BlkDev *dev, char *buf, size_t len) {
+    struct blk_snapshot *snap = dev->snap;
+    int used;
+
+    if (!dev->dirty)
+        return snprintf(buf, len, "dirty_bitmap: disabled\n");
+    used = snprintf(buf, len,
+                    "dirty: %" PRIu64 " of %" PRIu64 " blocks of %" PRIu64
+                    " bytes\n",
+                    bitmap_weight(dev->dirty, dev->dirty_blocks),
+                    dev->dirty_blocks, dev->dirty_block_size);
+    if (!snap || (size_t)used >= len)
+        return used;
+
+    pthread_mutex_lock(&snap->lock);
+    uint64_t copied = snap->copied;
+    int err = snap->err;
+    pthread_mutex_unlock(&snap->lock);
+    if (!snap_done(snap))
+        used += snprintf(buf + used, len - used,
+                         "snapshot: %s, running, %" PRIu64 " of %" PRIu64
+                         " blocks copied\n",
+                         snap->target, copied, snap->total);
+    else if (err)
+        used += snprintf(buf + used, len - used, "snapshot: %s, failed: %s\n",
+                         snap->target, strerror(err));
+    else
+        used += snprintf(buf + used, len - used,
+                         "snapshot: %s, done, %" PRIu64 " blocks in %.1fs\n",
+                         snap->target, copied, snap->elapsed);
+    return used;
+}
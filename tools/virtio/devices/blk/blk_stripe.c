@@ -0,0 +1,410 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "virtio_blk.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+/*
+ * Striped backend
+ * ---------------
+ * The virtual disk is cut into stripe_size units laid out round-robin over
+ * the member images: unit k lives on member k % num at member offset
+ * (k / num) * stripe_size. Consecutive units of one member are therefore
+ * contiguous on that member, so a guest request maps to at most one
+ * contiguous range per member. The range is described by an iovec list that
+ * slices the guest buffers.
+ *
+ * Every member has an I/O thread. A request touching several members queues
+ * the ranges of all but the first member to their threads, transfers the
+ * first range on the calling thread and then waits for the others, so the
+ * members work in parallel. Requests touching one member never leave the
+ * calling thread.
+ *
+ * DISCARD and WRITE_ZEROES ranges are split the same way, walking a single
+ * buffer-less iovec of the range length.
+ */
+
+enum stripe_op {
+    STRIPE_READ,
+    STRIPE_WRITE,
+    STRIPE_FLUSH,
+    STRIPE_DISCARD,
+    STRIPE_WRITE_ZEROES,
+};
+
+// Completion shared by the pieces of one request.
+struct stripe_call {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    int err;
+    ssize_t len;
+};
+
+// The piece of a request that falls on one member.
+struct stripe_task {
+    enum stripe_op op;
+    uint64_t off; // Offset on the member
+    struct iovec *iov;
+    int cnt;
+    bool unmap; // WRITE_ZEROES may deallocate
+    struct stripe_call *call;
+    struct stripe_task *next;
+};
+
+struct stripe_member {
+    int fd;
+    pthread_t tid;
+    bool thread_started;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct stripe_task *head, *tail; // Queued tasks, protected by mtx
+    bool close;
+};
+
+struct blk_stripe {
+    BlkBackend be;
+    uint64_t stripe_size;
+    int num;
+    struct stripe_member members[BLK_MAX_IMGS];
+};
+
+// preadv/pwritev take at most IOV_MAX entries, a member range may need more.
+static ssize_t stripe_rw(int fd, struct iovec *iov, int cnt, uint64_t off,
+                         bool write) {
+    ssize_t total = 0;
+    while (cnt > 0) {
+        int n = MIN(cnt, IOV_MAX);
+        ssize_t want = 0, len;
+        for (int i = 0; i < n; i++)
+            want += iov[i].iov_len;
+        if (write)
+            len = pwritev(fd, iov, n, off);
+        else
+            len = preadv(fd, iov, n, off);
+        if (len < 0)
+            return -1;
+        total += len;
+        if (len < want)
+            break;
+        off += len;
+        iov += n;
+        cnt -= n;
+    }
+    return total;
+}
+
+static void stripe_run_task(struct stripe_member *m, struct stripe_task *t) {
+    struct stripe_call *call = t->call;
+    ssize_t len = 0;
+    int err = 0;
+
+    switch (t->op) {
+    case STRIPE_READ:
+    case STRIPE_WRITE:
+        len = stripe_rw(m->fd, t->iov, t->cnt, t->off, t->op == STRIPE_WRITE);
+        break;
+    case STRIPE_FLUSH:
+        len = fdatasync(m->fd);
+        break;
+    case STRIPE_DISCARD:
+    case STRIPE_WRITE_ZEROES: {
+        uint64_t range = 0;
+        for (int i = 0; i < t->cnt; i++)
+            range += t->iov[i].iov_len;
+        if (t->op == STRIPE_DISCARD)
+            err = blk_fd_discard(m->fd, t->off, range);
+        else
+            err = blk_fd_write_zeroes(m->fd, t->off, range, t->unmap);
+        break;
+    }
+    }
+    if (len < 0) {
+        err = errno;
+        len = 0;
+    }
+
+    pthread_mutex_lock(&call->lock);
+    if (err && !call->err)
+        call->err = err;
+    if (t->op == STRIPE_READ || t->op == STRIPE_WRITE)
+        call->len += len;
+    if (--call->pending == 0)
+        pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&call->lock);
+}
+
+static void *stripe_member_thread(void *arg) {
+    struct stripe_member *m = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&m->mtx);
+        while (!m->head && !m->close)
+            pthread_cond_wait(&m->cond, &m->mtx);
+        struct stripe_task *t = m->head;
+        if (!t) {
+            pthread_mutex_unlock(&m->mtx);
+            break;
+        }
+        m->head = t->next;
+        if (!m->head)
+            m->tail = NULL;
+        pthread_mutex_unlock(&m->mtx);
+
+        stripe_run_task(m, t);
+    }
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+static void stripe_queue_task(struct stripe_member *m, struct stripe_task *t) {
+    t->next = NULL;
+    pthread_mutex_lock(&m->mtx);
+    if (m->tail)
+        m->tail->next = t;
+    else
+        m->head = t;
+    m->tail = t;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->mtx);
+}
+
+/*
+ * Run the tasks with a non-empty range (or every task for FLUSH): the first
+ * one on the calling thread, the rest on their member threads.
+ */
+static int stripe_run(struct blk_stripe *s, struct stripe_task *tasks,
+                      ssize_t *len) {
+    struct stripe_call call = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    int inline_member = -1;
+
+    for (int i = 0; i < s->num; i++) {
+        if (tasks[i].cnt == 0 && tasks[i].op != STRIPE_FLUSH)
+            continue;
+        tasks[i].call = &call;
+        call.pending++;
+    }
+    for (int i = 0; i < s->num; i++) {
+        if (!tasks[i].call)
+            continue;
+        if (inline_member < 0)
+            inline_member = i;
+        else
+            stripe_queue_task(&s->members[i], &tasks[i]);
+    }
+    if (inline_member >= 0)
+        stripe_run_task(&s->members[inline_member], &tasks[inline_member]);
+
+    pthread_mutex_lock(&call.lock);
+    while (call.pending > 0)
+        pthread_cond_wait(&call.cond, &call.lock);
+    pthread_mutex_unlock(&call.lock);
+    pthread_mutex_destroy(&call.lock);
+    pthread_cond_destroy(&call.cond);
+
+    if (len)
+        *len = call.len;
+    return call.err;
+}
+
+/*
+ * Walk the guest buffers in stripe-unit chunks. With tasks == NULL only count
+ * the iov slices each member needs into counts[]; otherwise append the slices
+ * to the member tasks, whose iov arrays were sized by the counting pass.
+ */
+static void stripe_walk(const struct blk_stripe *s, const struct iovec *iov,
+                        int cnt, uint64_t off, int *counts,
+                        struct stripe_task *tasks) {
+    uint64_t pos = off;
+    size_t ioff = 0;
+    int i = 0;
+
+    while (i < cnt) {
+        uint64_t unit = pos / s->stripe_size;
+        uint64_t chunk = s->stripe_size - pos % s->stripe_size;
+        int m = unit % s->num;
+
+        while (chunk > 0 && i < cnt) {
+            size_t take = MIN(iov[i].iov_len - ioff, chunk);
+            if (take > 0 && tasks) {
+                struct stripe_task *t = &tasks[m];
+                if (t->cnt == 0)
+                    t->off = (unit / s->num) * s->stripe_size +
+                             pos % s->stripe_size;
+                t->iov[t->cnt].iov_base = (uint8_t *)iov[i].iov_base + ioff;
+                t->iov[t->cnt].iov_len = take;
+                t->cnt++;
+            } else if (take > 0) {
+                counts[m]++;
+            }
+            ioff += take;
+            chunk -= take;
+            pos += take;
+            if (ioff == iov[i].iov_len) {
+                i++;
+                ioff = 0;
+            }
+        }
+    }
+}
+
+static int stripe_io(struct blk_stripe *s, enum stripe_op op,
+                     const struct iovec *iov, int cnt, uint64_t off,
+                     bool unmap, ssize_t *len) {
+    struct stripe_task tasks[BLK_MAX_IMGS] = {0};
+    int counts[BLK_MAX_IMGS] = {0};
+    int total = 0;
+
+    stripe_walk(s, iov, cnt, off, counts, NULL);
+    for (int i = 0; i < s->num; i++)
+        total += counts[i];
+
+    struct iovec *slices = malloc(sizeof(struct iovec) * (total ? total : 1));
+    if (!slices)
+        return ENOMEM;
+    for (int i = 0, used = 0; i < s->num; i++) {
+        tasks[i].op = op;
+        tasks[i].unmap = unmap;
+        tasks[i].iov = &slices[used];
+        used += counts[i];
+    }
+    stripe_walk(s, iov, cnt, off, NULL, tasks);
+
+    int err = stripe_run(s, tasks, len);
+    free(slices);
+    return err;
+}
+
+static int blk_stripe_preadv(BlkBackend *be, const struct iovec *iov, int cnt,
+                             uint64_t off, ssize_t *len) {
+    return stripe_io((struct blk_stripe *)be, STRIPE_READ, iov, cnt, off,
+                     false, len);
+}
+
+static int blk_stripe_pwritev(BlkBackend *be, const struct iovec *iov,
+                              int cnt, uint64_t off) {
+    return stripe_io((struct blk_stripe *)be, STRIPE_WRITE, iov, cnt, off,
+                     false, NULL);
+}
+
+static int blk_stripe_flush(BlkBackend *be) {
+    struct blk_stripe *s = (struct blk_stripe *)be;
+    struct stripe_task tasks[BLK_MAX_IMGS] = {0};
+
+    for (int i = 0; i < s->num; i++)
+        tasks[i].op = STRIPE_FLUSH;
+    return stripe_run(s, tasks, NULL);
+}
+
+static int blk_stripe_discard(BlkBackend *be, uint64_t off, uint64_t len) {
+    struct iovec range = {.iov_base = NULL, .iov_len = len};
+    return stripe_io((struct blk_stripe *)be, STRIPE_DISCARD, &range, 1, off,
+                     false, NULL);
+}
+
+static int blk_stripe_write_zeroes(BlkBackend *be, uint64_t off, uint64_t len,
+                                   bool unmap) {
+    struct iovec range = {.iov_base = NULL, .iov_len = len};
+    return stripe_io((struct blk_stripe *)be, STRIPE_WRITE_ZEROES, &range, 1,
+                     off, unmap, NULL);
+}
+
+static void blk_stripe_close(BlkBackend *be) {
+    struct blk_stripe *s = (struct blk_stripe *)be;
+
+    for (int i = 0; i < s->num; i++) {
+        struct stripe_member *m = &s->members[i];
+        if (m->thread_started) {
+            pthread_mutex_lock(&m->mtx);
+            m->close = true;
+            pthread_cond_signal(&m->cond);
+            pthread_mutex_unlock(&m->mtx);
+            pthread_join(m->tid, NULL);
+        }
+        pthread_mutex_destroy(&m->mtx);
+        pthread_cond_destroy(&m->cond);
+        if (m->fd >= 0)
+            close(m->fd);
+    }
+    free(s);
+}
+
+static const struct blk_backend_ops blk_stripe_ops = {
+    .name = "stripe",
+    .preadv = blk_stripe_preadv,
+    .pwritev = blk_stripe_pwritev,
+    .flush = blk_stripe_flush,
+    .discard = blk_stripe_discard,
+    .write_zeroes = blk_stripe_write_zeroes,
+    .close = blk_stripe_close,
+};
+
+BlkBackend *blk_stripe_open(const char *const *paths, int num,
+                            uint64_t stripe_size) {
+    struct blk_stripe *s = calloc(1, sizeof(*s));
+    uint64_t member_size = UINT64_MAX;
+
+    if (!s) {
+        log_error("failed to allocate blk stripe backend");
+        return NULL;
+    }
+    s->be.ops = &blk_stripe_ops;
+    s->be.flags = BLK_BACKEND_DISCARD | BLK_BACKEND_WRITE_ZEROES;
+    s->stripe_size = stripe_size;
+
+    for (int i = 0; i < num; i++) {
+        struct stripe_member *m = &s->members[i];
+        uint64_t size;
+
+        m->fd = -1;
+        pthread_mutex_init(&m->mtx, NULL);
+        pthread_cond_init(&m->cond, NULL);
+        // Let blk_stripe_close() release the members set up so far.
+        s->num = i + 1;
+        if (blk_open_image(paths[i], &m->fd, &size) != 0)
+            goto err;
+        member_size = MIN(member_size, size);
+        if (pthread_create(&m->tid, NULL, stripe_member_thread, m) != 0) {
+            log_error("failed to create blk stripe thread");
+            goto err;
+        }
+        m->thread_started = true;
+    }
+
+    // Only whole stripe units that exist on every member are usable.
+    s->be.size = member_size / stripe_size * stripe_size * num;
+    if (s->be.size == 0) {
+        log_error("stripe members are smaller than stripe size %" PRIu64,
+                  stripe_size);
+        goto err;
+    }
+    log_info("blk stripe: %d members, stripe size %" PRIu64
+             ", %" PRIu64 " bytes",
+             num, stripe_size, s->be.size);
+    return &s->be;
+
+err:
+    blk_stripe_close(&s->be);
+    return NULL;
+}
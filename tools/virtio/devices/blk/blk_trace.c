@@ -0,0 +1,598 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "virtio_blk.h"
+
+/*
+ * Request trace capture and replay
+ * ================================
+ *
+ * When tracing, the worker appends a struct blk_trace_rec per finished
+ * request to a single-producer, single-consumer ring; a writer thread moves
+ * batches of records to the trace file. The worker never blocks on the
+ * file: if the ring is full the record is dropped and counted in the file
+ * header, which is rewritten when the trace is closed.
+ *
+ * "hvisor virtio replay" issues the requests of a trace against an image or
+ * NBD server at their recorded submit times (or scaled, or as fast as
+ * possible) from a pool of threads, and reports throughput and latency
+ * percentiles per request type next to the recorded latencies. Each thread
+ * keeps one request in flight through the blocking backend calls: on an
+ * image they run in parallel, and the NBD backend gives every concurrent
+ * caller its own connection, so both reach the requested depth (NBD only
+ * if the server allows multiple connections).
+ */
+
+#define BLK_TRACE_RING (1U << 16) // Records, 2 MiB
+#define BLK_TRACE_BATCH 1024
+#define BLK_TRACE_POLL_US 10000
+
+struct blk_trace {
+    char *path;
+    int fd;
+    pthread_t tid;
+    struct blk_trace_hdr hdr;
+    uint64_t start;   // CLOCK_MONOTONIC at start_time
+    uint32_t head;    // Written by the worker
+    uint32_t tail;    // Written by the writer thread
+    uint64_t dropped; // Worker only
+    uint64_t written; // Writer thread only
+    int err;
+    bool stop;
+    bool detached; // Freed by the writer thread once the file is finished
+    struct blk_trace_rec ring[BLK_TRACE_RING];
+};
+
+static int trace_write(int fd, const void *buf, size_t len, off_t off) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pwrite(fd, (const uint8_t *)buf + done, len - done,
+                           off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? errno : EIO;
+        done += n;
+    }
+    return 0;
+}
+
+static void blk_trace_free(struct blk_trace *t) {
+    free(t->path);
+    free(t);
+}
+
+// Called by the writer thread once the ring is empty.
+static void blk_trace_finish(struct blk_trace *t) {
+    t->hdr.dropped = __atomic_load_n(&t->dropped, __ATOMIC_RELAXED);
+    if (!t->err)
+        t->err = trace_write(t->fd, &t->hdr, sizeof(t->hdr), 0);
+    if (!t->err && fdatasync(t->fd) < 0)
+        t->err = errno;
+    close(t->fd);
+    log_info("virtio-blk: trace %s closed, %" PRIu64 " records, %" PRIu64
+             " dropped%s",
+             t->path, t->written, t->hdr.dropped,
+             t->err ? ", write failed" : "");
+}
+
+static void *blk_trace_thread(void *arg) {
+    struct blk_trace *t = arg;
+    off_t off = sizeof(t->hdr);
+
+    for (;;) {
+        bool stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+        uint32_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = t->tail;
+
+        if (head == tail) {
+            if (stop)
+                break;
+            usleep(BLK_TRACE_POLL_US);
+            continue;
+        }
+        // Up to the end of the ring, the rest goes in the next round.
+        uint32_t idx = tail % BLK_TRACE_RING;
+        uint32_t num = MIN(head - tail, BLK_TRACE_RING - idx);
+        num = MIN(num, BLK_TRACE_BATCH);
+        if (!t->err) {
+            size_t len = num * sizeof(t->ring[0]);
+            t->err = trace_write(t->fd, &t->ring[idx], len, off);
+            if (t->err)
+                log_error("virtio-blk: writing trace %s failed: %s", t->path,
+                          strerror(t->err));
+            else
+                off += len;
+        }
+        if (!t->err)
+            __atomic_fetch_add(&t->written, num, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->tail, tail + num, __ATOMIC_RELEASE);
+    }
+    blk_trace_finish(t);
+    if (t->detached)
+        blk_trace_free(t);
+    return NULL;
+}
+
+struct blk_trace *blk_trace_open(const char *path, uint64_t disk_size) {
+    struct blk_trace *t = calloc(1, sizeof(*t));
+    struct timespec now;
+    int err;
+
+    if (!t || !(t->path = strdup(path))) {
+        free(t);
+        errno = ENOMEM;
+        return NULL;
+    }
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->fd < 0) {
+        err = errno;
+        log_error("virtio-blk: cannot open trace %s: %s", path, strerror(err));
+        goto err_free;
+    }
+    memcpy(t->hdr.magic, BLK_TRACE_MAGIC, sizeof(t->hdr.magic));
+    t->hdr.version = BLK_TRACE_VERSION;
+    t->hdr.rec_size = sizeof(struct blk_trace_rec);
+    t->hdr.disk_size = disk_size;
+    clock_gettime(CLOCK_REALTIME, &now);
+    t->hdr.start_time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    t->start = blk_trace_clock();
+    err = trace_write(t->fd, &t->hdr, sizeof(t->hdr), 0);
+    if (!err)
+        err = pthread_create(&t->tid, NULL, blk_trace_thread, t);
+    if (err) {
+        log_error("virtio-blk: cannot start trace %s: %s", path,
+                  strerror(err));
+        close(t->fd);
+        goto err_free;
+    }
+    log_info("virtio-blk: tracing requests to %s", path);
+    return t;
+err_free:
+    free(t->path);
+    free(t);
+    errno = err;
+    return NULL;
+}
+
+void blk_trace_add(struct blk_trace *t, struct blk_trace_rec *rec) {
+    uint32_t head = t->head;
+    uint32_t tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == BLK_TRACE_RING) {
+        __atomic_fetch_add(&t->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec->submit_ns -= t->start;
+    t->ring[head % BLK_TRACE_RING] = *rec;
+    __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Flush the ring and finish the file. The worker must not add any more.
+static void blk_trace_stop(struct blk_trace *t) {
+    __atomic_store_n(&t->stop, true, __ATOMIC_RELEASE);
+    pthread_join(t->tid, NULL);
+}
+
+void blk_trace_close(struct blk_trace *t) {
+    if (!t)
+        return;
+    blk_trace_stop(t);
+    blk_trace_free(t);
+}
+
+int blk_ctl_trace(VirtIODevice *vdev, int argc, char *argv[], char *reply,
+                  size_t len) {
+    BlkDev *dev = vdev->dev;
+    struct blk_trace *t;
+
+    if (argc != 2) {
+        snprintf(reply, len, "usage: trace <file>|off\n");
+        return -EINVAL;
+    }
+    if (strcmp(argv[1], "off") == 0) {
+        if (!dev->trace) {
+            snprintf(reply, len, "not tracing\n");
+            return -EINVAL;
+        }
+        // Take the trace from the worker at a request boundary.
+        blk_quiesce(dev);
+        t = dev->trace;
+        dev->trace = NULL;
+        blk_resume(dev);
+
+        // The writer thread flushes and syncs the rest of the trace and
+        // frees it, so that the event monitor thread does not wait for the
+        // disk. The final counts go to the log.
+        int err = t->err;
+        snprintf(reply, len,
+                 "closing %s, %" PRIu64 " requests written so far, %" PRIu64
+                 " dropped%s\n",
+                 t->path, __atomic_load_n(&t->written, __ATOMIC_RELAXED),
+                 t->dropped, err ? ", write failed" : "");
+        t->detached = true;
+        pthread_detach(t->tid);
+        __atomic_store_n(&t->stop, true, __ATOMIC_RELEASE);
+        return -err;
+    }
+
+    if (dev->trace) {
+        snprintf(reply, len, "already tracing to %s\n", dev->trace->path);
+        return -EBUSY;
+    }
+    t = blk_trace_open(argv[1], dev->backend->size);
+    if (!t) {
+        int err = errno;
+        snprintf(reply, len, "cannot trace to %s: %s\n", argv[1],
+                 strerror(err));
+        return -err;
+    }
+    blk_quiesce(dev);
+    dev->trace = t;
+    blk_resume(dev);
+    snprintf(reply, len, "tracing requests to %s\n", argv[1]);
+    return 0;
+}
+
+int blk_trace_status(BlkDev *dev, char *buf, size_t len) {
+    struct blk_trace *t = dev->trace;
+
+    if (!t)
+        return snprintf(buf, len, "trace: off\n");
+    // The counters are read racily, which is good enough for a status.
+    return snprintf(buf, len,
+                    "trace: %s, %" PRIu64 " records written, %" PRIu64
+                    " dropped%s\n",
+                    t->path, __atomic_load_n(&t->written, __ATOMIC_RELAXED),
+                    __atomic_load_n(&t->dropped, __ATOMIC_RELAXED),
+                    t->err ? ", write failed" : "");
+}
+
+/* Replay */
+
+#define REPLAY_MAX_JOBS 64
+#define REPLAY_SKIPPED UINT64_MAX
+#define REPLAY_PENDING (UINT64_MAX - 1) // Not reached, replay was stopped
+
+static const char *const replay_op_names[] = {
+    [BLK_IO_READ] = "read",
+    [BLK_IO_WRITE] = "write",
+    [BLK_IO_FLUSH] = "flush",
+    [BLK_IO_DISCARD] = "discard",
+    [BLK_IO_WRITE_ZEROES] = "write_zeroes",
+};
+#define REPLAY_OPS (sizeof(replay_op_names) / sizeof(replay_op_names[0]))
+
+struct replay {
+    BlkBackend *be;
+    struct blk_trace_rec *recs; // Sorted by submit_ns
+    uint64_t *lat; // Replayed latency in ns, REPLAY_SKIPPED or REPLAY_PENDING
+    size_t num;
+    size_t next;
+    size_t failed;
+    int err; // Set when a thread gave up, stops the others
+    uint32_t max_len;
+    double speed; // 0: as fast as possible
+    uint64_t start;
+};
+
+static int replay_cmp(const void *a, const void *b) {
+    const struct blk_trace_rec *x = a, *y = b;
+    return x->submit_ns < y->submit_ns ? -1 : x->submit_ns > y->submit_ns;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int replay_one(BlkBackend *be, const struct blk_trace_rec *rec,
+                      uint8_t *buf) {
+    uint64_t off = rec->sector * SECTOR_BSIZE;
+    struct iovec iov = {buf, rec->len};
+    ssize_t len;
+
+    switch (rec->op) {
+    case BLK_IO_READ:
+        return be->ops->preadv(be, &iov, 1, off, &len);
+    case BLK_IO_WRITE:
+        return be->ops->pwritev(be, &iov, 1, off);
+    case BLK_IO_FLUSH:
+        return be->ops->flush(be);
+    case BLK_IO_DISCARD:
+        return be->ops->discard(be, off, rec->len);
+    case BLK_IO_WRITE_ZEROES:
+        return be->ops->write_zeroes(be, off, rec->len, false);
+    }
+    return EOPNOTSUPP;
+}
+
+static void *replay_thread(void *arg) {
+    struct replay *r = arg;
+    uint8_t *buf = NULL;
+
+    if (r->max_len && posix_memalign((void **)&buf, 4096, r->max_len)) {
+        __atomic_store_n(&r->err, ENOMEM, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (buf)
+        memset(buf, 0xa5, r->max_len);
+
+    while (!__atomic_load_n(&r->err, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+        if (i >= r->num)
+            break;
+        if (r->lat[i] == REPLAY_SKIPPED)
+            continue;
+        if (r->speed > 0) {
+            uint64_t due = r->start + r->recs[i].submit_ns / r->speed;
+            struct timespec ts = {due / 1000000000, due % 1000000000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                   NULL) == EINTR)
+                ;
+        }
+        uint64_t t = blk_trace_clock();
+        if (replay_one(r->be, &r->recs[i], buf)) {
+            __atomic_fetch_add(&r->failed, 1, __ATOMIC_RELAXED);
+            r->lat[i] = REPLAY_SKIPPED;
+        } else {
+            r->lat[i] = blk_trace_clock() - t;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static struct blk_trace_rec *replay_load(const char *path, size_t *num,
+                                         uint64_t *disk_size) {
+    struct blk_trace_hdr hdr;
+    struct blk_trace_rec *recs = NULL;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, BLK_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != BLK_TRACE_VERSION ||
+        hdr.rec_size != sizeof(struct blk_trace_rec)) {
+        fprintf(stderr, "%s is not a virtio-blk trace\n", path);
+        goto out;
+    }
+    fseek(f, 0, SEEK_END);
+    *num = (ftell(f) - sizeof(hdr)) / sizeof(*recs);
+    fseek(f, sizeof(hdr), SEEK_SET);
+    recs = malloc(MAX(*num, 1) * sizeof(*recs));
+    if (!recs || fread(recs, sizeof(*recs), *num, f) != *num) {
+        fprintf(stderr, "cannot read %s\n", path);
+        free(recs);
+        recs = NULL;
+        goto out;
+    }
+    *disk_size = hdr.disk_size;
+    if (hdr.dropped)
+        fprintf(stderr, "warning: %" PRIu64 " requests were dropped while "
+                        "tracing\n",
+                hdr.dropped);
+out:
+    fclose(f);
+    return recs;
+}
+
+static void replay_usage(void) {
+    fprintf(stderr,
+            "usage: hvisor virtio replay [options] <trace> <img|nbd:server>\n"
+            "  -s <speed>   Time scale, 2 replays twice as fast, 0 as fast as\n"
+            "               possible (default 1)\n"
+            "  -j <jobs>    Requests in flight (default: recorded maximum)\n"
+            "  -e <export>  NBD export name\n"
+            "  -w           Allow writes to the target\n");
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+    return sorted[MIN(n - 1, (size_t)(p * n))];
+}
+
+static void replay_report(struct replay *r, double elapsed) {
+    uint64_t *lat = malloc(MAX(r->num, 1) * sizeof(*lat));
+    uint64_t *rec = malloc(MAX(r->num, 1) * sizeof(*rec));
+    size_t done = 0, skipped = 0, pending = 0;
+    uint64_t bytes = 0;
+
+    if (!lat || !rec)
+        goto out;
+    for (size_t i = 0; i < r->num; i++) {
+        if (r->lat[i] == REPLAY_SKIPPED) {
+            skipped++;
+            continue;
+        }
+        if (r->lat[i] == REPLAY_PENDING) {
+            pending++;
+            continue;
+        }
+        done++;
+        if (r->recs[i].op == BLK_IO_READ || r->recs[i].op == BLK_IO_WRITE)
+            bytes += r->recs[i].len;
+    }
+    skipped -= r->failed;
+    printf("%zu requests in %.2fs: %.0f IOPS, %.1f MiB/s", done, elapsed,
+           done / elapsed, bytes / elapsed / (1 << 20));
+    printf(", %zu skipped, %zu failed", skipped, r->failed);
+    if (pending)
+        printf(", %zu not replayed", pending);
+    printf("\n\n");
+    printf("%-12s %8s %10s %9s %9s %9s %9s %9s %9s %9s\n", "latency(us)",
+           "count", "MiB", "p50", "p90", "p99", "p99.9", "max", "rec p50",
+           "rec p99");
+
+    for (size_t op = 0; op < REPLAY_OPS; op++) {
+        size_t n = 0;
+        uint64_t op_bytes = 0;
+        for (size_t i = 0; i < r->num; i++) {
+            if (r->recs[i].op != op || r->lat[i] == REPLAY_SKIPPED ||
+                r->lat[i] == REPLAY_PENDING)
+                continue;
+            lat[n] = r->lat[i];
+            rec[n++] = r->recs[i].latency_ns;
+            op_bytes += r->recs[i].len;
+        }
+        if (!n)
+            continue;
+        qsort(lat, n, sizeof(*lat), u64_cmp);
+        qsort(rec, n, sizeof(*rec), u64_cmp);
+        printf("%-12s %8zu %10.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f "
+               "%9.1f\n",
+               replay_op_names[op], n, (double)op_bytes / (1 << 20),
+               percentile(lat, n, 0.5) / 1e3, percentile(lat, n, 0.9) / 1e3,
+               percentile(lat, n, 0.99) / 1e3, percentile(lat, n, 0.999) / 1e3,
+               lat[n - 1] / 1e3, percentile(rec, n, 0.5) / 1e3,
+               percentile(rec, n, 0.99) / 1e3);
+    }
+out:
+    free(lat);
+    free(rec);
+}
+
+int virtio_blk_replay(int argc, char *argv[]) {
+    struct replay r = {.speed = 1};
+    pthread_t tids[REPLAY_MAX_JOBS];
+    const char *export_name = "";
+    bool allow_writes = false, writes = false;
+    int jobs = 0, started = 0, opt, ret = -1;
+    uint64_t disk_size = 0;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "s:j:e:w")) != -1) {
+        switch (opt) {
+        case 's':
+            r.speed = strtod(optarg, &end);
+            if (*end || r.speed < 0) {
+                replay_usage();
+                return -1;
+            }
+            break;
+        case 'j':
+            jobs = strtol(optarg, &end, 0);
+            if (*end || jobs < 1 || jobs > REPLAY_MAX_JOBS) {
+                fprintf(stderr, "jobs must be 1 to %d\n", REPLAY_MAX_JOBS);
+                return -1;
+            }
+            break;
+        case 'e':
+            export_name = optarg;
+            break;
+        case 'w':
+            allow_writes = true;
+            break;
+        default:
+            replay_usage();
+            return -1;
+        }
+    }
+    if (argc - optind != 2) {
+        replay_usage();
+        return -1;
+    }
+    const char *target = argv[optind + 1];
+
+    r.recs = replay_load(argv[optind], &r.num, &disk_size);
+    if (!r.recs)
+        return -1;
+    qsort(r.recs, r.num, sizeof(*r.recs), replay_cmp);
+
+    int max_depth = 1;
+    for (size_t i = 0; i < r.num; i++) {
+        max_depth = MAX(max_depth, r.recs[i].depth);
+        writes |= r.recs[i].op != BLK_IO_READ && r.recs[i].op != BLK_IO_FLUSH;
+    }
+    if (writes && !allow_writes) {
+        fprintf(stderr, "the trace writes to the disk, pass -w to let it "
+                        "overwrite %s\n",
+                target);
+        goto out;
+    }
+    if (!jobs)
+        jobs = MIN(max_depth, REPLAY_MAX_JOBS);
+
+    // The jobs use the blocking calls, which open NBD connections of
+    // their own; one for the asynchronous interface is enough.
+    if (strncmp(target, "nbd:", 4) == 0)
+        r.be = blk_nbd_open(target + 4, export_name, 1);
+    else
+        r.be = blk_file_open(target);
+    if (!r.be) {
+        fprintf(stderr, "cannot open %s\n", target);
+        goto out;
+    }
+    if (r.be->size < disk_size)
+        fprintf(stderr, "warning: %s is smaller than the traced disk, "
+                        "requests beyond its end are skipped\n",
+                target);
+
+    r.lat = malloc(MAX(r.num, 1) * sizeof(*r.lat));
+    if (!r.lat)
+        goto out;
+    for (size_t i = 0; i < r.num; i++) {
+        struct blk_trace_rec *rec = &r.recs[i];
+        uint64_t off = rec->sector * SECTOR_BSIZE;
+        bool supported =
+            rec->op < REPLAY_OPS &&
+            (rec->op != BLK_IO_DISCARD || r.be->flags & BLK_BACKEND_DISCARD) &&
+            (rec->op != BLK_IO_WRITE_ZEROES ||
+             r.be->flags & BLK_BACKEND_WRITE_ZEROES);
+        r.lat[i] = REPLAY_PENDING;
+        // Requests the guest saw fail are not replayed either.
+        if (!supported || rec->status != VIRTIO_BLK_S_OK ||
+            (rec->op != BLK_IO_FLUSH &&
+             (off > r.be->size || rec->len > r.be->size - off)))
+            r.lat[i] = REPLAY_SKIPPED;
+        else if (rec->op == BLK_IO_READ || rec->op == BLK_IO_WRITE)
+            r.max_len = MAX(r.max_len, rec->len);
+    }
+
+    printf("replaying %zu requests on %s with %d jobs", r.num, target, jobs);
+    if (r.speed > 0)
+        printf(" at %gx speed\n", r.speed);
+    else
+        printf(" as fast as possible\n");
+    r.start = blk_trace_clock();
+    for (; started < jobs; started++)
+        if (pthread_create(&tids[started], NULL, replay_thread, &r))
+            break;
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    if (!started) {
+        fprintf(stderr, "cannot start replay threads\n");
+        goto out;
+    }
+    replay_report(&r, (blk_trace_clock() - r.start) / 1e9);
+    if (r.err) {
+        fprintf(stderr, "replay stopped: %s\n", strerror(r.err));
+        goto out;
+    }
+    ret = 0;
+out:
+    if (r.be)
+        r.be->ops->close(r.be);
+    free(r.lat);
+    free(r.recs);
+    return ret;
+}
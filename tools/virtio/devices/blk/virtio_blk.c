@@ -8,16 +8,20 @@
  * Authors:
  *      Guowei Li <2401213322@stu.pku.edu.cn>
  */
+#define _GNU_SOURCE
 
 #include "virtio_blk.h"
+#include "json_parse.h"
 #include "log.h"
 #include "virtio.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <linux/fs.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
@@ -37,14 +41,29 @@
  *     - does NOT touch the virtqueue or BlkDev (except mtx/cond/close/reset).
  *
  *   worker thread (blkproc_thread, one per blk device)
- *     - owns the virtqueue exclusively: drains avail_ring, performs disk I/O,
- *       updates used_ring, and injects IRQs back to the guest.
+ *     - owns the virtqueue exclusively: drains avail_ring, performs disk I/O
+ *       through dev->backend, updates used_ring, and injects IRQs back to the
+ *       guest. Backends may use helper threads of their own (see
+ *       blk_stripe.c) but complete every call before returning.
+ *     - with an asynchronous backend (see blk_nbd.c) READ/WRITE requests are
+ *       submitted while draining and reaped before the IRQ, so a whole batch
+ *       is in flight at once. Completions also run on the worker.
  *     - only it reads/writes vq->last_avail_idx and vq->last_used_idx.
  *
  * The virtqueue (avail_ring, desc_table) is single-threaded - the main thread
  * never accesses it. This avoids the intermediate procq and the extra locking
  * the old design required.
  *
+ * The BlkDev fields both threads touch outside mtx are config.wce and
+ * quiesce: the main thread stores wce when the guest writes the config space
+ * and the worker loads it per request, and the worker polls quiesce while
+ * draining, all with __atomic builtins.
+ *
+ * Control commands (see blk_snapshot.c) run on the main thread and may need
+ * the worker idle: blk_quiesce() sets dev->quiesce and waits until the
+ * worker, which stops after the current request and reaps the backend, has
+ * cleared dev->busy. blk_resume() lets it continue.
+ *
  * Cross-CPU shared memory (guest <-> worker)
  * ------------------------------------------
  * avail_ring->idx is written by the guest and read by the worker, hence the
@@ -52,66 +71,250 @@
  * by the guest, hence write_barrier() in update_used_ring().
  */
 
+/*
+ * File backend: a regular image file or a host block device.
+ */
+struct blk_file {
+    BlkBackend be;
+    int fd;
+};
+
+int blk_open_image(const char *path, int *fd, uint64_t *size) {
+    *fd = open(path, O_RDWR);
+    if (*fd == -1) {
+        log_error("cannot open %s, Error code is %d", path, errno);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(*fd, &st) == -1) {
+        log_error("cannot stat %s, Error code is %d", path, errno);
+        goto err;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        // st_size may be 0 for real block devices; try BLKGETSIZE64
+        if (ioctl(*fd, BLKGETSIZE64, size) != 0) {
+            log_error("cannot determine block device size for %s", path);
+            goto err;
+        }
+    }
+    return 0;
+err:
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static int blk_file_preadv(BlkBackend *be, const struct iovec *iov, int cnt,
+                           uint64_t off, ssize_t *len) {
+    struct blk_file *file = (struct blk_file *)be;
+    *len = preadv(file->fd, iov, cnt, off);
+    return *len < 0 ? errno : 0;
+}
+
+static int blk_file_pwritev(BlkBackend *be, const struct iovec *iov, int cnt,
+                            uint64_t off) {
+    struct blk_file *file = (struct blk_file *)be;
+    return pwritev(file->fd, iov, cnt, off) < 0 ? errno : 0;
+}
+
+static int blk_file_flush(BlkBackend *be) {
+    struct blk_file *file = (struct blk_file *)be;
+    return fdatasync(file->fd) < 0 ? errno : 0;
+}
+
+/*
+ * fallocate(2) covers regular files and, since Linux 4.9, block devices,
+ * where hole punching and zeroing map to discard and write-zeroes commands.
+ */
+int blk_fd_discard(int fd, uint64_t off, uint64_t len) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) ==
+        0)
+        return 0;
+    // Discard is only a hint: ignore storage that cannot deallocate.
+    return errno == EOPNOTSUPP ? 0 : errno;
+}
+
+int blk_fd_write_zeroes(int fd, uint64_t off, uint64_t len, bool unmap) {
+    static const uint8_t zeroes[64 * 1024];
+
+    if (unmap && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+                           len) == 0)
+        return 0;
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len) ==
+        0)
+        return 0;
+    if (errno != EOPNOTSUPP)
+        return errno;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, zeroes, MIN(len, sizeof(zeroes)), off);
+        if (n < 0)
+            return errno;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int blk_file_discard(BlkBackend *be, uint64_t off, uint64_t len) {
+    struct blk_file *file = (struct blk_file *)be;
+    return blk_fd_discard(file->fd, off, len);
+}
+
+static int blk_file_write_zeroes(BlkBackend *be, uint64_t off, uint64_t len,
+                                 bool unmap) {
+    struct blk_file *file = (struct blk_file *)be;
+    return blk_fd_write_zeroes(file->fd, off, len, unmap);
+}
+
+static void blk_file_close(BlkBackend *be) {
+    struct blk_file *file = (struct blk_file *)be;
+    close(file->fd);
+    free(file);
+}
+
+static const struct blk_backend_ops blk_file_ops = {
+    .name = "file",
+    .preadv = blk_file_preadv,
+    .pwritev = blk_file_pwritev,
+    .flush = blk_file_flush,
+    .discard = blk_file_discard,
+    .write_zeroes = blk_file_write_zeroes,
+    .close = blk_file_close,
+};
+
+BlkBackend *blk_file_open(const char *path) {
+    struct blk_file *file = calloc(1, sizeof(*file));
+    if (!file) {
+        log_error("failed to allocate blk file backend");
+        return NULL;
+    }
+    if (blk_open_image(path, &file->fd, &file->be.size) != 0) {
+        free(file);
+        return NULL;
+    }
+    file->be.ops = &blk_file_ops;
+    file->be.flags = BLK_BACKEND_DISCARD | BLK_BACKEND_WRITE_ZEROES;
+    return &file->be;
+}
+
 /**
- * VIRTIO_BLK_T_IN — read sectors from the backing file.
+ * VIRTIO_BLK_T_IN — read sectors from the backend.
  *
  * Virtio descriptor layout: out_iov=[header], in_iov=[data…, status].
  *
- * @param fd    backing file descriptor
+ * @param be    storage backend
  * @param wlen  [out] bytes successfully read
  * @param iov   guest data buffers (device-writable in_iov)
  * @param cnt   number of iov entries
  * @param off   byte offset (= sector * 512)
  * @return      0 on success, errno on failure
  */
-static int blk_do_read(int fd, ssize_t *wlen, struct iovec *iov, int cnt,
-                       uint64_t off) {
-    ssize_t len = preadv(fd, iov, cnt, off);
-    log_debug("preadv, len=%zd, offset=%ld", len, off);
-    if (len < 0) {
-        log_error("preadv failed, errno=%d", errno);
-        return errno;
-    }
-    *wlen = len;
-    return 0;
+static int blk_do_read(BlkBackend *be, ssize_t *wlen, struct iovec *iov,
+                       int cnt, uint64_t off) {
+    int err = be->ops->preadv(be, iov, cnt, off, wlen);
+    log_debug("preadv, len=%zd, offset=%ld", *wlen, off);
+    if (err)
+        log_error("%s preadv failed, errno=%d", be->ops->name, err);
+    return err;
 }
 
 /**
- * VIRTIO_BLK_T_OUT — write sectors to the backing file.
+ * VIRTIO_BLK_T_OUT — write sectors to the backend.
  *
  * Virtio descriptor layout: out_iov=[header, data…], in_iov=[status].
  *
- * @param fd   backing file descriptor
+ * @param be   storage backend
  * @param iov  guest data buffers (device-readable out_iov, excluding header)
  * @param cnt  number of iov entries
  * @param off  byte offset (= sector * 512)
  * @return     0 on success, errno on failure
  */
-static int blk_do_write(int fd, struct iovec *iov, int cnt, uint64_t off) {
-    ssize_t len = pwritev(fd, iov, cnt, off);
-    log_debug("pwritev, len=%zd, offset=%ld", len, off);
-    if (len < 0) {
-        log_error("pwritev failed, errno=%d", errno);
-        return errno;
-    }
-    return 0;
+static int blk_do_write(BlkBackend *be, struct iovec *iov, int cnt,
+                        uint64_t off) {
+    int err = be->ops->pwritev(be, iov, cnt, off);
+    log_debug("pwritev, offset=%ld", off);
+    if (err)
+        log_error("%s pwritev failed, errno=%d", be->ops->name, err);
+    return err;
 }
 
 /**
  * VIRTIO_BLK_T_FLUSH — persist all previously completed writes.
  *
  * Virtio descriptor layout: out_iov=[header], in_iov=[status].
- * Implemented via fdatasync(2); guarantees data is on stable storage.
+ * File-based backends implement it via fdatasync(2); guarantees data is on
+ * stable storage.
  *
- * @param fd  backing file descriptor
+ * @param be  storage backend
  * @return    0 on success, errno on failure
  */
-static int blk_do_flush(int fd) {
-    if (fdatasync(fd) < 0) {
-        log_error("fdatasync failed, errno=%d", errno);
-        return errno;
+static int blk_do_flush(BlkBackend *be) {
+    int err = be->ops->flush(be);
+    if (err)
+        log_error("%s flush failed, errno=%d", be->ops->name, err);
+    return err;
+}
+
+/**
+ * VIRTIO_BLK_T_DISCARD / VIRTIO_BLK_T_WRITE_ZEROES — one range of such a
+ * request. DISCARD may leave the range with any content, WRITE_ZEROES must
+ * read back as zeroes.
+ *
+ * @param be  storage backend
+ * @param io  range and flags (op, off, len, unmap)
+ * @return    0 on success, errno on failure
+ */
+static int blk_do_discard(BlkBackend *be, const struct blk_io *io) {
+    int err;
+    if (io->op == BLK_IO_DISCARD)
+        err = be->ops->discard(be, io->off, io->len);
+    else
+        err = be->ops->write_zeroes(be, io->off, io->len, io->unmap);
+    if (err)
+        log_error("%s %s failed, errno=%d", be->ops->name,
+                  io->op == BLK_IO_DISCARD ? "discard" : "write_zeroes", err);
+    return err;
+}
+
+// Run io through the blocking backend calls.
+static int blk_do_io(BlkBackend *be, struct blk_io *io, ssize_t *len) {
+    int err = 0;
+
+    *len = 0;
+    switch (io->op) {
+    case BLK_IO_READ:
+        err = blk_do_read(be, len, io->iov, io->cnt, io->off);
+        break;
+    case BLK_IO_WRITE:
+        err = blk_do_write(be, io->iov, io->cnt, io->off);
+        if (!err && io->fua)
+            err = blk_do_flush(be);
+        break;
+    case BLK_IO_FLUSH:
+        err = blk_do_flush(be);
+        break;
+    case BLK_IO_DISCARD:
+    case BLK_IO_WRITE_ZEROES:
+        err = blk_do_discard(be, io);
+        break;
     }
-    return 0;
+    return err;
+}
+
+/*
+ * Whether the device currently acts as a write-back cache. With
+ * VIRTIO_BLK_F_CONFIG_WCE negotiated the guest selects the mode through
+ * config.wce. Otherwise a driver that negotiated FLUSH expects write-back
+ * and one that did not expects write-through (virtio spec 5.2.6.2).
+ */
+static bool blk_writeback_enabled(VirtIODevice *vdev, BlkDev *dev) {
+    uint64_t features = vdev->regs.drv_feature;
+    if (features & (1ULL << VIRTIO_BLK_F_CONFIG_WCE))
+        return __atomic_load_n(&dev->config.wce, __ATOMIC_RELAXED) != 0;
+    return (features & (1ULL << VIRTIO_BLK_F_FLUSH)) != 0;
 }
 
 /**
@@ -129,6 +332,14 @@ static ssize_t blk_do_get_id(struct iovec *iov) {
     return MIN(n + 1, (ssize_t)iov->iov_len);
 }
 
+static uint8_t blk_status(int err) {
+    if (err == 0)
+        return VIRTIO_BLK_S_OK;
+    if (err == EOPNOTSUPP)
+        return VIRTIO_BLK_S_UNSUPP;
+    return VIRTIO_BLK_S_IOERR;
+}
+
 /**
  * Set the status byte and push a used-ring entry.
  *
@@ -146,19 +357,188 @@ static ssize_t blk_do_get_id(struct iovec *iov) {
  */
 static void blk_complete(VirtQueue *vq, uint16_t idx, uint8_t *st, int err,
                          ssize_t wlen) {
-    if (st) {
-        if (err == 0)
-            *st = VIRTIO_BLK_S_OK;
-        else if (err == EOPNOTSUPP)
-            *st = VIRTIO_BLK_S_UNSUPP;
-        else
-            *st = VIRTIO_BLK_S_IOERR;
-    }
+    if (st)
+        *st = blk_status(err);
     if (err && err != EOPNOTSUPP)
         log_error("virtio-block error, err=%d", err);
     update_used_ring(vq, idx, wlen + 1);
 }
 
+// Record a finished request in the trace, see blk_trace.c.
+static void blk_trace_io(BlkDev *dev, const struct blk_io *io, uint64_t start,
+                         int err, uint16_t depth) {
+    uint64_t len = io->len, lat = blk_trace_clock() - start;
+
+    if (io->iov) {
+        len = 0;
+        for (int i = 0; i < io->cnt; i++)
+            len += io->iov[i].iov_len;
+    }
+    struct blk_trace_rec rec = {
+        .submit_ns = start,
+        .sector = io->off / SECTOR_BSIZE,
+        .len = MIN(len, UINT32_MAX),
+        .latency_ns = MIN(lat, UINT32_MAX),
+        .op = io->op,
+        .status = blk_status(err),
+        .depth = depth,
+    };
+    blk_trace_add(dev->trace, &rec);
+}
+
+static void blk_inflight_done(struct blk_io *io, int err, ssize_t len) {
+    struct blk_inflight *req = (struct blk_inflight *)io;
+    BlkDev *dev = req->dev;
+
+    if (err)
+        log_error("%s request failed, errno=%d", dev->backend->ops->name, err);
+    if (dev->trace)
+        blk_trace_io(dev, io, req->start, err, req->depth);
+    blk_complete(req->vq, req->desc_idx, req->status, err, len);
+    dev->inflight_count--;
+    req->next_free = dev->inflight_free;
+    dev->inflight_free = req;
+}
+
+/*
+ * Queue a READ or WRITE on an asynchronous backend. It completes from a
+ * later reap(). The iovec array is copied because dev->in_buf and
+ * dev->out_buf are reused by the next request.
+ */
+static void blk_submit(BlkDev *dev, VirtQueue *vq, uint16_t desc_idx,
+                       uint8_t *status, const struct blk_io *io,
+                       uint64_t start) {
+    BlkBackend *be = dev->backend;
+    struct blk_inflight *req;
+    int err;
+
+    while (!(req = dev->inflight_free))
+        be->ops->reap(be, false);
+
+    if (req->iov_cap < io->cnt) {
+        struct iovec *iov = realloc(req->io.iov, sizeof(*iov) * io->cnt);
+        if (!iov) {
+            blk_complete(vq, desc_idx, status, ENOMEM, 0);
+            return;
+        }
+        req->io.iov = iov;
+        req->iov_cap = io->cnt;
+    }
+    dev->inflight_free = req->next_free;
+    req->depth = ++dev->inflight_count;
+    req->start = start;
+
+    struct iovec *iov = req->io.iov;
+    memcpy(iov, io->iov, sizeof(*iov) * io->cnt);
+    req->io = *io;
+    req->io.iov = iov;
+    req->io.done = blk_inflight_done;
+    req->vq = vq;
+    req->desc_idx = desc_idx;
+    req->status = status;
+
+    while ((err = be->ops->submit(be, &req->io)) == EAGAIN)
+        be->ops->reap(be, false);
+    if (err)
+        blk_inflight_done(&req->io, err, 0);
+}
+
+struct blk_wait {
+    struct blk_io io; // Must stay first, done() casts back
+    int err;
+};
+
+static void blk_wait_done(struct blk_io *io, int err, ssize_t len) {
+    (void)len;
+    ((struct blk_wait *)io)->err = err;
+}
+
+/*
+ * Run io to completion on the worker. On an asynchronous backend the
+ * requests already queued complete first, so FLUSH, DISCARD and
+ * WRITE_ZEROES are ordered after every READ/WRITE received before them.
+ */
+static int blk_run_io(BlkDev *dev, const struct blk_io *io) {
+    BlkBackend *be = dev->backend;
+    struct blk_wait w = {.io = *io};
+    ssize_t len;
+    int err;
+
+    if (!be->ops->submit)
+        return blk_do_io(be, &w.io, &len);
+
+    w.io.done = blk_wait_done;
+    be->ops->reap(be, true);
+    while ((err = be->ops->submit(be, &w.io)) == EAGAIN)
+        be->ops->reap(be, false);
+    if (err)
+        return err;
+    be->ops->reap(be, true);
+    return w.err;
+}
+
+/*
+ * DISCARD and WRITE_ZEROES carry an array of
+ * struct virtio_blk_discard_write_zeroes in the read-only buffers after the
+ * header. The segments are handled one after another. With @p sync set
+ * (write-through), the backend is flushed once after the last segment,
+ * just as a regular write is.
+ */
+static int blk_handle_discard(BlkDev *dev, uint32_t type,
+                              const struct iovec *iov, int cnt, bool sync) {
+    struct virtio_blk_discard_write_zeroes segs[BLK_MAX_DISCARD_SEG];
+    size_t total = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        if (iov[i].iov_len > sizeof(segs) - total) {
+            log_error("too many discard segments");
+            return EIO;
+        }
+        memcpy((uint8_t *)segs + total, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    if (total == 0 || total % sizeof(segs[0]) != 0) {
+        log_error("invalid discard segment size %zu", total);
+        return EIO;
+    }
+
+    for (size_t i = 0; i < total / sizeof(segs[0]); i++) {
+        uint64_t sector = segs[i].sector;
+        uint32_t num = segs[i].num_sectors;
+        uint32_t flags = segs[i].flags;
+        struct blk_io io = {
+            .op = type == VIRTIO_BLK_T_DISCARD ? BLK_IO_DISCARD
+                                               : BLK_IO_WRITE_ZEROES,
+            .off = sector * SECTOR_BSIZE,
+            .len = (uint64_t)num * SECTOR_BSIZE,
+            .unmap = flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP,
+        };
+
+        if (flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP ||
+            (io.unmap && type == VIRTIO_BLK_T_DISCARD))
+            return EOPNOTSUPP;
+        if (num > BLK_MAX_DISCARD_SECTORS || sector > dev->config.capacity ||
+            num > dev->config.capacity - sector) {
+            log_error("discard range out of bounds, sector=%" PRIu64
+                      ", num=%u",
+                      sector, num);
+            return EIO;
+        }
+        blk_dirty_write(dev, &io);
+        uint64_t start = dev->trace ? blk_trace_clock() : 0;
+        int err = blk_run_io(dev, &io);
+        if (dev->trace)
+            blk_trace_io(dev, &io, start, err, 1);
+        if (err)
+            return err;
+    }
+    if (sync) {
+        struct blk_io io = {.op = BLK_IO_FLUSH};
+        return blk_run_io(dev, &io);
+    }
+    return 0;
+}
+
 static void virtq_blk_handle_one_request(BlkDev *dev, VirtQueue *vq) {
     struct VirtioBufConfig cfg = {
         .out_iov = dev->out_buf,
@@ -203,12 +583,14 @@ static void virtq_blk_handle_one_request(BlkDev *dev, VirtQueue *vq) {
     }
 
     BlkReqHead *hdr = vreq.out_iov[0].iov_base;
-    // OUT carries its data in the read-only part, so only the status byte
-    // stays in the writable part (in_count == 1). IN/FLUSH/GET_ID carry
-    // their data in the writable part, so only the header stays in the
-    // read-only part (out_count == 1).
-    if (hdr->type == VIRTIO_BLK_T_OUT ? vreq.in_count != 1
-                                      : vreq.out_count != 1) {
+    // OUT/DISCARD/WRITE_ZEROES carry their data in the read-only part, so
+    // only the status byte stays in the writable part (in_count == 1).
+    // IN/FLUSH/GET_ID carry their data in the writable part, so only the
+    // header stays in the read-only part (out_count == 1).
+    bool data_out = hdr->type == VIRTIO_BLK_T_OUT ||
+                    hdr->type == VIRTIO_BLK_T_DISCARD ||
+                    hdr->type == VIRTIO_BLK_T_WRITE_ZEROES;
+    if (data_out ? vreq.in_count != 1 : vreq.out_count != 1) {
         log_error("descriptor direction conflicts with operation type %u",
                   hdr->type);
         blk_complete(vq, desc_idx, NULL, EIO, 0);
@@ -216,20 +598,43 @@ static void virtq_blk_handle_one_request(BlkDev *dev, VirtQueue *vq) {
     }
 
     uint8_t *vstatus = vreq.in_iov[vreq.in_count - 1].iov_base;
+    // VIRTIO_BLK_F_RO is only advisory: refuse writes before they reach
+    // the backend or mark anything dirty.
+    if (data_out && dev->backend->flags & BLK_BACKEND_READ_ONLY) {
+        blk_complete(vq, desc_idx, vstatus, EROFS, 0);
+        return;
+    }
+
     int err = 0;
     ssize_t wlen = 0;
+    struct blk_io io = {.off = hdr->sector * SECTOR_BSIZE};
+    uint64_t start = dev->trace ? blk_trace_clock() : 0;
+    // Write-through: written data must be stable before completion.
+    bool sync = data_out && dev->cache_mode != BLK_CACHE_UNSAFE &&
+                !blk_writeback_enabled(vq->dev, dev);
 
     switch (hdr->type) {
     case VIRTIO_BLK_T_IN:
-        err = blk_do_read(dev->img_fd, &wlen, vreq.in_iov, vreq.in_count - 1,
-                          hdr->sector * SECTOR_BSIZE);
+        io.op = BLK_IO_READ;
+        io.iov = vreq.in_iov;
+        io.cnt = vreq.in_count - 1;
         break;
     case VIRTIO_BLK_T_OUT:
-        err = blk_do_write(dev->img_fd, &vreq.out_iov[1], vreq.out_count - 1,
-                           hdr->sector * SECTOR_BSIZE);
+        io.op = BLK_IO_WRITE;
+        io.iov = &vreq.out_iov[1];
+        io.cnt = vreq.out_count - 1;
+        io.fua = sync;
+        blk_dirty_write(dev, &io);
         break;
     case VIRTIO_BLK_T_FLUSH:
-        err = blk_do_flush(dev->img_fd);
+        io.op = BLK_IO_FLUSH;
+        if (dev->cache_mode != BLK_CACHE_UNSAFE)
+            err = blk_run_io(dev, &io);
+        break;
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        err = blk_handle_discard(dev, hdr->type, &vreq.out_iov[1],
+                                 vreq.out_count - 1, sync);
         break;
     case VIRTIO_BLK_T_GET_ID:
         wlen = blk_do_get_id(&vreq.in_iov[0]);
@@ -240,9 +645,41 @@ static void virtq_blk_handle_one_request(BlkDev *dev, VirtQueue *vq) {
         break;
     }
 
+    if (hdr->type == VIRTIO_BLK_T_IN || hdr->type == VIRTIO_BLK_T_OUT) {
+        if (dev->backend->ops->submit) {
+            blk_submit(dev, vq, desc_idx, vstatus, &io, start);
+            return;
+        }
+        err = blk_do_io(dev->backend, &io, &wlen);
+    }
+    // DISCARD and WRITE_ZEROES are traced per segment.
+    if (dev->trace &&
+        (hdr->type == VIRTIO_BLK_T_IN || hdr->type == VIRTIO_BLK_T_OUT ||
+         hdr->type == VIRTIO_BLK_T_FLUSH))
+        blk_trace_io(dev, &io, start, err, 1);
     blk_complete(vq, desc_idx, vstatus, err, wlen);
 }
 
+static bool blk_quiescing(BlkDev *dev) {
+    return __atomic_load_n(&dev->quiesce, __ATOMIC_RELAXED);
+}
+
+void blk_quiesce(BlkDev *dev) {
+    pthread_mutex_lock(&dev->mtx);
+    __atomic_store_n(&dev->quiesce, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&dev->cond);
+    while (dev->busy)
+        pthread_cond_wait(&dev->cond, &dev->mtx);
+    pthread_mutex_unlock(&dev->mtx);
+}
+
+void blk_resume(BlkDev *dev) {
+    pthread_mutex_lock(&dev->mtx);
+    __atomic_store_n(&dev->quiesce, false, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->mtx);
+}
+
 /*
  * Worker thread entry point - one per virtio-blk device.
  *
@@ -266,10 +703,14 @@ static void *blkproc_thread(void *arg) {
     for (bool closing = false; !closing;) {
         // Hold mtx to check the close/reset flags and wait on cond.
         pthread_mutex_lock(&dev->mtx);
-        while (vq_is_empty(vq) && !dev->close && !dev->reset)
+        dev->busy = false;
+        if (dev->quiesce)
+            pthread_cond_broadcast(&dev->cond);
+        while ((vq_is_empty(vq) || dev->quiesce) && !dev->close && !dev->reset)
             pthread_cond_wait(&dev->cond, &dev->mtx);
         closing = dev->close;
         bool resetting = dev->reset;
+        dev->busy = !closing && !resetting;
         pthread_mutex_unlock(&dev->mtx);
 
         // A device reset is in progress: the main thread is about to
@@ -295,14 +736,19 @@ static void *blkproc_thread(void *arg) {
         // Drain all pending requests. The double-checked loop follows the
         // standard virtio pattern: disable-notify, process until empty,
         // enable-notify, then re-check in case the guest added buffers
-        // while notifications were suppressed.
+        // while notifications were suppressed. A quiesce request cuts the
+        // drain short; the rest is handled after blk_resume().
         if (!vq_is_empty(vq)) {
             do {
                 virtqueue_disable_notify(vq);
-                while (!vq_is_empty(vq))
+                while (!vq_is_empty(vq) && !blk_quiescing(dev))
                     virtq_blk_handle_one_request(dev, vq);
+                // Requests still queued on an asynchronous backend must
+                // complete before the IRQ, and before a reset may pause us.
+                if (dev->backend->ops->reap)
+                    dev->backend->ops->reap(dev->backend, true);
                 virtqueue_enable_notify(vq);
-            } while (!vq_is_empty(vq));
+            } while (!vq_is_empty(vq) && !blk_quiescing(dev));
 
             // Tell the guest that used-ring entries are available.
             virtio_inject_irq(vq);
@@ -329,7 +775,9 @@ static BlkDev *init_blk_dev(VirtIODevice *vdev) {
     dev->config.size_max = -1;
     dev->config.seg_max = BLK_SEG_MAX;
     dev->config.blk_size = SECTOR_BSIZE;
-    dev->img_fd = -1;
+    dev->config.wce = 1;
+    dev->backend = NULL;
+    dev->cache_mode = BLK_CACHE_WRITEBACK;
 
     if (pthread_mutex_init(&dev->mtx, NULL) != 0) {
         log_error("failed to init blk mutex");
@@ -369,41 +817,77 @@ static int start_blk_worker(VirtIODevice *vdev) {
     return 0;
 }
 
-static int virtio_blk_init(VirtIODevice *vdev, const char *img_path) {
+static int virtio_blk_init(VirtIODevice *vdev,
+                           const struct virtio_blk_init_params *p) {
 
     BlkDev *dev = vdev->dev;
     if (!dev) {
         log_error("virtio_blk_init: vdev->dev is nullptr");
         return -1;
     }
+    dev->cache_mode = p->cache_mode;
+    dev->config.wce = p->cache_mode != BLK_CACHE_WRITETHROUGH;
 
-    dev->img_fd = open(img_path, O_RDWR);
-    if (dev->img_fd == -1) {
-        log_error("cannot open %s, Error code is %d", img_path, errno);
+    if (p->nbd_server)
+        dev->backend =
+            blk_nbd_open(p->nbd_server, p->nbd_export, p->nbd_connections);
+    else if (p->num_imgs == 1)
+        dev->backend = blk_file_open(p->img_paths[0]);
+    else
+        dev->backend =
+            blk_stripe_open(p->img_paths, p->num_imgs, p->stripe_size);
+    if (!dev->backend)
         return -1;
+
+    uint64_t blk_size = dev->backend->size / SECTOR_BSIZE;
+    dev->config.capacity = blk_size;
+    dev->config.size_max = blk_size;
+
+    // Only advertise what the backend can do.
+    uint32_t flags = dev->backend->flags;
+    if (flags & BLK_BACKEND_DISCARD) {
+        dev->config.max_discard_sectors = BLK_MAX_DISCARD_SECTORS;
+        dev->config.max_discard_seg = BLK_MAX_DISCARD_SEG;
+        dev->config.discard_sector_alignment = BLK_DISCARD_ALIGNMENT;
+    } else {
+        vdev->regs.dev_feature &= ~(1ULL << VIRTIO_BLK_F_DISCARD);
     }
+    if (flags & BLK_BACKEND_WRITE_ZEROES) {
+        dev->config.max_write_zeroes_sectors = BLK_MAX_DISCARD_SECTORS;
+        dev->config.max_write_zeroes_seg = BLK_MAX_DISCARD_SEG;
+        dev->config.write_zeroes_may_unmap = 1;
+    } else {
+        vdev->regs.dev_feature &= ~(1ULL << VIRTIO_BLK_F_WRITE_ZEROES);
+    }
+    if (flags & BLK_BACKEND_READ_ONLY)
+        vdev->regs.dev_feature |= 1ULL << VIRTIO_BLK_F_RO;
 
-    struct stat st;
-    if (fstat(dev->img_fd, &st) == -1) {
-        log_error("cannot stat %s, Error code is %d", img_path, errno);
+    if (p->dirty_block_size &&
+        blk_dirty_init(dev, p->dirty_block_size) != 0)
         return -1;
+
+    if (p->trace) {
+        dev->trace = blk_trace_open(p->trace, dev->backend->size);
+        if (!dev->trace)
+            return -1;
     }
-    uint64_t blk_size = st.st_size / SECTOR_BSIZE;
-    if (blk_size == 0) {
-        // st_size may be 0 for real block devices; try BLKGETSIZE64
-        uint64_t size64;
-        if (ioctl(dev->img_fd, BLKGETSIZE64, &size64) == 0) {
-            blk_size = size64 / SECTOR_BSIZE;
-        } else {
-            log_error("cannot determine block device size for %s", img_path);
+
+    if (dev->backend->ops->submit) {
+        dev->inflight = calloc(BLK_MAX_INFLIGHT, sizeof(*dev->inflight));
+        if (!dev->inflight) {
+            log_error("failed to allocate blk inflight requests");
             return -1;
         }
+        for (int i = 0; i < BLK_MAX_INFLIGHT; i++) {
+            dev->inflight[i].dev = dev;
+            dev->inflight[i].next_free = dev->inflight_free;
+            dev->inflight_free = &dev->inflight[i];
+        }
     }
-    dev->config.capacity = blk_size;
-    dev->config.size_max = blk_size;
 
-    log_info("virtio_blk_init: %s, size is %" PRIu64, img_path,
-             dev->config.capacity);
+    log_info("virtio_blk_init: %s (%s backend), size is %" PRIu64,
+             p->nbd_server ? p->nbd_server : p->img_paths[0],
+             dev->backend->ops->name, dev->config.capacity);
     return 0;
 }
 
@@ -446,6 +930,32 @@ static void virtio_blk_reset(VirtIODevice *vdev) {
     while (!dev->worker_paused)
         pthread_cond_wait(&dev->cond, &dev->mtx);
     pthread_mutex_unlock(&dev->mtx);
+
+    // A guest-selected cache mode does not survive a device reset.
+    __atomic_store_n(&dev->config.wce,
+                     dev->cache_mode != BLK_CACHE_WRITETHROUGH,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * Called by the main thread when the guest writes the device config space.
+ * Only the writeback field is writable, and only with
+ * VIRTIO_BLK_F_CONFIG_WCE negotiated.
+ */
+static void virtio_blk_config_write(VirtIODevice *vdev, uint64_t offset,
+                                    uint64_t value, unsigned size) {
+    BlkDev *dev = vdev->dev;
+
+    if (offset != offsetof(BlkConfig, wce) || size != 1 ||
+        !(vdev->regs.drv_feature & (1ULL << VIRTIO_BLK_F_CONFIG_WCE))) {
+        log_error("virtio-blk: invalid config write, offset %#" PRIx64
+                  ", size %u",
+                  offset, size);
+        return;
+    }
+    __atomic_store_n(&dev->config.wce, value ? 1 : 0, __ATOMIC_RELAXED);
+    log_info("virtio-blk: zone %u switched to %s mode", vdev->zone_id,
+             value ? "writeback" : "writethrough");
 }
 
 /*
@@ -467,8 +977,16 @@ static void virtio_blk_close(VirtIODevice *vdev) {
         }
         pthread_mutex_destroy(&dev->mtx);
         pthread_cond_destroy(&dev->cond);
-        if (dev->img_fd >= 0)
-            close(dev->img_fd);
+        // The snapshot thread reads through the backend.
+        blk_dirty_close(dev);
+        blk_trace_close(dev->trace);
+        if (dev->backend)
+            dev->backend->ops->close(dev->backend);
+        if (dev->inflight) {
+            for (int i = 0; i < BLK_MAX_INFLIGHT; i++)
+                free(dev->inflight[i].io.iov);
+            free(dev->inflight);
+        }
         free(dev);
         vdev->dev = NULL;
     }
@@ -483,7 +1001,7 @@ static int virtio_blk_do_init(VirtIODevice *vdev, const void *params) {
         return -EINVAL;
     if (!init_blk_dev(vdev))
         return -ENOMEM;
-    if (virtio_blk_init(vdev, p->img_path) != 0)
+    if (virtio_blk_init(vdev, p) != 0)
         return -EIO;
     // The worker is only started once the backing image is open; the
     // virtqueue was already allocated by init_virtio_queue() before init.
@@ -492,6 +1010,29 @@ static int virtio_blk_do_init(VirtIODevice *vdev, const void *params) {
     return 0;
 }
 
+static int blk_ctl_status(VirtIODevice *vdev, int argc, char *argv[],
+                          char *reply, size_t len) {
+    BlkDev *dev = vdev->dev;
+    size_t used;
+    (void)argc;
+    (void)argv;
+
+    used = snprintf(reply, len, "backend: %s, %" PRIu64 " bytes\n",
+                    dev->backend->ops->name, dev->backend->size);
+    if (used < len)
+        used += blk_snapshot_status(dev, reply + used, len - used);
+    if (used < len)
+        blk_trace_status(dev, reply + used, len - used);
+    return 0;
+}
+
+const struct virtio_ctl_command blk_ctl_commands[] = {
+    {"status", "", blk_ctl_status},
+    {"snapshot", "<target> [full]", blk_ctl_snapshot},
+    {"trace", "<file>|off", blk_ctl_trace},
+    {NULL, NULL, NULL},
+};
+
 const struct virtio_device_ops virtio_blk_ops = {
     .type = VirtioTBlock,
     .features = BLK_SUPPORTED_FEATURES,
@@ -500,19 +1041,127 @@ const struct virtio_device_ops virtio_blk_ops = {
     .init = virtio_blk_do_init,
     .close = virtio_blk_close,
     .reset = virtio_blk_reset,
+    .config_write = virtio_blk_config_write,
+    .ctl_commands = blk_ctl_commands,
     .notify_handlers = {virtio_blk_notify_handler},
 };
 
+static int parse_cache_mode(const cJSON *json, enum blk_cache_mode *mode) {
+    static const struct {
+        const char *name;
+        enum blk_cache_mode mode;
+    } cache_modes[] = {
+        {"writeback", BLK_CACHE_WRITEBACK},
+        {"writethrough", BLK_CACHE_WRITETHROUGH},
+        {"unsafe", BLK_CACHE_UNSAFE},
+    };
+
+    if (!cJSON_IsString(json))
+        return -EINVAL;
+    for (size_t i = 0; i < sizeof(cache_modes) / sizeof(cache_modes[0]);
+         i++) {
+        if (strcmp(json->valuestring, cache_modes[i].name) == 0) {
+            *mode = cache_modes[i].mode;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
 static int virtio_blk_parse_params(const cJSON *json, void **out) {
     struct virtio_blk_init_params *p = calloc(1, sizeof(*p));
     if (!p)
         return -ENOMEM;
-    cJSON *img = cJSON_GetObjectItem(json, "img");
-    if (!cJSON_IsString(img) || !img->valuestring[0]) {
+    // "nbd" names an NBD server to use instead of local images.
+    cJSON *nbd = cJSON_GetObjectItem(json, "nbd");
+    if (nbd) {
+        if (!cJSON_IsString(nbd) || !nbd->valuestring[0]) {
+            free(p);
+            return -EINVAL;
+        }
+        p->nbd_server = nbd->valuestring;
+        p->nbd_export = "";
+        cJSON *export_name = cJSON_GetObjectItem(json, "export");
+        if (cJSON_IsString(export_name))
+            p->nbd_export = export_name->valuestring;
+        uint32_t connections = 1;
+        cJSON *conns = cJSON_GetObjectItem(json, "connections");
+        if (conns && (parse_json_u32(conns, &connections) != 0 ||
+                      connections < 1 || connections > BLK_NBD_MAX_CONNS)) {
+            log_error("virtio-blk: connections must be 1 to %d",
+                      BLK_NBD_MAX_CONNS);
+            free(p);
+            return -EINVAL;
+        }
+        p->nbd_connections = connections;
+    }
+
+    // "img" is a single image path, or an array of paths to stripe the
+    // disk over. It is not needed with "nbd".
+    cJSON *img = p->nbd_server ? NULL : cJSON_GetObjectItem(json, "img");
+    if (cJSON_IsArray(img)) {
+        p->num_imgs = cJSON_GetArraySize(img);
+        if (p->num_imgs < 1 || p->num_imgs > BLK_MAX_IMGS) {
+            log_error("virtio-blk: img needs 1 to %d paths", BLK_MAX_IMGS);
+            free(p);
+            return -EINVAL;
+        }
+        for (int i = 0; i < p->num_imgs; i++) {
+            cJSON *path = cJSON_GetArrayItem(img, i);
+            if (!cJSON_IsString(path) || !path->valuestring[0]) {
+                free(p);
+                return -EINVAL;
+            }
+            p->img_paths[i] = path->valuestring;
+        }
+    } else if (cJSON_IsString(img) && img->valuestring[0]) {
+        p->img_paths[0] = img->valuestring;
+        p->num_imgs = 1;
+    } else if (!p->nbd_server) {
+        free(p);
+        return -EINVAL;
+    }
+
+    p->stripe_size = BLK_DEFAULT_STRIPE_SIZE;
+    cJSON *stripe_size = cJSON_GetObjectItem(json, "stripe_size");
+    if (stripe_size &&
+        (parse_json_u64(stripe_size, &p->stripe_size) != 0 ||
+         p->stripe_size == 0 || p->stripe_size % SECTOR_BSIZE != 0)) {
+        log_error("virtio-blk: stripe_size must be a non-zero multiple of %d",
+                  SECTOR_BSIZE);
+        free(p);
+        return -EINVAL;
+    }
+
+    // "dirty_bitmap" enables dirty block tracking for incremental
+    // snapshots, in units of "dirty_block_size" bytes.
+    if (cJSON_IsTrue(cJSON_GetObjectItem(json, "dirty_bitmap"))) {
+        p->dirty_block_size = BLK_DEFAULT_DIRTY_BLOCK_SIZE;
+        cJSON *bs = cJSON_GetObjectItem(json, "dirty_block_size");
+        if (bs && (parse_json_u64(bs, &p->dirty_block_size) != 0 ||
+                   p->dirty_block_size < SECTOR_BSIZE ||
+                   (p->dirty_block_size & (p->dirty_block_size - 1)))) {
+            log_error("virtio-blk: dirty_block_size must be a power of 2 "
+                      "of at least %d",
+                      SECTOR_BSIZE);
+            free(p);
+            return -EINVAL;
+        }
+    }
+
+    // "trace" records every request to a file, see blk_trace.c.
+    cJSON *trace = cJSON_GetObjectItem(json, "trace");
+    if (cJSON_IsString(trace))
+        p->trace = trace->valuestring;
+
+    p->cache_mode = BLK_CACHE_WRITEBACK;
+    cJSON *cache = cJSON_GetObjectItem(json, "cache");
+    if (cache && parse_cache_mode(cache, &p->cache_mode) != 0) {
+        log_error("virtio-blk: cache must be writeback, writethrough or "
+                  "unsafe");
         free(p);
         return -EINVAL;
     }
-    p->img_path = img->valuestring;
     *out = p;
     return 0;
 }
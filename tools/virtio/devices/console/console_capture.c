@@ -0,0 +1,445 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "virtio_console.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Output capture
+ * --------------
+ * The output of a console port can be copied to a log file, rotated by size,
+ * and to any number of readers attached to a unix socket. The TX path only
+ * appends the output to the history ring of the port and wakes the writer
+ * thread of the capture, which feeds the log and the readers at their own
+ * pace. A reader that attaches is first sent the history, the latest
+ * CONSOLE_HISTORY_SIZE bytes, so it sees the boot log too.
+ *
+ * Every consumer keeps its position in the output stream. One that falls
+ * more than the ring behind, like a reader that stopped reading, skips to
+ * the oldest output still kept.
+ */
+
+// Bytes a consumer takes from the history at a time.
+#define CAPTURE_CHUNK (16 * 1024)
+
+// Epoll data of the writer's fds, readers by their index.
+#define CAPTURE_EV_WAKE (-1)
+#define CAPTURE_EV_LISTEN (-2)
+
+struct capture_reader {
+    int fd;
+    uint64_t pos;
+    bool want_out; // Polled for EPOLLOUT
+};
+
+struct console_capture {
+    int port_id;
+    // Guards the history, which the TX path appends to.
+    pthread_mutex_t lock;
+    uint8_t *hist;
+    uint64_t head;  // Bytes of output so far, the end of the history
+    bool kicked;    // wakefd signaled since the writer last looked
+    bool stop;
+    int wakefd;
+    int epfd;
+    pthread_t tid;
+    bool thread_started;
+    // Log file.
+    char *log_path;
+    int log_fd;
+    uint64_t log_size, log_len, log_pos;
+    int log_files;
+    // Attached readers.
+    char *attach_path;
+    int listen_fd;
+    struct capture_reader readers[CONSOLE_ATTACH_MAX_CLIENTS];
+};
+
+void console_capture_push(struct console_capture *c, const struct iovec *iov,
+                          int n) {
+    uint64_t val = 1;
+    bool kick;
+
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < n; i++) {
+        const uint8_t *data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        // Only the tail of an oversized buffer stays in the history.
+        if (len > CONSOLE_HISTORY_SIZE) {
+            c->head += len - CONSOLE_HISTORY_SIZE;
+            data += len - CONSOLE_HISTORY_SIZE;
+            len = CONSOLE_HISTORY_SIZE;
+        }
+        while (len) {
+            size_t off = c->head % CONSOLE_HISTORY_SIZE;
+            size_t chunk = MIN(len, CONSOLE_HISTORY_SIZE - off);
+            memcpy(c->hist + off, data, chunk);
+            c->head += chunk;
+            data += chunk;
+            len -= chunk;
+        }
+    }
+    kick = !c->kicked;
+    c->kicked = true;
+    pthread_mutex_unlock(&c->lock);
+    if (kick && write(c->wakefd, &val, sizeof(val)) < 0)
+        log_error("console port %d: failed to wake capture writer",
+                  c->port_id);
+}
+
+// Copy the output from *pos on into buf. A position the history no longer
+// reaches is moved to its oldest byte, and the bytes skipped are returned
+// in *lost.
+static size_t capture_peek(struct console_capture *c, uint64_t *pos,
+                           uint8_t *buf, size_t len, uint64_t *lost) {
+    size_t got = 0;
+
+    pthread_mutex_lock(&c->lock);
+    *lost = 0;
+    if (c->head - *pos > CONSOLE_HISTORY_SIZE) {
+        *lost = c->head - CONSOLE_HISTORY_SIZE - *pos;
+        *pos = c->head - CONSOLE_HISTORY_SIZE;
+    }
+    len = MIN(len, c->head - *pos);
+    while (got < len) {
+        size_t off = (*pos + got) % CONSOLE_HISTORY_SIZE;
+        size_t chunk = MIN(len - got, CONSOLE_HISTORY_SIZE - off);
+        memcpy(buf + got, c->hist + off, chunk);
+        got += chunk;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return got;
+}
+
+/*
+ * Log file
+ */
+
+static int capture_log_open(struct console_capture *c, int flags) {
+    struct stat st;
+
+    c->log_fd = open(c->log_path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0644);
+    if (c->log_fd < 0) {
+        log_error("console port %d: cannot open %s, errno %d", c->port_id,
+                  c->log_path, errno);
+        return -1;
+    }
+    c->log_len = fstat(c->log_fd, &st) == 0 ? st.st_size : 0;
+    return 0;
+}
+
+// log.N-1 becomes log.N, ..., log becomes log.1, and a new log is started.
+static void capture_log_rotate(struct console_capture *c) {
+    size_t len = strlen(c->log_path) + 16;
+    char from[len], to[len];
+
+    close(c->log_fd);
+    c->log_fd = -1;
+    for (int i = c->log_files - 1; i >= 0; i--) {
+        if (i)
+            snprintf(from, len, "%s.%d", c->log_path, i);
+        else
+            snprintf(from, len, "%s", c->log_path);
+        snprintf(to, len, "%s.%d", c->log_path, i + 1);
+        if (rename(from, to) < 0 && errno != ENOENT)
+            log_error("console port %d: cannot rename %s, errno %d",
+                      c->port_id, from, errno);
+    }
+    capture_log_open(c, O_TRUNC);
+}
+
+static void capture_log_write(struct console_capture *c) {
+    uint8_t buf[CAPTURE_CHUNK];
+    uint64_t lost;
+    size_t len;
+    ssize_t n;
+
+    while (c->log_fd >= 0) {
+        if (c->log_len >= c->log_size)
+            capture_log_rotate(c);
+        if (c->log_fd < 0)
+            break;
+        len = capture_peek(c, &c->log_pos, buf,
+                           MIN(sizeof(buf), c->log_size - c->log_len), &lost);
+        if (lost)
+            log_warn("console port %d: %llu bytes missing from %s",
+                     c->port_id, (unsigned long long)lost, c->log_path);
+        if (!len)
+            break;
+        n = write(c->log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // Keep up with the output; the log has a hole.
+            log_error("console port %d: cannot write %s, errno %d",
+                      c->port_id, c->log_path, errno);
+            n = len;
+        }
+        c->log_pos += n;
+        c->log_len += n;
+    }
+}
+
+/*
+ * Attached readers
+ */
+
+static void capture_reader_watch(struct console_capture *c, int i,
+                                 bool want_out) {
+    struct capture_reader *r = &c->readers[i];
+    struct epoll_event ev = {.events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+                             .data.u64 = i};
+
+    if (r->want_out == want_out)
+        return;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, r->fd, &ev) == 0)
+        r->want_out = want_out;
+}
+
+static void capture_reader_drop(struct console_capture *c, int i) {
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->readers[i].fd, NULL);
+    close(c->readers[i].fd);
+    c->readers[i].fd = -1;
+    log_info("console port %d: reader %d detached", c->port_id, i);
+}
+
+// Send the reader what it has not seen, as far as its socket takes it.
+static void capture_reader_write(struct console_capture *c, int i) {
+    struct capture_reader *r = &c->readers[i];
+    uint8_t buf[CAPTURE_CHUNK];
+    uint64_t lost;
+    size_t len;
+    ssize_t n;
+
+    for (;;) {
+        len = capture_peek(c, &r->pos, buf, sizeof(buf), &lost);
+        if (lost)
+            log_warn("console port %d: reader %d fell %llu bytes behind",
+                     c->port_id, i, (unsigned long long)lost);
+        if (!len)
+            break;
+        // MSG_NOSIGNAL: a reader that went away must not raise SIGPIPE.
+        n = send(r->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            capture_reader_drop(c, i);
+            return;
+        }
+        r->pos += n;
+        if ((size_t)n < len)
+            break;
+    }
+    capture_reader_watch(c, i, len > 0);
+}
+
+static void capture_accept(struct console_capture *c) {
+    struct epoll_event ev = {.events = EPOLLIN};
+    int fd, i;
+
+    fd = accept4(c->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    for (i = 0; i < CONSOLE_ATTACH_MAX_CLIENTS; i++)
+        if (c->readers[i].fd < 0)
+            break;
+    ev.data.u64 = i;
+    if (i == CONSOLE_ATTACH_MAX_CLIENTS ||
+        epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_warn("console port %d: reader refused", c->port_id);
+        close(fd);
+        return;
+    }
+    // Replay the history first.
+    pthread_mutex_lock(&c->lock);
+    c->readers[i] = (struct capture_reader){
+        .fd = fd,
+        .pos = c->head > CONSOLE_HISTORY_SIZE ? c->head - CONSOLE_HISTORY_SIZE
+                                              : 0,
+    };
+    pthread_mutex_unlock(&c->lock);
+    log_info("console port %d: reader %d attached", c->port_id, i);
+    capture_reader_write(c, i);
+}
+
+// Readers only read. Their input is discarded; end of file detaches them.
+static void capture_reader_input(struct console_capture *c, int i) {
+    char buf[256];
+    ssize_t n;
+
+    while ((n = recv(c->readers[i].fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        ;
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        capture_reader_drop(c, i);
+}
+
+static void *capture_thread(void *arg) {
+    struct console_capture *c = arg;
+    struct epoll_event events[CONSOLE_ATTACH_MAX_CLIENTS + 2];
+    uint64_t val;
+    int n;
+
+    while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+        n = epoll_wait(c->epfd, events, CONSOLE_ATTACH_MAX_CLIENTS + 2, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("console port %d: epoll_wait failed, errno %d",
+                      c->port_id, errno);
+            break;
+        }
+        for (int e = 0; e < n; e++) {
+            int64_t id = (int64_t)events[e].data.u64;
+            uint32_t ev = events[e].events;
+
+            if (id == CAPTURE_EV_WAKE) {
+                if (read(c->wakefd, &val, sizeof(val)) < 0)
+                    log_debug("console capture: empty wakeup");
+            } else if (id == CAPTURE_EV_LISTEN) {
+                capture_accept(c);
+            } else if (c->readers[id].fd >= 0) {
+                if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    capture_reader_input(c, id);
+                if (c->readers[id].fd >= 0 && (ev & EPOLLOUT))
+                    capture_reader_write(c, id);
+            }
+        }
+        // Output may have come in: take it to every consumer.
+        pthread_mutex_lock(&c->lock);
+        c->kicked = false;
+        pthread_mutex_unlock(&c->lock);
+        capture_log_write(c);
+        for (int i = 0; i < CONSOLE_ATTACH_MAX_CLIENTS; i++)
+            if (c->readers[i].fd >= 0 && !c->readers[i].want_out)
+                capture_reader_write(c, i);
+    }
+    return NULL;
+}
+
+static int capture_listen(struct console_capture *c) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u64 = (uint64_t)CAPTURE_EV_LISTEN};
+
+    if (strlen(c->attach_path) >= sizeof(addr.sun_path)) {
+        log_error("console port %d: attach path too long", c->port_id);
+        return -1;
+    }
+    strcpy(addr.sun_path, c->attach_path);
+    c->listen_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->listen_fd < 0)
+        return -1;
+    unlink(c->attach_path);
+    if (bind(c->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(c->listen_fd, CONSOLE_ATTACH_MAX_CLIENTS) < 0 ||
+        epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->listen_fd, &ev) < 0) {
+        log_error("console port %d: cannot listen on %s, errno %d",
+                  c->port_id, c->attach_path, errno);
+        return -1;
+    }
+    log_info("console port %d: readers attach at %s", c->port_id,
+             c->attach_path);
+    return 0;
+}
+
+struct console_capture *
+console_capture_open(int port_id, const struct console_capture_params *p) {
+    struct console_capture *c = calloc(1, sizeof(*c));
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u64 = (uint64_t)CAPTURE_EV_WAKE};
+
+    if (!c)
+        return NULL;
+    c->port_id = port_id;
+    c->wakefd = c->epfd = c->log_fd = c->listen_fd = -1;
+    pthread_mutex_init(&c->lock, NULL);
+    for (int i = 0; i < CONSOLE_ATTACH_MAX_CLIENTS; i++)
+        c->readers[i].fd = -1;
+    c->hist = malloc(CONSOLE_HISTORY_SIZE);
+    c->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!c->hist || c->wakefd < 0 || c->epfd < 0 ||
+        epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wakefd, &ev) < 0)
+        goto err;
+    if (p->log) {
+        c->log_path = strdup(p->log);
+        c->log_size = p->log_size;
+        c->log_files = p->log_files;
+        // Appended to, the log of the previous run is kept.
+        if (!c->log_path || capture_log_open(c, O_APPEND) < 0)
+            goto err;
+    }
+    if (p->attach) {
+        c->attach_path = strdup(p->attach);
+        if (!c->attach_path || capture_listen(c) < 0)
+            goto err;
+    }
+    if (pthread_create(&c->tid, NULL, capture_thread, c) != 0) {
+        log_error("console port %d: failed to create capture thread",
+                  port_id);
+        goto err;
+    }
+    c->thread_started = true;
+    return c;
+err:
+    console_capture_close(c);
+    return NULL;
+}
+
+void console_capture_close(struct console_capture *c) {
+    uint64_t val = 1;
+
+    if (!c)
+        return;
+    if (c->thread_started) {
+        __atomic_store_n(&c->stop, true, __ATOMIC_RELEASE);
+        if (write(c->wakefd, &val, sizeof(val)) < 0)
+            log_error("console port %d: failed to stop capture writer",
+                      c->port_id);
+        pthread_join(c->tid, NULL);
+        // Whatever output is left still goes to the log.
+        capture_log_write(c);
+    }
+    for (int i = 0; i < CONSOLE_ATTACH_MAX_CLIENTS; i++)
+        if (c->readers[i].fd >= 0)
+            close(c->readers[i].fd);
+    if (c->listen_fd >= 0) {
+        close(c->listen_fd);
+        unlink(c->attach_path);
+    }
+    if (c->log_fd >= 0)
+        close(c->log_fd);
+    if (c->epfd >= 0)
+        close(c->epfd);
+    if (c->wakefd >= 0)
+        close(c->wakefd);
+    free(c->log_path);
+    free(c->attach_path);
+    free(c->hist);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
@@ -1,16 +1,17 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /**
- * Copyright (c) 2025 Syswonder
- *
- * Syswonder Website:
- *      https://www.syswonder.org
- *
- * Authors:
- *      Guowei Li <2401213322@stu.pku.edu.cn>
- */
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      Guowei Li <2401213322@stu.pku.edu.cn>
+ */
 #define _GNU_SOURCE
 
 #include "virtio_console.h"
+#include "json_parse.h"
 #include "log.h"
 #include "virtio.h"
 #include <errno.h>
@@ -18,77 +19,532 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <termios.h>
 
-static uint8_t trashbuf[1024];
+/*
+ * Ports
+ * =====
+ *
+ * Without configured ports the device is a single console on a pty. With
+ * "ports" it offers VIRTIO_CONSOLE_F_MULTIPORT: port 0 is the console, and
+ * every port is backed by a pty, a unix socket or a file. The driver learns
+ * about the ports over the control queues, see virtio_console_ctrl().
+ *
+ * The fds of all ports are polled on one epoll fd of the device, so that a
+ * device registers a single event with the event monitor whatever its
+ * number of ports. Input of a port is read on the event monitor thread
+ * while the port's RX queue has buffers. When it runs out, the fd is taken
+ * off the epoll set until the driver adds buffers, so input waits in the
+ * pty or socket instead of being dropped. Control requests are handled on
+ * the MMIO dispatcher thread.
+ *
+ * Output of a pty or socket port is copied into the port's ring and the
+ * guest buffer is completed at once, so neither the guest nor the MMIO
+ * dispatcher thread waits for a slow reader. The event monitor thread
+ * drains the ring whenever the fd is writable. If nobody reads the port for
+ * long, e.g. no terminal is attached to the pty, the ring keeps the latest
+ * output and the oldest is dropped. File ports are written directly.
+ */
+
+// epoll data of a port fd: the port in the upper half, whether it is the
+// listening socket in the lower.
+#define CONSOLE_EV(id, listen) (((uint64_t)(id) << 32) | (listen))
 
 static ConsoleDev *init_console_dev() {
-    ConsoleDev *dev = (ConsoleDev *)malloc(sizeof(ConsoleDev));
+    ConsoleDev *dev = (ConsoleDev *)calloc(1, sizeof(ConsoleDev));
+    if (!dev)
+        return NULL;
     dev->config.cols = 80;
     dev->config.rows = 25;
-    dev->master_fd = -1;
-    dev->slave_keepalive_fd = -1;
-    dev->rx_ready = -1;
+    dev->epfd = -1;
     dev->event = NULL;
+    pthread_mutex_init(&dev->lock, NULL);
+    for (int i = 0; i < CONSOLE_MAX_PORTS; i++) {
+        ConsolePort *port = &dev->ports[i];
+        port->id = i;
+        port->fd = -1;
+        port->listen_fd = -1;
+        port->slave_keepalive_fd = -1;
+    }
     return dev;
 }
 
-static void virtio_console_event_handler(int fd, int epoll_type, void *param) {
-    // log_debug("%s", __func__);
-    VirtIODevice *vdev = (VirtIODevice *)param;
-    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    VirtQueue *vq = &vdev->vqs[CONSOLE_QUEUE_RX];
-    int n;
-    ssize_t len;
+static inline ConsolePort *console_port_of(VirtIODevice *vdev, VirtQueue *vq) {
+    ConsoleDev *dev = vdev->dev;
+    return &dev->ports[vq->vq_idx < 2 ? 0 : vq->vq_idx / 2 - 1];
+}
+
+// Is the host side of the port connected, see VIRTIO_CONSOLE_PORT_OPEN.
+static inline bool console_port_connected(ConsolePort *port) {
+    return port->fd >= 0;
+}
+
+// Poll the fd of port for input unless it is blocked, and for room while
+// output is buffered.
+static void console_port_rearm(ConsoleDev *dev, ConsolePort *port) {
+    uint32_t events =
+        (port->rx_blocked ? 0 : EPOLLIN) | (port->out_len ? EPOLLOUT : 0);
+    struct epoll_event ev = {.events = events,
+                             .data.u64 = CONSOLE_EV(port->id, 0)};
+
+    if (events == port->events)
+        return;
+    if (epoll_ctl(dev->epfd, EPOLL_CTL_MOD, port->fd, &ev) < 0)
+        log_error("console port %d: epoll_ctl failed, errno %d", port->id,
+                  errno);
+    else
+        port->events = events;
+}
+
+// Does the driver take input of port. The driver discards input of a port
+// nobody opened, so it waits in the pty or socket until the port is opened.
+static inline bool console_port_can_rx(ConsoleDev *dev, ConsolePort *port) {
+    return port->rx_ready && (!dev->multiport || port->id == 0 ||
+                              port->guest_open);
+}
+
+// Poll the fd of port again once it can take input, called with dev->lock
+// held.
+static void console_port_unblock(ConsoleDev *dev, ConsolePort *port) {
+    if (port->rx_blocked && port->fd >= 0 && console_port_can_rx(dev, port)) {
+        port->rx_blocked = false;
+        console_port_rearm(dev, port);
+    }
+}
+
+/*
+ * Control queues
+ */
+
+// Fill the control RX queue with the pending messages, called with dev->lock
+// held.
+static void console_ctrl_flush(VirtIODevice *vdev) {
+    ConsoleDev *dev = vdev->dev;
+    VirtQueue *vq = &vdev->vqs[CONSOLE_QUEUE_CTRL_RX];
     struct iovec *iov = NULL;
     uint16_t idx;
+    int n;
+    bool used = false;
 
-    if (fd != dev->master_fd || !(epoll_type & EPOLLIN)) {
-        log_error("Invalid console event");
-        return;
+    while (dev->pending_count && !virtqueue_is_empty(vq)) {
+        struct console_ctrl_msg *msg = &dev->pending[dev->pending_head];
+        const uint8_t *src[2] = {(const uint8_t *)&msg->ctrl,
+                                 (const uint8_t *)msg->name};
+        size_t left[2] = {sizeof(msg->ctrl), msg->name_len};
+        size_t copied = 0;
+
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1) {
+            log_error("console: bad control RX buffer");
+            break;
+        }
+        for (int i = 0, s = 0; i < n && s < 2; i++) {
+            size_t off = 0;
+            while (off < iov[i].iov_len && s < 2) {
+                size_t chunk = MIN(iov[i].iov_len - off, left[s]);
+                memcpy((uint8_t *)iov[i].iov_base + off, src[s], chunk);
+                src[s] += chunk;
+                left[s] -= chunk;
+                off += chunk;
+                copied += chunk;
+                if (!left[s])
+                    s++;
+            }
+        }
+        free(iov);
+        iov = NULL;
+        update_used_ring(vq, idx, copied);
+        used = true;
+        dev->pending_head = (dev->pending_head + 1) % CONSOLE_CTRL_PENDING;
+        dev->pending_count--;
     }
-    if (dev->master_fd <= 0 || vdev->type != VirtioTConsole) {
-        log_error("console event handler should not be called");
+    if (used)
+        virtio_inject_irq(vq);
+}
+
+// Queue a control message to the driver, called with dev->lock held.
+static void console_ctrl_send(VirtIODevice *vdev, uint32_t id, uint16_t event,
+                              uint16_t value, const char *name) {
+    ConsoleDev *dev = vdev->dev;
+    struct console_ctrl_msg *msg;
+
+    if (dev->pending_count == CONSOLE_CTRL_PENDING) {
+        log_error("console: control message %u for port %u dropped", event,
+                  id);
         return;
     }
-    if (dev->rx_ready <= 0) {
-        read(dev->master_fd, trashbuf, sizeof(trashbuf));
+    msg = &dev->pending[(dev->pending_head + dev->pending_count) %
+                        CONSOLE_CTRL_PENDING];
+    msg->ctrl = (struct virtio_console_control){
+        .id = id, .event = event, .value = value};
+    msg->name_len = name ? strlen(name) : 0;
+    if (name)
+        memcpy(msg->name, name, msg->name_len);
+    dev->pending_count++;
+    console_ctrl_flush(vdev);
+}
+
+// Tell the driver whether the host side of port is connected.
+static void console_port_set_open(VirtIODevice *vdev, ConsolePort *port) {
+    ConsoleDev *dev = vdev->dev;
+    if (dev->multiport)
+        console_ctrl_send(vdev, port->id, VIRTIO_CONSOLE_PORT_OPEN,
+                          console_port_connected(port), NULL);
+}
+
+static void virtio_console_ctrl(VirtIODevice *vdev,
+                                const struct virtio_console_control *ctrl) {
+    ConsoleDev *dev = vdev->dev;
+    ConsolePort *port;
+
+    if (ctrl->event == VIRTIO_CONSOLE_DEVICE_READY) {
+        if (!ctrl->value) {
+            log_error("console: driver failed to initialize");
+            return;
+        }
+        for (int i = 0; i < dev->nr_ports; i++)
+            console_ctrl_send(vdev, i, VIRTIO_CONSOLE_PORT_ADD, 0, NULL);
         return;
     }
-    if (virtqueue_is_empty(vq)) {
-        read(dev->master_fd, trashbuf, sizeof(trashbuf));
-        virtio_inject_irq(vq);
+    if (ctrl->id >= (uint32_t)dev->nr_ports) {
+        log_error("console: control event %u for bad port %u", ctrl->event,
+                  ctrl->id);
         return;
     }
+    port = &dev->ports[ctrl->id];
+    switch (ctrl->event) {
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (!ctrl->value) {
+            log_error("console: driver failed to add port %u", ctrl->id);
+            break;
+        }
+        if (port->id == 0)
+            console_ctrl_send(vdev, 0, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+        if (port->name[0])
+            console_ctrl_send(vdev, port->id, VIRTIO_CONSOLE_PORT_NAME, 1,
+                              port->name);
+        if (console_port_connected(port))
+            console_port_set_open(vdev, port);
+        break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+        port->guest_open = ctrl->value;
+        console_port_unblock(dev, port);
+        log_info("console port %u %s by the driver", ctrl->id,
+                 ctrl->value ? "opened" : "closed");
+        break;
+    default:
+        log_warn("console: unknown control event %u", ctrl->event);
+    }
+}
+
+static int virtio_console_ctrl_rxq_notify_handler(VirtIODevice *vdev,
+                                                  VirtQueue *vq) {
+    ConsoleDev *dev = vdev->dev;
+    (void)vq;
+    pthread_mutex_lock(&dev->lock);
+    console_ctrl_flush(vdev);
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
 
+static int virtio_console_ctrl_txq_notify_handler(VirtIODevice *vdev,
+                                                  VirtQueue *vq) {
+    ConsoleDev *dev = vdev->dev;
+    struct virtio_console_control ctrl;
+    struct iovec *iov = NULL;
+    uint16_t idx;
+    int n;
+
+    pthread_mutex_lock(&dev->lock);
     while (!virtqueue_is_empty(vq)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        size_t len = 0;
+        for (int i = 0; i < n && len < sizeof(ctrl); i++) {
+            size_t chunk = MIN(iov[i].iov_len, sizeof(ctrl) - len);
+            memcpy((uint8_t *)&ctrl + len, iov[i].iov_base, chunk);
+            len += chunk;
+        }
+        free(iov);
+        iov = NULL;
+        update_used_ring(vq, idx, 0);
+        if (len == sizeof(ctrl))
+            virtio_console_ctrl(vdev, &ctrl);
+        else
+            log_error("console: short control request");
+    }
+    virtio_inject_irq(vq);
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+/*
+ * Port I/O
+ */
+
+static void console_port_disconnect(VirtIODevice *vdev, ConsolePort *port) {
+    ConsoleDev *dev = vdev->dev;
+
+    epoll_ctl(dev->epfd, EPOLL_CTL_DEL, port->fd, NULL);
+    close(port->fd);
+    port->fd = -1;
+    port->rx_blocked = false;
+    port->events = 0;
+    // Output for the next client starts afresh.
+    port->out_head = port->out_len = 0;
+    port->out_dropped = 0;
+    log_info("console port %d: client disconnected", port->id);
+    console_port_set_open(vdev, port);
+}
+
+static void console_port_accept(VirtIODevice *vdev, ConsolePort *port) {
+    ConsoleDev *dev = vdev->dev;
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u64 = CONSOLE_EV(port->id, 0)};
+    int fd = accept4(port->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0)
+        return;
+    if (console_port_connected(port)) {
+        log_warn("console port %d: already has a client", port->id);
+        close(fd);
+        return;
+    }
+    port->fd = fd;
+    // Wait until the driver takes input before reading the client.
+    port->rx_blocked = !console_port_can_rx(dev, port);
+    if (port->rx_blocked)
+        ev.events = 0;
+    port->events = ev.events;
+    if (epoll_ctl(dev->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("console port %d: epoll_ctl failed, errno %d", port->id,
+                  errno);
+        close(fd);
+        port->fd = -1;
+        return;
+    }
+    log_info("console port %d: client connected", port->id);
+    console_port_set_open(vdev, port);
+}
+
+// Move input of port to its RX queue, called with dev->lock held.
+static void console_port_rx(VirtIODevice *vdev, ConsolePort *port) {
+    ConsoleDev *dev = vdev->dev;
+    VirtQueue *vq = &vdev->vqs[CONSOLE_PORT_RXQ(port->id)];
+    struct iovec *iov = NULL;
+    uint16_t idx;
+    ssize_t len;
+    int n;
+
+    while (console_port_can_rx(dev, port) && !virtqueue_is_empty(vq)) {
         n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
         if (n < 1) {
             log_error("process_descriptor_chain failed");
             break;
         }
-        len = readv(dev->master_fd, iov, n);
-        if (len < 0 && errno == EWOULDBLOCK) {
-            log_debug("no more bytes");
-            vq->last_avail_idx--;
-            free(iov);
-            break;
-        } else if (len < 0) {
-            log_debug("Failed to read from console, errno is %d", errno);
+        len = readv(port->fd, iov, n);
+        free(iov);
+        iov = NULL;
+        if (len <= 0) {
+            // Drained, or the client went away.
+            if (len < 0 && errno != EWOULDBLOCK)
+                log_debug("Failed to read from console, errno is %d", errno);
             vq->last_avail_idx--;
-            free(iov);
-            break;
+            virtio_inject_irq(vq);
+            if (len == 0 && port->type == CONSOLE_PORT_SOCKET)
+                console_port_disconnect(vdev, port);
+            return;
         }
         update_used_ring(vq, idx, len);
-        free(iov);
     }
     virtio_inject_irq(vq);
-    return;
+    // Out of buffers: ask for the next notification, and stop polling the
+    // fd unless the driver added some meanwhile.
+    if (console_port_can_rx(dev, port)) {
+        virtqueue_enable_notify(vq);
+        if (!virtqueue_is_empty(vq))
+            return;
+    }
+    port->rx_blocked = true;
+    console_port_rearm(dev, port);
+}
+
+// Write the buffered output of port as far as its fd takes it, called on
+// the event monitor thread with dev->lock held.
+static void console_port_flush(VirtIODevice *vdev, ConsolePort *port) {
+    ConsoleDev *dev = vdev->dev;
+    ssize_t n;
+
+    while (port->out_len) {
+        uint8_t *data = port->out_ring + port->out_head;
+        size_t len = MIN(port->out_len, CONSOLE_OUT_RING_SIZE - port->out_head);
+
+        // MSG_NOSIGNAL: a client that went away must not raise SIGPIPE.
+        if (port->type == CONSOLE_PORT_SOCKET)
+            n = send(port->fd, data, len, MSG_NOSIGNAL);
+        else
+            n = write(port->fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (port->type == CONSOLE_PORT_SOCKET) {
+                console_port_disconnect(vdev, port);
+                return;
+            }
+            log_error("Failed to write to console port %d, errno is %d",
+                      port->id, errno);
+            port->out_dropped += port->out_len;
+            port->out_len = 0;
+            break;
+        }
+        port->out_head = (port->out_head + n) % CONSOLE_OUT_RING_SIZE;
+        port->out_len -= n;
+    }
+    if (!port->out_len) {
+        port->out_head = 0;
+        if (port->out_dropped) {
+            log_warn("console port %d: %llu bytes of output dropped",
+                     port->id, (unsigned long long)port->out_dropped);
+            port->out_dropped = 0;
+        }
+    }
+    console_port_rearm(dev, port);
+}
+
+static void virtio_console_event_handler(int fd, int epoll_type, void *param) {
+    VirtIODevice *vdev = (VirtIODevice *)param;
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    struct epoll_event events[CONSOLE_MAX_PORTS];
+    int n;
+
+    if (fd != dev->epfd || !(epoll_type & EPOLLIN)) {
+        log_error("Invalid console event");
+        return;
+    }
+    n = epoll_wait(dev->epfd, events, CONSOLE_MAX_PORTS, 0);
+    pthread_mutex_lock(&dev->lock);
+    for (int i = 0; i < n; i++) {
+        ConsolePort *port = &dev->ports[events[i].data.u64 >> 32];
+        uint32_t ev = events[i].events;
+
+        if (events[i].data.u64 & 1) {
+            console_port_accept(vdev, port);
+            continue;
+        }
+        if (port->fd >= 0 && (ev & EPOLLOUT))
+            console_port_flush(vdev, port);
+        if (port->fd >= 0 && (ev & EPOLLIN))
+            console_port_rx(vdev, port);
+        else if (port->fd >= 0 && (ev & (EPOLLHUP | EPOLLERR)) &&
+                 port->type == CONSOLE_PORT_SOCKET)
+            console_port_disconnect(vdev, port);
+    }
+    pthread_mutex_unlock(&dev->lock);
 }
 
-static int virtio_console_init(VirtIODevice *vdev) {
+static int virtio_console_rxq_notify_handler(VirtIODevice *vdev,
+                                             VirtQueue *vq) {
+    log_debug("%s", __func__);
     ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    ConsolePort *port = console_port_of(vdev, vq);
+
+    pthread_mutex_lock(&dev->lock);
+    port->rx_ready = 1;
+    virtqueue_disable_notify(vq);
+    console_port_unblock(dev, port);
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+// Append output of the guest to the ring of port. When the ring is full the
+// oldest output is overwritten, so the guest never waits for a reader.
+static void console_port_push(ConsolePort *port, const uint8_t *data,
+                              size_t len) {
+    size_t tail, first;
+
+    if (len > CONSOLE_OUT_RING_SIZE) {
+        port->out_dropped += len - CONSOLE_OUT_RING_SIZE;
+        data += len - CONSOLE_OUT_RING_SIZE;
+        len = CONSOLE_OUT_RING_SIZE;
+    }
+    if (port->out_len + len > CONSOLE_OUT_RING_SIZE) {
+        size_t over = port->out_len + len - CONSOLE_OUT_RING_SIZE;
+        port->out_head = (port->out_head + over) % CONSOLE_OUT_RING_SIZE;
+        port->out_len -= over;
+        port->out_dropped += over;
+    }
+    tail = (port->out_head + port->out_len) % CONSOLE_OUT_RING_SIZE;
+    first = MIN(len, CONSOLE_OUT_RING_SIZE - tail);
+    memcpy(port->out_ring + tail, data, first);
+    memcpy(port->out_ring, data + first, len - first);
+    port->out_len += len;
+}
+
+static void virtq_tx_handle_one_request(ConsolePort *port, VirtQueue *vq) {
+    int n;
+    uint16_t idx;
+    ssize_t len;
+    struct iovec *iov = NULL;
+
+    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+
+    if (n < 1) {
+        return;
+    }
+
+    if (port->capture)
+        console_capture_push(port->capture, iov, n);
+    if (port->type == CONSOLE_PORT_FILE) {
+        len = writev(port->fd, iov, n);
+        if (len < 0) {
+            log_error("Failed to write to console port %d, errno is %d",
+                      port->id, errno);
+        }
+    } else if (port->fd >= 0) {
+        // Output of a socket port without a client is dropped.
+        for (int i = 0; i < n; i++)
+            console_port_push(port, iov[i].iov_base, iov[i].iov_len);
+    }
+    update_used_ring(vq, idx, 0);
+    free(iov);
+}
+
+static int virtio_console_txq_notify_handler(VirtIODevice *vdev,
+                                             VirtQueue *vq) {
+    log_debug("%s", __func__);
+    ConsoleDev *dev = vdev->dev;
+    ConsolePort *port = console_port_of(vdev, vq);
+
+    // The event monitor may close a socket client meanwhile.
+    pthread_mutex_lock(&dev->lock);
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            virtq_tx_handle_one_request(port, vq);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    virtio_inject_irq(vq);
+    // The event monitor writes the output once the fd takes it.
+    if (port->out_len)
+        console_port_rearm(dev, port);
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+/*
+ * Port backends
+ */
+
+static int console_open_pty(ConsolePort *port) {
     int master_fd, slave_fd;
     char *slave_name;
     struct termios term_io;
@@ -96,6 +552,7 @@ static int virtio_console_init(VirtIODevice *vdev) {
     master_fd = posix_openpt(O_RDWR | O_NOCTTY);
     if (master_fd < 0) {
         log_error("Failed to open master pty, errno is %d", errno);
+        return -1;
     }
     if (grantpt(master_fd) < 0) {
         log_error("Failed to grant pty, errno is %d", errno);
@@ -103,11 +560,12 @@ static int virtio_console_init(VirtIODevice *vdev) {
     if (unlockpt(master_fd) < 0) {
         log_error("Failed to unlock pty, errno is %d", errno);
     }
-    dev->master_fd = master_fd;
+    port->fd = master_fd;
 
     slave_name = ptsname(master_fd);
     if (slave_name == NULL) {
         log_error("Failed to get slave name, errno is %d", errno);
+        return -1;
     }
     log_info("char device redirected to %s", slave_name);
     // Open and keep a slave fd in this process. Without a slave peer,
@@ -124,87 +582,197 @@ static int virtio_console_init(VirtIODevice *vdev) {
     cfmakeraw(&term_io);
     term_io.c_oflag |= ONLCR;
     tcsetattr(slave_fd, TCSAFLUSH, &term_io);
-    dev->slave_keepalive_fd = slave_fd;
+    port->slave_keepalive_fd = slave_fd;
 
-    if (set_nonblocking(dev->master_fd) < 0) {
+    if (set_nonblocking(port->fd) < 0) {
         log_error("Failed to set nonblocking mode");
         return -1;
     }
+    // A stable name for the pty, whose number changes from run to run.
+    if (port->path) {
+        unlink(port->path);
+        if (symlink(slave_name, port->path) < 0) {
+            log_error("Failed to link %s to %s, errno is %d", port->path,
+                      slave_name, errno);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    dev->event =
-        add_event(dev->master_fd, EPOLLIN, virtio_console_event_handler, vdev);
+static int console_open_socket(ConsolePort *port) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
 
-    if (dev->event == NULL) {
-        log_error("Can't register console event");
+    if (strlen(port->path) >= sizeof(addr.sun_path)) {
+        log_error("console port %d: socket path too long", port->id);
         return -1;
     }
-
+    strcpy(addr.sun_path, port->path);
+    port->listen_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (port->listen_fd < 0) {
+        log_error("console port %d: socket failed, errno %d", port->id,
+                  errno);
+        return -1;
+    }
+    unlink(port->path);
+    if (bind(port->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(port->listen_fd, 1) < 0) {
+        log_error("console port %d: cannot listen on %s, errno %d", port->id,
+                  port->path, errno);
+        return -1;
+    }
+    log_info("console port %d listening on %s", port->id, port->path);
     return 0;
 }
 
-static int virtio_console_rxq_notify_handler(VirtIODevice *vdev,
-                                             VirtQueue *vq) {
-    log_debug("%s", __func__);
-    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    if (dev->rx_ready <= 0) {
-        dev->rx_ready = 1;
-        virtqueue_disable_notify(vq);
+static int console_open_port(ConsoleDev *dev, ConsolePort *port) {
+    struct epoll_event ev = {.events = EPOLLIN};
+    int ret;
+
+    switch (port->type) {
+    case CONSOLE_PORT_PTY:
+        ret = console_open_pty(port);
+        break;
+    case CONSOLE_PORT_SOCKET:
+        ret = console_open_socket(port);
+        break;
+    case CONSOLE_PORT_FILE:
+        // Output only, so it is never polled.
+        port->fd = open(port->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0644);
+        if (port->fd < 0)
+            log_error("console port %d: cannot open %s, errno %d", port->id,
+                      port->path, errno);
+        return port->fd < 0 ? -1 : 0;
+    default:
+        return -1;
     }
-    return 0;
+    if (ret < 0)
+        return -1;
+    port->out_ring = malloc(CONSOLE_OUT_RING_SIZE);
+    if (!port->out_ring)
+        return -1;
+    if (port->type == CONSOLE_PORT_SOCKET) {
+        ev.data.u64 = CONSOLE_EV(port->id, 1);
+        return epoll_ctl(dev->epfd, EPOLL_CTL_ADD, port->listen_fd, &ev);
+    }
+    // Polled once the driver adds RX buffers.
+    ev.events = 0;
+    ev.data.u64 = CONSOLE_EV(port->id, 0);
+    port->rx_blocked = true;
+    return epoll_ctl(dev->epfd, EPOLL_CTL_ADD, port->fd, &ev);
 }
 
-static void virtq_tx_handle_one_request(ConsoleDev *dev, VirtQueue *vq) {
-    int n;
-    uint16_t idx;
-    ssize_t len;
-    struct iovec *iov = NULL;
-    if (dev->master_fd <= 0) {
-        log_error("Console master fd is not ready");
-        return;
-    }
+static int virtio_console_init(VirtIODevice *vdev,
+                               const struct virtio_console_init_params *p) {
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    struct console_port_params single = {.type = CONSOLE_PORT_PTY};
 
-    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+    dev->multiport = p && p->nr_ports > 0;
+    dev->nr_ports = dev->multiport ? p->nr_ports : 1;
+    if (p && !dev->multiport)
+        single.capture = p->ports[0].capture;
+    // The queue layout depends on the number of ports, so the handlers are
+    // set here rather than in virtio_console_ops.
+    vdev->vqs_len = dev->multiport ? 2 * (dev->nr_ports + 1) : 2;
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        VirtQueue *vq = &vdev->vqs[i];
+        if (i == CONSOLE_QUEUE_CTRL_RX)
+            vq->notify_handler = virtio_console_ctrl_rxq_notify_handler;
+        else if (i == CONSOLE_QUEUE_CTRL_TX)
+            vq->notify_handler = virtio_console_ctrl_txq_notify_handler;
+        else if (i % 2 == CONSOLE_QUEUE_RX)
+            vq->notify_handler = virtio_console_rxq_notify_handler;
+        else
+            vq->notify_handler = virtio_console_txq_notify_handler;
+    }
+    if (dev->multiport)
+        dev->config.max_nr_ports = dev->nr_ports;
+    else
+        vdev->regs.dev_feature &= ~(1ULL << VIRTIO_CONSOLE_F_MULTIPORT);
 
-    if (n < 1) {
-        return;
+    dev->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (dev->epfd < 0) {
+        log_error("console: epoll_create1 failed, errno %d", errno);
+        return -1;
+    }
+    for (int i = 0; i < dev->nr_ports; i++) {
+        const struct console_port_params *pp =
+            dev->multiport ? &p->ports[i] : &single;
+        ConsolePort *port = &dev->ports[i];
+        port->type = pp->type;
+        if (pp->name)
+            strncpy(port->name, pp->name, sizeof(port->name) - 1);
+        if (pp->path && !(port->path = strdup(pp->path)))
+            return -1;
+        if (console_open_port(dev, port) < 0) {
+            log_error("console: cannot open port %d", i);
+            return -1;
+        }
+        if ((pp->capture.log || pp->capture.attach) &&
+            !(port->capture = console_capture_open(i, &pp->capture)))
+            return -1;
     }
 
-    len = writev(dev->master_fd, iov, n);
-    if (len < 0) {
-        log_error("Failed to write to console, errno is %d", errno);
+    dev->event =
+        add_event(dev->epfd, EPOLLIN, virtio_console_event_handler, vdev);
+
+    if (dev->event == NULL) {
+        log_error("Can't register console event");
+        return -1;
     }
-    update_used_ring(vq, idx, 0);
-    free(iov);
+
+    return 0;
 }
 
-static int virtio_console_txq_notify_handler(VirtIODevice *vdev,
-                                             VirtQueue *vq) {
-    log_debug("%s", __func__);
-    while (!virtqueue_is_empty(vq)) {
-        virtqueue_disable_notify(vq);
-        while (!virtqueue_is_empty(vq)) {
-            virtq_tx_handle_one_request(vdev->dev, vq);
+static void virtio_console_reset(VirtIODevice *vdev) {
+    ConsoleDev *dev = vdev->dev;
+
+    // Keep the event monitor off the RX queues until the driver sets them
+    // up again.
+    pthread_mutex_lock(&dev->lock);
+    for (int i = 0; i < dev->nr_ports; i++) {
+        ConsolePort *port = &dev->ports[i];
+        port->rx_ready = 0;
+        port->guest_open = false;
+        // Output the driver has handed over is still written.
+        if (port->fd >= 0 && port->type != CONSOLE_PORT_FILE &&
+            !port->rx_blocked) {
+            port->rx_blocked = true;
+            console_port_rearm(dev, port);
         }
-        virtqueue_enable_notify(vq);
     }
-    virtio_inject_irq(vq);
-    return 0;
+    dev->pending_head = dev->pending_count = 0;
+    pthread_mutex_unlock(&dev->lock);
 }
 
-static void virtio_console_reset(VirtIODevice *vdev) { (void)vdev; }
-
 static void virtio_console_close(VirtIODevice *vdev) {
     if (!vdev)
         return;
 
     ConsoleDev *dev = vdev->dev;
     if (dev) {
-        if (dev->master_fd >= 0)
-            close(dev->master_fd);
-        if (dev->slave_keepalive_fd >= 0)
-            close(dev->slave_keepalive_fd);
         remove_event(dev->event);
         free(dev->event);
+        for (int i = 0; i < CONSOLE_MAX_PORTS; i++) {
+            ConsolePort *port = &dev->ports[i];
+            if (port->fd >= 0)
+                close(port->fd);
+            if (port->slave_keepalive_fd >= 0)
+                close(port->slave_keepalive_fd);
+            if (port->listen_fd >= 0)
+                close(port->listen_fd);
+            // The socket and the pty link go with the daemon.
+            if (port->path && port->type != CONSOLE_PORT_FILE)
+                unlink(port->path);
+            free(port->path);
+            free(port->out_ring);
+            console_capture_close(port->capture);
+        }
+        if (dev->epfd >= 0)
+            close(dev->epfd);
+        pthread_mutex_destroy(&dev->lock);
         free(dev);
         vdev->dev = NULL;
     }
@@ -214,11 +782,10 @@ static void virtio_console_close(VirtIODevice *vdev) {
 }
 
 static int virtio_console_do_init(VirtIODevice *vdev, const void *params) {
-    (void)params;
     vdev->dev = init_console_dev();
     if (!vdev->dev)
         return -ENOMEM;
-    return virtio_console_init(vdev);
+    return virtio_console_init(vdev, params);
 }
 
 const struct virtio_device_ops virtio_console_ops = {
@@ -229,22 +796,119 @@ const struct virtio_device_ops virtio_console_ops = {
     .init = virtio_console_do_init,
     .close = virtio_console_close,
     .reset = virtio_console_reset,
-    .notify_handlers =
-        {
-            [CONSOLE_QUEUE_RX] = virtio_console_rxq_notify_handler,
-            [CONSOLE_QUEUE_TX] = virtio_console_txq_notify_handler,
-        },
+    // notify_handlers are set by virtio_console_init().
 };
 
+// "log", "log_size", "log_files" and "attach" of a port, or of the console
+// without "ports".
+static int parse_console_capture(const cJSON *json,
+                                 struct console_capture_params *cp) {
+    cJSON *log = cJSON_GetObjectItem(json, "log");
+    cJSON *log_size = cJSON_GetObjectItem(json, "log_size");
+    cJSON *log_files = cJSON_GetObjectItem(json, "log_files");
+    cJSON *attach = cJSON_GetObjectItem(json, "attach");
+
+    cp->log_size = CONSOLE_LOG_SIZE_DEFAULT;
+    cp->log_files = CONSOLE_LOG_FILES_DEFAULT;
+    if (log) {
+        if (!cJSON_IsString(log) || !log->valuestring[0])
+            return -EINVAL;
+        cp->log = log->valuestring;
+    }
+    if (log_size) {
+        // At least a page, so that a line or two fit in each file.
+        if (!cJSON_IsNumber(log_size) || log_size->valuedouble < 4096)
+            return -EINVAL;
+        cp->log_size = log_size->valuedouble;
+    }
+    if (log_files) {
+        if (!cJSON_IsNumber(log_files) || log_files->valueint < 0 ||
+            log_files->valueint > 99)
+            return -EINVAL;
+        cp->log_files = log_files->valueint;
+    }
+    if (attach) {
+        if (!cJSON_IsString(attach) || !attach->valuestring[0])
+            return -EINVAL;
+        cp->attach = attach->valuestring;
+    }
+    return 0;
+}
+
+static int parse_console_port(const cJSON *json,
+                              struct console_port_params *pp) {
+    cJSON *type = cJSON_GetObjectItem(json, "type");
+    cJSON *path = cJSON_GetObjectItem(json, "path");
+    cJSON *name = cJSON_GetObjectItem(json, "name");
+
+    if (!cJSON_IsObject(json))
+        return -EINVAL;
+    if (!type || (cJSON_IsString(type) && !strcmp(type->valuestring, "pty")))
+        pp->type = CONSOLE_PORT_PTY;
+    else if (cJSON_IsString(type) && !strcmp(type->valuestring, "socket"))
+        pp->type = CONSOLE_PORT_SOCKET;
+    else if (cJSON_IsString(type) && !strcmp(type->valuestring, "file"))
+        pp->type = CONSOLE_PORT_FILE;
+    else
+        return -EINVAL;
+    if (path) {
+        if (!cJSON_IsString(path) || !path->valuestring[0])
+            return -EINVAL;
+        pp->path = path->valuestring;
+    } else if (pp->type != CONSOLE_PORT_PTY) {
+        return -EINVAL;
+    }
+    if (name) {
+        if (!cJSON_IsString(name) || !name->valuestring[0] ||
+            strlen(name->valuestring) >= CONSOLE_PORT_NAME_MAX)
+            return -EINVAL;
+        pp->name = name->valuestring;
+    }
+    return parse_console_capture(json, &pp->capture);
+}
+
 static int virtio_console_parse_params(const cJSON *json, void **out) {
-    (void)json;
-    *out = NULL;
+    struct virtio_console_init_params *p = calloc(1, sizeof(*p));
+    if (!p)
+        return -ENOMEM;
+
+    // "ports" makes a multiport device, each port an object with "type"
+    // ("pty", the default, "socket" or "file"), "path" and "name". Port 0
+    // is the console. The output of each port, or of the console without
+    // "ports", may also go to a rotated "log" and to readers of "attach".
+    cJSON *ports = cJSON_GetObjectItem(json, "ports");
+    if (ports) {
+        p->nr_ports = cJSON_GetArraySize(ports);
+        if (!cJSON_IsArray(ports) || p->nr_ports < 1 ||
+            p->nr_ports > CONSOLE_MAX_PORTS) {
+            log_error("virtio console: ports needs 1 to %d ports",
+                      CONSOLE_MAX_PORTS);
+            free(p);
+            return -EINVAL;
+        }
+        for (int i = 0; i < p->nr_ports; i++) {
+            if (parse_console_port(cJSON_GetArrayItem(ports, i),
+                                   &p->ports[i]) != 0) {
+                log_error("virtio console: invalid port %d, a socket or "
+                          "file needs a path",
+                          i);
+                free(p);
+                return -EINVAL;
+            }
+        }
+    } else if (parse_console_capture(json, &p->ports[0].capture) != 0) {
+        log_error("virtio console: invalid log or attach setting");
+        free(p);
+        return -EINVAL;
+    }
+
+    *out = p;
     return 0;
 }
 
-static void virtio_console_free_params(void *params) { (void)params; }
+static void virtio_console_free_params(void *params) { free(params); }
 
 const struct virtio_config_ops virtio_console_config_ops = {
     .parse = virtio_console_parse_params,
     .free = virtio_console_free_params,
-};
\ No newline at end of file
+};
@@ -18,15 +18,142 @@
 #include <drm/drm.h>
 #include <drm/drm_fourcc.h>
 #include <drm/drm_mode.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+// Damage tracking
+// The guest reports what it drew with transfer_to_2d and what to show with
+// resource_flush. Both only mark rows and columns as dirty here, and a flush
+// copies the dirty spans of its rectangle, so that a blinking cursor costs a
+// few kilobytes instead of the whole framebuffer.
+
+static int virtio_gpu_damage_init(GPUDamage *d, uint32_t height) {
+    d->rows = calloc(height ? height : 1, sizeof(GPUSpan));
+    if (!d->rows) {
+        return -1;
+    }
+    d->height = height;
+    d->y0 = 0;
+    d->y1 = 0;
+    return 0;
+}
+
+static void virtio_gpu_damage_free(GPUDamage *d) {
+    free(d->rows);
+    memset(d, 0, sizeof(*d));
+}
+
+static void virtio_gpu_damage_add_span(GPUDamage *d, uint32_t y, uint32_t x0,
+                                       uint32_t x1) {
+    GPUSpan *s = NULL;
+
+    if (x0 >= x1 || y >= d->height) {
+        return;
+    }
+
+    s = &d->rows[y];
+    if (s->x0 >= s->x1) {
+        s->x0 = x0;
+        s->x1 = x1;
+    } else {
+        s->x0 = MIN(s->x0, x0);
+        s->x1 = MAX(s->x1, x1);
+    }
+
+    if (d->y0 >= d->y1) {
+        d->y0 = y;
+        d->y1 = y + 1;
+    } else {
+        d->y0 = MIN(d->y0, y);
+        d->y1 = MAX(d->y1, y + 1);
+    }
+}
+
+static void virtio_gpu_damage_add_rect(GPUDamage *d,
+                                       const struct virtio_gpu_rect *r) {
+    for (uint32_t y = r->y; y < r->y + r->height; ++y) {
+        virtio_gpu_damage_add_span(d, y, r->x, r->x + r->width);
+    }
+}
+
+// Forget the damage inside r. A span r cuts in two is kept whole.
+static void virtio_gpu_damage_clear_rect(GPUDamage *d,
+                                         const struct virtio_gpu_rect *r) {
+    uint32_t x0 = r->x, x1 = r->x + r->width;
+    uint32_t y0 = MAX(d->y0, r->y), y1 = MIN(d->y1, r->y + r->height);
+
+    for (uint32_t y = y0; y < y1; ++y) {
+        GPUSpan *s = &d->rows[y];
+        if (s->x0 >= x0 && s->x1 <= x1) {
+            s->x0 = 0;
+            s->x1 = 0;
+        } else if (s->x0 >= x0 && s->x0 < x1) {
+            s->x0 = x1;
+        } else if (s->x1 > x0 && s->x1 <= x1) {
+            s->x1 = x0;
+        }
+    }
+
+    // Shrink the dirty rows past the ones that became clean
+    while (d->y0 < d->y1 && d->rows[d->y0].x0 >= d->rows[d->y0].x1) {
+        d->y0++;
+    }
+    while (d->y1 > d->y0 && d->rows[d->y1 - 1].x0 >= d->rows[d->y1 - 1].x1) {
+        d->y1--;
+    }
+}
+
+// Reads the backing iov of a resource at increasing offsets. Rows are copied
+// top to bottom, so the segment holding the next row is found from where the
+// previous row ended instead of by walking the iov from its start, which for
+// a backing of 4K pages would be thousands of steps per row.
+struct virtio_gpu_iov_cursor {
+    const struct iovec *iov;
+    unsigned int iov_cnt;
+    unsigned int idx; // Segment the cursor is in
+    size_t base;      // Offset of iov[idx] in the resource
+};
+
+static size_t virtio_gpu_iov_cursor_copy(struct virtio_gpu_iov_cursor *c,
+                                         size_t offset, void *dst,
+                                         size_t len) {
+    size_t copied = 0;
+
+    if (offset < c->base) {
+        c->idx = 0;
+        c->base = 0;
+    }
+    while (c->idx < c->iov_cnt && offset >= c->base + c->iov[c->idx].iov_len) {
+        c->base += c->iov[c->idx].iov_len;
+        c->idx++;
+    }
+
+    // memcpy is the vectorised copy of the C library (NEON on aarch64)
+    while (copied < len && c->idx < c->iov_cnt) {
+        const struct iovec *seg = &c->iov[c->idx];
+        size_t in = offset + copied - c->base;
+        size_t chunk = MIN(seg->iov_len - in, len - copied);
+
+        memcpy((uint8_t *)dst + copied, (uint8_t *)seg->iov_base + in, chunk);
+        copied += chunk;
+        if (in + chunk == seg->iov_len) {
+            c->base += seg->iov_len;
+            c->idx++;
+        }
+    }
+
+    return copied;
+}
+
 void virtio_gpu_ctrl_response(VirtIODevice *vdev, GPUCommand *gcmd,
                               GPUControlHeader *resp, size_t resp_len) {
     log_debug("sending response");
@@ -138,6 +265,14 @@ void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
         return;
     }
 
+    if (virtio_gpu_damage_init(&res->damage, res->height) < 0) {
+        log_error("%s failed to allocate damage of resource %d", __func__,
+                  res->resource_id);
+        free(res);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
+
     // If memory is sufficient, add the resource to the virtio gpu management
     TAILQ_INSERT_HEAD(&gdev->resource_list, res, next);
     gdev->hostmem += res->hostmem;
@@ -229,6 +364,7 @@ void virtio_gpu_resource_destory(GPUDev *gdev, GPUSimpleResource *res) {
     virtio_gpu_cleanup_mapping(gdev, res);
     TAILQ_REMOVE(&gdev->resource_list, res, next);
     gdev->hostmem -= res->hostmem;
+    virtio_gpu_damage_free(&res->damage);
     free(res);
 }
 
@@ -250,7 +386,42 @@ void virtio_gpu_disable_scanout(GPUDev *gdev, int scanout_id) {
     scanout->height = 0;
 }
 
+// Remove the framebuffer imported from the backing of the resource
+static void virtio_gpu_release_import(GPUDev *gdev, GPUSimpleResource *res) {
+    if (res->prime_fb_id) {
+        // Removing a framebuffer that is scanned out turns the crtc off, so
+        // the next flush sets it again
+        for (int i = 0; i < gdev->scanouts_num; ++i) {
+            GPUScanout *scanout = &gdev->scanouts[i];
+            GPUFrameBuffer *fb = &scanout->frame_buffer;
+
+            pthread_mutex_lock(&scanout->flip_lock);
+            if (fb->direct_fb_id == res->prime_fb_id) {
+                fb->front = fb->front == GPU_SCANOUT_DIRECT ? -1 : fb->front;
+                fb->pending =
+                    fb->pending == GPU_SCANOUT_DIRECT ? -1 : fb->pending;
+                fb->ready = fb->ready == GPU_SCANOUT_DIRECT ? -1 : fb->ready;
+                fb->direct_fb_id = 0;
+                fb->mode_set = false;
+            }
+            pthread_mutex_unlock(&scanout->flip_lock);
+        }
+
+        drmModeRmFB(res->prime_card_fd, res->prime_fb_id);
+        drmCloseBufferHandle(res->prime_card_fd, res->prime_handle);
+        log_debug("%s released framebuffer %d of resource %d", __func__,
+                  res->prime_fb_id, res->resource_id);
+    }
+
+    // A new backing may be importable
+    res->prime_fb_id = 0;
+    res->prime_handle = 0;
+    res->prime_failed = false;
+}
+
 void virtio_gpu_cleanup_mapping(GPUDev *gdev, GPUSimpleResource *res) {
+    virtio_gpu_release_import(gdev, res);
+
     if (res->iov) {
         free(res->iov);
         // The memory block corresponding to iov is handled by the guest
@@ -299,198 +470,565 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
         }
         scanout = &gdev->scanouts[i];
 
+        if (gdev->zero_copy &&
+            virtio_gpu_import_resource(vdev, scanout, res) == 0) {
+            virtio_gpu_direct_flush(scanout, res, &resource_flush.r,
+                                    &gcmd->error);
+            continue;
+        }
+
         if (!scanout->frame_buffer.enabled) {
             virtio_gpu_create_drm_framebuffer(scanout, &gcmd->error);
             if (gcmd->error) {
                 return;
             }
 
-            virtio_gpu_copy_and_flush(scanout, res, &gcmd->error);
+            virtio_gpu_copy_and_flush(scanout, res, &resource_flush.r,
+                                      &gcmd->error);
         } else {
             // TODO: If the framebuffer has already been allocated once and the
             // size is not suitable, it needs to be reallocated
             // TODO: This includes calling munmap and the drm destroy function
             // TODO: Encapsulate the case where it has not been allocated
 
-            virtio_gpu_copy_and_flush(scanout, res, &gcmd->error);
+            virtio_gpu_copy_and_flush(scanout, res, &resource_flush.r,
+                                      &gcmd->error);
         }
     }
-}
 
-void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout, uint32_t *error) {
-    if (scanout->frame_buffer.enabled) {
-        return;
-    }
-
-    // If the scanout's frame_buffer has not been initialized yet
-    GPUFrameBuffer *fb = &scanout->frame_buffer;
+    // Every scanout of the resource has been given the flushed damage
+    virtio_gpu_damage_clear_rect(&res->damage, &resource_flush.r);
+}
 
+// Create one dumb buffer of the framebuffer, map it and add it as a drm
+// framebuffer
+static int virtio_gpu_create_drm_buffer(int fd, GPUFrameBuffer *fb,
+                                        GPUDrmBuffer *buf) {
     struct drm_mode_create_dumb dumb = {0};
     struct drm_mode_map_dumb map = {0};
+    struct drm_mode_destroy_dumb destory = {0};
+    uint32_t fb_id = 0;
+    void *vaddr = NULL;
+
     dumb.width = fb->width;
     dumb.height = fb->height;
     dumb.bpp = fb->bytes_pp * 8;
-    uint32_t offsets[4] = {0};
-    uint32_t fb_id = 0;
 
-    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
+    if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
         log_error("%s failed to create a drm dumb", __func__);
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
+        return -1;
     } // Create a dumb object
 
     map.handle = dumb.handle;
     // Bind the video memory to the framebuffer, get the offset based on the
     // handle
-    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+    if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
         log_error("%s failed to map a drm dumb", __func__);
-        virtio_gpu_remove_drm_framebuffer(scanout);
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
+        goto err;
     }
 
-    // ! legacy
-    // uint32_t drm_format = VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(fb->format);
-    // if (!drm_format) {
-    //   log_error("%s found drm_framebuffer has an unknown format", __func__);
-    //   *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-    //   return;
-    // }
-
-    // ! legacy
-    // if (drmModeAddFB2(scanout->card0_fd, dumb.width, dumb.height, drm_format,
-    //                   &dumb.handle, &dumb.pitch, offsets, &fb_id, 0) < 0) {
-    //   log_error("%s failed to add a drm_framebuffer to card0", __func__);
-    //   *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-    //   return;
-    // }
-
-    if (drmModeAddFB(scanout->card0_fd, dumb.width, dumb.height, 24, 32,
-                     dumb.pitch, dumb.handle, &fb_id) < 0) {
+    if (drmModeAddFB(fd, dumb.width, dumb.height, 24, 32, dumb.pitch,
+                     dumb.handle, &fb_id) < 0) {
         log_error("%s failed to add a drm_framebuffer to card0", __func__);
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
+        goto err;
+    }
+
+    vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 map.offset);
+    if (vaddr == MAP_FAILED) {
+        log_error("%s cannot map drm_framebuffer of scanout", __func__);
+        drmModeRmFB(fd, fb_id);
+        goto err;
     }
 
-    ///
     log_debug("%s create a drm_framebuffer with width: %d, height: %d, "
-              "format: %d, handle: %d, fb_id: %d",
+              "format: %d, handle: %d, fb_id: %d, mapped to %p",
               __func__, dumb.width, dumb.height, fb->format, dumb.handle,
-              fb_id);
-    ///
+              fb_id, vaddr);
+
+    buf->fb_id = fb_id;
+    buf->handle = dumb.handle;
+    buf->size = dumb.size;
+    buf->pitch = dumb.pitch;
+    buf->addr = vaddr;
+    // Nothing is drawn yet
+    if (virtio_gpu_damage_init(&buf->stale, fb->height) < 0) {
+        log_error("%s failed to allocate damage of a drm buffer", __func__);
+        munmap(vaddr, dumb.size);
+        drmModeRmFB(fd, fb_id);
+        goto err;
+    }
+    virtio_gpu_damage_add_rect(
+        &buf->stale, &(struct virtio_gpu_rect){0, 0, fb->width, fb->height});
+    return 0;
 
-    void *vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                       scanout->card0_fd, map.offset);
+err:
+    destory.handle = dumb.handle;
+    drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+    return -1;
+}
 
-    if (!vaddr) {
-        log_error("%s cannot map drm_framebuffer of scanout", __func__);
-        virtio_gpu_remove_drm_framebuffer(scanout);
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout, uint32_t *error) {
+    if (scanout->frame_buffer.enabled) {
         return;
     }
 
-    log_debug("%s map drm_framebuffer to %x with size %d", __func__, vaddr,
-              dumb.size);
+    // If the scanout's frame_buffer has not been initialized yet
+    GPUFrameBuffer *fb = &scanout->frame_buffer;
 
-    fb->fb_id = fb_id;
-    fb->drm_dumb_handle = dumb.handle;
-    fb->drm_dumb_size = dumb.size;
-    fb->fb_addr = vaddr;
+    fb->nr_bufs = 0;
+    for (int i = 0; i < scanout->nr_buffers; ++i) {
+        if (virtio_gpu_create_drm_buffer(scanout->card0_fd, fb,
+                                         &fb->bufs[i]) < 0) {
+            // Let virtio_gpu_remove_drm_framebuffer free the created ones
+            fb->enabled = true;
+            virtio_gpu_remove_drm_framebuffer(scanout);
+            *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+            return;
+        }
+        fb->nr_bufs++;
+    }
+
+    fb->front = -1;
+    fb->pending = -1;
+    fb->ready = -1;
+    fb->mode_set = false;
     fb->enabled = true;
 }
 
-void virtio_gpu_copy_and_flush(GPUScanout *scanout, GPUSimpleResource *res,
-                               uint32_t *error) {
+// Copy the stale spans of a drm buffer from the resource and clear them,
+// returns the number of bytes copied
+static size_t virtio_gpu_copy_damage(GPUFrameBuffer *fb, GPUDrmBuffer *buf,
+                                     GPUSimpleResource *res) {
+    GPUDamage *d = &buf->stale;
+    struct virtio_gpu_iov_cursor cursor = {res->iov, res->iov_cnt, 0, 0};
+    uint32_t stride = res->hostmem / res->height;
+    uint32_t width = MIN(fb->width, res->width);
+    uint32_t y1 = MIN(d->y1, res->height);
+    size_t copied = 0;
+
+    for (uint32_t y = d->y0; y < y1; ++y) {
+        GPUSpan *s = &d->rows[y];
+        uint32_t x1 = MIN(s->x1, width);
+        if (s->x0 >= x1) {
+            continue;
+        }
+        copied += virtio_gpu_iov_cursor_copy(
+            &cursor, (size_t)y * stride + s->x0 * fb->bytes_pp,
+            (uint8_t *)buf->addr + (size_t)y * buf->pitch +
+                s->x0 * fb->bytes_pp,
+            (x1 - s->x0) * fb->bytes_pp);
+    }
+
+    memset(d->rows, 0, d->height * sizeof(GPUSpan));
+    d->y0 = 0;
+    d->y1 = 0;
+    return copied;
+}
+
+static long timespec_ms_since(const struct timespec *t) {
+    struct timespec now;
 
-    uint32_t format = 0;
-    uint32_t stride = 0;
-    uint32_t src_offset = 0;
-    uint32_t dst_offset = 0;
-    int bpp = 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 +
+           (now.tv_nsec - t->tv_nsec) / 1000000;
+}
 
+static uint32_t virtio_gpu_fb_id(GPUFrameBuffer *fb, int buf) {
+    return buf == GPU_SCANOUT_DIRECT ? fb->direct_fb_id : fb->bufs[buf].fb_id;
+}
+
+// Show buf on the next vblank, called with flip_lock held
+static void virtio_gpu_queue_flip(GPUScanout *scanout, int buf) {
+    GPUFrameBuffer *fb = &scanout->frame_buffer;
+
+    if (!scanout->flip_failed &&
+        drmModePageFlip(scanout->card0_fd, scanout->crtc->crtc_id,
+                        virtio_gpu_fb_id(fb, buf), DRM_MODE_PAGE_FLIP_EVENT,
+                        scanout) == 0) {
+        fb->pending = buf;
+        clock_gettime(CLOCK_MONOTONIC, &fb->flip_time);
+        return;
+    }
+
+    // Fall back to a modeset, which may tear
+    if (!scanout->flip_failed) {
+        log_warn("%s page flip failed, errno %d, setting the crtc instead",
+                 __func__, errno);
+        scanout->flip_failed = true;
+    }
+    drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id,
+                   virtio_gpu_fb_id(fb, buf), 0, 0,
+                   &scanout->connector->connector_id, 1,
+                   &scanout->connector->modes[0]);
+    fb->front = buf;
+}
+
+// A flip whose event was lost would hold its buffer forever, called with
+// flip_lock held
+static void virtio_gpu_expire_flip(GPUFrameBuffer *fb) {
+    if (fb->pending >= 0 &&
+        timespec_ms_since(&fb->flip_time) > GPU_FLIP_TIMEOUT_MS) {
+        log_warn("%s page flip to buffer %d timed out", __func__,
+                 fb->pending);
+        fb->front = fb->pending;
+        fb->pending = -1;
+    }
+}
+
+// Pick the buffer to draw the next frame into, called with flip_lock held
+static int virtio_gpu_back_buffer(GPUScanout *scanout) {
     GPUFrameBuffer *fb = &scanout->frame_buffer;
+    struct timespec deadline;
+
+    // A frame that is still waiting for its flip is replaced by the new one
+    if (fb->ready >= 0) {
+        return fb->ready;
+    }
+
+    for (;;) {
+        for (int i = 0; i < fb->nr_bufs; ++i) {
+            if (i != fb->front && i != fb->pending) {
+                return i;
+            }
+        }
+
+        // With two buffers, wait for the pending flip to free the front one
+        deadline = fb->flip_time;
+        deadline.tv_nsec += GPU_FLIP_TIMEOUT_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (pthread_cond_timedwait(&scanout->flip_cond, &scanout->flip_lock,
+                                   &deadline) == ETIMEDOUT &&
+            fb->pending >= 0) {
+            log_warn("%s page flip to buffer %d timed out", __func__,
+                     fb->pending);
+            fb->front = fb->pending;
+            fb->pending = -1;
+        }
+    }
+}
+
+// Host address of zone memory to the physical address the root zone,
+// which is mapped one to one, knows it by. Returns 0 if addr is not in the
+// memory of the zone.
+static uint64_t virtio_gpu_zone_paddr(int zone_id, const void *addr,
+                                      size_t len) {
+    struct zone_mem *z = &zone_mem[zone_id];
+    uintptr_t va = (uintptr_t)addr;
+
+    for (size_t i = 0; i < z->num_regions; ++i) {
+        struct zone_mem_region *r = &z->regions[i];
+        if (r->mem_size && va >= r->virt_addr &&
+            va + len <= r->virt_addr + r->mem_size) {
+            return r->zone0_ipa + (va - r->virt_addr);
+        }
+    }
+    return 0;
+}
+
+// Import the backing of the resource as a drm framebuffer, so that the
+// display reads the guest's memory and flushes copy nothing. The pages are
+// exported as a dma-buf by the hvisor kernel module, merged into as few
+// physically contiguous chunks as they allow. Whether the display accepts
+// them, e.g. a display without an IOMMU needs them in one chunk and its own
+// pitch alignment, is up to its driver. Tried once per backing, a resource
+// that cannot be imported is copied.
+int virtio_gpu_import_resource(VirtIODevice *vdev, GPUScanout *scanout,
+                               GPUSimpleResource *res) {
+    struct hvisor_dmabuf_chunk *chunks = NULL;
+    struct hvisor_export_dmabuf_args args = {0};
+    uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+    uint32_t format = VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(res->format);
+    uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uint64_t cap = 0, size = 0;
+    uint32_t n = 0, handle = 0, fb_id = 0;
+    int card = scanout->card0_fd;
+    int fd = -1;
+
+    if (res->prime_fb_id) {
+        return 0;
+    }
+    if (res->prime_failed) {
+        return -1;
+    }
+    // Until it is imported
+    res->prime_failed = true;
+
+    if (!format || drmGetCap(card, DRM_CAP_PRIME, &cap) < 0 ||
+        !(cap & DRM_PRIME_CAP_IMPORT)) {
+        log_info("%s display cannot import resource %d, copying it",
+                 __func__, res->resource_id);
+        return -1;
+    }
+
+    chunks = calloc(res->iov_cnt, sizeof(*chunks));
+    if (!chunks) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < res->iov_cnt; ++i) {
+        uint64_t len = res->iov[i].iov_len;
+        uint64_t paddr =
+            virtio_gpu_zone_paddr(vdev->zone_id, res->iov[i].iov_base, len);
+
+        if (!paddr || (paddr & page_mask) || (len & page_mask)) {
+            log_info("%s backing of resource %d is not in whole pages, "
+                     "copying it",
+                     __func__, res->resource_id);
+            free(chunks);
+            return -1;
+        }
+        if (n && chunks[n - 1].paddr + chunks[n - 1].size == paddr &&
+            chunks[n - 1].size + len <= UINT32_MAX) {
+            chunks[n - 1].size += len;
+        } else {
+            chunks[n++] = (struct hvisor_dmabuf_chunk){paddr, len};
+        }
+        size += len;
+    }
+
+    if (size < res->hostmem || n > HVISOR_DMABUF_MAX_CHUNKS) {
+        log_info("%s backing of resource %d cannot be exported, copying it",
+                 __func__, res->resource_id);
+        free(chunks);
+        return -1;
+    }
+
+    args.chunks = (uintptr_t)chunks;
+    args.nr_chunks = n;
+    args.zone_id = vdev->zone_id;
+    fd = ioctl(ko_fd, HVISOR_EXPORT_DMABUF, &args);
+    free(chunks);
+    if (fd < 0) {
+        log_warn("%s failed to export resource %d, errno %d, copying it",
+                 __func__, res->resource_id, errno);
+        return -1;
+    }
+
+    if (drmPrimeFDToHandle(card, fd, &handle) < 0) {
+        log_info("%s display cannot import resource %d in %d chunks, errno "
+                 "%d, copying it",
+                 __func__, res->resource_id, n, errno);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    handles[0] = handle;
+    pitches[0] = res->hostmem / res->height;
+    if (drmModeAddFB2(card, res->width, res->height, format, handles, pitches,
+                      offsets, &fb_id, 0) < 0) {
+        log_info("%s display cannot scan out resource %d, errno %d, copying "
+                 "it",
+                 __func__, res->resource_id, errno);
+        drmCloseBufferHandle(card, handle);
+        return -1;
+    }
+
+    res->prime_fb_id = fb_id;
+    res->prime_handle = handle;
+    res->prime_card_fd = card;
+    res->prime_failed = false;
+    log_info("%s scanning out resource %d from guest memory in %d chunks",
+             __func__, res->resource_id, n);
+    return 0;
+}
+
+// Show an imported resource. Once it is the front buffer, the display reads
+// the guest's memory and a flush only tells the driver what changed.
+void virtio_gpu_direct_flush(GPUScanout *scanout, GPUSimpleResource *res,
+                             const struct virtio_gpu_rect *r,
+                             uint32_t *error) {
+    GPUFrameBuffer *fb = &scanout->frame_buffer;
+    drmModeClip clip = {r->x, r->y, r->x + r->width, r->y + r->height};
+
+    pthread_mutex_lock(&scanout->flip_lock);
+
+    virtio_gpu_expire_flip(fb);
+    if (fb->direct_fb_id != res->prime_fb_id) {
+        // Another imported resource was bound, flip to this one, after the
+        // pending flip to the other if there is one
+        fb->direct_fb_id = res->prime_fb_id;
+        if (fb->front == GPU_SCANOUT_DIRECT) {
+            fb->front = -1;
+        }
+        if (fb->pending == GPU_SCANOUT_DIRECT) {
+            fb->ready = GPU_SCANOUT_DIRECT;
+        }
+    }
+
+    if (!fb->mode_set) {
+        drmModeModeInfo mode = scanout->connector->modes[0];
+        if (drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id,
+                           fb->direct_fb_id, 0, 0,
+                           &scanout->connector->connector_id, 1,
+                           &mode) < 0) {
+            log_error("%s failed to set crtc %d, errno %d", __func__,
+                      scanout->crtc->crtc_id, errno);
+            *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        } else {
+            fb->mode_set = true;
+            fb->front = GPU_SCANOUT_DIRECT;
+            fb->pending = -1;
+            fb->ready = -1;
+        }
+    } else if (fb->pending >= 0 && fb->pending != GPU_SCANOUT_DIRECT) {
+        // Flipped to once the pending flip completes
+        fb->ready = GPU_SCANOUT_DIRECT;
+    } else if (fb->pending == GPU_SCANOUT_DIRECT ||
+               fb->front == GPU_SCANOUT_DIRECT) {
+        // Only displays that do not refresh from memory by themselves need
+        // this, the others fail with ENOSYS
+        drmModeDirtyFB(scanout->card0_fd, fb->direct_fb_id, &clip, 1);
+    } else {
+        virtio_gpu_queue_flip(scanout, GPU_SCANOUT_DIRECT);
+    }
+
+    pthread_mutex_unlock(&scanout->flip_lock);
+}
+
+void virtio_gpu_copy_and_flush(GPUScanout *scanout, GPUSimpleResource *res,
+                               const struct virtio_gpu_rect *r,
+                               uint32_t *error) {
+    GPUFrameBuffer *fb = &scanout->frame_buffer;
+    GPUDamage *damage = &res->damage;
+    uint32_t y0 = 0, y1 = 0;
+    size_t copied = 0;
+    int back = 0;
 
     if (!res || !res->iov || res->hostmem <= 0) {
-        log_error("%s found res is not create yet");
+        log_error("%s found res is not create yet", __func__);
         *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         return;
     }
 
-    if (!fb || !fb->enabled || !fb->fb_addr) {
-        log_error("%s found drm_framebuffer is not enabled yet");
+    if (!fb || !fb->enabled) {
+        log_error("%s found drm_framebuffer is not enabled yet", __func__);
         *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         return;
     }
 
-    format = res->format;
-    bpp = 32;
-    stride = res->hostmem / res->height;
-
-    // Copy data from resource to framebuffer
-    if (res->transfer_rect.x || res->transfer_rect.width != res->width) {
-        for (int h = 0; h < res->transfer_rect.height; h++) {
-            src_offset = res->transfer_offset + stride * h;
-            dst_offset = (res->transfer_rect.y + h) * stride +
-                         (res->transfer_rect.x * bpp);
+    pthread_mutex_lock(&scanout->flip_lock);
 
-            size_t s = iov_to_buf(res->iov, res->iov_cnt, src_offset,
-                                  fb->fb_addr + dst_offset,
-                                  res->transfer_rect.width * bpp);
+    virtio_gpu_expire_flip(fb);
+    back = virtio_gpu_back_buffer(scanout);
 
-            // debug
-            log_debug("%s copy %d bytes from resource %d to drm_framebuffer, "
-                      "src_offset: %d, dst_offset: %d",
-                      __func__, s, res->resource_id, src_offset, dst_offset);
+    // The flushed damage is new to every buffer. The back buffer copies it
+    // along with what the other buffers were given since it was last drawn.
+    y0 = MAX(damage->y0, r->y);
+    y1 = MIN(damage->y1, r->y + r->height);
+    for (uint32_t y = y0; y < y1; ++y) {
+        uint32_t x0 = MAX(damage->rows[y].x0, r->x);
+        uint32_t x1 = MIN(damage->rows[y].x1, r->x + r->width);
+        for (int i = 0; i < fb->nr_bufs; ++i) {
+            virtio_gpu_damage_add_span(&fb->bufs[i].stale, y, x0, x1);
+        }
+    }
+    copied = virtio_gpu_copy_damage(fb, &fb->bufs[back], res);
+
+    log_debug("%s copied %zu bytes of resource %d to buffer %d", __func__,
+              copied, res->resource_id, back);
+
+    if (!fb->mode_set) {
+        // The only modeset, later frames are page flipped
+        drmModeModeInfo mode = scanout->connector->modes[0];
+        if (drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id,
+                           fb->bufs[back].fb_id, 0, 0,
+                           &scanout->connector->connector_id, 1,
+                           &mode) < 0) {
+            log_error("%s failed to set crtc %d, errno %d", __func__,
+                      scanout->crtc->crtc_id, errno);
+            *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        } else {
+            fb->mode_set = true;
+            fb->front = back;
         }
+    } else if (fb->pending >= 0) {
+        // Flipped to once the pending flip completes
+        fb->ready = back;
     } else {
-        src_offset = res->transfer_offset;
-        dst_offset = res->transfer_rect.y * stride + res->transfer_rect.x * bpp;
+        virtio_gpu_queue_flip(scanout, back);
+    }
 
-        size_t s = iov_to_buf(res->iov, res->iov_cnt, src_offset,
-                              fb->fb_addr + dst_offset,
-                              stride * res->transfer_rect.height);
+    pthread_mutex_unlock(&scanout->flip_lock);
+}
+
+static void virtio_gpu_page_flip_handler(int fd, unsigned int sequence,
+                                         unsigned int tv_sec,
+                                         unsigned int tv_usec,
+                                         void *user_data) {
+    GPUScanout *scanout = user_data;
+    GPUFrameBuffer *fb = &scanout->frame_buffer;
+    int ready = fb->ready;
 
-        // debug
-        log_debug("%s copy %d bytes from resource %d to drm_framebuffer, "
-                  "src_offset: %d, dst_offset: %d",
-                  __func__, s, res->resource_id, src_offset, dst_offset);
+    (void)fd;
+    (void)sequence;
+    (void)tv_sec;
+    (void)tv_usec;
+
+    if (fb->pending < 0) {
+        return;
+    }
+
+    fb->front = fb->pending;
+    fb->pending = -1;
+    if (ready >= 0) {
+        // Show the latest frame drawn meanwhile
+        fb->ready = -1;
+        virtio_gpu_queue_flip(scanout, ready);
     }
+    pthread_cond_signal(&scanout->flip_cond);
+}
+
+void virtio_gpu_drm_event_handler(int fd, int epoll_type, void *param) {
+    GPUScanout *scanout = param;
+    drmEventContext ctx = {
+        .version = 2,
+        .page_flip_handler = virtio_gpu_page_flip_handler,
+    };
 
-    drmModeModeInfo mode = scanout->connector->modes[0];
-    drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id, fb->fb_id, 0, 0,
-                   &scanout->connector->connector_id, 1, &mode);
+    (void)epoll_type;
 
-    log_debug("%s flush with card0_fd: %d, crtc_id: %d, fb_id: %d, "
-              "connector_id: %d",
-              __func__, scanout->card0_fd, scanout->crtc->crtc_id, fb->fb_id,
-              scanout->connector->connector_id);
+    pthread_mutex_lock(&scanout->flip_lock);
+    if (drmHandleEvent(fd, &ctx) < 0) {
+        log_error("%s failed to read drm events", __func__);
+    }
+    pthread_mutex_unlock(&scanout->flip_lock);
 }
 
 void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout) {
     GPUFrameBuffer *fb = &scanout->frame_buffer;
 
-    if (!fb || !fb->enabled || !fb->fb_addr) {
-        log_error("%s found drm_framebuffer is not enabled yet");
+    if (!fb || !fb->enabled) {
+        log_error("%s found drm_framebuffer is not enabled yet", __func__);
         return;
     }
 
-    struct drm_mode_destroy_dumb destory = {0};
-    destory.handle = fb->drm_dumb_handle;
+    for (int i = 0; i < fb->nr_bufs; ++i) {
+        GPUDrmBuffer *buf = &fb->bufs[i];
+        struct drm_mode_destroy_dumb destory = {0};
+        destory.handle = buf->handle;
 
-    drmModeRmFB(scanout->card0_fd, fb->fb_id);
-    if (fb->fb_addr != NULL) {
-        munmap(fb->fb_addr, fb->drm_dumb_size);
-    }
-    drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+        drmModeRmFB(scanout->card0_fd, buf->fb_id);
+        if (buf->addr != NULL) {
+            munmap(buf->addr, buf->size);
+        }
+        drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+        virtio_gpu_damage_free(&buf->stale);
+
+        log_debug(
+            "%s destoryed drm_framebuffer with id: %d, handle: %d, size: %d",
+            __func__, buf->fb_id, buf->handle, buf->size);
 
-    log_debug("%s destoryed drm_framebuffer with id: %d, handle: %d, size: %d",
-              __func__, fb->fb_id, fb->drm_dumb_handle, fb->drm_dumb_size);
+        memset(buf, 0, sizeof(*buf));
+    }
 
     // Reserve others
-    fb->fb_id = 0;
-    fb->drm_dumb_handle = 0;
-    fb->drm_dumb_size = 0;
-    fb->fb_addr = NULL;
+    fb->nr_bufs = 0;
+    fb->front = -1;
+    fb->pending = -1;
+    fb->ready = -1;
+    fb->mode_set = false;
     fb->enabled = false;
 }
 
@@ -528,7 +1066,9 @@ void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd) {
     fb.height = res->height;
     fb.stride = res->hostmem / res->height; // hostmem = height * stride
     fb.offset = set_scanout.r.x * fb.bytes_pp + set_scanout.r.y * fb.stride;
-    fb.fb_addr = NULL;
+    fb.front = -1;
+    fb.pending = -1;
+    fb.ready = -1;
     fb.enabled = false;
 
     virtio_gpu_do_set_scanout(vdev, set_scanout.scanout_id, &fb, res,
@@ -593,7 +1133,31 @@ void virtio_gpu_update_scanout(VirtIODevice *vdev, uint32_t scanout_id,
     scanout->y = r->y;
     scanout->width = r->width;
     scanout->height = r->height;
-    scanout->frame_buffer = *fb;
+
+    pthread_mutex_lock(&scanout->flip_lock);
+    GPUFrameBuffer *cur = &scanout->frame_buffer;
+    if (cur->enabled && cur->width == fb->width &&
+        cur->height == fb->height) {
+        // Keep the buffers, the new resource is drawn over all of them
+        if (cur->ready == GPU_SCANOUT_DIRECT) {
+            cur->ready = -1;
+        }
+        cur->format = fb->format;
+        cur->stride = fb->stride;
+        cur->offset = fb->offset;
+        for (int i = 0; i < cur->nr_bufs; ++i) {
+            virtio_gpu_damage_add_rect(
+                &cur->bufs[i].stale,
+                &(struct virtio_gpu_rect){0, 0, cur->width, cur->height});
+        }
+    } else {
+        // Recreated in the size of the new resource on the next flush
+        if (cur->enabled) {
+            virtio_gpu_remove_drm_framebuffer(scanout);
+        }
+        *cur = *fb;
+    }
+    pthread_mutex_unlock(&scanout->flip_lock);
 }
 
 void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -602,8 +1166,6 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
     GPUDev *gdev = vdev->dev;
 
     GPUSimpleResource *res = NULL;
-    uint32_t src_offset = 0;
-    uint32_t dst_offset = 0;
     struct virtio_gpu_transfer_to_host_2d transfer_2d;
 
     VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, transfer_2d);
@@ -633,12 +1195,9 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
         __func__, transfer_2d.r.x, transfer_2d.r.y, transfer_2d.r.width,
         transfer_2d.r.height, res->resource_id, res->width, res->height);
 
-    // Retain transfer information, and perform the actual copy during flush
-    res->transfer_rect.x = transfer_2d.r.x;
-    res->transfer_rect.y = transfer_2d.r.y;
-    res->transfer_rect.width = transfer_2d.r.width;
-    res->transfer_rect.height = transfer_2d.r.height;
-    res->transfer_offset = transfer_2d.offset;
+    // Only mark the region as damaged, the copy is done by the flush. The
+    // offset is that of (r.x, r.y) in the backing, so it is not needed.
+    virtio_gpu_damage_add_rect(&res->damage, &transfer_2d.r);
 }
 
 void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
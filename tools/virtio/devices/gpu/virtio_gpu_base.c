@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -66,7 +67,20 @@ static GPUDev *init_gpu_dev(const GPURequestedState *requested_state) {
     // gdev->scanouts[0].resource_id = 0;
     gdev->scanouts[0].current_cursor = NULL;
     gdev->scanouts[0].card0_fd = -1;
+    gdev->scanouts[0].nr_buffers = requested_state->buffers;
+    gdev->scanouts[0].frame_buffer.front = -1;
+    gdev->scanouts[0].frame_buffer.pending = -1;
+    gdev->scanouts[0].frame_buffer.ready = -1;
+
+    // Flip deadlines are taken from CLOCK_MONOTONIC
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&gdev->scanouts[0].flip_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&gdev->scanouts[0].flip_lock, NULL);
     gdev->enabled_scanout_bitmask |= (1 << 0); // Enable scanout 0
+    gdev->zero_copy = requested_state->zero_copy;
 
     // The framebuffer of the scanout is set by the driver frontend, see
     // virtio_gpu_set_scanout
@@ -175,6 +189,15 @@ static int virtio_gpu_init(VirtIODevice *vdev) {
     gdev->scanouts[0].width = connector->modes[0].hdisplay;
     gdev->scanouts[0].height = connector->modes[0].vdisplay;
 
+    // Page flip events are read on the event monitor thread
+    gdev->scanouts[0].drm_event =
+        add_event(drm_fd, EPOLLIN, virtio_gpu_drm_event_handler,
+                  &gdev->scanouts[0]);
+    if (!gdev->scanouts[0].drm_event) {
+        log_error("%s cannot register page flip events", __func__);
+        return -1;
+    }
+
     // async
     pthread_create(&gdev->gpu_thread, NULL, virtio_gpu_handler, vdev);
     pthread_cond_init(&gdev->gpu_cond, NULL);
@@ -196,6 +219,10 @@ static void virtio_gpu_close(VirtIODevice *vdev) {
         for (int i = 0; i < gdev->scanouts_num; ++i) {
             free(gdev->scanouts[i].current_cursor);
 
+            // No page flip events from here on
+            remove_event(gdev->scanouts[i].drm_event);
+            free(gdev->scanouts[i].drm_event);
+
             virtio_gpu_remove_drm_framebuffer(&gdev->scanouts[i]);
 
             drmModeFreeCrtc(gdev->scanouts[i].crtc);
@@ -205,12 +232,16 @@ static void virtio_gpu_close(VirtIODevice *vdev) {
             if (gdev->scanouts[i].card0_fd != -1) {
                 close(gdev->scanouts[i].card0_fd);
             }
+
+            pthread_cond_destroy(&gdev->scanouts[i].flip_cond);
+            pthread_mutex_destroy(&gdev->scanouts[i].flip_lock);
         }
 
         // Reclaim memory related to resources
         while (!TAILQ_EMPTY(&gdev->resource_list)) {
             GPUSimpleResource *temp = TAILQ_FIRST(&gdev->resource_list);
             TAILQ_REMOVE(&gdev->resource_list, temp, next);
+            free(temp->damage.rows);
             free(temp);
         }
 
@@ -272,6 +303,30 @@ static int virtio_gpu_parse_params(const cJSON *json, void **out) {
         free(s);
         return -EINVAL;
     }
+
+    // "buffers": 2 for double buffering, or 3 so that the guest never waits
+    // for a vblank
+    cJSON *buffers = cJSON_GetObjectItem(json, "buffers");
+    s->buffers = GPU_SCANOUT_BUFFERS_DEFAULT;
+    if (buffers && (parse_json_u32(buffers, &s->buffers) != 0 ||
+                    s->buffers < 2 || s->buffers > GPU_SCANOUT_BUFFERS_MAX)) {
+        log_error("virtio gpu: buffers must be 2 or %d",
+                  GPU_SCANOUT_BUFFERS_MAX);
+        free(s);
+        return -EINVAL;
+    }
+
+    // "zero_copy" scans out the guest's framebuffer from its memory when the
+    // display can import it, default false.
+    cJSON *zero_copy = cJSON_GetObjectItem(json, "zero_copy");
+    if (zero_copy) {
+        if (!cJSON_IsBool(zero_copy)) {
+            log_error("virtio gpu: zero_copy must be true or false");
+            free(s);
+            return -EINVAL;
+        }
+        s->zero_copy = cJSON_IsTrue(zero_copy);
+    }
     *out = s;
     return 0;
 }
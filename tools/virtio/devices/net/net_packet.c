@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "virtio_net.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * AF_PACKET backend
+ * -----------------
+ * The device is attached to a host interface (a veth end, a physical NIC)
+ * through a raw packet socket with TPACKET_V3 rings mapped into the daemon.
+ *
+ * RX: the kernel fills blocks of the RX ring and hands a block over when it
+ * is full or PACKET_BLOCK_TOV_MS after its first frame. recv() copies frames
+ * out of the handed over blocks, so the worker does one poll() per batch
+ * and no syscall per frame. A block goes back to the kernel once all its
+ * frames are copied.
+ *
+ * TX: send() copies a frame into the next slot of the TX ring and flush()
+ * hands all queued slots to the kernel with one sendto(). Kernels without
+ * TPACKET_V3 TX rings (before 4.11) fall back to one sendmsg() per frame.
+ *
+ * The socket carries plain Ethernet frames, so no offloads are offered, the
+ * virtio-net header is zeroed on RX and dropped on TX.
+ */
+
+#define PACKET_BLOCK_SIZE (1 << 18)
+#define PACKET_RX_BLOCKS 16
+// Only sets the RX ring geometry, TPACKET_V3 frames are packed in blocks.
+#define PACKET_RX_FRAME_SIZE 2048
+#define PACKET_TX_BLOCKS 4
+// How long a partly filled RX block may wait before it is handed over.
+#define PACKET_BLOCK_TOV_MS 1
+// How long send() waits for a free TX slot.
+#define PACKET_TX_WAIT_MS 100
+
+#define PACKET_HDR_LEN TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+typedef struct net_packet {
+    NetBackend be; // Must stay first
+    size_t hdr_len;
+    uint8_t *map;
+    size_t map_len;
+    // RX ring
+    uint8_t *rx_ring;
+    unsigned int rx_block;
+    struct tpacket3_hdr *rx_frame; // Next frame in rx_block
+    uint32_t rx_left;              // Frames left in rx_block
+    // TX ring, NULL without TPACKET_V3 TX support
+    uint8_t *tx_ring;
+    unsigned int tx_frame_size;
+    unsigned int tx_frames;
+    unsigned int tx_next;
+    unsigned int tx_queued;
+    struct iovec tx_iov[NET_IOV_MAX];
+} NetPacket;
+
+static ssize_t net_packet_recv(NetBackend *be, const struct iovec *iov,
+                               int cnt) {
+    NetPacket *pk = (NetPacket *)be;
+    static const uint8_t zero_hdr[sizeof(NetHdr)];
+
+    for (;;) {
+        struct tpacket_block_desc *bd =
+            (void *)(pk->rx_ring + pk->rx_block * PACKET_BLOCK_SIZE);
+        if (!pk->rx_left) {
+            if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+                                  __ATOMIC_ACQUIRE) &
+                  TP_STATUS_USER)) {
+                errno = EWOULDBLOCK;
+                return -1;
+            }
+            pk->rx_frame = (void *)((uint8_t *)bd +
+                                    bd->hdr.bh1.offset_to_first_pkt);
+            pk->rx_left = bd->hdr.bh1.num_pkts;
+        }
+
+        struct tpacket3_hdr *h = pk->rx_frame;
+        struct sockaddr_ll *sll = (void *)((uint8_t *)h + PACKET_HDR_LEN);
+        const uint8_t *data = (uint8_t *)h + h->tp_mac;
+        ssize_t len = -1;
+        // Frames the host sends out of the interface are not for the
+        // guest, in case PACKET_IGNORE_OUTGOING is not supported.
+        if (pk->rx_left && sll->sll_pkttype != PACKET_OUTGOING &&
+            h->tp_snaplen >= ETH_HLEN) {
+            struct iovec src[4] = {
+                {(void *)zero_hdr, pk->hdr_len},
+                {(void *)data, h->tp_snaplen},
+            };
+            int n = 2;
+            // Put back the VLAN tag the kernel moved out of the frame.
+            uint16_t tag[2] = {
+                htons(h->tp_status & TP_STATUS_VLAN_TPID_VALID
+                          ? h->hv1.tp_vlan_tpid
+                          : ETH_P_8021Q),
+                htons(h->hv1.tp_vlan_tci),
+            };
+            if (h->tp_status & TP_STATUS_VLAN_VALID) {
+                src[1].iov_len = 2 * ETH_ALEN;
+                src[2] = (struct iovec){tag, sizeof(tag)};
+                src[3] = (struct iovec){(void *)(data + 2 * ETH_ALEN),
+                                        h->tp_snaplen - 2 * ETH_ALEN};
+                n = 4;
+            }
+            len = net_iov_copy(iov, cnt, 0, src, n, 0,
+                               net_iov_size(src, n));
+        }
+
+        if (pk->rx_left && --pk->rx_left) {
+            pk->rx_frame = (void *)((uint8_t *)h + h->tp_next_offset);
+        } else {
+            __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                             __ATOMIC_RELEASE);
+            pk->rx_block = (pk->rx_block + 1) % PACKET_RX_BLOCKS;
+        }
+        if (len >= 0)
+            return len;
+    }
+}
+
+static ssize_t net_packet_send(NetBackend *be, const struct iovec *iov,
+                               int cnt) {
+    NetPacket *pk = (NetPacket *)be;
+    size_t len;
+    // Drop the virtio-net header.
+    int n = net_iov_skip(pk->tx_iov, iov, cnt, pk->hdr_len, &len);
+
+    if (!pk->tx_ring) {
+        struct msghdr msg = {.msg_iov = pk->tx_iov, .msg_iovlen = n};
+        ssize_t ret = sendmsg(be->fd, &msg, 0);
+        return ret < 0 ? -1 : (ssize_t)(ret + pk->hdr_len);
+    }
+
+    if (len > pk->tx_frame_size - PACKET_HDR_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    struct tpacket3_hdr *h =
+        (void *)(pk->tx_ring + pk->tx_next * pk->tx_frame_size);
+    if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_AVAILABLE) {
+        // The ring is full: push out what is queued and wait for the slot.
+        struct pollfd pfd = {.fd = be->fd, .events = POLLOUT};
+        be->ops->flush(be);
+        poll(&pfd, 1, PACKET_TX_WAIT_MS);
+        if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) !=
+            TP_STATUS_AVAILABLE) {
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    uint8_t *data = (uint8_t *)h + PACKET_HDR_LEN;
+    for (int i = 0; i < n; i++) {
+        memcpy(data, pk->tx_iov[i].iov_base, pk->tx_iov[i].iov_len);
+        data += pk->tx_iov[i].iov_len;
+    }
+    h->tp_len = len;
+    h->tp_next_offset = 0;
+    __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    pk->tx_next = (pk->tx_next + 1) % pk->tx_frames;
+    pk->tx_queued++;
+    return len + pk->hdr_len;
+}
+
+static void net_packet_flush(NetBackend *be) {
+    NetPacket *pk = (NetPacket *)be;
+
+    if (!pk->tx_queued)
+        return;
+    pk->tx_queued = 0;
+    if (sendto(be->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS)
+        log_error("virtio net packet: TX ring flush failed, errno %d", errno);
+}
+
+static int net_packet_set_features(NetBackend *be, size_t hdr_len,
+                                   uint64_t features) {
+    (void)features;
+    ((NetPacket *)be)->hdr_len = hdr_len;
+    return 0;
+}
+
+static void net_packet_close(NetBackend *be) {
+    NetPacket *pk = (NetPacket *)be;
+
+    if (pk->map)
+        munmap(pk->map, pk->map_len);
+    if (be->fd >= 0)
+        close(be->fd);
+    free(pk);
+}
+
+static const struct net_backend_ops net_packet_ops = {
+    .name = "packet",
+    .recv = net_packet_recv,
+    .send = net_packet_send,
+    .flush = net_packet_flush,
+    .set_features = net_packet_set_features,
+    .close = net_packet_close,
+};
+
+NetBackend *net_packet_open(const char *ifname) {
+    int version = TPACKET_V3, one = 1;
+    unsigned int ifindex = if_nametoindex(ifname);
+
+    if (!ifindex) {
+        log_error("virtio net packet: no interface %s", ifname);
+        return NULL;
+    }
+    NetPacket *pk = calloc(1, sizeof(*pk));
+    if (!pk)
+        return NULL;
+    pk->be.ops = &net_packet_ops;
+    pk->hdr_len = sizeof(NetHdr);
+    // No frames are queued before the socket is bound below.
+    pk->be.fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (pk->be.fd < 0) {
+        log_error("virtio net packet: socket failed, errno %d", errno);
+        goto err;
+    }
+    if (setsockopt(pk->be.fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0) {
+        log_error("virtio net packet: TPACKET_V3 not supported");
+        goto err;
+    }
+    setsockopt(pk->be.fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+               sizeof(one));
+
+    struct tpacket_req3 rx = {
+        .tp_block_size = PACKET_BLOCK_SIZE,
+        .tp_block_nr = PACKET_RX_BLOCKS,
+        .tp_frame_size = PACKET_RX_FRAME_SIZE,
+        .tp_frame_nr =
+            PACKET_RX_BLOCKS * (PACKET_BLOCK_SIZE / PACKET_RX_FRAME_SIZE),
+        .tp_retire_blk_tov = PACKET_BLOCK_TOV_MS,
+    };
+    if (setsockopt(pk->be.fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) <
+        0) {
+        log_error("virtio net packet: cannot set up RX ring, errno %d",
+                  errno);
+        goto err;
+    }
+
+    // A TX slot holds the largest frame the interface sends.
+    pk->tx_frame_size = 2048;
+    while (pk->tx_frame_size <
+           PACKET_HDR_LEN + net_if_mtu(ifname) + ETH_HLEN + 4)
+        pk->tx_frame_size <<= 1;
+    pk->tx_frames = PACKET_TX_BLOCKS * (PACKET_BLOCK_SIZE / pk->tx_frame_size);
+    struct tpacket_req3 tx = {
+        .tp_block_size = PACKET_BLOCK_SIZE,
+        .tp_block_nr = PACKET_TX_BLOCKS,
+        .tp_frame_size = pk->tx_frame_size,
+        .tp_frame_nr = pk->tx_frames,
+    };
+    bool tx_ring = setsockopt(pk->be.fd, SOL_PACKET, PACKET_TX_RING, &tx,
+                              sizeof(tx)) == 0;
+    if (!tx_ring)
+        log_warn("virtio net packet: no TX ring, sending frame by frame");
+
+    pk->map_len = (size_t)PACKET_BLOCK_SIZE *
+                  (PACKET_RX_BLOCKS + (tx_ring ? PACKET_TX_BLOCKS : 0));
+    pk->map = mmap(NULL, pk->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   pk->be.fd, 0);
+    if (pk->map == MAP_FAILED) {
+        pk->map = NULL;
+        log_error("virtio net packet: cannot map rings, errno %d", errno);
+        goto err;
+    }
+    pk->rx_ring = pk->map;
+    if (tx_ring)
+        pk->tx_ring = pk->map + (size_t)PACKET_BLOCK_SIZE * PACKET_RX_BLOCKS;
+
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex = ifindex,
+    };
+    if (bind(pk->be.fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        log_error("virtio net packet: cannot bind to %s, errno %d", ifname,
+                  errno);
+        goto err;
+    }
+    // The guest has its own MAC address.
+    struct packet_mreq mreq = {.mr_ifindex = ifindex,
+                               .mr_type = PACKET_MR_PROMISC};
+    if (setsockopt(pk->be.fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) < 0)
+        log_warn("virtio net packet: cannot make %s promiscuous", ifname);
+
+    log_info("virtio net packet: attached to %s", ifname);
+    return &pk->be;
+err:
+    net_packet_close(&pk->be);
+    return NULL;
+}
@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "virtio_net.h"
+
+/*
+ * Frame capture
+ * -------------
+ * While capturing, every frame the guest transmits or is given, and every
+ * frame the daemon drops on the way, is appended to a pcapng file, cut to
+ * the snap length. Each RX and TX queue has its own single-producer,
+ * single-consumer byte ring, filled by the thread that owns the queue with
+ * ready-made Enhanced Packet Blocks, so a writer thread only moves spans of
+ * the rings to the file. Blocks of different queues are not ordered by time
+ * in the file.
+ *
+ * Each queue pair is an interface of the file. Packets are marked inbound
+ * (to the guest) or outbound, and a frame dropped by the daemon carries the
+ * reason as a comment. The queue threads never block on the file: a packet
+ * that does not fit its ring is lost, counted in the dropcount option of the
+ * next packet and in an Interface Statistics Block when the capture ends.
+ *
+ * The queue threads only test NetDev.pcap while no capture runs.
+ */
+
+#define NET_PCAP_RING (1U << 22) // Bytes per queue
+#define NET_PCAP_POLL_US 10000
+#define NET_PCAP_WRITE_MAX (1U << 20)
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_ISB 0x00000005
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_EPB_DROPCOUNT 4
+#define PCAPNG_EPB_INBOUND 1
+#define PCAPNG_EPB_OUTBOUND 2
+#define PCAPNG_ISB_OSDROP 7
+// Reserved block type, skips the end of a ring.
+#define NET_PCAP_WRAP 0
+
+#define PAD4(x) (((x) + 3) & ~3U)
+
+static const char *const net_pcap_drop_reasons[] = {
+    [NET_PCAP_PASSED] = NULL,
+    [NET_PCAP_DROP_FILTER] = "dropped: RX filter",
+    [NET_PCAP_DROP_NO_BUFFER] = "dropped: no RX buffer",
+    [NET_PCAP_DROP_SEND] = "dropped: backend send failed",
+    [NET_PCAP_DROP_RATE] = "dropped: RX rate limit",
+};
+
+struct net_pcap_ring {
+    uint32_t head;  // Written by the queue thread
+    uint32_t tail;  // Written by the writer thread
+    uint64_t lost;  // Queue thread only, since the last packet added
+    uint64_t total; // Lost packets, for the status
+    uint8_t *buf;
+};
+
+struct net_pcap {
+    char *path;
+    int fd;
+    pthread_t tid;
+    uint32_t snaplen;
+    int num_rings; // 2 per queue pair, indexed like the virtqueues
+    off_t off;     // Writer thread only
+    uint64_t written;
+    int err;
+    bool stop;
+    bool detached; // Freed by the writer thread once the file is finished
+    struct net_pcap_ring rings[2 * NET_MAX_QUEUE_PAIRS];
+};
+
+static int pcap_write(struct net_pcap *p, const void *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pwrite(p->fd, (const uint8_t *)buf + done, len - done,
+                           p->off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? errno : EIO;
+        done += n;
+    }
+    p->off += len;
+    return 0;
+}
+
+static inline void put16(uint8_t **pos, uint16_t val) {
+    memcpy(*pos, &val, sizeof(val));
+    *pos += sizeof(val);
+}
+
+static inline void put32(uint8_t **pos, uint32_t val) {
+    memcpy(*pos, &val, sizeof(val));
+    *pos += sizeof(val);
+}
+
+static inline void put_opt(uint8_t **pos, uint16_t code, const void *val,
+                           uint16_t len) {
+    put16(pos, code);
+    put16(pos, len);
+    memcpy(*pos, val, len);
+    memset(*pos + len, 0, PAD4(len) - len);
+    *pos += PAD4(len);
+}
+
+static inline uint64_t pcap_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// The section header and one interface per queue pair.
+static int pcap_write_header(struct net_pcap *p, const char *ifname) {
+    uint8_t buf[256], *pos = buf;
+    uint8_t tsresol = 9; // Nanoseconds
+    char name[IFNAMSIZ + 8];
+    int err;
+
+    put32(&pos, PCAPNG_SHB);
+    put32(&pos, 28);
+    put32(&pos, PCAPNG_BYTE_ORDER);
+    put16(&pos, 1); // Version 1.0
+    put16(&pos, 0);
+    put32(&pos, UINT32_MAX); // Unknown section length
+    put32(&pos, UINT32_MAX);
+    put32(&pos, 28);
+    if ((err = pcap_write(p, buf, pos - buf)) != 0)
+        return err;
+
+    for (int i = 0; i < p->num_rings / 2; i++) {
+        uint8_t *len;
+
+        pos = buf;
+        snprintf(name, sizeof(name), "%s-q%d", ifname, i);
+        put32(&pos, PCAPNG_IDB);
+        len = pos;
+        pos += 4;
+        put16(&pos, PCAPNG_LINKTYPE_ETHERNET);
+        put16(&pos, 0);
+        put32(&pos, p->snaplen);
+        put_opt(&pos, PCAPNG_IF_NAME, name, strlen(name));
+        put_opt(&pos, PCAPNG_IF_TSRESOL, &tsresol, 1);
+        put32(&pos, PCAPNG_OPT_END);
+        put32(&pos, pos - buf + 4);
+        memcpy(len, pos - 4, 4);
+        if ((err = pcap_write(p, buf, pos - buf)) != 0)
+            return err;
+    }
+    return 0;
+}
+
+// Loss counters of every interface, once the rings are drained.
+static int pcap_write_stats(struct net_pcap *p) {
+    uint64_t ts = pcap_now_ns();
+
+    for (int i = 0; i < p->num_rings / 2; i++) {
+        uint64_t lost = p->rings[2 * i].total + p->rings[2 * i + 1].total;
+        uint8_t buf[40], *pos = buf;
+        int err;
+
+        put32(&pos, PCAPNG_ISB);
+        put32(&pos, sizeof(buf));
+        put32(&pos, i);
+        put32(&pos, ts >> 32);
+        put32(&pos, ts);
+        put_opt(&pos, PCAPNG_ISB_OSDROP, &lost, sizeof(lost));
+        put32(&pos, PCAPNG_OPT_END);
+        put32(&pos, sizeof(buf));
+        if ((err = pcap_write(p, buf, sizeof(buf))) != 0)
+            return err;
+    }
+    return 0;
+}
+
+// Write the blocks between tail and head of r, up to the end of the ring.
+// Returns the number of bytes consumed.
+static uint32_t pcap_drain(struct net_pcap *p, struct net_pcap_ring *r,
+                           uint32_t head, uint32_t tail) {
+    uint32_t idx = tail % NET_PCAP_RING;
+    uint32_t end = MIN(head - tail, NET_PCAP_RING - idx);
+    uint32_t span = 0, blocks = 0;
+
+    while (span < end && span < NET_PCAP_WRITE_MAX) {
+        uint32_t type, len;
+
+        // Less than a block header left, or a wrap marker: the rest of the
+        // ring is skipped.
+        if (end - span < 8)
+            break;
+        memcpy(&type, r->buf + idx + span, 4);
+        memcpy(&len, r->buf + idx + span + 4, 4);
+        if (type == NET_PCAP_WRAP)
+            break;
+        span += len;
+        blocks++;
+    }
+    if (span > 0) {
+        if (!p->err) {
+            p->err = pcap_write(p, r->buf + idx, span);
+            if (p->err)
+                log_error("virtio-net: writing capture %s failed: %s",
+                          p->path, strerror(p->err));
+        }
+        if (!p->err)
+            __atomic_fetch_add(&p->written, blocks, __ATOMIC_RELAXED);
+        return span;
+    }
+    return end;
+}
+
+static uint64_t net_pcap_lost(struct net_pcap *p) {
+    uint64_t lost = 0;
+    for (int i = 0; i < p->num_rings; i++)
+        lost += __atomic_load_n(&p->rings[i].total, __ATOMIC_RELAXED);
+    return lost;
+}
+
+static void net_pcap_free(struct net_pcap *p) {
+    for (int i = 0; i < p->num_rings; i++)
+        free(p->rings[i].buf);
+    free(p->path);
+    free(p);
+}
+
+// Called by the writer thread once the rings are empty.
+static void pcap_finish(struct net_pcap *p) {
+    if (!p->err)
+        p->err = pcap_write_stats(p);
+    if (!p->err && fdatasync(p->fd) < 0)
+        p->err = errno;
+    close(p->fd);
+    log_info("virtio-net: capture %s closed, %" PRIu64 " packets, %" PRIu64
+             " lost%s",
+             p->path, p->written, net_pcap_lost(p),
+             p->err ? ", write failed" : "");
+}
+
+static void *net_pcap_thread(void *arg) {
+    struct net_pcap *p = arg;
+
+    for (;;) {
+        bool stop = __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+        bool idle = true;
+
+        for (int i = 0; i < p->num_rings; i++) {
+            struct net_pcap_ring *r = &p->rings[i];
+            uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            uint32_t tail = r->tail;
+
+            if (head == tail)
+                continue;
+            idle = false;
+            tail += pcap_drain(p, r, head, tail);
+            __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        }
+        if (idle) {
+            if (stop)
+                break;
+            usleep(NET_PCAP_POLL_US);
+        }
+    }
+    pcap_finish(p);
+    if (p->detached)
+        net_pcap_free(p);
+    return NULL;
+}
+
+struct net_pcap *net_pcap_open(const char *path, const char *ifname,
+                               int num_pairs, uint32_t snaplen) {
+    struct net_pcap *p = calloc(1, sizeof(*p));
+    int err = ENOMEM;
+
+    if (!p || !(p->path = strdup(path))) {
+        free(p);
+        errno = ENOMEM;
+        return NULL;
+    }
+    p->snaplen = snaplen;
+    p->num_rings = 2 * num_pairs;
+    for (int i = 0; i < p->num_rings; i++)
+        if (!(p->rings[i].buf = malloc(NET_PCAP_RING)))
+            goto err_free;
+    p->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (p->fd < 0) {
+        err = errno;
+        log_error("virtio-net: cannot open capture %s: %s", path,
+                  strerror(err));
+        goto err_free;
+    }
+    err = pcap_write_header(p, ifname);
+    if (!err)
+        err = pthread_create(&p->tid, NULL, net_pcap_thread, p);
+    if (err) {
+        log_error("virtio-net: cannot start capture %s: %s", path,
+                  strerror(err));
+        close(p->fd);
+        goto err_free;
+    }
+    log_info("virtio-net: capturing %s to %s", ifname, path);
+    return p;
+err_free:
+    for (int i = 0; i < p->num_rings; i++)
+        free(p->rings[i].buf);
+    free(p->path);
+    free(p);
+    errno = err;
+    return NULL;
+}
+
+void net_pcap_add(struct net_pcap *p, int pair, int dir,
+                  const struct iovec *iov, int cnt, size_t skip, size_t len,
+                  enum net_pcap_drop drop) {
+    struct net_pcap_ring *r = &p->rings[2 * pair + dir];
+    const char *reason = net_pcap_drop_reasons[drop];
+    uint32_t caplen = p->snaplen ? MIN(len, p->snaplen) : len;
+    uint32_t flags = dir == NET_QUEUE_RX ? PCAPNG_EPB_INBOUND
+                                         : PCAPNG_EPB_OUTBOUND;
+    uint32_t size = 28 + PAD4(caplen) + 8 + 4 + 4;
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint32_t idx = head % NET_PCAP_RING;
+    uint32_t room = NET_PCAP_RING - idx;
+
+    if (r->lost)
+        size += 4 + sizeof(r->lost);
+    if (reason)
+        size += 4 + PAD4(strlen(reason));
+    // A block is never split, the end of the ring is skipped instead.
+    if (NET_PCAP_RING - (head - tail) < size + (room < size ? room : 0)) {
+        r->lost++;
+        __atomic_fetch_add(&r->total, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (room < size) {
+        if (room >= 8) {
+            uint8_t *pos = r->buf + idx;
+            put32(&pos, NET_PCAP_WRAP);
+            put32(&pos, room);
+        }
+        head += room;
+        idx = 0;
+    }
+
+    uint8_t *pos = r->buf + idx;
+    uint64_t ts = pcap_now_ns();
+    put32(&pos, PCAPNG_EPB);
+    put32(&pos, size);
+    put32(&pos, pair);
+    put32(&pos, ts >> 32);
+    put32(&pos, ts);
+    put32(&pos, caplen);
+    put32(&pos, len);
+    uint8_t *data = pos;
+    struct iovec data_iov = {data, caplen};
+    pos += net_iov_copy(&data_iov, 1, 0, iov, cnt, skip, caplen);
+    memset(pos, 0, PAD4(caplen) - (pos - data));
+    pos = data + PAD4(caplen);
+    put_opt(&pos, PCAPNG_EPB_FLAGS, &flags, sizeof(flags));
+    if (r->lost) {
+        put_opt(&pos, PCAPNG_EPB_DROPCOUNT, &r->lost, sizeof(r->lost));
+        r->lost = 0;
+    }
+    if (reason)
+        put_opt(&pos, PCAPNG_OPT_COMMENT, reason, strlen(reason));
+    put32(&pos, PCAPNG_OPT_END);
+    put32(&pos, size);
+    __atomic_store_n(&r->head, head + size, __ATOMIC_RELEASE);
+}
+
+// Flush the rings and finish the file. The queues must not add any more.
+static void net_pcap_stop(struct net_pcap *p) {
+    __atomic_store_n(&p->stop, true, __ATOMIC_RELEASE);
+    pthread_join(p->tid, NULL);
+}
+
+void net_pcap_close(struct net_pcap *p) {
+    if (!p)
+        return;
+    net_pcap_stop(p);
+    net_pcap_free(p);
+}
+
+// Install or remove the capture of net while no queue thread runs.
+static void net_pcap_set(NetDev *net, struct net_pcap *p) {
+    for (int i = 0; i < net->num_pairs; i++)
+        pthread_mutex_lock(&net->queues[i].tx_lock);
+    for (int i = 0; i < net->num_pairs; i++)
+        pthread_mutex_lock(&net->queues[i].lock);
+    net->pcap = p;
+    for (int i = net->num_pairs - 1; i >= 0; i--)
+        pthread_mutex_unlock(&net->queues[i].lock);
+    for (int i = net->num_pairs - 1; i >= 0; i--)
+        pthread_mutex_unlock(&net->queues[i].tx_lock);
+}
+
+int net_ctl_pcap(VirtIODevice *vdev, int argc, char *argv[], char *reply,
+                 size_t len) {
+    NetDev *net = vdev->dev;
+    struct net_pcap *p;
+    uint32_t snaplen = 0;
+    char *end;
+
+    if (argc < 2 || argc > 3 ||
+        (argc == 3 && ((snaplen = strtoul(argv[2], &end, 0)) == 0 || *end))) {
+        snprintf(reply, len, "usage: pcap <file> [snaplen]|off\n");
+        return -EINVAL;
+    }
+    if (strcmp(argv[1], "off") == 0) {
+        if (!net->pcap) {
+            snprintf(reply, len, "not capturing\n");
+            return -EINVAL;
+        }
+        p = net->pcap;
+        net_pcap_set(net, NULL);
+
+        // The writer thread flushes and syncs the rest of the capture and
+        // frees it, so that the event monitor thread does not wait for the
+        // disk. The final counts go to the log.
+        int err = p->err;
+        snprintf(reply, len,
+                 "closing %s, %" PRIu64 " packets written so far, %" PRIu64
+                 " lost%s\n",
+                 p->path, __atomic_load_n(&p->written, __ATOMIC_RELAXED),
+                 net_pcap_lost(p), err ? ", write failed" : "");
+        p->detached = true;
+        pthread_detach(p->tid);
+        __atomic_store_n(&p->stop, true, __ATOMIC_RELEASE);
+        return -err;
+    }
+
+    if (net->vhost) {
+        snprintf(reply, len, "frames do not pass the daemon with vhost\n");
+        return -EINVAL;
+    }
+    if (net->pcap) {
+        snprintf(reply, len, "already capturing to %s\n", net->pcap->path);
+        return -EBUSY;
+    }
+    p = net_pcap_open(argv[1], net->ifname, net->num_pairs, snaplen);
+    if (!p) {
+        int err = errno;
+        snprintf(reply, len, "cannot capture to %s: %s\n", argv[1],
+                 strerror(err));
+        return -err;
+    }
+    net_pcap_set(net, p);
+    snprintf(reply, len, "capturing frames to %s\n", argv[1]);
+    return 0;
+}
+
+int net_pcap_status(NetDev *net, char *buf, size_t len) {
+    struct net_pcap *p = net->pcap;
+
+    if (!p)
+        return snprintf(buf, len, "pcap: off\n");
+    // The counters are read racily, which is good enough for a status.
+    return snprintf(buf, len,
+                    "pcap: %s, %" PRIu64 " packets written, %" PRIu64
+                    " lost%s\n",
+                    p->path, __atomic_load_n(&p->written, __ATOMIC_RELAXED),
+                    net_pcap_lost(p), p->err ? ", write failed" : "");
+}
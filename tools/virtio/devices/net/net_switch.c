@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "virtio_net.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * In-daemon switch
+ * ----------------
+ * Net devices with the same "switch" name are ports of one learning L2
+ * switch inside the daemon, so zones talk to each other without going
+ * through the host stack. A frame the guest of one port transmits is copied
+ * by the thread handling that TX queue straight from the TX descriptors into
+ * the RX descriptors of the destination port, under the destination queue's
+ * lock, and the destination guest is interrupted right away. The port
+ * backend has no file descriptor, its recv() only returns the frame being
+ * delivered. A frame finding no RX buffer at its port is dropped, as on a
+ * congested switch port.
+ *
+ * Source MAC addresses are learned into a direct mapped forwarding table.
+ * Unicast frames to a known address go to its port only, others are flooded
+ * to every port but the one they came from.
+ *
+ * A switch may have an uplink tap, read by a thread of the switch, which is
+ * handled as one more port so that zones can reach the host. Frames carry
+ * no offloads on the switch, the virtio-net header is zeroed on delivery.
+ */
+
+#define NET_SWITCH_MAX_PORTS 32
+// The uplink in the forwarding table.
+#define NET_SWITCH_UPLINK NET_SWITCH_MAX_PORTS
+#define NET_SWITCH_FDB_SIZE 1024
+// Seconds a learned address stays valid without traffic from it.
+#define NET_SWITCH_AGEING 300
+// Largest frame read from the uplink, virtio-net header included.
+#define NET_SWITCH_UPLINK_MAX (sizeof(NetHdr) + NET_RX_GSO_FRAME_MAX)
+
+struct net_switch_fdb {
+    uint8_t mac[ETH_ALEN];
+    int port; // -1 when free
+    time_t seen;
+};
+
+typedef struct net_switch_port {
+    NetBackend be; // Must stay first
+    struct net_switch *sw;
+    NetQueue *q;
+    int idx;
+    size_t hdr_len;
+    // Frame being delivered to this port, set under q->lock
+    const struct iovec *in_iov;
+    int in_cnt;
+    size_t in_skip; // Header of the sender
+    uint64_t dropped;
+} NetSwitchPort;
+
+typedef struct net_switch {
+    char name[IFNAMSIZ];
+    struct net_switch *next;
+    // Held for reading while frames are forwarded, for writing while ports
+    // come and go.
+    pthread_rwlock_t lock;
+    NetSwitchPort *ports[NET_SWITCH_MAX_PORTS];
+    int num_ports;
+    pthread_mutex_t fdb_lock;
+    struct net_switch_fdb fdb[NET_SWITCH_FDB_SIZE];
+    // Uplink, NULL without one
+    NetBackend *uplink;
+    char uplink_name[IFNAMSIZ];
+    int stopfd;
+    pthread_t tid;
+    uint8_t *uplink_buf;
+} NetSwitch;
+
+static NetSwitch *switches;
+static pthread_mutex_t switches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct net_switch_fdb *fdb_slot(NetSwitch *sw, const uint8_t *mac) {
+    uint32_t hash = 0;
+
+    for (int i = 0; i < ETH_ALEN; i++)
+        hash = hash * 31 + mac[i];
+    return &sw->fdb[hash % NET_SWITCH_FDB_SIZE];
+}
+
+// Learn the source of a frame from port and look up its destination.
+// Returns the destination port, or -1 to flood.
+static int fdb_update(NetSwitch *sw, const uint8_t *eth, int port) {
+    const uint8_t *dst = eth, *src = eth + ETH_ALEN;
+    struct timespec now;
+    int to = -1;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    pthread_mutex_lock(&sw->fdb_lock);
+    if (!(src[0] & 1)) {
+        struct net_switch_fdb *e = fdb_slot(sw, src);
+        memcpy(e->mac, src, ETH_ALEN);
+        e->port = port;
+        e->seen = now.tv_sec;
+    }
+    if (!(dst[0] & 1)) {
+        struct net_switch_fdb *e = fdb_slot(sw, dst);
+        if (e->port >= 0 && memcmp(e->mac, dst, ETH_ALEN) == 0 &&
+            now.tv_sec - e->seen < NET_SWITCH_AGEING)
+            to = e->port;
+    }
+    pthread_mutex_unlock(&sw->fdb_lock);
+    return to;
+}
+
+static void fdb_flush_port(NetSwitch *sw, int port) {
+    pthread_mutex_lock(&sw->fdb_lock);
+    for (int i = 0; i < NET_SWITCH_FDB_SIZE; i++)
+        if (sw->fdb[i].port == port)
+            sw->fdb[i].port = -1;
+    pthread_mutex_unlock(&sw->fdb_lock);
+}
+
+// Copy a frame into the RX queue of port, called with sw->lock held.
+static void net_switch_deliver(NetSwitchPort *port, const struct iovec *iov,
+                               int cnt, size_t hdr_len) {
+    NetQueue *q = port->q;
+
+    pthread_mutex_lock(&q->lock);
+    port->in_iov = iov;
+    port->in_cnt = cnt;
+    port->in_skip = hdr_len;
+    virtio_net_event_handler(q);
+    if (port->in_iov) {
+        // The frame cannot wait for buffers or tokens.
+        enum net_pcap_drop why = NET_PCAP_DROP_NO_BUFFER;
+        port->in_iov = NULL;
+        port->dropped++;
+        if (q->rx_wait) {
+            why = NET_PCAP_DROP_RATE;
+            pthread_mutex_lock(&q->net->rx_rate.lock);
+            q->net->rx_rate.dropped++;
+            pthread_mutex_unlock(&q->net->rx_rate.lock);
+        }
+        if (q->net->pcap)
+            net_pcap_add(q->net->pcap, q->idx, NET_QUEUE_RX, iov, cnt, hdr_len,
+                         net_iov_size(iov, cnt) - hdr_len, why);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void net_switch_to_uplink(NetSwitch *sw, const struct iovec *iov,
+                                 int cnt, size_t hdr_len) {
+    static const NetHdr zero_hdr;
+    struct iovec out[NET_IOV_MAX + 1];
+    size_t len;
+
+    out[0].iov_base = (void *)&zero_hdr;
+    out[0].iov_len = sizeof(zero_hdr);
+    int n = 1 + net_iov_skip(out + 1, iov, MIN(cnt, NET_IOV_MAX), hdr_len,
+                             &len);
+    if (sw->uplink->ops->send(sw->uplink, out, n) < 0 && errno != EAGAIN)
+        log_error("virtio net switch %s: uplink send failed, errno %d",
+                  sw->name, errno);
+}
+
+// Forward a frame starting with a virtio-net header of hdr_len bytes.
+static void net_switch_forward(NetSwitch *sw, int from,
+                               const struct iovec *iov, int cnt,
+                               size_t hdr_len) {
+    uint8_t eth[2 * ETH_ALEN];
+    struct iovec eth_iov = {eth, sizeof(eth)};
+
+    if (net_iov_copy(&eth_iov, 1, 0, iov, cnt, hdr_len, sizeof(eth)) <
+        sizeof(eth))
+        return;
+    int to = fdb_update(sw, eth, from);
+    if (to == from)
+        return;
+
+    pthread_rwlock_rdlock(&sw->lock);
+    if (to == NET_SWITCH_UPLINK) {
+        net_switch_to_uplink(sw, iov, cnt, hdr_len);
+    } else if (to >= 0) {
+        if (sw->ports[to])
+            net_switch_deliver(sw->ports[to], iov, cnt, hdr_len);
+    } else {
+        for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++)
+            if (i != from && sw->ports[i])
+                net_switch_deliver(sw->ports[i], iov, cnt, hdr_len);
+        if (from != NET_SWITCH_UPLINK && sw->uplink)
+            net_switch_to_uplink(sw, iov, cnt, hdr_len);
+    }
+    pthread_rwlock_unlock(&sw->lock);
+}
+
+static ssize_t net_switch_recv(NetBackend *be, const struct iovec *iov,
+                               int cnt) {
+    NetSwitchPort *port = (NetSwitchPort *)be;
+    static const uint8_t zero_hdr[sizeof(NetHdr)];
+    struct iovec hdr_iov = {(void *)zero_hdr, port->hdr_len};
+
+    if (!port->in_iov) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    size_t len = net_iov_size(port->in_iov, port->in_cnt) - port->in_skip;
+    net_iov_copy(iov, cnt, 0, &hdr_iov, 1, 0, port->hdr_len);
+    len = net_iov_copy(iov, cnt, port->hdr_len, port->in_iov, port->in_cnt,
+                       port->in_skip, len);
+    port->in_iov = NULL;
+    return port->hdr_len + len;
+}
+
+// The frame being delivered, so that a small one does not wait for
+// mergeable buffers enough for the largest.
+static size_t net_switch_next_len(NetBackend *be) {
+    NetSwitchPort *port = (NetSwitchPort *)be;
+
+    if (!port->in_iov)
+        return 0;
+    return port->hdr_len + net_iov_size(port->in_iov, port->in_cnt) -
+           port->in_skip;
+}
+
+static ssize_t net_switch_send(NetBackend *be, const struct iovec *iov,
+                               int cnt) {
+    NetSwitchPort *port = (NetSwitchPort *)be;
+
+    net_switch_forward(port->sw, port->idx, iov, cnt, port->hdr_len);
+    return net_iov_size(iov, cnt);
+}
+
+static int net_switch_set_features(NetBackend *be, size_t hdr_len,
+                                   uint64_t features) {
+    (void)features;
+    ((NetSwitchPort *)be)->hdr_len = hdr_len;
+    return 0;
+}
+
+static void *net_switch_uplink_thread(void *arg) {
+    NetSwitch *sw = arg;
+    struct pollfd fds[2] = {
+        {.fd = sw->stopfd, .events = POLLIN},
+        {.fd = sw->uplink->fd, .events = POLLIN},
+    };
+    struct iovec iov = {sw->uplink_buf, NET_SWITCH_UPLINK_MAX};
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("virtio net switch %s: poll failed, errno %d",
+                      sw->name, errno);
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            break;
+        ssize_t len;
+        while ((len = sw->uplink->ops->recv(sw->uplink, &iov, 1)) > 0) {
+            struct iovec frame = {sw->uplink_buf, len};
+            net_switch_forward(sw, NET_SWITCH_UPLINK, &frame, 1,
+                               sizeof(NetHdr));
+        }
+    }
+    return NULL;
+}
+
+static int net_switch_add_uplink(NetSwitch *sw, const char *uplink) {
+    sw->uplink = net_tap_open(uplink, false);
+    if (!sw->uplink)
+        return -1;
+    // The uplink carries plain frames after a zeroed header.
+    if (sw->uplink->ops->set_features(sw->uplink, sizeof(NetHdr), 0) < 0)
+        return -1;
+    strncpy(sw->uplink_name, uplink, sizeof(sw->uplink_name) - 1);
+    sw->uplink_buf = malloc(NET_SWITCH_UPLINK_MAX);
+    if (!sw->uplink_buf)
+        return -1;
+    sw->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sw->stopfd < 0)
+        return -1;
+    if (pthread_create(&sw->tid, NULL, net_switch_uplink_thread, sw) != 0) {
+        close(sw->stopfd);
+        sw->stopfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void net_switch_free(NetSwitch *sw) {
+    if (sw->stopfd >= 0) {
+        uint64_t one = 1;
+        if (write(sw->stopfd, &one, sizeof(one)) < 0)
+            log_error("virtio net switch %s: cannot stop uplink", sw->name);
+        pthread_join(sw->tid, NULL);
+        close(sw->stopfd);
+    }
+    if (sw->uplink)
+        sw->uplink->ops->close(sw->uplink);
+    free(sw->uplink_buf);
+    pthread_rwlock_destroy(&sw->lock);
+    pthread_mutex_destroy(&sw->fdb_lock);
+    free(sw);
+}
+
+// Find the switch called name or create it, called with switches_lock held.
+static NetSwitch *net_switch_get(const char *name, const char *uplink) {
+    NetSwitch *sw;
+
+    for (sw = switches; sw; sw = sw->next) {
+        if (strcmp(sw->name, name) != 0)
+            continue;
+        if (uplink && strcmp(sw->uplink_name, uplink) != 0) {
+            log_error("virtio net switch %s: already has uplink %s", name,
+                      sw->uplink_name[0] ? sw->uplink_name : "none");
+            return NULL;
+        }
+        return sw;
+    }
+
+    sw = calloc(1, sizeof(*sw));
+    if (!sw)
+        return NULL;
+    strncpy(sw->name, name, sizeof(sw->name) - 1);
+    pthread_rwlock_init(&sw->lock, NULL);
+    pthread_mutex_init(&sw->fdb_lock, NULL);
+    for (int i = 0; i < NET_SWITCH_FDB_SIZE; i++)
+        sw->fdb[i].port = -1;
+    sw->stopfd = -1;
+    if (uplink && net_switch_add_uplink(sw, uplink) < 0) {
+        log_error("virtio net switch %s: cannot open uplink %s", name,
+                  uplink);
+        net_switch_free(sw);
+        return NULL;
+    }
+    sw->next = switches;
+    switches = sw;
+    log_info("virtio net switch %s: created, uplink %s", name,
+             uplink ? uplink : "none");
+    return sw;
+}
+
+static void net_switch_close(NetBackend *be) {
+    NetSwitchPort *port = (NetSwitchPort *)be;
+    NetSwitch *sw = port->sw;
+
+    pthread_mutex_lock(&switches_lock);
+    pthread_rwlock_wrlock(&sw->lock);
+    sw->ports[port->idx] = NULL;
+    sw->num_ports--;
+    pthread_rwlock_unlock(&sw->lock);
+    fdb_flush_port(sw, port->idx);
+    if (port->dropped)
+        log_info("virtio net switch %s: port %d dropped %" PRIu64 " frames",
+                 sw->name, port->idx, port->dropped);
+    if (!sw->num_ports) {
+        NetSwitch **pp = &switches;
+        while (*pp != sw)
+            pp = &(*pp)->next;
+        *pp = sw->next;
+        net_switch_free(sw);
+    }
+    pthread_mutex_unlock(&switches_lock);
+    free(port);
+}
+
+static const struct net_backend_ops net_switch_ops = {
+    .name = "switch",
+    .recv = net_switch_recv,
+    .send = net_switch_send,
+    .set_features = net_switch_set_features,
+    .next_len = net_switch_next_len,
+    .close = net_switch_close,
+};
+
+NetBackend *net_switch_open(const char *name, const char *uplink,
+                            NetQueue *q) {
+    NetSwitchPort *port = calloc(1, sizeof(*port));
+    if (!port)
+        return NULL;
+    port->be.ops = &net_switch_ops;
+    port->be.fd = -1;
+    port->q = q;
+    port->hdr_len = sizeof(NetHdr);
+
+    pthread_mutex_lock(&switches_lock);
+    NetSwitch *sw = net_switch_get(name, uplink);
+    if (!sw)
+        goto err;
+    pthread_rwlock_wrlock(&sw->lock);
+    for (port->idx = 0; port->idx < NET_SWITCH_MAX_PORTS; port->idx++)
+        if (!sw->ports[port->idx])
+            break;
+    if (port->idx == NET_SWITCH_MAX_PORTS) {
+        pthread_rwlock_unlock(&sw->lock);
+        log_error("virtio net switch %s: all %d ports in use", name,
+                  NET_SWITCH_MAX_PORTS);
+        // The switch has ports, so it is not freed here.
+        goto err;
+    }
+    port->sw = sw;
+    sw->ports[port->idx] = port;
+    sw->num_ports++;
+    pthread_rwlock_unlock(&sw->lock);
+    pthread_mutex_unlock(&switches_lock);
+    log_info("virtio net switch %s: port %d attached", name, port->idx);
+    return &port->be;
+err:
+    pthread_mutex_unlock(&switches_lock);
+    free(port);
+    return NULL;
+}
@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/vhost.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "virtio_net.h"
+
+/*
+ * vhost-net offload
+ * -----------------
+ * The frames of the tap backend are moved by the host kernel instead of the
+ * queue workers. Each queue pair gets a /dev/vhost-net instance, which is
+ * given the zone memory the daemon has mapped (zone_mem[]), so the rings and
+ * buffers are reached through the same addresses the daemon would use, and
+ * the tap queue of the pair. The daemon keeps the configuration space, the
+ * feature negotiation and the control queue.
+ *
+ * Once the driver sets DRIVER_OK, the rings are handed to the kernel. A
+ * QUEUE_NOTIFY of a data queue only signals the kick eventfd of the ring,
+ * and a thread turns the call eventfds the kernel signals when it used
+ * buffers into virtio_inject_irq(). Reset takes the rings back before the
+ * virtqueues are cleared.
+ */
+
+// Ring features vhost-net implements, cleared from the device features if
+// the kernel lacks them. The other virtio-net features are the daemon's or
+// the tap's.
+#define NET_VHOST_FEATURES                                                     \
+    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MRG_RXBUF))
+
+struct net_vhost_pair {
+    int fd;        // /dev/vhost-net instance of the pair
+    int kickfd[2]; // Signaled on QUEUE_NOTIFY, by ring (NET_QUEUE_RX, TX)
+    int callfd[2]; // Signaled by the kernel when it used buffers
+    bool running;
+};
+
+struct net_vhost {
+    VirtIODevice *vdev;
+    NetDev *net;
+    uint64_t features; // Offered by the kernel
+    // Held while the rings are handed over or taken back, and while an
+    // interrupt is injected, so that reset never races with the thread.
+    pthread_mutex_t lock;
+    int wakefd;
+    bool thread_started;
+    pthread_t tid;
+    struct net_vhost_pair pairs[NET_MAX_QUEUE_PAIRS];
+};
+
+uint64_t net_vhost_features(const struct net_vhost *v) {
+    return ~NET_VHOST_FEATURES | v->features;
+}
+
+void net_vhost_kick(struct net_vhost *v, int vq_idx) {
+    uint64_t val = 1;
+
+    if (write(v->pairs[vq_idx / 2].kickfd[vq_idx % 2], &val, sizeof(val)) <
+        0)
+        log_error("vhost-net: failed to kick queue %d", vq_idx);
+}
+
+static void *net_vhost_irq_thread(void *arg) {
+    struct net_vhost *v = arg;
+    struct pollfd fds[1 + 2 * NET_MAX_QUEUE_PAIRS];
+    int n = 2 * v->net->num_pairs;
+    uint64_t val;
+
+    fds[0] = (struct pollfd){.fd = v->wakefd, .events = POLLIN};
+    for (int i = 0; i < n; i++)
+        fds[1 + i] = (struct pollfd){.fd = v->pairs[i / 2].callfd[i % 2],
+                                     .events = POLLIN};
+    while (!__atomic_load_n(&v->net->stop, __ATOMIC_ACQUIRE)) {
+        if (poll(fds, 1 + n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("vhost-net: poll failed, errno %d", errno);
+            break;
+        }
+        if (fds[0].revents & POLLIN && read(v->wakefd, &val, sizeof(val)) < 0)
+            log_debug("vhost-net: empty wakeup");
+        for (int i = 0; i < n; i++) {
+            if (!(fds[1 + i].revents & POLLIN) ||
+                read(fds[1 + i].fd, &val, sizeof(val)) < 0)
+                continue;
+            pthread_mutex_lock(&v->lock);
+            if (v->pairs[i / 2].running)
+                virtio_inject_irq(&v->vdev->vqs[i]);
+            pthread_mutex_unlock(&v->lock);
+        }
+    }
+    return NULL;
+}
+
+struct net_vhost *net_vhost_open(VirtIODevice *vdev, NetDev *net) {
+    struct net_vhost *v = calloc(1, sizeof(*v));
+
+    if (!v)
+        return NULL;
+    v->vdev = vdev;
+    v->net = net;
+    v->wakefd = -1;
+    pthread_mutex_init(&v->lock, NULL);
+    for (int i = 0; i < NET_MAX_QUEUE_PAIRS; i++) {
+        struct net_vhost_pair *vp = &v->pairs[i];
+        vp->fd = vp->kickfd[0] = vp->kickfd[1] = -1;
+        vp->callfd[0] = vp->callfd[1] = -1;
+    }
+    for (int i = 0; i < net->num_pairs; i++) {
+        struct net_vhost_pair *vp = &v->pairs[i];
+        uint64_t features;
+
+        vp->fd = open("/dev/vhost-net", O_RDWR | O_CLOEXEC);
+        if (vp->fd < 0) {
+            log_error("vhost-net: cannot open /dev/vhost-net, errno %d",
+                      errno);
+            goto err;
+        }
+        if (ioctl(vp->fd, VHOST_SET_OWNER) < 0 ||
+            ioctl(vp->fd, VHOST_GET_FEATURES, &features) < 0) {
+            log_error("vhost-net: cannot set up queue pair %d, errno %d", i,
+                      errno);
+            goto err;
+        }
+        v->features = features;
+        for (int d = 0; d < 2; d++) {
+            vp->kickfd[d] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            vp->callfd[d] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (vp->kickfd[d] < 0 || vp->callfd[d] < 0) {
+                log_error("vhost-net: failed to create eventfds");
+                goto err;
+            }
+        }
+    }
+    v->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (v->wakefd < 0) {
+        log_error("vhost-net: failed to create eventfd");
+        goto err;
+    }
+    if (pthread_create(&v->tid, NULL, net_vhost_irq_thread, v) != 0) {
+        log_error("vhost-net: failed to create interrupt thread");
+        goto err;
+    }
+    v->thread_started = true;
+    log_info("vhost-net: %d queue pairs, kernel features %#llx",
+             net->num_pairs, (unsigned long long)v->features);
+    return v;
+err:
+    net_vhost_close(v);
+    return NULL;
+}
+
+// The guest memory as the daemon maps it, which is where the kernel reaches
+// the rings and buffers.
+static struct vhost_memory *net_vhost_mem_table(int zone_id) {
+    struct zone_mem *z = &zone_mem[zone_id];
+    struct vhost_memory *mem;
+
+    mem = calloc(1, sizeof(*mem) +
+                        z->num_regions * sizeof(struct vhost_memory_region));
+    if (!mem)
+        return NULL;
+    for (size_t i = 0; i < z->num_regions; i++) {
+        if (z->regions[i].mem_size == 0)
+            continue;
+        mem->regions[mem->nregions++] = (struct vhost_memory_region){
+            .guest_phys_addr = z->regions[i].zonex_ipa,
+            .memory_size = z->regions[i].mem_size,
+            .userspace_addr = z->regions[i].virt_addr,
+        };
+    }
+    return mem;
+}
+
+static int net_vhost_start_ring(struct net_vhost_pair *vp, int d,
+                                VirtQueue *vq) {
+    struct vhost_vring_state num = {.index = d, .num = vq->num};
+    struct vhost_vring_state base = {.index = d, .num = vq->last_avail_idx};
+    struct vhost_vring_addr addr = {
+        .index = d,
+        .desc_user_addr = (uintptr_t)vq->desc_table,
+        .avail_user_addr = (uintptr_t)vq->avail_ring,
+        .used_user_addr = (uintptr_t)vq->used_ring,
+    };
+    struct vhost_vring_file kick = {.index = d, .fd = vp->kickfd[d]};
+    struct vhost_vring_file call = {.index = d, .fd = vp->callfd[d]};
+
+    if (ioctl(vp->fd, VHOST_SET_VRING_NUM, &num) < 0 ||
+        ioctl(vp->fd, VHOST_SET_VRING_BASE, &base) < 0 ||
+        ioctl(vp->fd, VHOST_SET_VRING_ADDR, &addr) < 0 ||
+        ioctl(vp->fd, VHOST_SET_VRING_KICK, &kick) < 0 ||
+        ioctl(vp->fd, VHOST_SET_VRING_CALL, &call) < 0)
+        return -1;
+    return 0;
+}
+
+static void net_vhost_stop_pair(struct net_vhost_pair *vp) {
+    for (int d = 0; d < 2; d++) {
+        struct vhost_vring_file backend = {.index = d, .fd = -1};
+        if (ioctl(vp->fd, VHOST_NET_SET_BACKEND, &backend) < 0)
+            log_error("vhost-net: cannot stop ring %d, errno %d", d, errno);
+    }
+    vp->running = false;
+}
+
+int net_vhost_start(struct net_vhost *v) {
+    VirtIODevice *vdev = v->vdev;
+    uint64_t features = vdev->regs.drv_feature & v->features;
+    struct vhost_memory *mem;
+    int ret = 0;
+
+    mem = net_vhost_mem_table(vdev->zone_id);
+    if (!mem)
+        return -1;
+    pthread_mutex_lock(&v->lock);
+    for (int i = 0; i < v->net->num_pairs; i++) {
+        struct net_vhost_pair *vp = &v->pairs[i];
+        VirtQueue *vqs = &vdev->vqs[2 * i];
+
+        // The driver may leave the queues of pairs it does not use unset.
+        if (vp->running || !vqs[NET_QUEUE_RX].ready ||
+            !vqs[NET_QUEUE_TX].ready)
+            continue;
+        if (ioctl(vp->fd, VHOST_SET_FEATURES, &features) < 0 ||
+            ioctl(vp->fd, VHOST_SET_MEM_TABLE, mem) < 0 ||
+            net_vhost_start_ring(vp, NET_QUEUE_RX, &vqs[NET_QUEUE_RX]) < 0 ||
+            net_vhost_start_ring(vp, NET_QUEUE_TX, &vqs[NET_QUEUE_TX]) < 0) {
+            log_error("vhost-net: cannot set up queue pair %d, errno %d", i,
+                      errno);
+            ret = -1;
+            break;
+        }
+        vp->running = true;
+        for (int d = 0; d < 2; d++) {
+            struct vhost_vring_file backend = {
+                .index = d, .fd = v->net->queues[i].be->fd};
+            if (ioctl(vp->fd, VHOST_NET_SET_BACKEND, &backend) < 0) {
+                log_error("vhost-net: cannot attach the tap to queue pair "
+                          "%d, errno %d",
+                          i, errno);
+                net_vhost_stop_pair(vp);
+                ret = -1;
+                break;
+            }
+        }
+        if (ret < 0)
+            break;
+        log_info("vhost-net: queue pair %d handed to the kernel", i);
+    }
+    pthread_mutex_unlock(&v->lock);
+    free(mem);
+    return ret;
+}
+
+void net_vhost_stop(struct net_vhost *v) {
+    pthread_mutex_lock(&v->lock);
+    for (int i = 0; i < v->net->num_pairs; i++)
+        if (v->pairs[i].running)
+            net_vhost_stop_pair(&v->pairs[i]);
+    pthread_mutex_unlock(&v->lock);
+}
+
+void net_vhost_close(struct net_vhost *v) {
+    uint64_t val = 1;
+
+    if (!v)
+        return;
+    if (v->thread_started) {
+        // net->stop is set by the caller.
+        if (write(v->wakefd, &val, sizeof(val)) < 0)
+            log_error("vhost-net: failed to wake interrupt thread");
+        pthread_join(v->tid, NULL);
+    }
+    for (int i = 0; i < NET_MAX_QUEUE_PAIRS; i++) {
+        struct net_vhost_pair *vp = &v->pairs[i];
+        if (vp->running)
+            net_vhost_stop_pair(vp);
+        // Closing the instance releases the rings and the tap.
+        if (vp->fd >= 0)
+            close(vp->fd);
+        for (int d = 0; d < 2; d++) {
+            if (vp->kickfd[d] >= 0)
+                close(vp->kickfd[d]);
+            if (vp->callfd[d] >= 0)
+                close(vp->callfd[d]);
+        }
+    }
+    if (v->wakefd >= 0)
+        close(v->wakefd);
+    pthread_mutex_destroy(&v->lock);
+    free(v);
+}
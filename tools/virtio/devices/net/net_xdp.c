@@ -0,0 +1,510 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "virtio_net.h"
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/rtnetlink.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * AF_XDP backend
+ * --------------
+ * The device is attached to one queue of a host interface through an AF_XDP
+ * socket. The socket owns a UMEM, a region of the daemon split in frames,
+ * and four rings shared with the kernel: the fill ring gives free frames to
+ * the kernel for RX, the RX ring returns them holding frames, the TX ring
+ * passes frames to send and the completion ring returns them once sent.
+ *
+ * A small XDP program, loaded through bpf() so that no libbpf is needed,
+ * redirects every frame of the bound queue to the socket. Frames of other
+ * queues go to the host stack. The program is attached in native mode when
+ * the driver supports it and in generic (skb) mode otherwise, and detached
+ * on close. An interface that already has an XDP program is refused.
+ *
+ * recv() copies a frame out of its UMEM frame straight into the guest
+ * buffers and gives the frame back on the fill ring. send() copies the
+ * guest buffers into a free UMEM frame and flush() wakes the kernel once
+ * per batch. With a busy-poll budget the socket polls the device queue
+ * instead of waiting for its interrupt.
+ *
+ * Frames carry no offloads, the virtio-net header is zeroed on RX and
+ * dropped on TX.
+ */
+
+#define XDP_FRAME_SIZE 4096
+// Entries of the fill and RX rings, and of the TX and completion rings.
+// There are as many RX frames as fill ring entries and as many TX frames as
+// TX ring entries, so no ring can overflow. The RX frames absorb bursts
+// while the guest is short of buffers, frames are dropped beyond that.
+#define XDP_RX_RING_SIZE 4096
+#define XDP_TX_RING_SIZE 1024
+#define XDP_RX_FRAMES XDP_RX_RING_SIZE
+#define XDP_TX_FRAMES XDP_TX_RING_SIZE
+#define XDP_NUM_FRAMES (XDP_RX_FRAMES + XDP_TX_FRAMES)
+// Bounds the sendto() calls of one flush.
+#define XDP_TX_KICKS 64
+// Frames handled per busy-poll round.
+#define XDP_BUSY_POLL_BUDGET 64
+
+// Producer/consumer ring mapped from the socket.
+struct xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *desc;
+    uint32_t mask;
+    void *map;
+    size_t map_len;
+};
+
+typedef struct net_xdp {
+    NetBackend be; // Must stay first
+    size_t hdr_len;
+    int ifindex;
+    uint32_t queue_id;
+    bool need_wakeup;   // Bound with XDP_USE_NEED_WAKEUP
+    bool busy_poll;     // SO_BUSY_POLL is set
+    uint32_t xdp_flags; // Mode the program is attached in, 0 if detached
+    int map_fd;
+    int prog_fd;
+    uint8_t *umem;
+    struct xdp_ring fill, comp, rx, tx;
+    uint64_t tx_free[XDP_TX_FRAMES]; // Stack of free TX frames
+    unsigned int tx_nfree;
+    unsigned int tx_queued;
+    struct iovec tx_iov[NET_IOV_MAX];
+} NetXdp;
+
+static inline uint32_t ring_load(const uint32_t *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void ring_store(uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static ssize_t net_xdp_recv(NetBackend *be, const struct iovec *iov,
+                            int cnt) {
+    NetXdp *xs = (NetXdp *)be;
+    static const uint8_t zero_hdr[sizeof(NetHdr)];
+    uint32_t cons = *xs->rx.consumer;
+
+    if (ring_load(xs->rx.producer) == cons && xs->busy_poll) {
+        // Let the kernel poll the device queue for us.
+        recvfrom(be->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+    if (ring_load(xs->rx.producer) == cons) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    struct xdp_desc *d = &((struct xdp_desc *)xs->rx.desc)[cons & xs->rx.mask];
+    struct iovec src[2] = {
+        {(void *)zero_hdr, xs->hdr_len},
+        {xs->umem + d->addr, d->len},
+    };
+    ssize_t len = net_iov_copy(iov, cnt, 0, src, 2, 0, xs->hdr_len + d->len);
+
+    // Hand the frame back to the kernel. Fill ring entries are frame
+    // addresses, the headroom the kernel put in front is dropped.
+    uint32_t prod = *xs->fill.producer;
+    ((uint64_t *)xs->fill.desc)[prod & xs->fill.mask] =
+        d->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    ring_store(xs->fill.producer, prod + 1);
+    ring_store(xs->rx.consumer, cons + 1);
+    return len;
+}
+
+// Take back the TX frames the kernel is done with.
+static void net_xdp_complete(NetXdp *xs) {
+    uint32_t cons = *xs->comp.consumer, prod = ring_load(xs->comp.producer);
+
+    for (; cons != prod; cons++)
+        xs->tx_free[xs->tx_nfree++] =
+            ((uint64_t *)xs->comp.desc)[cons & xs->comp.mask];
+    ring_store(xs->comp.consumer, cons);
+}
+
+static void net_xdp_flush(NetBackend *be) {
+    NetXdp *xs = (NetXdp *)be;
+    int kicks = 0, ret = 0;
+
+    if (!xs->tx_queued)
+        return;
+    xs->tx_queued = 0;
+    // In copy mode each sendto() sends a bounded batch and fails with EAGAIN
+    // while frames are left on the TX ring.
+    do {
+        if (xs->need_wakeup &&
+            !(ring_load(xs->tx.flags) & XDP_RING_NEED_WAKEUP))
+            break;
+        ret = sendto(be->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    } while (ret < 0 && errno == EAGAIN &&
+             ring_load(xs->tx.consumer) != *xs->tx.producer &&
+             ++kicks < XDP_TX_KICKS);
+    if (ret < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS &&
+        errno != ENETDOWN)
+        log_error("virtio net xdp: TX kick failed, errno %d", errno);
+    net_xdp_complete(xs);
+}
+
+static ssize_t net_xdp_send(NetBackend *be, const struct iovec *iov,
+                            int cnt) {
+    NetXdp *xs = (NetXdp *)be;
+    size_t len;
+    // Drop the virtio-net header.
+    int n = net_iov_skip(xs->tx_iov, iov, cnt, xs->hdr_len, &len);
+    if (len > XDP_FRAME_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (!xs->tx_nfree) {
+        // All frames are in flight: kick the kernel and reclaim.
+        xs->tx_queued = 0;
+        sendto(be->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        net_xdp_complete(xs);
+        if (!xs->tx_nfree) {
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    uint64_t addr = xs->tx_free[--xs->tx_nfree];
+    uint8_t *data = xs->umem + addr;
+    for (int i = 0; i < n; i++) {
+        memcpy(data, xs->tx_iov[i].iov_base, xs->tx_iov[i].iov_len);
+        data += xs->tx_iov[i].iov_len;
+    }
+    // A free frame means a free TX ring entry, see XDP_TX_RING_SIZE.
+    uint32_t prod = *xs->tx.producer;
+    struct xdp_desc *d = &((struct xdp_desc *)xs->tx.desc)[prod & xs->tx.mask];
+    d->addr = addr;
+    d->len = len;
+    d->options = 0;
+    ring_store(xs->tx.producer, prod + 1);
+    xs->tx_queued++;
+    return len + xs->hdr_len;
+}
+
+static int net_xdp_set_features(NetBackend *be, size_t hdr_len,
+                                uint64_t features) {
+    (void)features;
+    ((NetXdp *)be)->hdr_len = hdr_len;
+    return 0;
+}
+
+static int xdp_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// Append attribute type to the nested attribute nest.
+static void nl_put(struct rtattr *nest, int type, const void *data, int len) {
+    struct rtattr *rta = (void *)((uint8_t *)nest + RTA_ALIGN(nest->rta_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nest->rta_len = RTA_ALIGN(nest->rta_len) + RTA_ALIGN(rta->rta_len);
+}
+
+// Attach program prog_fd to ifindex, or detach it with prog_fd -1.
+static int xdp_link_set(int ifindex, int prog_fd, uint32_t flags) {
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        uint8_t attrs[64];
+    } req = {0};
+    struct {
+        struct nlmsghdr nh;
+        struct nlmsgerr err;
+    } ack;
+    int ret = -EIO;
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+        return -errno;
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifindex;
+    struct rtattr *xdp =
+        (void *)((uint8_t *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    xdp->rta_type = IFLA_XDP | NLA_F_NESTED;
+    xdp->rta_len = RTA_LENGTH(0);
+    nl_put(xdp, IFLA_XDP_FD, &prog_fd, sizeof(prog_fd));
+    nl_put(xdp, IFLA_XDP_FLAGS, &flags, sizeof(flags));
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + xdp->rta_len;
+
+    if (send(fd, &req, req.nh.nlmsg_len, 0) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    ssize_t n = recv(fd, &ack, sizeof(ack), 0);
+    if (n >= (ssize_t)sizeof(ack) && ack.nh.nlmsg_type == NLMSG_ERROR)
+        ret = ack.err.error;
+out:
+    close(fd);
+    return ret;
+}
+
+// Load the program redirecting the frames of each queue to the socket
+// stored at that index of the XSKMAP, or to the host stack if there is none.
+static int xdp_load_prog(NetXdp *xs) {
+    union bpf_attr attr = {0};
+    char license[] = "GPL";
+
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = xs->queue_id + 1;
+    xs->map_fd = xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (xs->map_fd < 0)
+        return -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xs->map_fd;
+    attr.key = (uint64_t)(uintptr_t)&xs->queue_id;
+    attr.value = (uint64_t)(uintptr_t)&xs->be.fd;
+    if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+        return -1;
+
+    // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+    struct bpf_insn prog[] = {
+        {.code = BPF_LDX | BPF_MEM | BPF_W,
+         .dst_reg = BPF_REG_2,
+         .src_reg = BPF_REG_1,
+         .off = offsetof(struct xdp_md, rx_queue_index)},
+        {.code = BPF_LD | BPF_DW | BPF_IMM,
+         .dst_reg = BPF_REG_1,
+         .src_reg = BPF_PSEUDO_MAP_FD,
+         .imm = xs->map_fd},
+        {0},
+        {.code = BPF_ALU64 | BPF_MOV | BPF_K,
+         .dst_reg = BPF_REG_3,
+         .imm = XDP_PASS},
+        {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map},
+        {.code = BPF_JMP | BPF_EXIT},
+    };
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)license;
+    xs->prog_fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+    return xs->prog_fd < 0 ? -1 : 0;
+}
+
+static int xdp_ring_map(int fd, struct xdp_ring *r,
+                        const struct xdp_ring_offset *off, uint32_t size,
+                        size_t desc_size, off_t pgoff) {
+    r->map_len = off->desc + size * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (void *)((uint8_t *)r->map + off->producer);
+    r->consumer = (void *)((uint8_t *)r->map + off->consumer);
+    r->flags = (void *)((uint8_t *)r->map + off->flags);
+    r->desc = (uint8_t *)r->map + off->desc;
+    r->mask = size - 1;
+    return 0;
+}
+
+static void net_xdp_close(NetBackend *be) {
+    NetXdp *xs = (NetXdp *)be;
+    struct xdp_ring *rings[] = {&xs->fill, &xs->comp, &xs->rx, &xs->tx};
+
+    if (xs->xdp_flags)
+        xdp_link_set(xs->ifindex, -1, xs->xdp_flags);
+    if (xs->prog_fd >= 0)
+        close(xs->prog_fd);
+    if (xs->map_fd >= 0)
+        close(xs->map_fd);
+    for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++)
+        if (rings[i]->map)
+            munmap(rings[i]->map, rings[i]->map_len);
+    if (be->fd >= 0)
+        close(be->fd);
+    if (xs->umem)
+        munmap(xs->umem, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE);
+    free(xs);
+}
+
+static const struct net_backend_ops net_xdp_ops = {
+    .name = "xdp",
+    .recv = net_xdp_recv,
+    .send = net_xdp_send,
+    .flush = net_xdp_flush,
+    .set_features = net_xdp_set_features,
+    .close = net_xdp_close,
+};
+
+NetBackend *net_xdp_open(const char *ifname, uint32_t queue_id,
+                         uint32_t busy_poll_us) {
+    int rx_size = XDP_RX_RING_SIZE, tx_size = XDP_TX_RING_SIZE;
+    unsigned int ifindex = if_nametoindex(ifname);
+
+    if (!ifindex) {
+        log_error("virtio net xdp: no interface %s", ifname);
+        return NULL;
+    }
+    // The kernel puts XDP_PACKET_HEADROOM in front of every RX frame.
+    if (net_if_mtu(ifname) + ETH_HLEN + 4 >
+        XDP_FRAME_SIZE - XDP_PACKET_HEADROOM) {
+        log_error("virtio net xdp: MTU of %s does not fit a UMEM frame",
+                  ifname);
+        return NULL;
+    }
+    NetXdp *xs = calloc(1, sizeof(*xs));
+    if (!xs)
+        return NULL;
+    xs->be.ops = &net_xdp_ops;
+    xs->hdr_len = sizeof(NetHdr);
+    xs->ifindex = ifindex;
+    xs->queue_id = queue_id;
+    xs->map_fd = xs->prog_fd = -1;
+    xs->be.fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xs->be.fd < 0) {
+        log_error("virtio net xdp: socket failed, errno %d", errno);
+        goto err;
+    }
+
+    xs->umem = mmap(NULL, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xs->umem == MAP_FAILED) {
+        xs->umem = NULL;
+        log_error("virtio net xdp: cannot allocate UMEM");
+        goto err;
+    }
+    struct xdp_umem_reg mr = {
+        .addr = (uint64_t)(uintptr_t)xs->umem,
+        .len = (uint64_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE,
+        .chunk_size = XDP_FRAME_SIZE,
+    };
+    if (setsockopt(xs->be.fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0 ||
+        setsockopt(xs->be.fd, SOL_XDP, XDP_UMEM_FILL_RING, &rx_size,
+                   sizeof(rx_size)) < 0 ||
+        setsockopt(xs->be.fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &tx_size,
+                   sizeof(tx_size)) < 0 ||
+        setsockopt(xs->be.fd, SOL_XDP, XDP_RX_RING, &rx_size,
+                   sizeof(rx_size)) < 0 ||
+        setsockopt(xs->be.fd, SOL_XDP, XDP_TX_RING, &tx_size,
+                   sizeof(tx_size)) < 0) {
+        log_error("virtio net xdp: cannot set up UMEM, errno %d", errno);
+        goto err;
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(xs->be.fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0 ||
+        optlen != sizeof(off)) {
+        // The ring flags came with kernel 5.4.
+        log_error("virtio net xdp: kernel has no ring flags");
+        goto err;
+    }
+    if (xdp_ring_map(xs->be.fd, &xs->fill, &off.fr, rx_size,
+                     sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        xdp_ring_map(xs->be.fd, &xs->comp, &off.cr, tx_size,
+                     sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        xdp_ring_map(xs->be.fd, &xs->rx, &off.rx, rx_size,
+                     sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        xdp_ring_map(xs->be.fd, &xs->tx, &off.tx, tx_size,
+                     sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0) {
+        log_error("virtio net xdp: cannot map rings, errno %d", errno);
+        goto err;
+    }
+
+    // The first frames are for RX and all go to the fill ring, the others
+    // are for TX.
+    for (uint32_t i = 0; i < XDP_RX_FRAMES; i++)
+        ((uint64_t *)xs->fill.desc)[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    ring_store(xs->fill.producer, XDP_RX_FRAMES);
+    for (uint32_t i = 0; i < XDP_TX_FRAMES; i++)
+        xs->tx_free[xs->tx_nfree++] =
+            (uint64_t)(XDP_RX_FRAMES + i) * XDP_FRAME_SIZE;
+
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = queue_id,
+        .sxdp_flags = XDP_USE_NEED_WAKEUP,
+    };
+    xs->need_wakeup = true;
+    if (bind(xs->be.fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        sxdp.sxdp_flags = 0;
+        xs->need_wakeup = false;
+        if (bind(xs->be.fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+            log_error("virtio net xdp: cannot bind to %s queue %u, errno %d",
+                      ifname, queue_id, errno);
+            goto err;
+        }
+    }
+
+    if (busy_poll_us) {
+        int one = 1, budget = XDP_BUSY_POLL_BUDGET, usecs = busy_poll_us;
+        // SO_PREFER_BUSY_POLL and SO_BUSY_POLL_BUDGET came with kernel
+        // 5.11, busy polling works without them.
+        setsockopt(xs->be.fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+                   sizeof(one));
+        setsockopt(xs->be.fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget,
+                   sizeof(budget));
+        if (setsockopt(xs->be.fd, SOL_SOCKET, SO_BUSY_POLL, &usecs,
+                       sizeof(usecs)) < 0)
+            log_warn("virtio net xdp: busy polling not supported, errno %d",
+                     errno);
+        else
+            xs->busy_poll = true;
+    }
+
+    if (xdp_load_prog(xs) < 0) {
+        log_error("virtio net xdp: cannot load XDP program, errno %d", errno);
+        goto err;
+    }
+    int ret = xdp_link_set(ifindex, xs->prog_fd,
+                           XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_DRV_MODE);
+    xs->xdp_flags = XDP_FLAGS_DRV_MODE;
+    if (ret < 0 && ret != -EBUSY && ret != -EEXIST) {
+        ret = xdp_link_set(ifindex, xs->prog_fd,
+                           XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_SKB_MODE);
+        xs->xdp_flags = XDP_FLAGS_SKB_MODE;
+    }
+    if (ret < 0) {
+        xs->xdp_flags = 0;
+        log_error("virtio net xdp: cannot attach XDP program to %s, %s",
+                  ifname, strerror(-ret));
+        goto err;
+    }
+
+    log_info("virtio net xdp: attached to %s queue %u in %s mode", ifname,
+             queue_id,
+             xs->xdp_flags == XDP_FLAGS_DRV_MODE ? "native" : "generic");
+    return &xs->be;
+err:
+    net_xdp_close(&xs->be);
+    return NULL;
+}
@@ -8,6 +8,7 @@
  * Authors:
  *      Guowei Li <2401213322@stu.pku.edu.cn>
  */
+#define _GNU_SOURCE
 #include "virtio_net.h"
 #include "event_monitor.h"
 #include "json_parse.h"
@@ -16,173 +17,724 @@
 #include "virtio.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <linux/if_tun.h>
 #include <net/if.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-static NetDev *init_net_dev(const uint8_t mac[]) {
-    NetDev *dev = malloc(sizeof(NetDev));
+/*
+ * Threading model
+ * ===============
+ *
+ * Every RX/TX queue pair owns a backend, one queue of the tap device
+ * (IFF_MULTI_QUEUE when there is more than one pair), an AF_PACKET socket
+ * (see net_packet.c), an AF_XDP socket (see net_xdp.c) or a port of the
+ * in-daemon switch (see net_switch.c), and two worker threads. The RX worker
+ * polls the backend and fills the pair's RX virtqueue. Frames from other
+ * switch ports are written to the RX virtqueue by the thread that forwards
+ * them. The TX worker drains the TX virtqueue into the backend, the TX
+ * notification only wakes it, so a slow backend never holds up the MMIO
+ * dispatcher thread and the register accesses of other devices. Control
+ * queue notifications are handled on the MMIO dispatcher thread. The kernel
+ * spreads flows over the attached tap queues, so a multi-vCPU guest receives
+ * on several cores.
+ *
+ * When the RX virtqueue runs out of buffers the RX worker stops polling the
+ * tap and waits for the RX notification, so packets queue up in the kernel
+ * rather than being dropped. With tx_busy_poll the TX worker keeps polling
+ * an empty TX virtqueue for a while before it asks for the next
+ * notification, which saves the guest the notification exits under steady
+ * traffic. With rx_busy_poll the RX worker, optionally pinned to its own
+ * core, likewise keeps polling the backend and a starved RX virtqueue for a
+ * while after each frame instead of sleeping, which takes the wakeup out of
+ * the receive latency.
+ *
+ * The optional rate limits are token buckets shared by the pairs of a
+ * device. Over its TX limit, the TX worker leaves requests in the TX queue
+ * and sleeps until the bucket refills, so the guest sees backpressure rather
+ * than loss. Over its RX limit, the RX worker leaves frames in the tap the
+ * same way; only the in-daemon switch, which cannot hold a frame back, drops
+ * frames for a port over its limit.
+ *
+ * Each worker holds a lock of its queue while it touches its virtqueue, so
+ * reset only has to take the locks to clear rx_ready and tx_ready and know
+ * that the workers keep off the queues until the driver sets them up again.
+ *
+ * With vhost, there are no workers: the kernel moves the frames between the
+ * tap and the rings, and the daemon only forwards notifications and
+ * interrupts, see net_vhost.c.
+ */
+
+// Drivers without VIRTIO_NET_F_CTRL_RX never set a filter, so every frame
+// is accepted until one is set.
+static void net_rx_filter_reset(struct net_rx_filter *f) {
+    memset(f, 0, sizeof(*f));
+    f->promisc = true;
+}
+
+static NetDev *init_net_dev(const uint8_t mac[], int queue_pairs) {
+    NetDev *dev = calloc(1, sizeof(NetDev));
+    if (!dev)
+        return NULL;
     memcpy(dev->config.mac, mac, sizeof(dev->config.mac));
+    memcpy(dev->mac, mac, sizeof(dev->mac));
+    net_rx_filter_reset(&dev->rx_filter);
     dev->config.status = VIRTIO_NET_S_LINK_UP;
-    dev->tapfd = -1;
-    dev->rx_ready = 0;
-    dev->event = NULL;
-    dev->in_iov = NULL;
-    dev->out_iov = NULL;
+    dev->config.max_virtqueue_pairs = queue_pairs;
+    dev->num_pairs = queue_pairs;
+    dev->active_pairs = 1;
+    for (int i = 0; i < NET_MAX_QUEUE_PAIRS; i++) {
+        dev->queues[i].net = dev;
+        dev->queues[i].idx = i;
+        dev->queues[i].kickfd = -1;
+        dev->queues[i].tx_kickfd = -1;
+        pthread_mutex_init(&dev->queues[i].lock, NULL);
+        pthread_mutex_init(&dev->queues[i].tx_lock, NULL);
+    }
     return dev;
 }
 
+/*
+ * Tap backend: one queue of a tap device, which passes the virtio-net header
+ * through in both directions.
+ */
+
+static ssize_t net_tap_recv(NetBackend *be, const struct iovec *iov,
+                            int cnt) {
+    return readv(be->fd, iov, cnt);
+}
+
+static ssize_t net_tap_send(NetBackend *be, const struct iovec *iov,
+                            int cnt) {
+    return writev(be->fd, iov, cnt);
+}
+
+// Map the negotiated guest offloads to the TUN_F_* flags telling the tap
+// which partial checksums and GSO frames it may hand us for the guest.
+static unsigned int net_tap_offloads(uint64_t features) {
+    unsigned int offloads = 0;
+
+    // The driver must not negotiate GUEST_TSO* or GUEST_UFO without
+    // GUEST_CSUM, and the tap refuses them without TUN_F_CSUM too.
+    if (!(features & (1ULL << VIRTIO_NET_F_GUEST_CSUM)))
+        return 0;
+    offloads |= TUN_F_CSUM;
+    if (features & (1ULL << VIRTIO_NET_F_GUEST_TSO4))
+        offloads |= TUN_F_TSO4;
+    if (features & (1ULL << VIRTIO_NET_F_GUEST_TSO6))
+        offloads |= TUN_F_TSO6;
+    if (features & (1ULL << VIRTIO_NET_F_GUEST_UFO))
+        offloads |= TUN_F_UFO;
+    return offloads;
+}
+
+static int net_tap_set_features(NetBackend *be, size_t hdr_len,
+                                uint64_t features) {
+    int hdr_sz = (int)hdr_len;
+    unsigned int offloads = net_tap_offloads(features);
+
+    if (ioctl(be->fd, TUNSETVNETHDRSZ, &hdr_sz) < 0) {
+        log_error("TUNSETVNETHDRSZ(%d) failed", hdr_sz);
+        return -1;
+    }
+    if (ioctl(be->fd, TUNSETOFFLOAD, offloads) < 0) {
+        log_error("TUNSETOFFLOAD(%#x) failed, errno %d", offloads, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// Attach or detach a queue of a multi-queue tap, so that the kernel only
+// steers packets to pairs the driver uses.
+static int net_tap_enable(NetBackend *be, bool enable) {
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = enable ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+    return ioctl(be->fd, TUNSETQUEUE, &ifr);
+}
+
+static void net_tap_close(NetBackend *be) {
+    close(be->fd);
+    free(be);
+}
+
+static const struct net_backend_ops net_tap_ops = {
+    .name = "tap",
+    .recv = net_tap_recv,
+    .send = net_tap_send,
+    .set_features = net_tap_set_features,
+    .enable = net_tap_enable,
+    .close = net_tap_close,
+};
+
+// Find the offload features the tap can deliver to the guest. Older
+// kernels refuse TUN_F_UFO, and without TUN_F_CSUM there is no offload at
+// all.
+static uint64_t net_tap_probe_offloads(int tapfd) {
+    uint64_t features = NET_OFFLOAD_FEATURES;
+
+    if (ioctl(tapfd, TUNSETOFFLOAD,
+              TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_UFO) == 0)
+        goto out;
+    features &= ~NET_UFO_FEATURES;
+    log_warn("virtio net: tap does not support UFO");
+    if (ioctl(tapfd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) == 0)
+        goto out;
+    features = 0;
+    log_warn("virtio net: tap does not support offloads");
+out:
+    // Nothing is offloaded until the driver negotiates it.
+    ioctl(tapfd, TUNSETOFFLOAD, 0);
+    return features;
+}
+
 // open tap device
-static int open_tap(const char *devname) {
+NetBackend *net_tap_open(const char *devname, bool multi_queue) {
     log_info("virtio net tap open");
     int tunfd;
     struct ifreq ifr;
     tunfd = open("/dev/net/tun", O_RDWR);
     if (tunfd < 0) {
         log_error("Failed to open tap device");
-        return -1;
+        return NULL;
     }
     memset(&ifr, 0, sizeof(ifr));
     // IFF_NO_PI tells kernel do not provide message header
     // IFF_VNET_HDR enables virtio-net header passthrough with TAP
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    // Each open of a multi-queue tap adds a queue to it.
+    if (multi_queue)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
     strncpy(ifr.ifr_name, devname, IFNAMSIZ);
     ifr.ifr_name[IFNAMSIZ - 1] = '\0';
     if (ioctl(tunfd, TUNSETIFF, (void *)&ifr) < 0) {
         log_error("open of tap device %s fail", devname);
         close(tunfd);
-        return -1;
+        return NULL;
+    }
+    // set tap device O_NONBLOCK. If io operation like readv blocks, then
+    // return errno EWOULDBLOCK
+    if (set_nonblocking(tunfd) < 0) {
+        log_error("failed to set tap nonblocking");
+        close(tunfd);
+        return NULL;
     }
+    NetBackend *be = calloc(1, sizeof(*be));
+    if (!be) {
+        close(tunfd);
+        return NULL;
+    }
+    be->ops = &net_tap_ops;
+    be->fd = tunfd;
+    be->features = net_tap_probe_offloads(tunfd);
     log_info("open virtio net tap succeed");
-    return tunfd;
+    return be;
+}
+
+static int net_enable_queue(NetQueue *q, bool enable) {
+    if (q->net->num_pairs == 1 || q->enabled == enable)
+        return 0;
+    if (!q->be->ops->enable || q->be->ops->enable(q->be, enable) < 0) {
+        log_error("virtio net: %s %s queue %d failed, errno %d",
+                  enable ? "attach" : "detach", q->be->ops->name, q->idx,
+                  errno);
+        return -1;
+    }
+    q->enabled = enable;
+    return 0;
+}
+
+static int net_set_queue_pairs(NetDev *net, int pairs) {
+    int ret = 0;
+
+    for (int i = 0; i < net->num_pairs; i++)
+        if (net_enable_queue(&net->queues[i], i < pairs) != 0)
+            ret = -1;
+    net->active_pairs = pairs;
+    log_info("virtio net: %d of %d queue pairs active", pairs, net->num_pairs);
+    return ret;
 }
 
-/// When driver notifies rxq, it means the rx process can now begin
+static inline NetQueue *net_queue_of(VirtIODevice *vdev, VirtQueue *vq) {
+    return &((NetDev *)vdev->dev)->queues[vq->vq_idx / 2];
+}
+
+static void net_queue_kick_fd(NetQueue *q, int fd) {
+    uint64_t val = 1;
+    if (write(fd, &val, sizeof(val)) < 0)
+        log_error("failed to wake net queue %d", q->idx);
+}
+
+static void net_queue_kick(NetQueue *q) { net_queue_kick_fd(q, q->kickfd); }
+
+/// When driver notifies rxq, it means the rx process can now begin, or that
+/// the worker waiting for buffers can go on.
 static int virtio_net_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     log_debug("virtio_net_rxq_notify_handler");
-    NetDev *net = vdev->dev;
-    if (net->rx_ready <= 0) {
-        net->rx_ready = 1;
-        // When buffers are all used, virtio_net_event_handler will notify the
-        // driver.
-        virtqueue_disable_notify(vq);
-    }
+    NetQueue *q = net_queue_of(vdev, vq);
+    q->rx_ready = 1;
+    // The worker asks for the next notification when it runs out of
+    // buffers again.
+    virtqueue_disable_notify(vq);
+    net_queue_kick(q);
     return 0;
 }
 size_t get_nethdr_size(VirtIODevice *vdev) {
     // Virtio 1.0 specifies the header as NetHdr. But the legacy version
-    // specifies the headr as NetHdrLegacy
-    if (vdev->regs.drv_feature & (1ULL << VIRTIO_F_VERSION_1)) {
+    // specifies the headr as NetHdrLegacy, unless mergeable RX buffers add
+    // num_buffers to it.
+    if (vdev->regs.drv_feature &
+        ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MRG_RXBUF))) {
         return sizeof(NetHdr);
     } else {
         return sizeof(NetHdrLegacy);
     }
 }
 
-/// Called when tap device received packets
-static void virtio_net_event_handler(int fd, int epoll_type, void *param) {
-    log_debug("virtio_net_event_handler");
-    VirtIODevice *vdev = param;
-    NetDev *net = vdev->dev;
-    VirtQueue *vq = &vdev->vqs[NET_QUEUE_RX];
-    ssize_t len;
-    if (fd != net->tapfd || !(epoll_type & EPOLLIN)) {
-        log_error("invalid event");
-        return;
+// Whether the driver wants frames to dst, called with a queue lock held.
+static bool net_rx_filter_accept(NetDev *net, const uint8_t *dst) {
+    static const uint8_t bcast[ETH_ALEN] = {0xff, 0xff, 0xff,
+                                            0xff, 0xff, 0xff};
+    const struct net_rx_filter *f = &net->rx_filter;
+    int first = 0, last = f->uni_count;
+
+    if (f->promisc)
+        return true;
+    if (dst[0] & 1) {
+        if (memcmp(dst, bcast, ETH_ALEN) == 0)
+            return !f->nobcast;
+        if (f->nomulti)
+            return false;
+        if (f->allmulti || f->multi_overflow)
+            return true;
+        first = f->uni_count;
+        last = f->count;
+    } else {
+        if (f->nouni)
+            return false;
+        if (f->alluni || f->uni_overflow ||
+            memcmp(dst, net->config.mac, ETH_ALEN) == 0)
+            return true;
     }
-    if (net->tapfd == -1 || vdev->type != VirtioTNet) {
-        log_error("net rx callback should not be called");
-        return;
+    for (int i = first; i < last; i++)
+        if (memcmp(dst, f->macs[i], ETH_ALEN) == 0)
+            return true;
+    return false;
+}
+
+size_t net_iov_copy(const struct iovec *dst, int dcnt, size_t doff,
+                    const struct iovec *src, int scnt, size_t soff,
+                    size_t len) {
+    size_t done = 0;
+    int d = 0, s = 0;
+
+    for (; d < dcnt && doff >= dst[d].iov_len; d++)
+        doff -= dst[d].iov_len;
+    for (; s < scnt && soff >= src[s].iov_len; s++)
+        soff -= src[s].iov_len;
+    while (d < dcnt && s < scnt && done < len) {
+        size_t chunk = MIN(dst[d].iov_len - doff, src[s].iov_len - soff);
+        chunk = MIN(chunk, len - done);
+        memcpy((uint8_t *)dst[d].iov_base + doff,
+               (const uint8_t *)src[s].iov_base + soff, chunk);
+        done += chunk;
+        doff += chunk;
+        soff += chunk;
+        if (doff == dst[d].iov_len) {
+            d++;
+            doff = 0;
+        }
+        if (soff == src[s].iov_len) {
+            s++;
+            soff = 0;
+        }
     }
+    return done;
+}
 
-    // if vq is not setup, drop the packet
-    uint8_t trashbuf[1600];
-    if (!net->rx_ready) {
-        read(net->tapfd, trashbuf, sizeof(trashbuf));
-        return;
+int net_iov_skip(struct iovec *dst, const struct iovec *src, int cnt,
+                 size_t skip, size_t *len) {
+    int n = 0;
+
+    *len = 0;
+    for (int i = 0; i < cnt; i++) {
+        if (skip >= src[i].iov_len) {
+            skip -= src[i].iov_len;
+            continue;
+        }
+        dst[n].iov_base = (uint8_t *)src[i].iov_base + skip;
+        dst[n].iov_len = src[i].iov_len - skip;
+        *len += dst[n++].iov_len;
+        skip = 0;
     }
-    // if rx_vq is empty, drop the packet
-    if (virtqueue_is_empty(vq)) {
-        read(net->tapfd, trashbuf, sizeof(trashbuf));
-        virtio_inject_irq(vq);
+    return n;
+}
+
+size_t net_iov_size(const struct iovec *iov, int cnt) {
+    size_t len = 0;
+
+    for (int i = 0; i < cnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+// Destination address of the frame received into iov, after a virtio-net
+// header of hdr_len bytes.
+static bool net_rx_dst(const struct iovec *iov, size_t cnt, size_t hdr_len,
+                       uint8_t *dst) {
+    struct iovec dst_iov = {dst, ETH_ALEN};
+
+    return net_iov_copy(&dst_iov, 1, 0, iov, cnt, hdr_len, ETH_ALEN) ==
+           ETH_ALEN;
+}
+
+static inline uint64_t net_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void net_rate_init(struct net_rate *r, const struct net_rate_params *p) {
+    pthread_mutex_init(&r->lock, NULL);
+    r->bytes.rate = p->bps / 8e9;
+    r->bytes.burst = p->burst ? p->burst : p->bps / 8 / 100;
+    r->bytes.tokens = r->bytes.burst;
+    r->auto_burst = !p->burst;
+    r->pkts.rate = p->pps / 1e9;
+    r->pkts.burst = p->burst_pkts ? p->burst_pkts : MAX(p->pps / 100, 1);
+    r->pkts.tokens = r->pkts.burst;
+    r->last_ns = net_now_ns();
+}
+
+// Below 800 bps, the default burst of 10 ms of traffic is 0 bytes and the
+// bucket never lets a frame through. The default burst is therefore at least
+// the largest frame, known once the features are negotiated.
+static void net_rate_fit_frame(struct net_rate *r, size_t frame_max) {
+    if (!r->auto_burst || !r->bytes.rate)
         return;
+    pthread_mutex_lock(&r->lock);
+    r->bytes.burst = MAX(r->bytes.rate * 1e7, (double)frame_max);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static inline bool net_rate_on(const struct net_rate *r) {
+    return r->bytes.rate || r->pkts.rate;
+}
+
+static inline void net_rate_refill(struct net_rate_bucket *b, uint64_t ns) {
+    if (b->rate)
+        b->tokens = MIN(b->tokens + ns * b->rate, b->burst);
+}
+
+static inline uint64_t net_rate_bucket_wait(const struct net_rate_bucket *b) {
+    if (!b->rate || b->tokens > 0)
+        return 0;
+    return -b->tokens / b->rate + 1;
+}
+
+// Time in ns before the next frame may pass r, 0 if it may pass now.
+static uint64_t net_rate_delay(struct net_rate *r) {
+    uint64_t now, wait;
+
+    if (!net_rate_on(r))
+        return 0;
+    pthread_mutex_lock(&r->lock);
+    now = net_now_ns();
+    net_rate_refill(&r->bytes, now - r->last_ns);
+    net_rate_refill(&r->pkts, now - r->last_ns);
+    r->last_ns = now;
+    wait = MAX(net_rate_bucket_wait(&r->bytes),
+               net_rate_bucket_wait(&r->pkts));
+    if (wait)
+        r->deferred++;
+    pthread_mutex_unlock(&r->lock);
+    return wait;
+}
+
+// Account a frame of len bytes that passed r.
+static void net_rate_charge(struct net_rate *r, size_t len) {
+    if (!net_rate_on(r))
+        return;
+    pthread_mutex_lock(&r->lock);
+    if (r->bytes.rate)
+        r->bytes.tokens -= len;
+    if (r->pkts.rate)
+        r->pkts.tokens -= 1;
+    r->packets++;
+    r->octets += len;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Receive one frame from the tap. Without MRG_RXBUF it goes to a single
+ * descriptor chain. With it, avail entries are gathered until they can hold
+ * the largest frame (the tap silently truncates what does not fit), or the
+ * next frame if the backend knows its length. The frame is read across them
+ * in one readv, and the entries it did not reach are given back to the ring.
+ * The used entries are appended to indices/lens, at most NET_IOV_MAX of them.
+ * Returns 0 when a frame was received or dropped, -1 when the tap or the
+ * queue has nothing more to give, 1 when the queue holds too few buffers for
+ * the frame.
+ */
+static int virtio_net_rx_one(NetQueue *q, VirtQueue *vq, uint16_t *indices,
+                             uint32_t *lens, size_t *count) {
+    VirtIODevice *vdev = q->vdev;
+    bool mergeable =
+        vdev->regs.drv_feature & (1ULL << VIRTIO_NET_F_MRG_RXBUF);
+    size_t frame_max = q->net->rx_frame_max;
+    uint16_t heads[NET_IOV_MAX];
+    size_t caps[NET_IOV_MAX];
+    size_t chains = 0, iovs = 0, cap = 0;
+    uint16_t start = vq->last_avail_idx;
+
+    if (mergeable && q->be->ops->next_len) {
+        size_t next = q->be->ops->next_len(q->be);
+        if (next)
+            frame_max = MIN(frame_max, next);
     }
-    uint16_t batch_indices[VIRTQUEUE_NET_MAX_SIZE];
-    uint32_t batch_lens[VIRTQUEUE_NET_MAX_SIZE];
-    size_t batch_count = 0;
-    while (!virtqueue_is_empty(vq)) {
+
+    while (!virtqueue_is_empty(vq) && iovs < NET_IOV_MAX &&
+           (chains == 0 || (mergeable && cap < frame_max))) {
         struct VirtioBufConfig cfg = {
-            .in_iov = net->in_iov,
-            .max_in = NET_IOV_MAX,
+            .in_iov = q->in_iov + iovs,
+            .max_in = NET_IOV_MAX - iovs,
         };
         struct VirtioRequest req;
         uint16_t idx = vq->avail_ring->ring[vq->last_avail_idx & (vq->num - 1)];
         int n = process_descriptor_chain_buf(vq, idx, &cfg, &req);
-        if (n < 1 || n > VIRTQUEUE_NET_MAX_SIZE) {
-            log_error("process_descriptor_chain_buf failed: %d", n);
-            if (n < 1) {
-                vq->last_avail_idx++;
-            }
-            batch_indices[batch_count] = idx;
-            batch_lens[batch_count] = 0;
-            batch_count++;
+        // A chain that does not fit the remaining iovs is left for the
+        // next frame.
+        if (n < 1 && chains > 0)
             break;
+        if (n < 1 || (mergeable && chains == 0 &&
+                      req.in_iov[0].iov_len < sizeof(NetHdr))) {
+            log_error("malformed RX buffer: %d", n);
+            if (n < 1)
+                vq->last_avail_idx++;
+            indices[*count] = idx;
+            lens[(*count)++] = 0;
+            return 0;
         }
+        heads[chains] = idx;
+        caps[chains] = 0;
+        for (unsigned int i = 0; i < req.in_count; i++)
+            caps[chains] += req.in_iov[i].iov_len;
+        cap += caps[chains++];
+        iovs += req.in_count;
+    }
+    if (chains == 0)
+        return -1;
+    // Rather than truncate a large frame, wait for the driver to refill the
+    // queue, unless the frame could not fit even then.
+    if (mergeable && cap < frame_max && virtqueue_is_empty(vq) &&
+        (uint16_t)(vq->last_avail_idx - start) < vq->num) {
+        vq->last_avail_idx = start;
+        return 1;
+    }
 
-        // RX: all buffers are VRING_DESC_F_WRITE → in_iov
-        // IFF_VNET_HDR: TAP writes [virtio_net_hdr | packet] directly
-        len = readv(net->tapfd, req.in_iov, req.in_count);
-
+    // RX: all buffers are VRING_DESC_F_WRITE → in_iov
+    // IFF_VNET_HDR: TAP writes [virtio_net_hdr | packet] directly
+    ssize_t len = q->be->ops->recv(q->be, q->in_iov, iovs);
+    if (len <= 0) {
+        // Nothing was delivered, the buffers go back to the ring.
+        vq->last_avail_idx = start;
         if (len < 0 && errno == EWOULDBLOCK) {
-            // No more packets from tapfd, restore last_avail_idx.
-            log_info("no more packets");
-            vq->last_avail_idx--;
-            break;
+            // No more packets from the backend
+            return -1;
         }
-
         if (len < 0) {
             log_error("readv from tap failed, errno %d", errno);
-            batch_indices[batch_count] = idx;
-            batch_lens[batch_count] = 0;
-            batch_count++;
-            break;
+            return -1;
         }
-
         if (len == 0) {
             log_error("tap device EOF (closed or bridge down)");
-            batch_indices[batch_count] = idx;
-            batch_lens[batch_count] = 0;
-            batch_count++;
-            net->rx_ready = 0;
-            break;
+            q->rx_ready = 0;
+            return -1;
         }
+    }
+    NetDev *net = q->net;
+    size_t hdr_len = get_nethdr_size(vdev);
+    uint8_t dst[ETH_ALEN];
+    bool accept = net->rx_filter.promisc ||
+                  (net_rx_dst(q->in_iov, iovs, hdr_len, dst) &&
+                   net_rx_filter_accept(net, dst));
+    if (net->pcap)
+        net_pcap_add(net->pcap, q->idx, NET_QUEUE_RX, q->in_iov, iovs,
+                     hdr_len, len > (ssize_t)hdr_len ? len - hdr_len : 0,
+                     accept ? NET_PCAP_PASSED : NET_PCAP_DROP_FILTER);
+    // A frame the driver filtered out gives its buffers back to the ring,
+    // so it costs the guest neither descriptors nor an interrupt.
+    if (!accept) {
+        vq->last_avail_idx = start;
+        return 0;
+    }
+    net_rate_charge(&net->rx_rate, len - hdr_len);
 
-        batch_indices[batch_count] = idx;
-        batch_lens[batch_count] = len;
-        batch_count++;
+    size_t left = len;
+    uint16_t used = 0;
+    do {
+        size_t chunk = MIN(left, caps[used]);
+        indices[*count] = heads[used];
+        lens[(*count)++] = chunk;
+        left -= chunk;
+        used++;
+    } while (left > 0);
+    vq->last_avail_idx = start + used;
+    if (mergeable)
+        memcpy((uint8_t *)q->in_iov[0].iov_base +
+                   offsetof(NetHdr, num_buffers),
+               &used, sizeof(used));
+    return 0;
+}
+
+/// Called by the queue worker when its tap queue received packets, and by
+/// the in-daemon switch to deliver a frame. Returns false if the RX queue
+/// has no buffers for them. The packets then stay in the tap queue until the
+/// driver refills the RX queue and notifies it.
+bool virtio_net_event_handler(NetQueue *q) {
+    log_debug("virtio_net_event_handler");
+    VirtIODevice *vdev = q->vdev;
+    VirtQueue *vq = &vdev->vqs[2 * q->idx + NET_QUEUE_RX];
+    bool starved = false;
+    if (!q->be || vdev->type != VirtioTNet) {
+        log_error("net rx callback should not be called");
+        return true;
+    }
+
+    // if vq is not setup, wait for the driver
+    q->rx_wait = 0;
+    if (!q->rx_ready)
+        return false;
+
+    // A frame adds at most NET_IOV_MAX entries, so the batch is flushed
+    // once it holds that many.
+    uint16_t batch_indices[2 * NET_IOV_MAX];
+    uint32_t batch_lens[2 * NET_IOV_MAX];
+    size_t batch_count = 0;
+    uint16_t avail = 0;
+    int ret = -1;
+    for (;;) {
+        while (!(q->rx_wait = net_rate_delay(&q->net->rx_rate))) {
+            avail = __atomic_load_n(&vq->avail_ring->idx, __ATOMIC_ACQUIRE);
+            ret = virtio_net_rx_one(q, vq, batch_indices, batch_lens,
+                                    &batch_count);
+            if (ret != 0)
+                break;
+            if (batch_count >= NET_IOV_MAX) {
+                update_used_ring_batch(vq, batch_indices, batch_lens,
+                                       batch_count);
+                batch_count = 0;
+            }
+        }
+        // Stop on an empty backend. Otherwise the queue has no buffers, or
+        // too few for the next frame (ret > 0).
+        if (q->rx_wait || !q->rx_ready || (ret < 0 && !virtqueue_is_empty(vq)))
+            break;
+        // Ask the driver to notify us when it adds buffers, and re-check in
+        // case it did so before seeing the request.
+        virtqueue_enable_notify(vq);
+        if (__atomic_load_n(&vq->avail_ring->idx, __ATOMIC_ACQUIRE) == avail) {
+            q->rx_starved_avail = avail;
+            starved = true;
+            break;
+        }
+        virtqueue_disable_notify(vq);
     }
 
     if (batch_count > 0)
         update_used_ring_batch(vq, batch_indices, batch_lens, batch_count);
     virtio_inject_irq(vq);
+    return !starved;
+}
+
+// While busy-polling, check whether the driver refilled the RX queue the
+// worker ran out of buffers on, without waiting for its notification.
+static bool net_rx_refilled(NetQueue *q) {
+    VirtQueue *vq = &q->vdev->vqs[2 * q->idx + NET_QUEUE_RX];
+    bool refilled = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->rx_ready &&
+        __atomic_load_n(&vq->avail_ring->idx, __ATOMIC_ACQUIRE) !=
+            q->rx_starved_avail) {
+        virtqueue_disable_notify(vq);
+        refilled = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return refilled;
+}
+
+static void *virtio_net_rx_thread(void *arg) {
+    NetQueue *q = arg;
+    NetDev *net = q->net;
+    struct pollfd fds[2] = {
+        {.fd = q->kickfd, .events = POLLIN},
+        {.fd = q->be->fd, .events = POLLIN},
+    };
+    bool starved = false;
+    uint64_t wait = 0, spin_end = 0;
+
+    while (!__atomic_load_n(&net->stop, __ATOMIC_ACQUIRE)) {
+        struct timespec ts = {wait / 1000000000, wait % 1000000000};
+        // With rx_busy_poll, the worker keeps polling for rx_busy_poll us
+        // after the last frame or notification before it sleeps again. The
+        // zero wait makes ppoll() return at once.
+        bool spin = net->rx_busy_poll && !wait && net_now_ns() < spin_end;
+        if (spin && starved && net_rx_refilled(q))
+            starved = false;
+        // While the RX queue has no buffers, or the RX limit holds frames
+        // back, the tap is not polled, so that bursts wait in the tap queue
+        // instead of being dropped here.
+        fds[1].events = starved || wait ? 0 : POLLIN;
+        if (ppoll(fds, 2, spin || wait ? &ts : NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("virtio net queue %d: poll failed, errno %d", q->idx,
+                      errno);
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t val;
+            if (read(q->kickfd, &val, sizeof(val)) < 0)
+                log_debug("virtio net queue %d: empty kick", q->idx);
+            starved = false;
+        }
+        if ((fds[1].revents & POLLIN) || wait) {
+            pthread_mutex_lock(&q->lock);
+            starved = !virtio_net_event_handler(q);
+            wait = q->rx_wait;
+            pthread_mutex_unlock(&q->lock);
+        }
+        if (net->rx_busy_poll && (fds[0].revents | fds[1].revents) & POLLIN)
+            spin_end = net_now_ns() + net->rx_busy_poll * 1000ULL;
+    }
+    return NULL;
 }
 
 static void virtq_tx_handle_one_request(VirtIODevice *vdev, VirtQueue *vq,
                                         uint16_t *out_indices,
                                         uint32_t *out_lens, size_t *out_count) {
-    NetDev *net = vdev->dev;
-    if (net->tapfd == -1) {
-        log_error("tap device is invalid");
+    NetQueue *q = net_queue_of(vdev, vq);
+    if (!q->be) {
+        log_error("net backend is invalid");
         return;
     }
 
     size_t header_len = get_nethdr_size(vdev);
     struct VirtioBufConfig cfg = {
-        .out_iov = net->out_iov,
+        .out_iov = q->out_iov,
         .max_out = NET_IOV_MAX - 1,
     };
     struct VirtioRequest req;
@@ -214,38 +766,88 @@ static void virtq_tx_handle_one_request(VirtIODevice *vdev, VirtQueue *vq,
     size_t packet_len = all_len - header_len;
     log_debug("packet send: %zu bytes", packet_len);
 
-    // The mininum packet for data link layer is 64 bytes.
-    char pad[64] = {0};
-    if (packet_len < 64) {
+    // Pad runts to the minimum Ethernet frame, the FCS is added by the
+    // hardware.
+    char pad[ETH_ZLEN] = {0};
+    if (packet_len < ETH_ZLEN) {
         req.out_iov[req.out_count].iov_base = pad;
-        req.out_iov[req.out_count].iov_len = 64 - packet_len;
+        req.out_iov[req.out_count].iov_len = ETH_ZLEN - packet_len;
         req.out_count++;
     }
-    ssize_t len = writev(net->tapfd, req.out_iov, req.out_count);
+    ssize_t len = q->be->ops->send(q->be, req.out_iov, req.out_count);
     if (len < 0) {
-        log_error("write tap failed, errno %d", errno);
+        log_error("%s send failed, errno %d", q->be->ops->name, errno);
+    } else {
+        net_rate_charge(&q->net->tx_rate, packet_len);
     }
+    if (q->net->pcap)
+        net_pcap_add(q->net->pcap, q->idx, NET_QUEUE_TX, req.out_iov,
+                     req.out_count, header_len, packet_len,
+                     len < 0 ? NET_PCAP_DROP_SEND : NET_PCAP_PASSED);
     out_indices[*out_count] = idx;
     out_lens[*out_count] = (len < 0) ? 0 : all_len;
     (*out_count)++;
 }
 
-static int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
-    log_debug("virtio_net_txq_notify_handler");
-    virtqueue_disable_notify(vq);
-    uint16_t batch_indices[VIRTQUEUE_NET_MAX_SIZE];
-    uint32_t batch_lens[VIRTQUEUE_NET_MAX_SIZE];
+static inline uint64_t net_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Wait up to us microseconds for the driver to add TX requests.
+static bool net_tx_poll(VirtIODevice *vdev, VirtQueue *vq, uint32_t us) {
+    NetDev *net = vdev->dev;
+    uint64_t end = net_now_us() + us;
+
+    do {
+        if (!virtqueue_is_empty(vq))
+            return true;
+        if (__atomic_load_n(&net->stop, __ATOMIC_ACQUIRE))
+            return false;
+    } while (net_now_us() < end);
+    return false;
+}
+
+/// Send everything the driver queued, called by the TX worker with
+/// q->tx_lock held. Requests are completed by batches of NET_TX_BATCH, so
+/// the guest gets its buffers back while a long queue is still draining.
+/// Returns the time in ns to wait for the TX limit before draining the rest,
+/// 0 once the queue is empty and the notification enabled.
+static uint64_t virtio_net_tx_drain(NetQueue *q) {
+    VirtIODevice *vdev = q->vdev;
+    VirtQueue *vq = &vdev->vqs[2 * q->idx + NET_QUEUE_TX];
+    NetDev *net = vdev->dev;
+    uint16_t batch_indices[NET_TX_BATCH];
+    uint32_t batch_lens[NET_TX_BATCH];
     size_t batch_count = 0;
+    uint64_t wait = 0;
+
     for (;;) {
         while (!virtqueue_is_empty(vq)) {
-            virtq_tx_handle_one_request(vdev, vq, batch_indices, batch_lens,
-                                        &batch_count);
-        }
-        if (batch_count > 0) {
+            wait = net_rate_delay(&net->tx_rate);
+            if (!wait)
+                virtq_tx_handle_one_request(vdev, vq, batch_indices,
+                                            batch_lens, &batch_count);
+            if (!wait && batch_count < NET_TX_BATCH &&
+                !virtqueue_is_empty(vq))
+                continue;
+            if (batch_count == 0)
+                break;
+            if (q->be->ops->flush)
+                q->be->ops->flush(q->be);
             update_used_ring_batch(vq, batch_indices, batch_lens, batch_count);
             batch_count = 0;
             virtio_inject_irq(vq);
+            if (wait)
+                break;
         }
+        // Over the limit, the rest stays in the queue, and so does the
+        // notification disabled.
+        if (wait)
+            return wait;
+        if (net->tx_busy_poll && net_tx_poll(vdev, vq, net->tx_busy_poll))
+            continue;
         virtqueue_enable_notify(vq);
         // Re-check: guest may have added descriptors between our last
         // empty check and enable_notify.  Without this, UDP streams
@@ -255,62 +857,491 @@ static int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
             virtqueue_disable_notify(vq);
             continue;
         }
+        return 0;
+    }
+}
+
+static void *virtio_net_tx_thread(void *arg) {
+    NetQueue *q = arg;
+    struct pollfd pfd = {.fd = q->tx_kickfd, .events = POLLIN};
+    uint64_t wait = 0;
+
+    while (!__atomic_load_n(&q->net->stop, __ATOMIC_ACQUIRE)) {
+        // Held back by the TX limit, the queue is drained again once the
+        // bucket has refilled, without a notification.
+        struct timespec ts = {wait / 1000000000, wait % 1000000000};
+        int n = ppoll(&pfd, 1, wait ? &ts : NULL, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("virtio net queue %d: TX poll failed, errno %d", q->idx,
+                      errno);
+            break;
+        }
+        uint64_t val;
+        if (n > 0 && read(q->tx_kickfd, &val, sizeof(val)) < 0 && !wait)
+            continue;
+        pthread_mutex_lock(&q->tx_lock);
+        wait = q->tx_ready ? virtio_net_tx_drain(q) : 0;
+        pthread_mutex_unlock(&q->tx_lock);
+    }
+    return NULL;
+}
+
+/// The driver queued TX requests: wake the TX worker, which asks for the
+/// next notification once it has drained the queue.
+static int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    log_debug("virtio_net_txq_notify_handler");
+    NetQueue *q = net_queue_of(vdev, vq);
+    q->tx_ready = 1;
+    virtqueue_disable_notify(vq);
+    net_queue_kick_fd(q, q->tx_kickfd);
+    return 0;
+}
+
+/// With vhost, the kernel processes the data queues and only needs the
+/// notification.
+static int virtio_net_vhost_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    NetDev *net = vdev->dev;
+    net_vhost_kick(net->vhost, vq->vq_idx);
+    return 0;
+}
+
+// The RX workers read the filter with their queue lock held, so the
+// control queue changes it with every lock held. Switch deliveries take
+// one queue lock at a time, so the fixed order cannot deadlock.
+static void net_lock_rx_queues(NetDev *net) {
+    for (int i = 0; i < net->num_pairs; i++)
+        pthread_mutex_lock(&net->queues[i].lock);
+}
+
+static void net_unlock_rx_queues(NetDev *net) {
+    for (int i = net->num_pairs - 1; i >= 0; i--)
+        pthread_mutex_unlock(&net->queues[i].lock);
+}
+
+static uint8_t net_ctrl_rx(NetDev *net, uint8_t cmd, const uint8_t *data,
+                           size_t len) {
+    struct net_rx_filter *f = &net->rx_filter;
+    bool *mode;
+
+    if (len < 1)
+        return VIRTIO_NET_ERR;
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_RX_PROMISC:
+        mode = &f->promisc;
+        break;
+    case VIRTIO_NET_CTRL_RX_ALLMULTI:
+        mode = &f->allmulti;
         break;
+    case VIRTIO_NET_CTRL_RX_ALLUNI:
+        mode = &f->alluni;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOMULTI:
+        mode = &f->nomulti;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOUNI:
+        mode = &f->nouni;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOBCAST:
+        mode = &f->nobcast;
+        break;
+    default:
+        return VIRTIO_NET_ERR;
     }
+    net_lock_rx_queues(net);
+    *mode = data[0] != 0;
+    net_unlock_rx_queues(net);
+    return VIRTIO_NET_OK;
+}
+
+// Read one table of a VIRTIO_NET_CTRL_MAC_TABLE_SET command at *off into
+// f->macs from f->count on. Returns false if the command is too short.
+static bool net_ctrl_mac_table(struct net_rx_filter *f, const uint8_t *data,
+                               size_t len, size_t *off, bool *overflow) {
+    uint32_t entries;
+
+    if (len - *off < sizeof(entries))
+        return false;
+    memcpy(&entries, data + *off, sizeof(entries));
+    *off += sizeof(entries);
+    if ((len - *off) / ETH_ALEN < entries)
+        return false;
+    if (entries > (uint32_t)(NET_MAC_TABLE_LEN - f->count)) {
+        // Too many to filter: accept them all.
+        *overflow = true;
+    } else {
+        memcpy(f->macs[f->count], data + *off, entries * ETH_ALEN);
+        f->count += entries;
+    }
+    *off += (size_t)entries * ETH_ALEN;
+    return true;
+}
+
+static uint8_t net_ctrl_mac(NetDev *net, uint8_t cmd, const uint8_t *data,
+                            size_t len) {
+    struct net_rx_filter f;
+    size_t off = 0;
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_MAC_ADDR_SET:
+        if (len < ETH_ALEN)
+            return VIRTIO_NET_ERR;
+        net_lock_rx_queues(net);
+        memcpy(net->config.mac, data, ETH_ALEN);
+        net_unlock_rx_queues(net);
+        return VIRTIO_NET_OK;
+    case VIRTIO_NET_CTRL_MAC_TABLE_SET:
+        // The unicast table, then the multicast one.
+        memset(&f, 0, sizeof(f));
+        if (!net_ctrl_mac_table(&f, data, len, &off, &f.uni_overflow))
+            return VIRTIO_NET_ERR;
+        f.uni_count = f.count;
+        if (!net_ctrl_mac_table(&f, data, len, &off, &f.multi_overflow))
+            return VIRTIO_NET_ERR;
+        net_lock_rx_queues(net);
+        struct net_rx_filter *cur = &net->rx_filter;
+        cur->uni_overflow = f.uni_overflow;
+        cur->multi_overflow = f.multi_overflow;
+        cur->uni_count = f.uni_count;
+        cur->count = f.count;
+        memcpy(cur->macs, f.macs, sizeof(f.macs));
+        net_unlock_rx_queues(net);
+        return VIRTIO_NET_OK;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+}
+
+/*
+ * Handle one control command. data holds the command specific part of the
+ * request; the return value is the ack byte.
+ */
+static uint8_t virtio_net_ctrl(NetDev *net, uint8_t class, uint8_t cmd,
+                               const uint8_t *data, size_t len) {
+    if (class == VIRTIO_NET_CTRL_RX)
+        return net_ctrl_rx(net, cmd, data, len);
+    if (class == VIRTIO_NET_CTRL_MAC)
+        return net_ctrl_mac(net, cmd, data, len);
+    if (class == VIRTIO_NET_CTRL_MQ && cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        struct virtio_net_ctrl_mq mq;
+        if (len < sizeof(mq))
+            return VIRTIO_NET_ERR;
+        memcpy(&mq, data, sizeof(mq));
+        if (mq.virtqueue_pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+            mq.virtqueue_pairs > net->num_pairs)
+            return VIRTIO_NET_ERR;
+        return net_set_queue_pairs(net, mq.virtqueue_pairs) == 0
+                   ? VIRTIO_NET_OK
+                   : VIRTIO_NET_ERR;
+    }
+    log_warn("virtio net: unsupported control command %u.%u", class, cmd);
+    return VIRTIO_NET_ERR;
+}
+
+// Control queue: [virtio_net_ctrl_hdr | data] out, [ack] in.
+static int virtio_net_ctrlq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    log_debug("virtio_net_ctrlq_notify_handler");
+    NetDev *net = vdev->dev;
+
+    virtqueue_disable_notify(vq);
+    do {
+        while (!virtqueue_is_empty(vq)) {
+            struct VirtioBufConfig cfg = {
+                .out_iov = net->ctrl_iov,
+                .max_out = NET_CTRL_IOV_MAX - 1,
+                .in_iov = &net->ctrl_iov[NET_CTRL_IOV_MAX - 1],
+                .max_in = 1,
+            };
+            struct VirtioRequest req;
+            struct virtio_net_ctrl_hdr hdr;
+            uint16_t idx =
+                vq->avail_ring->ring[vq->last_avail_idx & (vq->num - 1)];
+            size_t len = 0;
+
+            int n = process_descriptor_chain_buf(vq, idx, &cfg, &req);
+            if (n < 1 || req.in_count != 1 || req.in_iov[0].iov_len < 1) {
+                log_error("malformed control request");
+                if (n < 1)
+                    vq->last_avail_idx++;
+                update_used_ring(vq, idx, 0);
+                continue;
+            }
+            for (unsigned int i = 0; i < req.out_count; i++) {
+                size_t chunk = MIN(req.out_iov[i].iov_len,
+                                   sizeof(net->ctrl_buf) - len);
+                memcpy(net->ctrl_buf + len, req.out_iov[i].iov_base, chunk);
+                len += chunk;
+            }
+            uint8_t *ack = req.in_iov[0].iov_base;
+            if (len < sizeof(hdr)) {
+                *ack = VIRTIO_NET_ERR;
+            } else {
+                memcpy(&hdr, net->ctrl_buf, sizeof(hdr));
+                *ack = virtio_net_ctrl(net, hdr.class, hdr.cmd,
+                                       net->ctrl_buf + sizeof(hdr),
+                                       len - sizeof(hdr));
+            }
+            update_used_ring(vq, idx, 1);
+        }
+        virtqueue_enable_notify(vq);
+    } while (!virtqueue_is_empty(vq));
+    virtio_inject_irq(vq);
     return 0;
 }
 
+int net_if_mtu(const char *ifname) {
+    struct ifreq ifr;
+    int sock, mtu = ETH_DATA_LEN;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return mtu;
+    if (ioctl(sock, SIOCGIFMTU, &ifr) == 0)
+        mtu = ifr.ifr_mtu;
+    close(sock);
+    return mtu;
+}
+
+int net_if_set_mtu(const char *ifname, int mtu) {
+    struct ifreq ifr;
+    int sock, ret;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    ifr.ifr_mtu = mtu;
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    ret = ioctl(sock, SIOCSIFMTU, &ifr);
+    close(sock);
+    return ret;
+}
+
 static void net_on_status(VirtIODevice *vdev, uint32_t status) {
     NetDev *net = vdev->dev;
+    uint64_t features = vdev->regs.drv_feature;
 
     // FEATURES_OK indicates guest has finished writing DRIVER_FEATURES.
-    // Configure TAP virtio-net header size to match the negotiated format.
+    // Configure the backend's virtio-net header size to match the
+    // negotiated format, and the offloads the guest can receive.
     if (status & VIRTIO_CONFIG_S_FEATURES_OK) {
-        int hdr_sz = (int)get_nethdr_size(vdev);
-        if (ioctl(net->tapfd, TUNSETVNETHDRSZ, &hdr_sz) < 0)
-            log_error("TUNSETVNETHDRSZ(%d) failed", hdr_sz);
+        size_t hdr_len = get_nethdr_size(vdev);
+        // Largest frame the backend may hand over, for gathering mergeable
+        // RX buffers. A host interface may carry more than the configured
+        // MTU, and the switch has no interface. A later change of the
+        // interface MTU is picked up on the next negotiation.
+        int mtu = MAX(net->config.mtu, net_if_mtu(net->ifname));
+        if (features & ((1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                        (1ULL << VIRTIO_NET_F_GUEST_TSO6) |
+                        (1ULL << VIRTIO_NET_F_GUEST_UFO)))
+            net->rx_frame_max = hdr_len + NET_RX_GSO_FRAME_MAX;
+        else
+            net->rx_frame_max = hdr_len + mtu + ETH_HLEN + 4;
+        net_rate_fit_frame(&net->rx_rate, net->rx_frame_max - hdr_len);
+        net_rate_fit_frame(&net->tx_rate,
+                           features & ((1ULL << VIRTIO_NET_F_HOST_TSO4) |
+                                       (1ULL << VIRTIO_NET_F_HOST_TSO6) |
+                                       (1ULL << VIRTIO_NET_F_HOST_UFO))
+                               ? NET_RX_GSO_FRAME_MAX
+                               : (size_t)mtu + ETH_HLEN + 4);
+        for (int i = 0; i < net->num_pairs; i++) {
+            NetBackend *be = net->queues[i].be;
+            if (be->ops->set_features(be, hdr_len, features) < 0)
+                log_error("virtio net: cannot configure %s queue %d",
+                          be->ops->name, i);
+        }
     }
+    if ((status & VIRTIO_CONFIG_S_DRIVER_OK) && net->vhost &&
+        net_vhost_start(net->vhost) < 0)
+        log_error("virtio net: vhost-net failed, the device is stalled");
+}
 
-    if (status == 0) {
-        net->rx_ready = 0;
+static int virtio_net_init_queue(VirtIODevice *vdev, NetQueue *q,
+                                 const struct virtio_net_init_params *p) {
+    NetDev *net = vdev->dev;
+
+    q->vdev = vdev;
+    if (p->packet)
+        q->be = net_packet_open(p->packet);
+    else if (p->xdp)
+        q->be = net_xdp_open(p->xdp, p->xdp_queue, p->xdp_busy_poll);
+    else if (p->sw)
+        q->be = net_switch_open(p->sw, p->uplink, q);
+    else
+        q->be = net_tap_open(p->tap, net->num_pairs > 1);
+    if (!q->be) {
+        log_error("open net backend failed");
+        return -1;
+    }
+    q->enabled = true;
+    if (net->vhost)
+        return 0;
+    q->kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->kickfd < 0) {
+        log_error("failed to create net queue eventfd");
+        return -1;
+    }
+    q->tx_kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->tx_kickfd < 0) {
+        log_error("failed to create net queue eventfd");
+        return -1;
+    }
+    q->in_iov = malloc(sizeof(struct iovec) * NET_IOV_MAX);
+    q->out_iov = malloc(sizeof(struct iovec) * NET_IOV_MAX);
+    if (!q->in_iov || !q->out_iov) {
+        log_error("failed to allocate iov buffers");
+        return -1;
     }
+    if (pthread_create(&q->tid, NULL, virtio_net_rx_thread, q) != 0) {
+        log_error("failed to create net queue worker");
+        return -1;
+    }
+    q->thread_started = true;
+    if (p->rx_busy_poll && p->rx_busy_poll_cpu >= 0) {
+        // A spinning worker should not share its core with other threads
+        // of the daemon, pair n takes the n-th CPU from rx_busy_poll_cpu.
+        int cpu = p->rx_busy_poll_cpu + q->idx;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(q->tid, sizeof(set), &set) != 0)
+            log_warn("virtio net queue %d: failed to pin RX worker to cpu %d",
+                     q->idx, cpu);
+        else
+            log_info("virtio net queue %d: RX worker pinned to cpu %d",
+                     q->idx, cpu);
+    }
+    if (pthread_create(&q->tx_tid, NULL, virtio_net_tx_thread, q) != 0) {
+        log_error("failed to create net queue TX worker");
+        return -1;
+    }
+    q->tx_thread_started = true;
+    return 0;
 }
 
-static int virtio_net_init(VirtIODevice *vdev, const char *devname) {
+static int virtio_net_init(VirtIODevice *vdev,
+                           const struct virtio_net_init_params *p) {
     log_info("virtio net init");
     NetDev *net = vdev->dev;
-    // open tap device
-    net->tapfd = open_tap(devname);
-    if (net->tapfd == -1) {
-        log_error("open tap device failed");
+
+    // The queue layout depends on the number of pairs, so the handlers are
+    // set here rather than in virtio_net_ops.
+    uint32_t ctrl = NET_QUEUE_CTRL(net->num_pairs);
+    vdev->vqs_len = ctrl + 1;
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        VirtQueue *vq = &vdev->vqs[i];
+        if (i == ctrl)
+            vq->notify_handler = virtio_net_ctrlq_notify_handler;
+        else if (p->vhost)
+            vq->notify_handler = virtio_net_vhost_notify_handler;
+        else if (i % 2 == NET_QUEUE_RX)
+            vq->notify_handler = virtio_net_rxq_notify_handler;
+        else
+            vq->notify_handler = virtio_net_txq_notify_handler;
+    }
+    if (net->num_pairs == 1)
+        vdev->regs.dev_feature &= ~(1ULL << VIRTIO_NET_F_MQ);
+    if (!p->mtu)
+        vdev->regs.dev_feature &= ~(1ULL << VIRTIO_NET_F_MTU);
+
+    if (p->packet && net->num_pairs > 1) {
+        // Sockets of one interface all see every frame, so there is nothing
+        // to steer flows over several pairs.
+        log_error("virtio net: the packet backend has a single queue pair");
         return -1;
     }
-    // set tap device O_NONBLOCK. If io operation like readv blocks, then return
-    // errno EWOULDBLOCK
-    if (set_nonblocking(net->tapfd) < 0) {
-        log_error("failed to set tap nonblocking");
+    if ((p->xdp || p->sw) && net->num_pairs > 1) {
+        // The socket is bound to a single queue of the interface, and the
+        // switch has one port per device.
+        log_error("virtio net: the %s backend has a single queue pair",
+                  p->xdp ? "xdp" : "switch");
         return -1;
     }
-    // register an epoll read event for tap device
-    net->event = add_event(net->tapfd, EPOLLIN, virtio_net_event_handler, vdev);
-    if (net->event == NULL) {
-        log_error("Can't register net event");
+    if (p->vhost && !p->tap) {
+        log_error("virtio net: vhost needs the tap backend");
         return -1;
     }
-    net->in_iov = malloc(sizeof(struct iovec) * NET_IOV_MAX);
-    net->out_iov = malloc(sizeof(struct iovec) * NET_IOV_MAX);
-    if (!net->in_iov || !net->out_iov) {
-        log_error("failed to allocate iov buffers");
+    if (p->vhost && (p->pcap || net_rate_on(&net->tx_rate) ||
+                     net_rate_on(&net->rx_rate) || p->tx_busy_poll ||
+                     p->rx_busy_poll)) {
+        // The frames never pass through the daemon.
+        log_error("virtio net: vhost excludes pcap, rate limits and busy "
+                  "polling");
         return -1;
     }
-    return 0;
+    const char *ifname = p->packet ? p->packet : p->xdp ? p->xdp : p->tap;
+    if (p->sw)
+        ifname = p->uplink ? p->uplink : p->sw;
+    strncpy(net->ifname, ifname, sizeof(net->ifname) - 1);
+
+    if (p->pcap) {
+        net->pcap = net_pcap_open(p->pcap, net->ifname, net->num_pairs,
+                                  p->pcap_snaplen);
+        if (!net->pcap)
+            return -1;
+    }
+
+    if (p->vhost) {
+        net->vhost = net_vhost_open(vdev, net);
+        if (!net->vhost)
+            return -1;
+        // The kernel delivers every frame of the tap, so the driver filters
+        // them itself.
+        vdev->regs.dev_feature &= net_vhost_features(net->vhost) &
+                                  ~((1ULL << VIRTIO_NET_F_CTRL_RX) |
+                                    (1ULL << VIRTIO_NET_F_CTRL_RX_EXTRA));
+    }
+
+    for (int i = 0; i < net->num_pairs; i++)
+        if (virtio_net_init_queue(vdev, &net->queues[i], p) != 0)
+            return -1;
+
+    // The daemon owns the tap and the uplink of the switch, and sets their
+    // MTU. A host interface is shared, and has to carry the MTU already.
+    if (p->mtu && (p->tap || p->uplink) &&
+        net_if_set_mtu(net->ifname, p->mtu) < 0) {
+        log_error("virtio net: cannot set the MTU of %s to %u, errno %d",
+                  net->ifname, p->mtu, errno);
+        return -1;
+    }
+    if (p->mtu && (p->packet || p->xdp) &&
+        net_if_mtu(net->ifname) < (int)p->mtu) {
+        log_error("virtio net: the MTU of %s is below %u", net->ifname,
+                  p->mtu);
+        return -1;
+    }
+    net->config.mtu = p->mtu;
+
+    vdev->regs.dev_feature &=
+        ~NET_OFFLOAD_FEATURES | net->queues[0].be->features;
+    // The driver starts with one pair and enables more with
+    // VIRTIO_NET_CTRL_MQ.
+    return net_set_queue_pairs(net, 1);
 }
 
 static void virtio_net_reset(VirtIODevice *vdev) {
     if (!vdev || !vdev->dev)
         return;
     NetDev *dev = vdev->dev;
-    dev->rx_ready = false;
+    // The kernel must be off the rings before they are cleared.
+    if (dev->vhost)
+        net_vhost_stop(dev->vhost);
+    for (int i = 0; i < dev->num_pairs; i++) {
+        pthread_mutex_lock(&dev->queues[i].tx_lock);
+        dev->queues[i].tx_ready = 0;
+        pthread_mutex_unlock(&dev->queues[i].tx_lock);
+    }
+    net_lock_rx_queues(dev);
+    for (int i = 0; i < dev->num_pairs; i++)
+        dev->queues[i].rx_ready = 0;
+    net_rx_filter_reset(&dev->rx_filter);
+    memcpy(dev->config.mac, dev->mac, sizeof(dev->config.mac));
+    net_unlock_rx_queues(dev);
+    if (dev->active_pairs != 1)
+        net_set_queue_pairs(dev, 1);
 }
 
 static void virtio_net_close(VirtIODevice *vdev) {
@@ -319,12 +1350,33 @@ static void virtio_net_close(VirtIODevice *vdev) {
 
     NetDev *dev = vdev->dev;
     if (dev) {
-        if (dev->tapfd >= 0)
-            close(dev->tapfd);
-        remove_event(dev->event);
-        free(dev->event);
-        free(dev->in_iov);
-        free(dev->out_iov);
+        __atomic_store_n(&dev->stop, true, __ATOMIC_RELEASE);
+        net_vhost_close(dev->vhost);
+        for (int i = 0; i < NET_MAX_QUEUE_PAIRS; i++) {
+            NetQueue *q = &dev->queues[i];
+            if (q->thread_started) {
+                net_queue_kick(q);
+                pthread_join(q->tid, NULL);
+            }
+            if (q->tx_thread_started) {
+                net_queue_kick_fd(q, q->tx_kickfd);
+                pthread_join(q->tx_tid, NULL);
+            }
+            if (q->be)
+                q->be->ops->close(q->be);
+            if (q->kickfd >= 0)
+                close(q->kickfd);
+            if (q->tx_kickfd >= 0)
+                close(q->tx_kickfd);
+            pthread_mutex_destroy(&q->lock);
+            pthread_mutex_destroy(&q->tx_lock);
+            free(q->in_iov);
+            free(q->out_iov);
+        }
+        // The queue threads are gone, and the switch ports with them.
+        net_pcap_close(dev->pcap);
+        pthread_mutex_destroy(&dev->tx_rate.lock);
+        pthread_mutex_destroy(&dev->rx_rate.lock);
         free(dev);
         vdev->dev = NULL;
     }
@@ -333,14 +1385,62 @@ static void virtio_net_close(VirtIODevice *vdev) {
     free(vdev);
 }
 
+static int net_rate_status(struct net_rate *r, const char *dir, char *buf,
+                           size_t len) {
+    int used;
+
+    if (!net_rate_on(r))
+        return snprintf(buf, len, "%s limit: off\n", dir);
+    pthread_mutex_lock(&r->lock);
+    used = snprintf(buf, len,
+                    "%s limit: %.0f bps %.0f pps, %" PRIu64 " packets %" PRIu64
+                    " bytes, deferred %" PRIu64 " times, %" PRIu64
+                    " dropped\n",
+                    dir, r->bytes.rate * 8e9, r->pkts.rate * 1e9, r->packets,
+                    r->octets, r->deferred, r->dropped);
+    pthread_mutex_unlock(&r->lock);
+    return used;
+}
+
+static int net_ctl_status(VirtIODevice *vdev, int argc, char *argv[],
+                          char *reply, size_t len) {
+    NetDev *net = vdev->dev;
+    size_t used;
+    (void)argc;
+    (void)argv;
+
+    used = snprintf(reply, len, "backend: %s %s%s, %d of %d queue pairs\n",
+                    net->queues[0].be->ops->name, net->ifname,
+                    net->vhost ? " (vhost-net)" : "", net->active_pairs,
+                    net->num_pairs);
+    if (used < len)
+        used += net_rate_status(&net->tx_rate, "tx", reply + used, len - used);
+    if (used < len)
+        used += net_rate_status(&net->rx_rate, "rx", reply + used, len - used);
+    if (used < len)
+        net_pcap_status(net, reply + used, len - used);
+    return 0;
+}
+
+static const struct virtio_ctl_command net_ctl_commands[] = {
+    {"status", "", net_ctl_status},
+    {"pcap", "<file> [snaplen]|off", net_ctl_pcap},
+    {NULL, NULL, NULL},
+};
+
 static int virtio_net_do_init(VirtIODevice *vdev, const void *params) {
     const struct virtio_net_init_params *p = params;
     if (!p)
         return -EINVAL;
-    vdev->dev = init_net_dev(p->mac);
+    vdev->dev = init_net_dev(p->mac, p->queue_pairs);
     if (!vdev->dev)
         return -ENOMEM;
-    return virtio_net_init(vdev, p->tap);
+    NetDev *net = vdev->dev;
+    net->tx_busy_poll = p->tx_busy_poll;
+    net->rx_busy_poll = p->rx_busy_poll;
+    net_rate_init(&net->tx_rate, &p->tx_limit);
+    net_rate_init(&net->rx_rate, &p->rx_limit);
+    return virtio_net_init(vdev, p);
 }
 
 const struct virtio_device_ops virtio_net_ops = {
@@ -352,24 +1452,179 @@ const struct virtio_device_ops virtio_net_ops = {
     .close = virtio_net_close,
     .reset = virtio_net_reset,
     .status_changed = net_on_status,
-    .notify_handlers =
-        {
-            [NET_QUEUE_RX] = virtio_net_rxq_notify_handler,
-            [NET_QUEUE_TX] = virtio_net_txq_notify_handler,
-        },
+    .ctl_commands = net_ctl_commands,
+    // notify_handlers are set by virtio_net_init().
 };
 
+static int parse_rate_limit(const cJSON *json, struct net_rate_params *p) {
+    static const char *const keys[] = {"bps", "pps", "burst", "burst_pkts"};
+    uint64_t *vals[] = {&p->bps, &p->pps, &p->burst, &p->burst_pkts};
+
+    if (!json)
+        return 0;
+    if (!cJSON_IsObject(json))
+        return -1;
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        cJSON *item = cJSON_GetObjectItem(json, keys[i]);
+        if (item && parse_json_u64(item, vals[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
 static int virtio_net_parse_params(const cJSON *json, void **out) {
     struct virtio_net_init_params *p = calloc(1, sizeof(*p));
     if (!p)
         return -ENOMEM;
 
-    cJSON *tap = cJSON_GetObjectItem(json, "tap");
-    if (!cJSON_IsString(tap) || !tap->valuestring[0]) {
+    // "packet" attaches to a host interface through AF_PACKET instead of a
+    // tap, "xdp" through AF_XDP and "switch" to the in-daemon switch.
+    cJSON *packet = cJSON_GetObjectItem(json, "packet");
+    cJSON *xdp = cJSON_GetObjectItem(json, "xdp");
+    cJSON *sw = cJSON_GetObjectItem(json, "switch");
+    if (!!packet + !!xdp + !!sw > 1) {
+        log_error("virtio net: packet, xdp and switch are exclusive");
+        free(p);
+        return -EINVAL;
+    }
+    if (packet) {
+        if (!cJSON_IsString(packet) || !packet->valuestring[0]) {
+            log_error("virtio net: packet must be an interface name");
+            free(p);
+            return -EINVAL;
+        }
+        p->packet = packet->valuestring;
+    } else if (xdp) {
+        if (!cJSON_IsString(xdp) || !xdp->valuestring[0]) {
+            log_error("virtio net: xdp must be an interface name");
+            free(p);
+            return -EINVAL;
+        }
+        p->xdp = xdp->valuestring;
+        // "xdp_queue" is the interface queue to take over, default 0, and
+        // "xdp_busy_poll" the busy-poll time in us, default 0 (off).
+        cJSON *queue = cJSON_GetObjectItem(json, "xdp_queue");
+        cJSON *busy_poll = cJSON_GetObjectItem(json, "xdp_busy_poll");
+        if ((queue && parse_json_u32(queue, &p->xdp_queue) != 0) ||
+            (busy_poll && parse_json_u32(busy_poll, &p->xdp_busy_poll) != 0)) {
+            log_error("virtio net: invalid xdp_queue or xdp_busy_poll");
+            free(p);
+            return -EINVAL;
+        }
+    } else if (sw) {
+        cJSON *uplink = cJSON_GetObjectItem(json, "uplink");
+        if (!cJSON_IsString(sw) || !sw->valuestring[0] ||
+            strlen(sw->valuestring) >= IFNAMSIZ) {
+            log_error("virtio net: switch must be a name of at most %d "
+                      "characters",
+                      IFNAMSIZ - 1);
+            free(p);
+            return -EINVAL;
+        }
+        p->sw = sw->valuestring;
+        // "uplink" is a tap connecting the switch to the host.
+        if (uplink) {
+            if (!cJSON_IsString(uplink) || !uplink->valuestring[0]) {
+                log_error("virtio net: uplink must be a tap name");
+                free(p);
+                return -EINVAL;
+            }
+            p->uplink = uplink->valuestring;
+        }
+    } else {
+        cJSON *tap = cJSON_GetObjectItem(json, "tap");
+        if (!cJSON_IsString(tap) || !tap->valuestring[0]) {
+            free(p);
+            return -EINVAL;
+        }
+        p->tap = tap->valuestring;
+    }
+
+    // "queues" is the number of RX/TX queue pairs, default 1.
+    p->queue_pairs = 1;
+    cJSON *queues = cJSON_GetObjectItem(json, "queues");
+    if (queues) {
+        uint32_t n;
+        if (parse_json_u32(queues, &n) != 0 || n < 1 ||
+            n > NET_MAX_QUEUE_PAIRS) {
+            log_error("virtio net: queues must be 1 to %d",
+                      NET_MAX_QUEUE_PAIRS);
+            free(p);
+            return -EINVAL;
+        }
+        p->queue_pairs = n;
+    }
+
+    // "vhost" moves the frames of the tap with vhost-net, default false.
+    cJSON *vhost = cJSON_GetObjectItem(json, "vhost");
+    if (vhost) {
+        if (!cJSON_IsBool(vhost)) {
+            log_error("virtio net: vhost must be true or false");
+            free(p);
+            return -EINVAL;
+        }
+        p->vhost = cJSON_IsTrue(vhost);
+    }
+
+    // "mtu" is the MTU offered to the driver with VIRTIO_NET_F_MTU, default
+    // none, which leaves the driver at 1500.
+    cJSON *mtu = cJSON_GetObjectItem(json, "mtu");
+    if (mtu && (parse_json_u32(mtu, &p->mtu) != 0 || p->mtu < ETH_MIN_MTU ||
+                p->mtu > ETH_MAX_MTU)) {
+        log_error("virtio net: mtu must be %d to %d", ETH_MIN_MTU,
+                  ETH_MAX_MTU);
+        free(p);
+        return -EINVAL;
+    }
+
+    // "tx_busy_poll" is how long the TX worker polls an idle TX queue before
+    // it waits for a notification, in us, default 0.
+    cJSON *tx_busy_poll = cJSON_GetObjectItem(json, "tx_busy_poll");
+    if (tx_busy_poll && parse_json_u32(tx_busy_poll, &p->tx_busy_poll) != 0) {
+        log_error("virtio net: invalid tx_busy_poll");
+        free(p);
+        return -EINVAL;
+    }
+
+    // "rx_busy_poll" is how long the RX worker keeps polling after the last
+    // frame before it sleeps, in us, default 0. "rx_busy_poll_cpu" pins the
+    // worker of pair n to that CPU plus n.
+    cJSON *rx_busy_poll = cJSON_GetObjectItem(json, "rx_busy_poll");
+    cJSON *rx_cpu = cJSON_GetObjectItem(json, "rx_busy_poll_cpu");
+    uint32_t cpu;
+    p->rx_busy_poll_cpu = -1;
+    if ((rx_busy_poll && parse_json_u32(rx_busy_poll, &p->rx_busy_poll) != 0) ||
+        (rx_cpu && (parse_json_u32(rx_cpu, &cpu) != 0 ||
+                    cpu + p->queue_pairs > CPU_SETSIZE))) {
+        log_error("virtio net: invalid rx_busy_poll or rx_busy_poll_cpu");
+        free(p);
+        return -EINVAL;
+    }
+    if (rx_cpu)
+        p->rx_busy_poll_cpu = cpu;
+
+    // "tx_limit" and "rx_limit" are token bucket limits of the device, each
+    // an object with "bps", "pps", "burst" (bytes) and "burst_pkts".
+    if (parse_rate_limit(cJSON_GetObjectItem(json, "tx_limit"),
+                         &p->tx_limit) != 0 ||
+        parse_rate_limit(cJSON_GetObjectItem(json, "rx_limit"),
+                         &p->rx_limit) != 0) {
+        log_error("virtio net: invalid tx_limit or rx_limit");
+        free(p);
+        return -EINVAL;
+    }
+
+    // "pcap" captures frames to a file from the start, see net_pcap.c, and
+    // "pcap_snaplen" is the number of bytes kept per frame, default all.
+    cJSON *pcap = cJSON_GetObjectItem(json, "pcap");
+    cJSON *snaplen = cJSON_GetObjectItem(json, "pcap_snaplen");
+    if (cJSON_IsString(pcap))
+        p->pcap = pcap->valuestring;
+    if (snaplen && parse_json_u32(snaplen, &p->pcap_snaplen) != 0) {
+        log_error("virtio net: invalid pcap_snaplen");
         free(p);
         return -EINVAL;
     }
-    p->tap = tap->valuestring;
 
     cJSON *mac_json = cJSON_GetObjectItem(json, "mac");
     if (cJSON_GetArraySize(mac_json) != 6) {
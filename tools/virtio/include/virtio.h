@@ -61,6 +61,7 @@ struct VirtIODevice;
 typedef struct VirtIODevice VirtIODevice;
 struct VirtQueue;
 typedef struct VirtQueue VirtQueue;
+struct virtio_ctl_command;
 
 struct VirtQueue {
     VirtIODevice *dev; // The device which the virtqueue belongs to
@@ -133,6 +134,10 @@ struct VirtIODevice {
         VirtIODevice *vdev); // Function called when closing the virtio device
     void (*status_changed)(VirtIODevice *vdev,
                            uint32_t status); // Called on STATUS register write
+    void (*config_write)(VirtIODevice *vdev, uint64_t offset, uint64_t value,
+                         unsigned size); // Called on device config space write
+    const struct virtio_ctl_command
+        *ctl_commands; // Commands of "hvisor virtio ctl", see virtio_ctl.h
     bool activated; // Whether the current virtio device is activated
     pthread_mutex_t interrupt_lock;
     bool interrupt_line_asserted;
@@ -147,7 +152,15 @@ struct virtio_device_ops {
     void (*close)(VirtIODevice *vdev);
     void (*reset)(VirtIODevice *vdev);
     void (*status_changed)(VirtIODevice *vdev, uint32_t status);
-#define VIRTIO_MAX_VQUEUES 4
+    // Optional: handle a driver write to the device config space. offset is
+    // relative to VIRTIO_MMIO_CONFIG. Devices without writable config fields
+    // leave this NULL.
+    void (*config_write)(VirtIODevice *vdev, uint64_t offset, uint64_t value,
+                         unsigned size);
+    // Optional: runtime control commands, terminated by an entry with a NULL
+    // name.
+    const struct virtio_ctl_command *ctl_commands;
+#define VIRTIO_MAX_VQUEUES 32
     int (*notify_handlers[VIRTIO_MAX_VQUEUES])(VirtIODevice *, VirtQueue *);
 };
 
@@ -182,6 +195,9 @@ VirtIODevice *create_virtio_device(VirtioDeviceType dev_type, uint32_t zone_id,
                                    uint64_t base_addr, uint64_t len,
                                    uint32_t irq_id, const void *params);
 
+// Find the device of a zone by the base address of its MMIO region.
+VirtIODevice *virtio_find_device(uint32_t zone_id, uint64_t base_addr);
+
 void init_mmio_regs(VirtMmioRegs *regs, VirtioDeviceType type);
 
 void virtio_dev_reset(VirtIODevice *vdev);
@@ -198,6 +214,23 @@ void virtqueue_enable_notify(VirtQueue *vq);
 
 bool desc_is_writable(volatile VirtqDesc *desc_table, uint16_t idx);
 
+// Memory of zone i mapped into the daemon, see virtio_start_from_json().
+struct zone_mem_region {
+    uintptr_t virt_addr;
+    uintptr_t zone0_ipa;
+    uintptr_t zonex_ipa;
+    uintptr_t mem_size;
+};
+
+struct zone_mem {
+    struct zone_mem_region regions[CONFIG_MAX_MEMORY_REGIONS];
+    size_t num_regions;
+};
+
+extern struct zone_mem zone_mem[MAX_ZONES];
+// /dev/hvisor, opened by virtio_init().
+extern int ko_fd;
+
 void *get_virt_addr(void *zonex_ipa, int zone_id);
 
 void virtqueue_set_avail(VirtQueue *vq);
@@ -11,10 +11,13 @@
 #ifndef _HVISOR_VIRTIO_BLK_H
 #define _HVISOR_VIRTIO_BLK_H
 #include "virtio.h"
+#include "virtio_ctl.h"
 #include <linux/virtio_blk.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
 
 /// Maximum number of segments in a request.
 #define BLK_SEG_MAX 512
@@ -26,14 +29,123 @@
 // for some reason we disable them for now.
 #define BLK_SUPPORTED_FEATURES                                                 \
     ((1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VIRTIO_BLK_F_SIZE_MAX) |        \
-     (1ULL << VIRTIO_BLK_F_FLUSH) | (1ULL << VIRTIO_F_VERSION_1))
+     (1ULL << VIRTIO_BLK_F_FLUSH) | (1ULL << VIRTIO_BLK_F_CONFIG_WCE) |      \
+     (1ULL << VIRTIO_BLK_F_DISCARD) | (1ULL << VIRTIO_BLK_F_WRITE_ZEROES) |   \
+     (1ULL << VIRTIO_F_VERSION_1))
+
+// Limits advertised for DISCARD and WRITE_ZEROES requests.
+#define BLK_MAX_DISCARD_SEG 32
+#define BLK_MAX_DISCARD_SECTORS (1U << 21)
+#define BLK_DISCARD_ALIGNMENT 8 // In sectors
 
 typedef struct virtio_blk_config BlkConfig;
 typedef struct virtio_blk_outhdr BlkReqHead;
 
+// Host-side caching policy, selected by the "cache" json option.
+enum blk_cache_mode {
+    // Writes land in the host page cache, FLUSH does fdatasync (default).
+    BLK_CACHE_WRITEBACK,
+    // Every write is followed by fdatasync; the guest sees wce = 0.
+    BLK_CACHE_WRITETHROUGH,
+    // Like writeback, but FLUSH is a no-op. Only for scratch disks whose
+    // content may be lost on a host crash.
+    BLK_CACHE_UNSAFE,
+};
+
+// Maximum number of images a striped device spreads over.
+#define BLK_MAX_IMGS 8
+// Default stripe unit of a striped device.
+#define BLK_DEFAULT_STRIPE_SIZE (64 * 1024)
+
+struct blk_backend;
+struct blk_snapshot;
+struct blk_trace;
+
+enum blk_io_op {
+    BLK_IO_READ,
+    BLK_IO_WRITE,
+    BLK_IO_FLUSH,
+    BLK_IO_DISCARD,
+    BLK_IO_WRITE_ZEROES,
+};
+
+// One request handed to a backend's asynchronous interface.
+struct blk_io {
+    enum blk_io_op op;
+    uint64_t off;
+    uint64_t len;      // Range length of DISCARD / WRITE_ZEROES
+    struct iovec *iov; // Buffers of READ / WRITE
+    int cnt;
+    bool fua;   // WRITE must be on stable storage when it completes
+    bool unmap; // WRITE_ZEROES may deallocate the range
+    // Called by reap() with 0 or a positive errno and the bytes read.
+    void (*done)(struct blk_io *io, int err, ssize_t len);
+};
+
+// Storage backend of a virtio-blk device. The synchronous calls return 0 on
+// success or a positive errno, and must be safe to call from several threads.
+struct blk_backend_ops {
+    const char *name;
+    int (*preadv)(struct blk_backend *be, const struct iovec *iov, int cnt,
+                  uint64_t off, ssize_t *len);
+    int (*pwritev)(struct blk_backend *be, const struct iovec *iov, int cnt,
+                   uint64_t off);
+    int (*flush)(struct blk_backend *be);
+    // Optional, enabled by BLK_BACKEND_DISCARD / BLK_BACKEND_WRITE_ZEROES.
+    int (*discard)(struct blk_backend *be, uint64_t off, uint64_t len);
+    int (*write_zeroes)(struct blk_backend *be, uint64_t off, uint64_t len,
+                        bool unmap);
+    // Optional asynchronous interface, only called by the device worker.
+    // submit() queues io and returns 0, EAGAIN when the backend is at its
+    // queue depth, or another errno. reap() blocks until at least one (or,
+    // with all set, every) queued request has completed and called
+    // io->done; it returns at once when nothing is queued. A request that
+    // fails early may also call io->done before submit() returns.
+    int (*submit)(struct blk_backend *be, struct blk_io *io);
+    void (*reap)(struct blk_backend *be, bool all);
+    void (*close)(struct blk_backend *be);
+};
+
+// BlkBackend flags
+#define BLK_BACKEND_DISCARD (1U << 0)
+#define BLK_BACKEND_WRITE_ZEROES (1U << 1)
+#define BLK_BACKEND_READ_ONLY (1U << 2)
+
+// Every backend embeds BlkBackend as its first member.
+typedef struct blk_backend {
+    const struct blk_backend_ops *ops;
+    uint64_t size; // Usable size in bytes
+    uint32_t flags;
+} BlkBackend;
+
+// Default granularity of dirty block tracking.
+#define BLK_DEFAULT_DIRTY_BLOCK_SIZE (64 * 1024)
+
+// Maximum number of connections to one NBD server.
+#define BLK_NBD_MAX_CONNS 8
+
+// Maximum number of requests the worker keeps queued on an asynchronous
+// backend.
+#define BLK_MAX_INFLIGHT 64
+
+// A guest request queued on an asynchronous backend.
+struct blk_inflight {
+    struct blk_io io; // Must stay first, done() casts back
+    struct virtio_blk_dev *dev;
+    VirtQueue *vq;
+    uint16_t desc_idx;
+    uint8_t *status;
+    int iov_cap;
+    uint16_t depth; // Requests queued when this one was submitted
+    uint64_t start; // Submit time, when tracing
+    struct blk_inflight *next_free;
+};
+
 typedef struct virtio_blk_dev {
-    BlkConfig config;
-    int img_fd;
+    BlkConfig config; // config.wce is written by the main thread (config
+                      // space write) and read by the worker thread
+    BlkBackend *backend;
+    enum blk_cache_mode cache_mode;
     pthread_t tid;
     pthread_mutex_t mtx;
     pthread_cond_t cond;
@@ -43,12 +155,108 @@ typedef struct virtio_blk_dev {
     bool worker_paused; // Worker parked in reset wait; vq not touched
     struct iovec out_buf[VIRTQUEUE_BLK_MAX_SIZE];
     struct iovec in_buf[VIRTQUEUE_BLK_MAX_SIZE];
+    // Requests queued on an asynchronous backend, worker thread only.
+    struct blk_inflight *inflight;
+    struct blk_inflight *inflight_free;
+    uint16_t inflight_count;
+    struct blk_trace *trace; // Request trace, NULL when off. See blk_trace.c.
+    bool quiesce; // Main thread waits for the worker to go idle
+    bool busy;    // Worker is processing requests, protected by mtx
+    // Dirty block tracking, NULL when disabled. See blk_snapshot.c.
+    uint64_t *dirty;
+    uint64_t dirty_block_size;
+    uint64_t dirty_blocks;
+    struct blk_snapshot *snap;
 } BlkDev;
 
 struct virtio_blk_init_params {
-    const char *img_path;
+    // One image: plain file backend. Several: striped backend.
+    const char *img_paths[BLK_MAX_IMGS];
+    int num_imgs;
+    uint64_t stripe_size;
+    enum blk_cache_mode cache_mode;
+    // NBD server ("host:port" or "unix:/path"), replaces the images.
+    const char *nbd_server;
+    const char *nbd_export;
+    int nbd_connections;
+    uint64_t dirty_block_size; // 0: no dirty block tracking
+    const char *trace;         // Record requests to this file
 };
 
+// Open an image file or block device read-write and report its size.
+int blk_open_image(const char *path, int *fd, uint64_t *size);
+
+// Deallocate or zero a byte range of an open image file or block device.
+int blk_fd_discard(int fd, uint64_t off, uint64_t len);
+int blk_fd_write_zeroes(int fd, uint64_t off, uint64_t len, bool unmap);
+
+BlkBackend *blk_file_open(const char *path);
+
+BlkBackend *blk_stripe_open(const char *const *paths, int num,
+                            uint64_t stripe_size);
+
+BlkBackend *blk_nbd_open(const char *server, const char *export_name,
+                         int connections);
+
+// Park the worker with no request in flight, and let it go again.
+void blk_quiesce(BlkDev *dev);
+void blk_resume(BlkDev *dev);
+
+int blk_dirty_init(BlkDev *dev, uint64_t block_size);
+// Called by the worker before a WRITE, DISCARD or WRITE_ZEROES is issued.
+void blk_dirty_write(BlkDev *dev, const struct blk_io *io);
+void blk_dirty_close(BlkDev *dev);
+
+int blk_ctl_snapshot(VirtIODevice *vdev, int argc, char *argv[], char *reply,
+                     size_t len);
+int blk_snapshot_status(BlkDev *dev, char *buf, size_t len);
+
+/*
+ * Request trace file: a struct blk_trace_hdr, then one struct blk_trace_rec
+ * per finished request, in completion order.
+ */
+#define BLK_TRACE_MAGIC "HVBLKTRC"
+#define BLK_TRACE_VERSION 1
+
+struct blk_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t disk_size;
+    uint64_t start_time; // CLOCK_REALTIME in ns
+    uint64_t dropped;    // Records lost because the ring was full
+};
+
+struct blk_trace_rec {
+    uint64_t submit_ns; // Since start_time
+    uint64_t sector;
+    uint32_t len;        // Bytes
+    uint32_t latency_ns; // Saturates at UINT32_MAX
+    uint8_t op;          // enum blk_io_op
+    uint8_t status;      // VIRTIO_BLK_S_*
+    uint16_t depth;      // Requests in flight, this one included
+    uint32_t reserved;
+};
+
+static inline uint64_t blk_trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct blk_trace *blk_trace_open(const char *path, uint64_t disk_size);
+// Worker thread only.
+void blk_trace_add(struct blk_trace *t, struct blk_trace_rec *rec);
+void blk_trace_close(struct blk_trace *t);
+int blk_ctl_trace(VirtIODevice *vdev, int argc, char *argv[], char *reply,
+                  size_t len);
+int blk_trace_status(BlkDev *dev, char *buf, size_t len);
+
+// hvisor virtio replay: run a trace against an image or NBD server.
+int virtio_blk_replay(int argc, char *argv[]);
+
+extern const struct virtio_ctl_command blk_ctl_commands[];
+
 extern const struct virtio_device_ops virtio_blk_ops;
 extern const struct virtio_config_ops virtio_blk_config_ops;
 
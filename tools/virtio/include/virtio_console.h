@@ -1,36 +1,131 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /**
- * Copyright (c) 2025 Syswonder
- *
- * Syswonder Website:
- *      https://www.syswonder.org
- *
- * Authors:
- *      Guowei Li <2401213322@stu.pku.edu.cn>
- */
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      Guowei Li <2401213322@stu.pku.edu.cn>
+ */
 #ifndef _HVISOR_VIRTIO_CONSOLE_H
 #define _HVISOR_VIRTIO_CONSOLE_H
 #include "event_monitor.h"
 #include "virtio.h"
 #include <linux/virtio_console.h>
+#include <pthread.h>
+#include <stdbool.h>
 
+// VIRTIO_CONSOLE_F_MULTIPORT is dropped in init unless ports are configured.
 #define CONSOLE_SUPPORTED_FEATURES                                             \
-    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE))
-#define CONSOLE_MAX_QUEUES 2
+    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE) |          \
+     (1ULL << VIRTIO_CONSOLE_F_MULTIPORT))
 #define VIRTQUEUE_CONSOLE_MAX_SIZE 64
+
+// Queue idx for virtio console. Port 0 uses queues 0 (RX) and 1 (TX), the
+// control queues follow, then port n uses 2n + 2 and 2n + 3.
 #define CONSOLE_QUEUE_RX 0
 #define CONSOLE_QUEUE_TX 1
+#define CONSOLE_QUEUE_CTRL_RX 2
+#define CONSOLE_QUEUE_CTRL_TX 3
+#define CONSOLE_PORT_RXQ(n) ((n) == 0 ? CONSOLE_QUEUE_RX : 2 * (n) + 2)
+
+// Ports of a multiport device, as many as VIRTIO_MAX_VQUEUES allows.
+#define CONSOLE_MAX_PORTS 15
+#define CONSOLE_MAX_QUEUES (2 * (CONSOLE_MAX_PORTS + 1))
+// Longest port name, see VIRTIO_CONSOLE_PORT_NAME.
+#define CONSOLE_PORT_NAME_MAX 64
+// Control messages waiting for buffers of the control RX queue.
+#define CONSOLE_CTRL_PENDING 64
+// Guest output a pty or socket port holds until its fd is writable.
+#define CONSOLE_OUT_RING_SIZE (64 * 1024)
+// Latest guest output of a captured port, replayed to attaching readers.
+#define CONSOLE_HISTORY_SIZE (256 * 1024)
+#define CONSOLE_LOG_SIZE_DEFAULT (1 << 20)
+#define CONSOLE_LOG_FILES_DEFAULT 4
+#define CONSOLE_ATTACH_MAX_CLIENTS 16
+
+enum console_port_type {
+    CONSOLE_PORT_PTY,
+    CONSOLE_PORT_SOCKET, // Unix socket, one client at a time
+    CONSOLE_PORT_FILE,   // Output only, appended to the file
+};
+
+// Copies of the output of a port, see console_capture.c.
+struct console_capture_params {
+    const char *log;    // Log file, NULL for none
+    uint64_t log_size;  // Rotated once it grows to this many bytes
+    int log_files;      // Rotated files kept as log.1 ... log.N
+    const char *attach; // Unix socket for readers, NULL for none
+};
+
+struct console_port_params {
+    enum console_port_type type;
+    const char *path; // Socket or file, symlink to the pty if set
+    const char *name; // Reported to the driver, NULL for none
+    struct console_capture_params capture;
+};
+
+struct virtio_console_init_params {
+    // 0 for a single console without VIRTIO_CONSOLE_F_MULTIPORT, which only
+    // uses ports[0].capture.
+    int nr_ports;
+    struct console_port_params ports[CONSOLE_MAX_PORTS];
+};
+
+struct console_capture;
+
+typedef struct virtio_console_port {
+    int id;
+    enum console_port_type type;
+    char name[CONSOLE_PORT_NAME_MAX];
+    char *path;
+    int fd;                 // Pty master, socket client or file, -1 if none
+    int listen_fd;          // Socket ports
+    int slave_keepalive_fd; // Pty ports
+    int rx_ready;
+    bool rx_blocked; // fd taken off the epoll set until RX buffers come
+    bool guest_open; // The driver opened the port, see VIRTIO_CONSOLE_PORT_OPEN
+    uint32_t events; // Polled for on the fd, see console_port_rearm()
+    // Output of the guest not yet written to fd, drained on EPOLLOUT.
+    uint8_t *out_ring;
+    size_t out_head, out_len;
+    uint64_t out_dropped; // Overwritten before it could be written
+    struct console_capture *capture; // NULL unless logged or attachable
+} ConsolePort;
+
+struct console_ctrl_msg {
+    struct virtio_console_control ctrl;
+    char name[CONSOLE_PORT_NAME_MAX]; // Follows VIRTIO_CONSOLE_PORT_NAME
+    size_t name_len;
+};
 
 typedef struct virtio_console_config ConsoleConfig;
 typedef struct virtio_console_dev {
     ConsoleConfig config;
-    int master_fd;
-    int slave_keepalive_fd;
-    int rx_ready;
+    bool multiport;
+    int nr_ports;
+    // The ports' fds are polled on epfd, which is the only fd the device
+    // registers with the event monitor.
+    int epfd;
     struct hvisor_event *event;
+    // Guards the ports and the control RX queue, which the event monitor
+    // and the MMIO dispatcher thread both use.
+    pthread_mutex_t lock;
+    struct console_ctrl_msg pending[CONSOLE_CTRL_PENDING];
+    int pending_head, pending_count;
+    ConsolePort ports[CONSOLE_MAX_PORTS];
 } ConsoleDev;
 
+// console_capture.c.
+struct console_capture *
+console_capture_open(int port_id, const struct console_capture_params *p);
+// Called with the output of the guest, never blocks on the readers.
+void console_capture_push(struct console_capture *c, const struct iovec *iov,
+                          int n);
+void console_capture_close(struct console_capture *c);
+
 extern const struct virtio_device_ops virtio_console_ops;
 extern const struct virtio_config_ops virtio_console_config_ops;
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#ifndef __HVISOR_VIRTIO_CTL_H
+#define __HVISOR_VIRTIO_CTL_H
+#include "virtio.h"
+#include <stddef.h>
+
+// Unix socket the virtio daemon accepts control commands on.
+#define VIRTIO_CTL_SOCK "/var/run/hvisor-virtio.sock"
+#define VIRTIO_CTL_MAX_ARGS 16
+#define VIRTIO_CTL_MAX_REQ 1024
+#define VIRTIO_CTL_MAX_REPLY 4096
+
+// A runtime control command of a device, listed in its
+// virtio_device_ops.ctl_commands.
+struct virtio_ctl_command {
+    const char *name;
+    const char *usage; // Arguments, shown by the "help" command
+    // Runs on the event monitor thread, so it must only block briefly.
+    // argv[0] is the command name. Writes its output to reply and returns
+    // 0 or a negative errno.
+    int (*handler)(VirtIODevice *vdev, int argc, char *argv[], char *reply,
+                   size_t len);
+};
+
+// Daemon side, called from virtio_init() and virtio_close().
+int virtio_ctl_init(void);
+void virtio_ctl_close(void);
+
+// Client side: hvisor virtio ctl <zone_id> <mmio_addr> <command> [args...]
+int virtio_ctl(int argc, char *argv[]);
+
+#endif /* __HVISOR_VIRTIO_CTL_H */
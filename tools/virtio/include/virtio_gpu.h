@@ -13,6 +13,7 @@
 #ifdef ENABLE_VIRTIO_GPU
 
 #include "bits/pthreadtypes.h"
+#include "event_monitor.h"
 #include "linux/types.h"
 #include "sys/queue.h"
 #include "virtio.h"
@@ -20,6 +21,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -55,6 +57,18 @@
 #define GPU_SUPPORTED_FEATURES                                                 \
     ((1ULL << VIRTIO_F_VERSION_1) | VIRTIO_RING_F_INDIRECT_DESC)
 
+// Dumb buffers a scanout flips between, see virtio_gpu_copy_and_flush
+#define GPU_SCANOUT_BUFFERS_MAX 3
+#define GPU_SCANOUT_BUFFERS_DEFAULT 3
+
+// Index of the front, pending or ready buffer of a scanout that stands for
+// the imported framebuffer of its resource, see virtio_gpu_import_resource
+#define GPU_SCANOUT_DIRECT GPU_SCANOUT_BUFFERS_MAX
+
+// A page flip whose event never came, e.g. because the crtc was turned off,
+// is taken as done after this long
+#define GPU_FLIP_TIMEOUT_MS 100
+
 // Default configuration for scanout[0]
 #define SCANOUT_DEFAULT_WIDTH 1280
 
@@ -63,6 +77,9 @@
 // Macro to find the minimum value
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+// Macro to find the maximum value
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 // Conversion between virtio_gpu_formats and drm formats
 #define VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(format)                                \
     ((format == VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM)   ? DRM_FORMAT_XRGB8888      \
@@ -97,6 +114,20 @@ typedef struct virtio_gpu_config GPUConfig;
 typedef struct virtio_gpu_ctrl_hdr GPUControlHeader;
 typedef struct virtio_gpu_update_cursor GPUUpdateCursor;
 
+// Columns [x0, x1) of one row of an image, empty if x0 >= x1
+typedef struct virtio_gpu_span {
+    uint32_t x0, x1;
+} GPUSpan;
+
+// Parts of an image that changed, kept as one span per row so that small
+// updates far apart, e.g. a blinking cursor and a clock, do not grow into a
+// rectangle covering everything between them
+typedef struct virtio_gpu_damage {
+    GPUSpan *rows;   // One per row of the image
+    uint32_t height; // Number of rows
+    uint32_t y0, y1; // Rows outside [y0, y1) are clean
+} GPUDamage;
+
 // Resource object stored in memory during rendering (e.g., images)
 // When in use, it needs to be converted from iov to a drm_mode_create_dumb
 // object for output
@@ -112,16 +143,31 @@ typedef struct virtio_gpu_simple_resource {
     unsigned int iov_cnt;
     uint64_t hostmem;         // Size of the resource in the host
     uint32_t scanout_bitmask; // Marks which scanout the resource is used by
-    struct virtio_gpu_rect
-        transfer_rect; // In transfer_to_2d, determines which part of the image
-                       // in guest memory to flush
-    uint64_t transfer_offset;
+    // Transferred by transfer_to_2d and not flushed yet, the flush copies
+    // the part of it inside the flushed rectangle
+    GPUDamage damage;
+    // With zero_copy, the backing imported as a drm framebuffer that is
+    // scanned out without copying
+    uint32_t prime_fb_id; // 0 if not imported
+    uint32_t prime_handle;
+    int prime_card_fd; // Card the framebuffer was added to
+    bool prime_failed; // Cannot be imported, the flush copies it
     TAILQ_ENTRY(virtio_gpu_simple_resource) next;
 } GPUSimpleResource;
 
+// One of the drm dumb buffers of a scanout
+typedef struct virtio_gpu_drm_buffer {
+    uint32_t fb_id;  // Framebuffer ID
+    uint32_t handle; // Handle pointing to the drm dumb buffer
+    uint32_t size;   // Buffer size
+    uint32_t pitch;  // Bytes per row of the buffer
+    void *addr;      // Virtual address of the buffer in this process
+    // Parts of the resource drawn into the other buffers since this one was
+    // last drawn, which are copied before it is shown again
+    GPUDamage stale;
+} GPUDrmBuffer;
+
 typedef struct virtio_gpu_framebuffer {
-    // TODO: Double buffering
-    uint32_t fb_id; // Framebuffer ID
     // TODO: Format
     // The format mainly determines how many bytes each pixel occupies
     // The formats provided by virtio_gpu_formats are all 4 bytes per pixel
@@ -133,10 +179,17 @@ typedef struct virtio_gpu_framebuffer {
                      // total number of bytes (hostmem)
     uint32_t offset;
     // drm related
-    uint32_t drm_dumb_size;   // Buffer size
-    uint32_t drm_dumb_handle; // Handle pointing to the drm framebuffer
-    void *fb_addr;            // Virtual address of the buffer in this process
-    bool enabled;             // Whether the buffer is enabled
+    // The frame is drawn into a buffer that is not being scanned out, which
+    // is then shown by a page flip on the next vblank
+    GPUDrmBuffer bufs[GPU_SCANOUT_BUFFERS_MAX];
+    int nr_bufs;
+    int front;   // Buffer being scanned out, -1 before the first modeset
+    int pending; // Buffer a page flip is queued to, -1 if none
+    int ready;   // Buffer drawn while a flip was pending, -1 if none
+    struct timespec flip_time; // When the pending flip was queued
+    uint32_t direct_fb_id;     // Framebuffer of GPU_SCANOUT_DIRECT
+    bool mode_set;             // drmModeSetCrtc was done for these buffers
+    bool enabled;              // Whether the buffers are enabled
 } GPUFrameBuffer;
 
 // 32-bit RGBA
@@ -157,6 +210,13 @@ typedef struct virtio_gpu_scanout {
     GPUFrameBuffer frame_buffer;
     // Output card used
     int card0_fd;
+    // Page flips complete on the event monitor thread, see
+    // virtio_gpu_drm_event_handler
+    int nr_buffers;
+    pthread_mutex_t flip_lock; // Guards frame_buffer
+    pthread_cond_t flip_cond;  // Signaled when a page flip completes
+    struct hvisor_event *drm_event;
+    bool flip_failed; // drmModePageFlip is not supported
     // drm related
     drmModeCrtc *crtc;
     drmModeEncoder *encoder;
@@ -167,6 +227,8 @@ typedef struct virtio_gpu_scanout {
 typedef struct virtio_gpu_requested_state {
     uint32_t width, height;
     int x, y;
+    uint32_t buffers; // Dumb buffers per scanout, 2 or 3
+    bool zero_copy;   // Scan out the guest's memory when the display can
 } GPURequestedState;
 
 // GPU device structure
@@ -188,6 +250,8 @@ typedef struct virtio_gpu_dev {
     uint64_t hostmem;
     // Enabled scanout
     int enabled_scanout_bitmask;
+    // Resources are scanned out from guest memory when they can be imported
+    bool zero_copy;
     // async
     pthread_t gpu_thread;
     pthread_cond_t gpu_cond;
@@ -335,13 +399,30 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd);
 // Create a drm_framebuffer for the scanout
 void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout, uint32_t *error);
 
-// Copy the resource to the scanout's drm_framebuffer and flush
+// With zero_copy, import the backing of the resource as a drm framebuffer of
+// the scanout, returns 0 if it can be scanned out directly
+int virtio_gpu_import_resource(VirtIODevice *vdev, GPUScanout *scanout,
+                               GPUSimpleResource *res);
+
+// Flip to the imported framebuffer of the resource, or report r as changed
+// if it is shown already
+void virtio_gpu_direct_flush(GPUScanout *scanout, GPUSimpleResource *res,
+                             const struct virtio_gpu_rect *r,
+                             uint32_t *error);
+
+// Copy the damage of the resource inside r to a back buffer of the scanout
+// and flip to it
 void virtio_gpu_copy_and_flush(GPUScanout *scanout, GPUSimpleResource *res,
+                               const struct virtio_gpu_rect *r,
                                uint32_t *error);
 
 // Remove the drm_framebuffer of the scanout
 void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout);
 
+// Handle the page flip events of the card of a scanout, registered with the
+// event monitor
+void virtio_gpu_drm_event_handler(int fd, int epoll_type, void *param);
+
 // Corresponding to VIRTIO_GPU_CMD_SET_SCANOUT
 // Set the display parameters of the scanout and bind the resource to the
 // scanout
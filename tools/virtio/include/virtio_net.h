@@ -12,20 +12,60 @@
 #define _HVISOR_VIRTIO_NET_H
 #include "event_monitor.h"
 #include "virtio.h"
+#include "virtio_ctl.h"
+#include <linux/if_ether.h>
 #include <linux/virtio_net.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-// Queue idx for virtio net.
+// Queue idx for virtio net. Pair n uses queues 2n (RX) and 2n + 1 (TX), the
+// control queue follows the last pair.
 #define NET_QUEUE_RX 0
 #define NET_QUEUE_TX 1
+#define NET_QUEUE_CTRL(pairs) (2 * (pairs))
+
+// Maximum number of RX/TX queue pairs, each with its own tap queue and worker
+#define NET_MAX_QUEUE_PAIRS 8
 
 // Maximum number of queues for Virtio net
-#define NET_MAX_QUEUES 2
+#define NET_MAX_QUEUES (2 * NET_MAX_QUEUE_PAIRS + 1)
 
 #define VIRTQUEUE_NET_MAX_SIZE 256
 
+// Token bucket limit of one direction, 0 for no limit.
+struct net_rate_params {
+    uint64_t bps;        // Bits per second
+    uint64_t pps;        // Packets per second
+    uint64_t burst;      // Bytes sent at once, default 10 ms at bps but at
+                         // least the largest frame
+    uint64_t burst_pkts; // Same in packets, default 10 ms at pps
+};
+
 struct virtio_net_init_params {
     uint8_t mac[6];
     const char *tap;
+    const char *packet; // Host interface of the AF_PACKET backend, replaces
+                        // the tap
+    const char *xdp;    // Host interface of the AF_XDP backend, replaces
+                        // the tap
+    uint32_t xdp_queue;     // Interface queue the AF_XDP socket is bound to
+    uint32_t xdp_busy_poll; // SO_BUSY_POLL of the AF_XDP socket, in us
+    const char *sw;         // In-daemon switch the device is a port of,
+                            // replaces the tap
+    const char *uplink;     // Tap connecting the switch to the host
+    uint32_t tx_busy_poll;  // Time the TX worker polls an idle queue, in us
+    uint32_t rx_busy_poll;  // Time the RX worker polls after a frame, in us
+    int rx_busy_poll_cpu;   // CPU of the busy-polling RX worker of pair 0,
+                            // -1 to leave it unpinned
+    const char *pcap;       // Capture frames to this file
+    uint32_t pcap_snaplen;  // Bytes captured per frame, 0 for all
+    struct net_rate_params tx_limit, rx_limit;
+    uint32_t mtu; // Offered with VIRTIO_NET_F_MTU and set on the tap, 0 to
+                  // leave both alone
+    int queue_pairs;
+    bool vhost; // Move the frames of the tap in the kernel with vhost-net
 };
 
 // Max iov entries for a single descriptor chain.  Each descriptor in the
@@ -35,24 +75,237 @@ struct virtio_net_init_params {
 // VIRTQUEUE_NET_MAX_SIZE is the tight upper bound.
 #define NET_IOV_MAX VIRTQUEUE_NET_MAX_SIZE
 
+// Largest frame received from the tap with guest GSO, virtio-net header
+// excluded. Without GSO the tap MTU bounds it.
+#define NET_RX_GSO_FRAME_MAX (65535 + ETH_HLEN + 4)
+
 // VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX are supported, for
 // some reason we cancel them.
+// VIRTIO_NET_F_MQ is dropped in init for single-queue devices, and
+// VIRTIO_NET_F_MTU when no MTU is configured.
 #define NET_SUPPORTED_FEATURES                                                 \
     ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MAC) |               \
-     (1ULL << VIRTIO_NET_F_STATUS))
+     (1ULL << VIRTIO_NET_F_STATUS) | (1ULL << VIRTIO_NET_F_CTRL_VQ) |          \
+     (1ULL << VIRTIO_NET_F_MQ) | (1ULL << VIRTIO_NET_F_MRG_RXBUF) |           \
+     (1ULL << VIRTIO_NET_F_CTRL_RX) | (1ULL << VIRTIO_NET_F_CTRL_RX_EXTRA) |  \
+     (1ULL << VIRTIO_NET_F_CTRL_MAC_ADDR) | (1ULL << VIRTIO_NET_F_MTU) |      \
+     NET_OFFLOAD_FEATURES)
+
+// Checksum and segmentation offloads. The tap passes the virtio-net header
+// through, so the host side (HOST_*) needs nothing from us and the guest side
+// (GUEST_*) is enabled on the tap with TUNSETOFFLOAD. The UFO bits are
+// dropped in init if the kernel does not take TUN_F_UFO.
+#define NET_OFFLOAD_FEATURES                                                   \
+    ((1ULL << VIRTIO_NET_F_CSUM) | (1ULL << VIRTIO_NET_F_GUEST_CSUM) |         \
+     (1ULL << VIRTIO_NET_F_HOST_TSO4) | (1ULL << VIRTIO_NET_F_HOST_TSO6) |     \
+     (1ULL << VIRTIO_NET_F_HOST_UFO) | (1ULL << VIRTIO_NET_F_GUEST_TSO4) |     \
+     (1ULL << VIRTIO_NET_F_GUEST_TSO6) | (1ULL << VIRTIO_NET_F_GUEST_UFO))
+#define NET_UFO_FEATURES                                                       \
+    ((1ULL << VIRTIO_NET_F_HOST_UFO) | (1ULL << VIRTIO_NET_F_GUEST_UFO))
+
+// Max iov entries of a control queue request.
+#define NET_CTRL_IOV_MAX 16
+// Max size of a control command, header and ack excluded.
+#define NET_CTRL_MAX_DATA 4096
+// Entries of the MAC filter table, see VIRTIO_NET_CTRL_MAC_TABLE_SET.
+#define NET_MAC_TABLE_LEN 64
 
 typedef struct virtio_net_config NetConfig;
 typedef struct virtio_net_hdr_v1 NetHdr;
 typedef struct virtio_net_hdr NetHdrLegacy;
-typedef struct virtio_net_dev {
-    NetConfig config;
-    int tapfd;
+struct virtio_net_dev;
+struct net_backend;
+struct net_pcap;
+struct net_vhost;
+
+// Host side of one RX/TX queue pair. Frames start with the virtio-net header
+// in both directions. recv() and send() return the frame length, or -1 and
+// errno, EWOULDBLOCK when recv() has nothing pending.
+struct net_backend_ops {
+    const char *name;
+    ssize_t (*recv)(struct net_backend *be, const struct iovec *iov, int cnt);
+    // A backend may queue frames until flush(), called after each TX batch.
+    ssize_t (*send)(struct net_backend *be, const struct iovec *iov, int cnt);
+    void (*flush)(struct net_backend *be);
+    // Called on FEATURES_OK with the header size and the negotiated
+    // features.
+    int (*set_features)(struct net_backend *be, size_t hdr_len,
+                        uint64_t features);
+    // Optional, attach or detach a queue of a multi-queue backend.
+    int (*enable)(struct net_backend *be, bool enable);
+    // Optional, length of the next frame with its header, 0 if unknown or
+    // none is pending.
+    size_t (*next_len)(struct net_backend *be);
+    void (*close)(struct net_backend *be);
+};
+
+// Every backend embeds NetBackend as its first member.
+typedef struct net_backend {
+    const struct net_backend_ops *ops;
+    int fd;            // Polled by the queue worker for received frames
+    uint64_t features; // Offloads it carries, out of NET_OFFLOAD_FEATURES
+} NetBackend;
+
+// MTU of a host interface, ETH_DATA_LEN if it cannot be read.
+int net_if_mtu(const char *ifname);
+int net_if_set_mtu(const char *ifname, int mtu);
+
+// Copy len bytes at offset soff of src to offset doff of dst, as far as
+// either reaches. Returns the bytes copied.
+size_t net_iov_copy(const struct iovec *dst, int dcnt, size_t doff,
+                    const struct iovec *src, int scnt, size_t soff,
+                    size_t len);
+// Point dst, room for cnt entries, at what follows the first skip bytes of
+// src. Returns the entries used, *len gets their size.
+int net_iov_skip(struct iovec *dst, const struct iovec *src, int cnt,
+                 size_t skip, size_t *len);
+size_t net_iov_size(const struct iovec *iov, int cnt);
+
+// One queue of the tap devname, IFF_MULTI_QUEUE if multi_queue is set.
+NetBackend *net_tap_open(const char *devname, bool multi_queue);
+
+// Frames of the AF_PACKET backend carry no offloads, so the header is
+// synthesized on RX and dropped on TX.
+NetBackend *net_packet_open(const char *ifname);
+
+// The AF_XDP backend takes over queue queue_id of ifname, see net_xdp.c.
+NetBackend *net_xdp_open(const char *ifname, uint32_t queue_id,
+                         uint32_t busy_poll_us);
+
+// Requests the TX worker sends before it completes them to the guest.
+#define NET_TX_BATCH 64
+
+// A RX/TX queue pair. Its backend is read by its RX worker thread and
+// written by its TX worker thread.
+typedef struct virtio_net_queue {
+    struct virtio_net_dev *net;
+    VirtIODevice *vdev;
+    int idx;
+    NetBackend *be;
+    int kickfd; // eventfd waking the RX worker
     int rx_ready;
-    struct hvisor_event *event;
+    bool enabled; // Attached to the backend, see VIRTIO_NET_CTRL_MQ
+    bool thread_started;
+    pthread_t tid;
+    pthread_mutex_t lock; // Held by the RX worker while it uses the RX queue
     struct iovec *in_iov;
+    // Set by virtio_net_event_handler(): ns before the RX limit lets the
+    // next frame in, 0 if it is not holding RX back.
+    uint64_t rx_wait;
+    uint16_t rx_starved_avail; // Avail index the RX queue ran short at
+    // TX worker, same scheme as the RX one
+    int tx_kickfd;
+    int tx_ready;
+    bool tx_thread_started;
+    pthread_t tx_tid;
+    pthread_mutex_t tx_lock;
     struct iovec *out_iov;
+} NetQueue;
+
+// Frames the driver wants, set through the control queue. Frames to the
+// device's own MAC address are always accepted.
+struct net_rx_filter {
+    bool promisc;
+    bool allmulti;
+    bool alluni;
+    bool nomulti;
+    bool nouni;
+    bool nobcast;
+    bool uni_overflow;   // More unicast addresses than NET_MAC_TABLE_LEN
+    bool multi_overflow; // Same for multicast
+    int uni_count;       // The first entries of macs are unicast
+    int count;           // The multicast entries follow them
+    uint8_t macs[NET_MAC_TABLE_LEN][ETH_ALEN];
+};
+
+// Token buckets of a rate limit. Tokens may go negative: a frame passes while
+// both buckets hold some and is charged afterwards, so a limit never splits
+// or drops a frame.
+struct net_rate_bucket {
+    double rate;  // Tokens per ns, 0 for no limit
+    double burst; // Capacity
+    double tokens;
+};
+
+struct net_rate {
+    pthread_mutex_t lock;
+    struct net_rate_bucket bytes;
+    struct net_rate_bucket pkts;
+    uint64_t last_ns; // Last refill, CLOCK_MONOTONIC
+    bool auto_burst;  // bytes.burst is the default, see net_rate_fit_frame()
+    // Counters, under lock
+    uint64_t packets;
+    uint64_t octets;
+    uint64_t deferred; // Times a queue waited for tokens
+    uint64_t dropped;  // Frames for a switch port over its RX limit
+};
+
+typedef struct virtio_net_dev {
+    NetConfig config;
+    uint8_t mac[ETH_ALEN]; // Configured address, restored on reset
+    char ifname[IFNAMSIZ]; // Tap or host interface of the backend
+    int num_pairs;    // Pairs offered to the driver
+    int active_pairs; // Pairs in use, set by VIRTIO_NET_CTRL_MQ
+    bool stop;
+    uint32_t tx_busy_poll; // In us, 0 to wait for the next notification
+    uint32_t rx_busy_poll; // In us, 0 to sleep as soon as the backend is idle
+    size_t rx_frame_max; // Set on FEATURES_OK, virtio-net header included
+    // Limits shared by the queue pairs. The TX one holds requests in the TX
+    // queue, the RX one leaves frames in the backend.
+    struct net_rate tx_rate, rx_rate;
+    // Changed with the lock of every queue held, see net_lock_rx_queues().
+    struct net_rx_filter rx_filter;
+    // Frame capture, NULL when off. Changed with the RX and TX lock of every
+    // queue held. See net_pcap.c.
+    struct net_pcap *pcap;
+    // vhost-net offload, NULL when the queue workers move the frames. See
+    // net_vhost.c.
+    struct net_vhost *vhost;
+    NetQueue queues[NET_MAX_QUEUE_PAIRS];
+    struct iovec ctrl_iov[NET_CTRL_IOV_MAX];
+    uint8_t ctrl_buf[NET_CTRL_MAX_DATA];
 } NetDev;
 
+// Fill the RX queue of q from its backend, called with q->lock held.
+// Returns false if the RX queue ran out of buffers.
+bool virtio_net_event_handler(NetQueue *q);
+
+// A port of the in-daemon switch name, which delivers frames to the RX queue
+// of q, see net_switch.c. uplink, if set, is the tap of the switch.
+NetBackend *net_switch_open(const char *name, const char *uplink,
+                            NetQueue *q);
+
+// Why the daemon dropped a captured frame.
+enum net_pcap_drop {
+    NET_PCAP_PASSED,
+    NET_PCAP_DROP_FILTER,    // Rejected by the RX filter
+    NET_PCAP_DROP_NO_BUFFER, // Switch port without RX buffers
+    NET_PCAP_DROP_SEND,      // The backend failed to send it
+    NET_PCAP_DROP_RATE,      // Switch port over its RX limit
+};
+
+struct net_pcap *net_pcap_open(const char *path, const char *ifname,
+                               int num_pairs, uint32_t snaplen);
+// Capture a frame of len bytes at offset skip of iov, called by the thread
+// owning queue dir (NET_QUEUE_RX or NET_QUEUE_TX) of pair.
+void net_pcap_add(struct net_pcap *p, int pair, int dir,
+                  const struct iovec *iov, int cnt, size_t skip, size_t len,
+                  enum net_pcap_drop drop);
+void net_pcap_close(struct net_pcap *p);
+int net_ctl_pcap(VirtIODevice *vdev, int argc, char *argv[], char *reply,
+                 size_t len);
+int net_pcap_status(NetDev *net, char *buf, size_t len);
+
+struct net_vhost *net_vhost_open(VirtIODevice *vdev, NetDev *net);
+// Mask of the device features the kernel data path supports.
+uint64_t net_vhost_features(const struct net_vhost *v);
+// Hand the rings to the kernel on DRIVER_OK, and take them back on reset.
+int net_vhost_start(struct net_vhost *v);
+void net_vhost_stop(struct net_vhost *v);
+// Forward a QUEUE_NOTIFY of data queue vq_idx to the kernel.
+void net_vhost_kick(struct net_vhost *v, int vq_idx);
+void net_vhost_close(struct net_vhost *v);
+
 extern const struct virtio_device_ops virtio_net_ops;
 extern const struct virtio_config_ops virtio_net_config_ops;
 
@@ -39,6 +39,7 @@
 #include "virtio.h"
 #include "virtio_blk.h"
 #include "virtio_console.h"
+#include "virtio_ctl.h"
 #include "virtio_net.h"
 #ifdef ENABLE_VIRTIO_GPU
 #include "virtio_gpu.h"
@@ -82,18 +83,6 @@ static int virtio_deassert_line_locked(VirtIODevice *vdev) {
 #endif
 }
 
-struct zone_mem_region {
-    uintptr_t virt_addr;
-    uintptr_t zone0_ipa;
-    uintptr_t zonex_ipa;
-    uintptr_t mem_size;
-};
-
-struct zone_mem {
-    struct zone_mem_region regions[CONFIG_MAX_MEMORY_REGIONS];
-    size_t num_regions;
-};
-
 struct zone_mem zone_mem[MAX_ZONES];
 
 const char *virtio_device_type_to_string(VirtioDeviceType type) {
@@ -264,6 +253,8 @@ VirtIODevice *create_virtio_device(VirtioDeviceType dev_type, uint32_t zone_id,
     vdev->regs.dev_feature = ops->features;
     vdev->virtio_close = ops->close;
     vdev->status_changed = ops->status_changed;
+    vdev->config_write = ops->config_write;
+    vdev->ctl_commands = ops->ctl_commands;
 
     // Allocate virtqueues before device init: net/console register their
     // fds with the already-running event-monitor epoll inside ops->init,
@@ -284,6 +275,13 @@ err:
     return NULL;
 }
 
+VirtIODevice *virtio_find_device(uint32_t zone_id, uint64_t base_addr) {
+    for (int i = 0; i < vdevs_num; i++)
+        if (vdevs[i]->zone_id == zone_id && vdevs[i]->base_addr == base_addr)
+            return vdevs[i];
+    return NULL;
+}
+
 static int init_virtio_queue(VirtIODevice *vdev,
                              const struct virtio_device_ops *ops) {
     log_info("Initializing virtio queue for zone:%d, device type:%s",
@@ -332,8 +330,9 @@ void virtio_dev_reset(VirtIODevice *vdev) {
     }
     pthread_mutex_unlock(&vdev->interrupt_lock);
     vdev->regs.status = 0;
-    int idx = vdev->regs.queue_sel;
-    vdev->vqs[idx].ready = 0;
+    uint32_t idx = vdev->regs.queue_sel;
+    if (idx < vdev->vqs_len)
+        vdev->vqs[idx].ready = 0;
     // Run the device reset op before re-initializing the virtqueues: reset
     // ops (e.g. virtio-blk's) quiesce worker threads that touch the vq
     // structs, which must not race with virtqueue_reset() below.
@@ -785,6 +784,15 @@ uint64_t virtio_mmio_read(VirtIODevice *vdev, uint64_t offset, unsigned size) {
         return 0;
     }
 
+    // Same as for writes, the driver may probe queues the device lacks.
+    switch (offset) {
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:
+    case VIRTIO_MMIO_QUEUE_READY:
+        if (vdev->regs.queue_sel >= vdev->vqs_len)
+            return 0;
+        break;
+    }
+
     switch (offset) {
     case VIRTIO_MMIO_MAGIC_VALUE:
         log_debug("read VIRTIO_MMIO_MAGIC_VALUE");
@@ -808,9 +816,6 @@ uint64_t virtio_mmio_read(VirtIODevice *vdev, uint64_t offset, unsigned size) {
         }
     case VIRTIO_MMIO_QUEUE_NUM_MAX:
         log_debug("read VIRTIO_MMIO_QUEUE_NUM_MAX");
-        if (vdev->regs.queue_sel >= vdev->vqs_len) {
-            return 0;
-        }
         return vdev->vqs[vdev->regs.queue_sel].queue_num_max;
     case VIRTIO_MMIO_QUEUE_READY:
         log_debug("read VIRTIO_MMIO_QUEUE_READY");
@@ -873,6 +878,10 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
 
     if (offset >= VIRTIO_MMIO_CONFIG) {
         offset -= VIRTIO_MMIO_CONFIG;
+        if (vdev->config_write) {
+            vdev->config_write(vdev, offset, value, size);
+            return;
+        }
         log_error("virtio_mmio_write: can't write config space");
         return;
     }
@@ -881,6 +890,26 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
         return;
     }
 
+    // The driver probes queues up to the number it expects, which may be more
+    // than the device has (e.g. virtio-net with fewer queue pairs).
+    switch (offset) {
+    case VIRTIO_MMIO_QUEUE_NUM:
+    case VIRTIO_MMIO_QUEUE_READY:
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+    case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+    case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+    case VIRTIO_MMIO_QUEUE_USED_LOW:
+    case VIRTIO_MMIO_QUEUE_USED_HIGH:
+        if (regs->queue_sel >= vdev->vqs_len) {
+            log_warn("zone %d %s: write to nonexistent queue %u",
+                     vdev->zone_id, virtio_device_type_to_string(vdev->type),
+                     regs->queue_sel);
+            return;
+        }
+        break;
+    }
+
     switch (offset) {
     case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
         log_debug("write VIRTIO_MMIO_DEVICE_FEATURES_SEL");
@@ -1186,6 +1215,7 @@ int virtio_handle_req(volatile struct device_req *req) {
 
 void virtio_close() {
     log_warn("virtio devices will be closed");
+    virtio_ctl_close();
     destroy_event_monitor();
     for (int i = 0; i < vdevs_num; i++)
         vdevs[i]->virtio_close(vdevs[i]);
@@ -1489,6 +1519,8 @@ int virtio_init() {
 
     // Initialize event_monitor used by console and net devices
     initialize_event_monitor();
+    // Runtime control socket; the daemon works without it.
+    virtio_ctl_init();
     log_info("hvisor init okay!");
     return 0;
 unmap:
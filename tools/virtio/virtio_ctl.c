@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      hvisor-tool contributors
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio_ctl.h"
+
+/*
+ * Runtime control of the virtio daemon. "hvisor virtio ctl" sends one line
+ * "<zone_id> <mmio_addr> <command> [args...]" over VIRTIO_CTL_SOCK. The
+ * daemon runs the command of the addressed device on the event monitor
+ * thread and answers "ok" or "error <errno>" on the first line, followed by
+ * the command output.
+ */
+
+static int ctl_fd = -1;
+static struct hvisor_event *ctl_event;
+
+static int ctl_dispatch(char *req, char *reply, size_t len) {
+    char *argv[VIRTIO_CTL_MAX_ARGS], *save, *end;
+    int argc = 0;
+
+    for (char *tok = strtok_r(req, " \t\r\n", &save);
+         tok && argc < VIRTIO_CTL_MAX_ARGS;
+         tok = strtok_r(NULL, " \t\r\n", &save))
+        argv[argc++] = tok;
+    if (argc < 3) {
+        snprintf(reply, len,
+                 "usage: <zone_id> <mmio_addr> <command> [args...]\n");
+        return -EINVAL;
+    }
+
+    uint32_t zone_id = strtoul(argv[0], &end, 0);
+    if (*end) {
+        snprintf(reply, len, "invalid zone id %s\n", argv[0]);
+        return -EINVAL;
+    }
+    uint64_t base_addr = strtoull(argv[1], &end, 0);
+    if (*end) {
+        snprintf(reply, len, "invalid mmio address %s\n", argv[1]);
+        return -EINVAL;
+    }
+    VirtIODevice *vdev = virtio_find_device(zone_id, base_addr);
+    if (!vdev) {
+        snprintf(reply, len, "no virtio device at %s in zone %s\n", argv[1],
+                 argv[0]);
+        return -ENODEV;
+    }
+
+    const struct virtio_ctl_command *cmd = vdev->ctl_commands;
+    if (strcmp(argv[2], "help") == 0) {
+        size_t used = 0;
+        reply[0] = '\0';
+        for (; cmd && cmd->name && used < len; cmd++)
+            used += snprintf(reply + used, len - used, "%s %s\n", cmd->name,
+                             cmd->usage);
+        return 0;
+    }
+    for (; cmd && cmd->name; cmd++)
+        if (strcmp(argv[2], cmd->name) == 0)
+            return cmd->handler(vdev, argc - 2, &argv[2], reply, len);
+
+    snprintf(reply, len, "unknown command %s for %s device, try help\n",
+             argv[2], virtio_device_type_to_string(vdev->type));
+    return -EINVAL;
+}
+
+static void ctl_accept_handler(int fd, int epoll_type, void *param) {
+    static char req[VIRTIO_CTL_MAX_REQ], reply[VIRTIO_CTL_MAX_REPLY];
+    // A client must not stall the event monitor thread.
+    struct timeval tv = {.tv_sec = 1};
+    size_t got = 0;
+    (void)epoll_type;
+    (void)param;
+
+    int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (cfd < 0)
+        return;
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (got < sizeof(req) - 1) {
+        ssize_t n = read(cfd, req + got, sizeof(req) - 1 - got);
+        if (n <= 0)
+            break;
+        got += n;
+        if (memchr(req + got - n, '\n', n))
+            break;
+    }
+    req[got] = '\0';
+    req[strcspn(req, "\n")] = '\0';
+    log_info("virtio ctl: %s", req);
+
+    reply[0] = '\0';
+    int ret = ctl_dispatch(req, reply, sizeof(reply));
+    if (ret)
+        dprintf(cfd, "error %d\n%s", -ret, reply);
+    else
+        dprintf(cfd, "ok\n%s", reply);
+    close(cfd);
+}
+
+int virtio_ctl_init(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    strncpy(addr.sun_path, VIRTIO_CTL_SOCK, sizeof(addr.sun_path) - 1);
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctl_fd < 0) {
+        log_warn("virtio ctl: socket failed, errno is %d", errno);
+        return -1;
+    }
+    unlink(VIRTIO_CTL_SOCK);
+    if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(VIRTIO_CTL_SOCK, 0600) < 0 || listen(ctl_fd, 4) < 0) {
+        log_warn("virtio ctl: cannot listen on %s, errno is %d",
+                 VIRTIO_CTL_SOCK, errno);
+        goto err;
+    }
+    ctl_event = add_event(ctl_fd, EPOLLIN, ctl_accept_handler, NULL);
+    if (!ctl_event)
+        goto err;
+    log_info("virtio ctl: listening on %s", VIRTIO_CTL_SOCK);
+    return 0;
+err:
+    close(ctl_fd);
+    ctl_fd = -1;
+    return -1;
+}
+
+void virtio_ctl_close(void) {
+    if (ctl_fd < 0)
+        return;
+    remove_event(ctl_event);
+    close(ctl_fd);
+    ctl_fd = -1;
+    unlink(VIRTIO_CTL_SOCK);
+}
+
+int virtio_ctl(int argc, char *argv[]) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char req[VIRTIO_CTL_MAX_REQ], reply[VIRTIO_CTL_MAX_REPLY];
+    size_t used = 0, got = 0;
+    int fd, ret = -1;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: hvisor virtio ctl <zone_id> <mmio_addr> "
+                        "<command> [args...]\n");
+        return -1;
+    }
+    for (int i = 0; i < argc; i++) {
+        int n = snprintf(req + used, sizeof(req) - used, "%s%s", argv[i],
+                         i == argc - 1 ? "\n" : " ");
+        if (n < 0 || (size_t)n >= sizeof(req) - used) {
+            fprintf(stderr, "command too long\n");
+            return -1;
+        }
+        used += n;
+    }
+
+    strncpy(addr.sun_path, VIRTIO_CTL_SOCK, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "cannot connect to the virtio daemon at %s: %s\n",
+                VIRTIO_CTL_SOCK, strerror(errno));
+        goto out;
+    }
+    if (write(fd, req, used) != (ssize_t)used) {
+        fprintf(stderr, "cannot send command: %s\n", strerror(errno));
+        goto out;
+    }
+    while (got < sizeof(reply) - 1) {
+        ssize_t n = read(fd, reply + got, sizeof(reply) - 1 - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    reply[got] = '\0';
+
+    char *body = strchr(reply, '\n');
+    body = body ? body + 1 : reply + got;
+    if (strncmp(reply, "ok\n", 3) == 0) {
+        fputs(body, stdout);
+        ret = 0;
+    } else {
+        int err = 0;
+        sscanf(reply, "error %d", &err);
+        fprintf(stderr, "%s%s\n", body, err ? strerror(err) : "bad reply");
+    }
+out:
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}